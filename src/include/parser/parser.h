@@ -17,6 +17,7 @@ typedef enum {
 typedef struct ReplicationCommand {
 	ReplCommandType command;
 	char *slotname;
+	bool logical;
 	TimeLineID timeline;
 	XLogRecPtr startpoint;
 } ReplicationCommand;
@@ -0,0 +1,23 @@
+#ifndef	_WB_ARCHIVE_H
+#define _WB_ARCHIVE_H 1
+
+#include <sys/types.h>
+
+#include "wbglobals.h"
+
+/*
+ * Archive mode streams WAL from the master, filters it like for a standby
+ * of the configured entry and writes it to segment files in a directory,
+ * like pg_receivexlog does. The segment being written has a .partial suffix
+ * until it is complete. Standbys can then restore from the directory with
+ * restore_command.
+ */
+
+/* Postmaster side */
+bool WbArNeedsWriter();
+void WbArSetWriterPid(pid_t pid);
+bool WbArProcessExited(pid_t pid);
+
+void WbArWriterMain();
+
+#endif
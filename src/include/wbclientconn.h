@@ -4,7 +4,9 @@
 #include "wbsocket.h"
 
 void WbCCInitConnection(WbConn conn);
-void WbCCPerformAuthentication(WbConn conn);
-void WbCCCommandLoop(WbConn conn);
+bool WbCCRun(WbConn conn);
+void WbCCCloseConnection(WbConn conn);
+
+extern const char * const WbReportedGucs[];
 
 #endif
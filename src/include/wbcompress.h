@@ -0,0 +1,32 @@
+#ifndef	_WB_COMPRESS_H
+#define _WB_COMPRESS_H 1
+
+#include "wbglobals.h"
+
+/*
+ * Compressed WAL transport between chained walbouncers. A downstream
+ * walbouncer asks for it when connecting, the upstream one then sends WAL
+ * data as 'z' messages instead of 'w'. Filtered out records are long runs of
+ * zeros, these are only sent as their length. What remains is compressed
+ * with zlib, using one stream per START_REPLICATION so that later messages
+ * refer back to earlier ones.
+ *
+ * The 'z' message has the same header as 'w', followed by the uncompressed
+ * length of the WAL data and the compressed data.
+ */
+
+#define WB_COMPRESSION_OPTION "walbouncer.compression"
+#define WB_COMPRESSION_ZLIB "zlib"
+
+/* 'z' dataStart walEnd sendTime rawLen */
+#define WB_COMPRESSED_HEADER_LEN 29
+
+typedef struct WbCompressor WbCompressor;
+
+WbCompressor* WbCmCreate(bool decompress);
+void WbCmFree(WbCompressor *cm);
+void WbCmReset(WbCompressor *cm);
+int WbCmCompress(WbCompressor *cm, char **parts, int *partLen, int nparts, char **out);
+char* WbCmDecompress(WbCompressor *cm, char *data, int len, int rawLen);
+
+#endif
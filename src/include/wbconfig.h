@@ -5,6 +5,7 @@
 
 typedef struct {
 	char *name;
+	int id;				/* position in the list, starting at 1 */
 	struct {
 		hostmask source_ip;
 		char *application_name;
@@ -19,6 +20,12 @@ typedef struct {
 		char **exclude_databases;
 		int n_exclude_databases;
 	} filter;
+	struct {
+		int memory;			/* in megabytes, 0 disables the spool */
+		int disk;			/* in megabytes */
+		char *directory;
+	} spool;
+	int max_rate;		/* to all standbys of the entry, in kilobytes per second, 0 for no limit */
 } wb_config_entry;
 
 typedef struct wb_config_list_entry {
@@ -28,10 +35,46 @@ typedef struct wb_config_list_entry {
 
 typedef struct {
 	int listen_port;
+	char *unix_socket_directory;	/* NULL for TCP only */
+	int workers;		/* 0 means one per CPU core */
+	int filter_threads;	/* per worker, 1 filters in the worker thread only */
+	int batch_size;		/* in kilobytes, 0 disables merging WAL messages */
+	int status_interval;	/* in seconds, between unchanged status messages */
+	int max_rate;		/* to all standbys, in kilobytes per second, 0 for no limit */
 	struct {
 		char *host;
 		int port;
+		char *compression;	/* asked of an upstream walbouncer, NULL for none */
+		char *sslmode;		/* passed on to libpq, NULL for its default */
 	} master;
+	struct {
+		bool enabled;
+		char *cert_file;
+		char *key_file;
+		bool ktls;			/* hand encryption to the kernel if it can */
+	} ssl;
+	struct {
+		bool enabled;
+		int buffer_size;	/* in megabytes */
+		char *user;
+	} fanout;
+	struct {
+		int size;			/* idle connections per user, 0 disables */
+		char **users;		/* users to connect for at startup */
+		int n_users;
+	} pool;
+	struct {
+		bool enabled;
+		char *directory;
+		int size;			/* in megabytes */
+		int max_slots;		/* replication slots, 0 disables them */
+	} wal_cache;
+	struct {
+		bool enabled;
+		char *directory;
+		char *configuration;	/* entry whose filter is applied, if any */
+		char *user;
+	} archive;
 	wb_config_list_entry *configurations;
 } wb_configuration;
 
@@ -41,6 +41,22 @@
 #define INIT_CRC32C(crc) ((crc) = 0xFFFFFFFF)
 #define EQ_CRC32C(c1, c2) ((c1) == (c2))
 
+#if defined(__x86_64__)
+/*
+ * Use Intel SSE 4.2 and PCLMULQDQ instructions when the CPU has them, with a
+ * runtime check. The first call goes through pg_comp_crc32c_choose(), which
+ * replaces the function pointer with the best implementation.
+ */
+#define USE_SSE42_CRC32C_WITH_RUNTIME_CHECK
+
+#define COMP_CRC32C(crc, data, len) \
+    ((crc) = pg_comp_crc32c((crc), (data), (len)))
+
+extern pg_crc32c (*pg_comp_crc32c) (pg_crc32c crc, const void *data, size_t len);
+extern pg_crc32c pg_comp_crc32c_sse42(pg_crc32c crc, const void *data, size_t len);
+extern pg_crc32c pg_comp_crc32c_pclmul(pg_crc32c crc, const void *data, size_t len);
+extern void pg_comp_crc32c_pclmul_init();
+#else
 /*
  * Use slicing-by-8 algorithm.
  *
@@ -50,13 +66,16 @@
  */
 #define COMP_CRC32C(crc, data, len) \
     ((crc) = pg_comp_crc32c_sb8((crc), (data), (len)))
-#define COMP_CRC32C_ZERO(crc, data, len) \
-    ((crc) = pg_comp_crc32c_sb8_zero((crc), (data), (len)))
+#endif
+
+/* Accumulate len zero bytes */
+#define COMP_CRC32C_ZERO(crc, len) \
+    ((crc) = pg_comp_crc32c_zero((crc), (len)))
 
 #define FIN_CRC32C(crc) ((crc) ^= 0xFFFFFFFF)
 
 
 extern pg_crc32c pg_comp_crc32c_sb8(pg_crc32c crc, const void *data, size_t len);
-extern pg_crc32c pg_comp_crc32c_sb8_zero(pg_crc32c crc, const void *data, size_t len);
+extern pg_crc32c pg_comp_crc32c_zero(pg_crc32c crc, size_t len);
 
 #endif   /* WB_CRC32C_H */
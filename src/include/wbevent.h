@@ -0,0 +1,22 @@
+#ifndef	_WB_EVENT_H
+#define _WB_EVENT_H 1
+
+#include <sys/epoll.h>
+
+#include "wbglobals.h"
+
+/*
+ * Thin wrapper around epoll. Every process running sessions has a single
+ * event set, the pointer given when registering a socket is handed back
+ * with its events.
+ */
+
+#define WB_MAX_EVENTS 64
+
+void WbEvInit();
+void WbEvAdd(int fd, uint32 events, void *ptr);
+void WbEvModify(int fd, uint32 events, void *ptr);
+void WbEvDelete(int fd);
+int WbEvWait(struct epoll_event *events, int maxevents, int timeout);
+
+#endif
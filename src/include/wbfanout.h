@@ -0,0 +1,41 @@
+#ifndef	_WB_FANOUT_H
+#define _WB_FANOUT_H 1
+
+#include <sys/types.h>
+
+#include "wbglobals.h"
+#include "wbmasterconn.h"
+
+/*
+ * Fan-out mode shares a single upstream replication connection between all
+ * standbys. A receiver process streams WAL from the master into a ring
+ * buffer in shared memory, each standby session reads from it with its own
+ * cursor.
+ */
+
+#define FANOUT_MAX_READERS 128
+
+typedef struct WbFanoutReader WbFanoutReader;
+
+/* Postmaster side */
+void WbFoInitShmem();
+bool WbFoEnabled();
+bool WbFoNeedsReceiver();
+void WbFoSetReceiverPid(pid_t pid);
+bool WbFoProcessExited(pid_t pid);
+void WbFoReceiverMain();
+
+/* Standby session side */
+bool WbFoIsReady();
+bool WbFoIdentifySystem(char** sysid, char** tli, char** xpos);
+const char *WbFoParameterStatus(const char *name);
+
+WbFanoutReader* WbFoAttach(XLogRecPtr startPos, TimeLineID tli);
+void WbFoDetach(WbFanoutReader *reader);
+bool WbFoRestartAt(WbFanoutReader *reader, XLogRecPtr pos);
+bool WbFoReceiveWalMessage(WbFanoutReader *reader, ReplMessage *msg);
+void WbFoEndStreaming(WbFanoutReader *reader, TimeLineID *nextTli, char** nextTliStart);
+void WbFoSendReply(WbFanoutReader *reader, StandbyReplyMessage *reply);
+void WbFoSendFeedback(WbFanoutReader *reader, HSFeedbackMessage *feedback);
+
+#endif
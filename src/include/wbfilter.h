@@ -3,6 +3,7 @@
 
 #include "wbglobals.h"
 #include "wbmasterconn.h"
+#include "wboidset.h"
 
 #define FS_BUFFERING_STATE (1 << 8)
 typedef enum {
@@ -15,19 +16,43 @@ typedef enum {
 	FS_BUFFER_BLOCK_HEADER = (6 | FS_BUFFERING_STATE),
 	FS_BUFFER_IMAGE_HEADER = (7 | FS_BUFFERING_STATE),
 	FS_BUFFER_COMPRESSION_HEADER = (8 | FS_BUFFERING_STATE),
-	FS_BUFFER_FILENODE = (9 | FS_BUFFERING_STATE)
+	FS_BUFFER_FILENODE = (9 | FS_BUFFERING_STATE),
+	FS_BUFFER_BLOCK_NUMBER = (10 | FS_BUFFERING_STATE)
 } FilterState;
 
-#define FL_BUFFER_LEN 128
+/*
+ * Room for a record header followed by headers of all block references,
+ * at most 24 + 33 * 27 + 1 bytes.
+ */
+#define FL_BUFFER_LEN 1024
 
-typedef struct {
+/* Decision for the relation seen last */
+typedef struct FilterDecision {
+	bool valid;
+	Oid spcNode;
+	Oid dbNode;
+	bool filtered;
+} FilterDecision;
+
+typedef struct FilterData {
 	FilterState state;
 	int dataNeeded;
 	int recordRemaining;
 
+	/* Block reference being buffered */
+	int blockId;
+	uint8 forkFlags;
+	/* Length of block data announced by the headers so far */
+	int dataTotal;
+
 	bool synchronized;
 	XLogRecPtr requestedStartPos;
 
+	/*
+	 * Where the record being decoded starts and the page header among its
+	 * headers, if headerLen is set. Relative to the block being processed,
+	 * negative positions are in the data held back from the previous block.
+	 */
 	int recordStart;
 	int headerPos;
 	int headerLen;
@@ -35,17 +60,49 @@ typedef struct {
 	int bufferLen;
 	char buffer[FL_BUFFER_LEN];
 
+	/*
+	 * Data held back from the previous block, the stream as received from
+	 * where the record being buffered starts. Alternates between two
+	 * buffers, output of the previous block may still point to the other.
+	 */
 	int unsentBufferLen;
-	char unsentBuffer[FL_BUFFER_LEN];
+	char *unsentBuffer;
+	char unsentBuffers[2][FL_BUFFER_LEN];
 
 	Oid *include_tablespaces;
 	Oid *include_databases;
 	Oid *exclude_tablespaces;
 	Oid *exclude_databases;
+
+	/* The lists above compiled for lookups, see WbFCompileFilter */
+	OidSet *include_tablespace_set;
+	OidSet *include_database_set;
+	OidSet *exclude_tablespace_set;
+	OidSet *exclude_database_set;
+
+	FilterDecision last;
 } FilterData;
 
+/*
+ * What of a processed block can be passed on: data held back from the
+ * previous block followed by the current one, minus whatever is now held
+ * back in turn. The parts point into the message and the filter state, they
+ * are valid until the next block is processed.
+ */
+typedef struct FilterOutput {
+	XLogRecPtr dataStart;
+	XLogRecPtr walEnd;
+	XLogRecPtr dataEnd;
+	int nparts;
+	char *parts[2];
+	int partLen[2];
+} FilterOutput;
+
 FilterData* WbFCreateProcessingState(XLogRecPtr startPos);
 void WbFFreeProcessingState(FilterData* fl);
+void WbFResetProcessingState(FilterData* fl, XLogRecPtr startPoint);
+void WbFCompileFilter(FilterData* fl);
 bool WbFProcessWalDataBlock(ReplMessage* msg, FilterData* fl, XLogRecPtr *retryPos);
+bool WbFGetOutput(ReplMessage* msg, FilterData* fl, FilterOutput *out);
 
 #endif
@@ -20,12 +20,17 @@ typedef int16_t int16;
 typedef int32_t int32;
 typedef int64_t int64;
 
+#define UINT64CONST(x) ((uint64) x##ULL)
+
 /* Compatibility stuff */
 typedef uint64 XLogRecPtr;
 typedef uint32 TimeLineID;
 typedef uint64 TimestampTz;
 typedef uint32 TransactionId;
 
+#define InvalidTransactionId ((TransactionId) 0)
+#define InvalidXLogRecPtr ((XLogRecPtr) 0)
+
 #define DEBUG 1
 
 #ifndef EOF
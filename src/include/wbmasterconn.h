@@ -11,7 +11,7 @@ typedef enum {
 	MSG_KEEPALIVE
 } WalMsgType;
 
-typedef struct {
+typedef struct ReplMessage {
 	WalMsgType type;
 	XLogRecPtr walEnd;
 	TimestampTz sendTime;
@@ -37,20 +37,50 @@ typedef enum {
 	OID_RESOLVE_DATABASES
 } OidResolveKind;
 
+#define MAX_CONNINFO_LEN 4000
+
+#define MC_WAIT_READ 1
+#define MC_WAIT_WRITE 2
+
 typedef struct MasterConn MasterConn;
 
+/*
+ * Most operations come in two flavours: blocking ones used by the fan-out
+ * receiver, and a WbMcSend.../WbMcFinish... pair for the event loop where
+ * Finish returns false until the answer has arrived.
+ */
+void WbMcBuildConninfo(char *buf, int buflen, const char *host, int port,
+		const char *user, bool replication);
 MasterConn* WbMcOpenConnection(const char *conninfo);
+MasterConn* WbMcStartConnection(const char *conninfo);
+bool WbMcConnectionReady(MasterConn *master);
 void WbMcCloseConnection(MasterConn *master);
 int WbMcGetSocket(MasterConn *master);
+const char *WbMcGetConninfo(MasterConn *master);
+bool WbMcIsIdle(MasterConn *master);
+bool WbMcIsStreaming(MasterConn *master);
+bool WbMcIsAlive(MasterConn *master);
+int WbMcWaitEvents(MasterConn *master);
 bool WbMcStartStreaming(MasterConn *master, XLogRecPtr pos, TimeLineID tli);
+void WbMcSendStartStreaming(MasterConn *master, XLogRecPtr pos, TimeLineID tli);
+bool WbMcFinishStartStreaming(MasterConn *master, bool *streaming);
 void WbMcEndStreaming(MasterConn *master, TimeLineID *nextTli, char** nextTliStart);
+void WbMcSendEndStreaming(MasterConn *master);
+bool WbMcFinishEndStreaming(MasterConn *master, TimeLineID *nextTli, char** nextTliStart);
 bool WbMcReceiveWalMessage(MasterConn *master, ReplMessage *msg);
 void WbMcSendReply(MasterConn *master, StandbyReplyMessage *reply, bool force, bool requestReply);
 void WbMcSendFeedback(MasterConn *master, HSFeedbackMessage *feedback);
 bool WbMcIdentifySystem(MasterConn* master,
 		char** primary_sysid, char** primary_tli, char** primary_xpos);
+void WbMcSendIdentifySystem(MasterConn* master);
+bool WbMcFinishIdentifySystem(MasterConn* master,
+		char** primary_sysid, char** primary_tli, char** primary_xpos);
 bool WbMcGetTimelineHistory(MasterConn* master, TimeLineID timeline,
 		TimelineHistory *history);
+void WbMcSendTimelineHistory(MasterConn* master, TimeLineID timeline);
+bool WbMcFinishTimelineHistory(MasterConn* master, TimelineHistory *history);
 Oid * WbMcResolveOids(MasterConn *master, OidResolveKind kind, bool include, char** names, int n_items);
+void WbMcSendResolveOids(MasterConn *master, OidResolveKind kind, bool include, char** names, int n_items);
+bool WbMcFinishResolveOids(MasterConn *master, OidResolveKind kind, Oid **result, char ***oidNames);
 const char *WbMcParameterStatus(MasterConn *master, char *name);
 #endif
@@ -0,0 +1,18 @@
+#ifndef	_WB_OIDCACHE_H
+#define _WB_OIDCACHE_H 1
+
+#include "wbglobals.h"
+#include "wbmasterconn.h"
+
+/*
+ * Tablespace and database name to OID mappings resolved on the master are
+ * cached in shared memory, so standbys (re)connecting in bulk don't each
+ * have to query the catalog.
+ */
+
+void WbOcInitShmem();
+bool WbOcLookup(OidResolveKind kind, bool include, char **names, int n_names, Oid **result);
+void WbOcStore(OidResolveKind kind, bool include, char **names, int n_names,
+		Oid *oids, char **oidNames);
+
+#endif
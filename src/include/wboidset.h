@@ -0,0 +1,17 @@
+#ifndef	_WB_OIDSET_H
+#define _WB_OIDSET_H 1
+
+#include "wbglobals.h"
+
+/*
+ * Read-only set of OIDs for the per record filtering checks. Built once from
+ * a zero terminated list, lookups are a hash probe regardless of how many
+ * databases or tablespaces the filter names.
+ */
+typedef struct OidSet OidSet;
+
+OidSet* WbOsCreate(Oid *list);
+bool WbOsContains(OidSet *set, Oid oid);
+void WbOsFree(OidSet *set);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef	_WB_POOL_H
+#define _WB_POOL_H 1
+
+#include "wbglobals.h"
+#include "wbmasterconn.h"
+
+/*
+ * Every worker keeps a few replication connections to the master open ahead
+ * of time so that a connecting standby does not have to wait for connection
+ * setup and authentication. Connections are pooled per connection string,
+ * connections of standbys that go away are put back into the pool.
+ */
+
+void WbPlInit();
+bool WbPlEnabled();
+bool WbPlIsEventTag(void *ptr);
+void WbPlProcessEvents();
+void WbPlMaintain();
+
+MasterConn* WbPlCheckout(const char *conninfo);
+void WbPlRelease(MasterConn *master);
+
+#endif
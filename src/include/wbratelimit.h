@@ -0,0 +1,22 @@
+#ifndef	_WB_RATELIMIT_H
+#define _WB_RATELIMIT_H 1
+
+#include "wbglobals.h"
+#include "wbconfig.h"
+
+/*
+ * Bandwidth towards standbys is shaped with token buckets, one for all
+ * standbys together and one per configuration entry, shared by the workers.
+ * A session sends what both of its buckets allow and waits until they have
+ * refilled, the spool keeps reading from the master meanwhile. Buckets hold
+ * a tenth of a second worth of their rate, so bursts are short.
+ */
+
+/* Postmaster side */
+void WbRlInit();
+
+bool WbRlLimited(wb_config_entry *entry);
+int WbRlAvailable(wb_config_entry *entry, int wanted, TimestampTz *retryAt);
+void WbRlCharge(wb_config_entry *entry, int bytes);
+
+#endif
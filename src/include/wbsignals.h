@@ -3,8 +3,14 @@
 
 #include "wbglobals.h"
 #include <signal.h>
+#include <sys/types.h>
 
 extern sig_atomic_t stopRequested;
 void WbInitializeSignals();
 
+void WbInitLatch();
+void WbSetLatch(pid_t pid);
+int WbLatchGetSocket();
+void WbResetLatch();
+
 #endif
@@ -0,0 +1,43 @@
+#ifndef	_WB_SLOTS_H
+#define _WB_SLOTS_H 1
+
+#include <sys/types.h>
+
+#include "wbglobals.h"
+
+/*
+ * Physical replication slots are kept by walbouncer itself instead of on the
+ * master. A slot remembers how far its standby has flushed WAL, everything
+ * from there on is retained in the WAL cache so the standby can catch up
+ * from local disk. Slots are saved to a file in the WAL cache directory and
+ * survive restarts.
+ */
+
+#define WB_SLOT_NAMELEN 64
+
+typedef enum {
+	SLOT_OK,
+	SLOT_INVALID_NAME,
+	SLOT_EXISTS,
+	SLOT_NOT_FOUND,
+	SLOT_ACTIVE,
+	SLOT_NO_SPACE
+} WbSlotResult;
+
+/* Postmaster side */
+void WbSlInit();
+bool WbSlEnabled();
+void WbSlProcessExited(pid_t pid);
+
+/* Replication commands */
+WbSlotResult WbSlCreate(const char *name);
+WbSlotResult WbSlDrop(const char *name);
+WbSlotResult WbSlAcquire(const char *name, XLogRecPtr startPos, int *slot);
+void WbSlRelease(int slot);
+void WbSlAdvance(int slot, XLogRecPtr flushPtr);
+const char* WbSlResultMessage(WbSlotResult result);
+
+/* Oldest WAL that has to be retained, 0 if none */
+XLogRecPtr WbSlRetainPtr();
+
+#endif
@@ -1,12 +1,16 @@
 #ifndef	_WB_SOCKET_H
 #define _WB_SOCKET_H 1
 
+#include <sys/uio.h>
+
 #include "wbglobals.h"
 #include "wbproto.h"
 #include "wbconfig.h"
 
 typedef struct {
 	int fd;
+	char *path;		/* of a Unix domain socket, NULL for TCP */
+	char *lockPath;	/* lock file next to it, with our PID */
 } WbSocketStruct;
 typedef WbSocketStruct* WbSocket;
 
@@ -24,15 +28,32 @@ typedef struct {
 	uint32		epoch;
 } HSFeedbackMessage;
 
-typedef struct {
+typedef enum {
+	CONN_STARTUP,		/* Reading the startup packet */
+	CONN_CONNECTING,	/* Waiting for the master connection */
+	CONN_IDLE,			/* Waiting for a command */
+	CONN_EXECUTING,		/* Executing a command, including streaming */
+	CONN_CLOSED
+} WbConnState;
+
+typedef struct WbPortStruct {
 	int fd;
 	char *recvBuffer;
+	int recvBufSize;
 	int recvPointer;
 	int recvLength;
+	// Socket may have data we haven't read yet, set on EPOLLIN and cleared
+	// once a read comes back short
+	bool recvReady;
+	// Set once the client asked for SSL, see wbtls.h
+	struct ssl_st *ssl;
+	bool sslHandshake;
+	bool ktlsSend;
 
 	struct {
 		uint32 addr;
 		uint16 port;
+		bool local;		/* connected over the Unix domain socket */
 	} client;
 
 	// Matched configuration entry
@@ -44,12 +65,26 @@ typedef struct {
 	int sendBufLen;
 	int sendBufMsgLenPtr;
 	int sendBufFlushPtr;
+	// Rate limit ran out, the event loop runs us again at this time
+	TimestampTz throttledUntil;
 
 	ProtocolVersion proto;
 
 	char *master_host;
 	int master_port;
 
+	// Upstream WAL source, either our own master connection, the shared
+	// fan-out buffer or the local WAL cache
+	struct MasterConn *master;
+	struct WbFanoutReader *fanout;
+	struct WbWalCacheReader *walCache;
+	// WAL read ahead from the master while the standby catches up
+	struct WbSpool *spool;
+	// Set while we produce the cached filtered output of our profile
+	uint32 producerClaim;
+	// Replication slot the standby streams from, 1-based, 0 if none
+	int replSlot;
+
 	char *database_name;
 	char *user_name;
 	char *application_name;
@@ -60,6 +95,16 @@ typedef struct {
 	// Sending state
 	XLogRecPtr sentPtr;
 	TimestampTz lastSend;
+	// WAL merged into a single message to the standby, see WbCCQueueWal
+	char *walBatch;
+	int walBatchLen;
+	bool walBatchOpen;
+	XLogRecPtr walBatchStart;
+	XLogRecPtr walBatchWalEnd;
+	TimestampTz walBatchSendTime;
+	// Set when a downstream walbouncer asked for compressed WAL
+	bool compressWal;
+	struct WbCompressor *compressor;
 	bool copyDoneSent;
 	bool copyDoneReceived;
 
@@ -68,6 +113,29 @@ typedef struct {
 	bool	replyForwarded;
 	HSFeedbackMessage lastFeedback;
 	bool	feedbackForwarded;
+	// Status as last sent to the master, see WbCCForwardPendingReplies
+	StandbyReplyMessage forwardedReply;
+	HSFeedbackMessage forwardedFeedback;
+	TimestampTz lastStatusForward;
+	bool	masterReplyRequested;
+
+	// Event loop state
+	WbConnState state;
+	bool runPending;
+	struct WbPortStruct *next;
+	struct WbPortStruct *prev;
+	int upstreamFd;
+	uint32 upstreamEvents;
+
+	// Command being executed, steps are resumed when the master answers
+	struct ReplicationCommand *command;
+	int commandStep;
+	int lookupStep;
+	bool querySent;
+	struct MasterConn *metadata;
+	struct FilterData *filter;
+	struct ReplMessage *msg;
+	XLogRecPtr startReceivingFrom;
 } WbPortStruct;
 typedef WbPortStruct* WbConn;
 
@@ -84,6 +152,9 @@ typedef enum {
 WbSocket
 OpenServerSocket(int port);
 
+WbSocket
+OpenUnixServerSocket(const char *directory, int port);
+
 WbConn
 ConnCreate(WbSocket server);
 
@@ -120,17 +191,14 @@ ConnSendBytes(WbConn conn, const char *str, int n);
 void
 ConnEndMessage(WbConn conn);
 
-int
-ConnGetByte(WbConn conn);
-
-int
-ConnGetBytes(WbConn conn, char *s, size_t len);
+void
+ConnEndMessageWithData(WbConn conn, const struct iovec *data, int ndata);
 
 int
-ConnGetByteIfAvailable(WbConn conn, char *c);
+ConnGetMessage(WbConn conn, int *type, WbMessage **msg);
 
 int
-ConnGetMessage(WbConn conn, WbMessage **msg);
+ConnGetMessageData(WbConn conn, int *type, char **data, int *len);
 
 void
 ConnFreeMessage(WbMessage *msg);
@@ -0,0 +1,26 @@
+#ifndef	_WB_SPOOL_H
+#define _WB_SPOOL_H 1
+
+#include <sys/types.h>
+
+#include "wbglobals.h"
+#include "wbmasterconn.h"
+
+/*
+ * Read-ahead spool of a standby session. WAL keeps being read from the
+ * master while the standby is catching up and waits here, first in memory
+ * and once the memory budget is used up in a compressed temporary file.
+ * Messages come out in the order they were put in.
+ */
+
+typedef struct WbSpool WbSpool;
+
+WbSpool* WbSpCreate(size_t memoryLimit, off_t diskLimit, const char *directory);
+void WbSpFree(WbSpool *spool);
+void WbSpReset(WbSpool *spool);
+bool WbSpIsEmpty(WbSpool *spool);
+bool WbSpHasRoom(WbSpool *spool);
+void WbSpPut(WbSpool *spool, ReplMessage *msg);
+bool WbSpGet(WbSpool *spool, ReplMessage *msg);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef	_WB_TLS_H
+#define _WB_TLS_H 1
+
+#include "wbglobals.h"
+#include "wbsocket.h"
+
+/*
+ * TLS towards standbys. The server context is set up before workers are
+ * forked, so all of them share the session ticket keys and a standby can
+ * resume its session on whichever worker it reconnects to.
+ *
+ * When the kernel supports it, encryption of what we send is handed to
+ * kernel TLS after the handshake. Sending then keeps going straight to the
+ * socket with writev, without a copy into OpenSSL. Reads always go through
+ * OpenSSL, standby replies are small.
+ */
+
+struct ssl_st;
+
+/* Postmaster side */
+void WbTlInit();
+bool WbTlEnabled();
+
+/* Standby connections */
+void WbTlStartServer(WbConn conn);
+bool WbTlHandshake(WbConn conn);
+void WbTlClose(WbConn conn);
+
+/* Master connection, libpq made it and we take over while streaming */
+void WbTlAdoptClient(struct ssl_st *ssl);
+
+/* Like recv and send on a nonblocking socket, EAGAIN when OpenSSL would block */
+int WbTlRead(struct ssl_st *ssl, char *buf, int len);
+int WbTlWrite(struct ssl_st *ssl, const char *buf, int len);
+bool WbTlPending(struct ssl_st *ssl);
+
+#endif
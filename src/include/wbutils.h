@@ -1,6 +1,8 @@
 #ifndef	_WB_UTILS_H
 #define _WB_UTILS_H 1
 
+#include <setjmp.h>
+
 #include "wbglobals.h"
 
 typedef enum LogLevel {
@@ -27,15 +29,17 @@ extern LogLevel loggingLevel;
 #define log_warning(...) wb_log(LOG_WARNING, "WARNING", __VA_ARGS__)
 #define log_error(...) wb_log(LOG_ERROR, "ERROR", __VA_ARGS__)
 
+extern jmp_buf *WbErrorJump;
+
 void do_wb_log(LogLevel logLevel, const char* logLevelStr, const char* file, const char* message, ...);
 void __attribute__((noreturn)) error(const char *message, ...);
-void showPQerror(PGconn *mc, char *message);
+void __attribute__((noreturn)) showPQerror(PGconn *mc, char *message);
 
 
 void *wballoc(size_t amount);
 void *wballoc0(size_t amount);
 void *rewballoc(void *ptr, size_t amount);
-char *wbstrdup(char *s);
+char *wbstrdup(const char *s);
 void wbfree(void *ptr);
 
 #define Assert(x) do {\
@@ -54,6 +58,8 @@ void write64(char *buf, uint64 v);
 void write32(char *buf, uint32 v);
 
 const char * timestamptz_to_str(TimestampTz t);
+TimestampTz GetCurrentTimestamp();
+bool parse_recptr(const char *s, XLogRecPtr *result);
 
 typedef struct {
 	uint32 addr;
@@ -0,0 +1,50 @@
+#ifndef	_WB_WALCACHE_H
+#define _WB_WALCACHE_H 1
+
+#include <sys/types.h>
+
+#include "wbglobals.h"
+#include "wbmasterconn.h"
+
+/*
+ * WAL received from the master is also written to a cache of whole segments
+ * in a file on local disk. Standbys that (re)connect or have to resynchronize
+ * at an earlier position are served from the cache until they reach its end,
+ * only then is streaming from the master started. The least recently used
+ * segment is replaced when the cache is full, except for WAL that replication
+ * slots retain. The cache is kept over restarts.
+ *
+ * The output of filtering is cached the same way, per profile. A profile is
+ * the position of a configuration entry with filter clauses, 0 stands for
+ * WAL as received. One session at a time produces the output of a profile,
+ * the others follow it through the cache without filtering on their own.
+ * The producer also reports the status of its followers' standbys to the
+ * master.
+ */
+
+typedef struct WbWalCacheReader WbWalCacheReader;
+
+/* Postmaster side */
+void WbWcInit();
+bool WbWcEnabled();
+void WbWcProcessExited(pid_t pid);
+
+/* Writers, fed with WAL as received or as sent to standbys of a profile */
+void WbWcSetSystem(const char *sysid);
+void WbWcWrite(int profile, TimeLineID tli, XLogRecPtr dataStart, const char *data, int len);
+uint32 WbWcClaimProducer(int profile, TimeLineID tli);
+void WbWcReleaseProducer(int profile, uint32 claim);
+void WbWcProducerKeepalive(int profile, XLogRecPtr walEnd, TimestampTz sendTime, bool replyRequested);
+void WbWcMergeFollowerStatus(int profile, StandbyReplyMessage *reply, HSFeedbackMessage *feedback);
+
+/* Standby session side */
+WbWalCacheReader* WbWcAttach(XLogRecPtr startPos, TimeLineID tli, int profile);
+void WbWcDetach(WbWalCacheReader *reader);
+bool WbWcIsFiltered(WbWalCacheReader *reader);
+void WbWcSendReply(WbWalCacheReader *reader, StandbyReplyMessage *reply);
+void WbWcSendFeedback(WbWalCacheReader *reader, HSFeedbackMessage *feedback);
+bool WbWcRestartAt(WbWalCacheReader *reader, XLogRecPtr pos);
+XLogRecPtr WbWcGetPosition(WbWalCacheReader *reader);
+bool WbWcReceiveWalMessage(WbWalCacheReader *reader, ReplMessage *msg);
+
+#endif
@@ -5,35 +5,47 @@
 
 
 #include <getopt.h>
+#include <poll.h>
 #include <unistd.h>
 #include <sys/wait.h>
 
+#include "wbarchive.h"
 #include "wbconfig.h"
 #include "wbutils.h"
 #include "wbsocket.h"
 #include "wbsignals.h"
 #include "wbclientconn.h"
+#include "wbevent.h"
+#include "wbfanout.h"
+#include "wbmasterconn.h"
+#include "wboidcache.h"
+#include "wbpool.h"
+#include "wbratelimit.h"
+#include "wbslots.h"
+#include "wbtls.h"
+#include "wbwalcache.h"
 
-typedef enum {
-	SLOT_UNUSED,
-	SLOT_ACTIVE
-} BouncerSlotState;
+char* config_filename = NULL;
 
-typedef struct {
-	pid_t pid;
-	BouncerSlotState state;
-} BouncerSlot;
-typedef struct {
-	BouncerSlot* slots;
-	int numSlots;
-} BouncerArrayStruct;
+/* How long to sleep between checks on child processes, in milliseconds */
+#define POSTMASTER_NAPTIME 5000
+#define WORKER_NAPTIME 5000
 
-char* config_filename = NULL;
-BouncerArrayStruct BouncerArray;
+/*
+ * All sessions are multiplexed in this process. Closed sessions are only
+ * freed once we are done with the batch of events that might still refer
+ * to them.
+ */
+static WbConn sessions = NULL;
+static WbConn closedSessions = NULL;
+static bool sessionsPending = false;
+
+/* Tags for non-session sockets in the event set */
+static char listenTag;
+static char unixListenTag;
+static char latchTag;
 
 static pid_t fork_process();
-static void InitializeBouncerArray();
-static void ResizeBouncerArray(int newSize);
 
 static pid_t fork_process()
 {
@@ -45,75 +57,52 @@ static pid_t fork_process()
 	return result;
 }
 
+/*
+ * Sessions are spread over worker processes. Each worker has its own listen
+ * socket bound with SO_REUSEPORT and its own event loop, the kernel balances
+ * incoming connections between them. The listen sockets are opened here so
+ * that a restarted worker picks up connections queued for its predecessor.
+ */
+static int numWorkers = 0;
+static pid_t *workerPids = NULL;
+static WbSocket *workerSockets = NULL;
+/* Shared by all workers, whichever accepts first gets the connection */
+static WbSocket unixSocket = NULL;
+/* Set by the SIGCHLD handler */
+static volatile sig_atomic_t childExited = false;
+
 static void
-InitializeBouncerArray()
-{
-	BouncerArray.numSlots = 0;
-	ResizeBouncerArray(8);
-}
-static void
-ResizeBouncerArray(int newSize)
+CleanupChild(int pid, int exitstatus)
 {
 	int i;
-	int oldSize = BouncerArray.numSlots;
-
-	log_debug2("Resizing bouncer array from %d to %d", oldSize, newSize);
-	sleep(1);
 
-	if (oldSize == 0)
-		BouncerArray.slots = wballoc0(sizeof(BouncerSlot)*newSize);
-	else
-		BouncerArray.slots = rewballoc(BouncerArray.slots, sizeof(BouncerSlot)*newSize);
+	WbWcProcessExited(pid);
+	WbSlProcessExited(pid);
 
-	for (i = oldSize; i < newSize; i++)
+	if (WbFoProcessExited(pid))
 	{
-		BouncerArray.slots[i].pid = 0;
-		BouncerArray.slots[i].state = SLOT_UNUSED;
+		log_warning("Fan-out receiver with PID %d exited with exit code %d", pid, exitstatus);
+		return;
 	}
-	BouncerArray.numSlots = newSize;
-}
 
-static BouncerSlot*
-FindBouncerSlot()
-{
-	do
+	if (WbArProcessExited(pid))
 	{
-		int i;
-		for (i = 0; i < BouncerArray.numSlots; i++)
-		{
-			if (BouncerArray.slots[i].state == SLOT_UNUSED)
-				return &(BouncerArray.slots[i]);
-		}
-		ResizeBouncerArray(BouncerArray.numSlots * 2);
-	} while (true);
-}
-
-static void
-CleanupBackend(int pid, int exitstatus)
-{
-	int i;
-	BouncerSlot *slot = NULL;
-
-	for (i = 0; i < BouncerArray.numSlots; i++)
-		if (BouncerArray.slots[i].pid == pid)
-			slot = &(BouncerArray.slots[i]);
-
-	if (!slot)
-	{
-		log_warning("Trying to clean non-existant backend with PID %d", pid);
+		log_warning("Archive writer with PID %d exited with exit code %d", pid, exitstatus);
 		return;
 	}
 
-	log_debug2("Backend %d exited in state %d", pid, slot->state);
-
-	if (((exitstatus & 0xff00) >> 8) != 1 && exitstatus != 0)
+	for (i = 0; i < numWorkers; i++)
 	{
-		log_warning("Backend with PID %d crashed with exit code %d", pid, exitstatus);
+		if (workerPids[i] == pid)
+		{
+			if (!stopRequested)
+				log_warning("Worker %d with PID %d exited with exit code %d", i, pid, exitstatus);
+			workerPids[i] = 0;
+			return;
+		}
 	}
-	
-	/* Mark the slot as empty */
-	slot->pid = 0;
-	slot->state = SLOT_UNUSED;
+
+	log_warning("Trying to clean non-existant child with PID %d", pid);
 }
 
 static void
@@ -124,113 +113,418 @@ static void
 UnblockSignals()
 {}
 
+/*
+ * Cleaning up after a child takes spinlocks in shared memory and may write
+ * files, which is not safe in a signal handler. The main loop does it.
+ */
 static void
 reaper(int signum)
 {
 	int save_errno = errno;
-	int pid;
-	int exitstatus;
 
 	BlockSignals();
 
-	log_debug2("Reaping dead child process");
-
-	while ((pid = waitpid(-1, &exitstatus, WNOHANG)) > 0)
-		CleanupBackend(pid, exitstatus);
+	childExited = true;
+	WbSetLatch(getpid());
 
 	UnblockSignals();
 	errno = save_errno;
 }
 
-static int
-InitMasks(fd_set *rmask, WbSocket server)
+static void
+ReapChildren()
 {
-	int maxsock = - 1;
-	int fd = server->fd;
-	FD_ZERO(rmask);
+	int pid;
+	int exitstatus;
 
-	FD_SET(fd, rmask);
-	if (fd > maxsock)
-		maxsock = fd;
+	childExited = false;
+	log_debug2("Reaping dead child processes");
 
-	return maxsock + 1;
+	while ((pid = waitpid(-1, &exitstatus, WNOHANG)) > 0)
+		CleanupChild(pid, exitstatus);
 }
 
-void WalBouncerMain()
+static void
+CloseListenSockets()
 {
-	// set up signals for child reaper, etc.
-	WbInitializeSignals();
-	signal(SIGCHLD, reaper);
+	int i;
 
-	// open socket for listening
-	WbSocket server = OpenServerSocket(CurrentConfig->listen_port);
-	WbConn conn;
-	fd_set readmask;
-	int nSock;
+	for (i = 0; i < numWorkers; i++)
+		CloseSocket(workerSockets[i]);
+	if (unixSocket)
+		CloseSocket(unixSocket);
+	unixSocket = NULL;
+}
 
-	nSock = InitMasks(&readmask, server);
+static void
+StartFanoutReceiver()
+{
+	pid_t pid;
 
+	pid = fork_process();
+	if (pid == 0) /* child */
+	{
+		CloseListenSockets();
+		CloseDeathwatchPort();
 
-	while (!stopRequested)
+		WbFoReceiverMain();
+		exit(0);
+	}
+
+	if (pid < 0)
+	{
+		log_error("Could not fork fan-out receiver");
+	}
+	else
+		WbFoSetReceiverPid(pid);
+}
+
+static void
+StartArchiveWriter()
+{
+	pid_t pid;
+
+	pid = fork_process();
+	if (pid == 0) /* child */
+	{
+		CloseListenSockets();
+		CloseDeathwatchPort();
+
+		WbArWriterMain();
+		exit(0);
+	}
+
+	if (pid < 0)
+	{
+		log_error("Could not fork archive writer");
+	}
+	else
+		WbArSetWriterPid(pid);
+}
+
+static void
+EndSession(WbConn conn)
+{
+	WbCCCloseConnection(conn);
+
+	if (conn->prev)
+		conn->prev->next = conn->next;
+	else
+		sessions = conn->next;
+	if (conn->next)
+		conn->next->prev = conn->prev;
+
+	conn->next = closedSessions;
+	closedSessions = conn;
+
+	log_debug1("Connection from %08X:%d closed", conn->client.addr, conn->client.port);
+}
+
+/*
+ * Let the session make progress. An error in the session only closes that
+ * session.
+ */
+static void
+RunSession(WbConn conn)
+{
+	jmp_buf jump;
+
+	if (conn->state == CONN_CLOSED)
+		return;
+
+	conn->runPending = false;
+
+	if (setjmp(jump) == 0)
 	{
-		pid_t pid;
+		WbErrorJump = &jump;
+		if (WbCCRun(conn))
 		{
-			fd_set rmask;
-			int selres;
-			struct timeval timeout;
-			timeout.tv_sec = 60;
-			timeout.tv_usec = 0;
-
-			memcpy((char*) &rmask, (char*)&readmask, sizeof(fd_set));
-			selres = select(nSock, &rmask, NULL, NULL, &timeout);
-			log_debug2("select returned %d", selres)
-			/* Now check the select() result */
-			if (selres < 0)
-				if (errno != EINTR && errno != EWOULDBLOCK)
-					error("select failed");
-			if (selres <= 0)
-				continue;
+			conn->runPending = true;
+			sessionsPending = true;
 		}
+	}
+	else
+	{
+		log_info("Closing connection from %08X:%d after error",
+				conn->client.addr, conn->client.port);
+		conn->state = CONN_CLOSED;
+	}
+	WbErrorJump = NULL;
+
+	if (conn->state == CONN_CLOSED)
+		EndSession(conn);
+}
 
-		conn = ConnCreate(server);
+static void
+AcceptConnections(WbSocket server)
+{
+	WbConn conn;
+
+	while ((conn = ConnCreate(server)) != NULL)
+	{
 		conn->master_host = CurrentConfig->master.host;
 		conn->master_port = CurrentConfig->master.port;
 
 		log_debug2("Received new connection");
 
-		pid = fork_process();
-		if (pid == 0) /* child */
-		{
-			CloseSocket(server);
-			CloseDeathwatchPort();
+		conn->next = sessions;
+		if (sessions)
+			sessions->prev = conn;
+		sessions = conn;
 
-			WbCCInitConnection(conn);
+		WbEvAdd(conn->fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, conn);
+		WbCCInitConnection(conn);
+		RunSession(conn);
+	}
+}
 
-			WbCCPerformAuthentication(conn);
+/* Run sessions that gave up their turn with work left */
+static void
+RunPendingSessions()
+{
+	WbConn conn;
+	WbConn next;
 
-			WbCCCommandLoop(conn);
+	sessionsPending = false;
+	for (conn = sessions; conn; conn = next)
+	{
+		next = conn->next;
+		if (conn->runPending)
+			RunSession(conn);
+	}
+}
 
-			CloseConn(conn);
+/*
+ * The fan-out receiver or the producer of a filter profile has set our latch,
+ * check on sessions reading from them. Followers of a profile set the latch
+ * of its producer when their standby's status changed.
+ */
+static void
+RunLatchedSessions()
+{
+	WbConn conn;
+	WbConn next;
 
-			return;
-		}
+	WbResetLatch();
+	for (conn = sessions; conn; conn = next)
+	{
+		next = conn->next;
+		if (conn->fanout || conn->walCache || conn->producerClaim)
+			RunSession(conn);
+	}
+}
+
+/*
+ * Milliseconds until the first throttled session may send again, at most
+ * WORKER_NAPTIME.
+ */
+static int
+ThrottleTimeout()
+{
+	TimestampTz now = GetCurrentTimestamp();
+	TimestampTz first = now + WORKER_NAPTIME * 1000;
+	WbConn conn;
+
+	for (conn = sessions; conn; conn = conn->next)
+		if (conn->throttledUntil && conn->throttledUntil < first)
+			first = conn->throttledUntil;
+	return first > now ? (first - now + 999) / 1000 : 0;
+}
 
-		if (pid < 0)
+static void
+RunThrottledSessions()
+{
+	TimestampTz now = GetCurrentTimestamp();
+	WbConn conn;
+	WbConn next;
+
+	for (conn = sessions; conn; conn = next)
+	{
+		next = conn->next;
+		if (conn->throttledUntil && conn->throttledUntil <= now)
 		{
-			/* failed fork */
+			conn->throttledUntil = 0;
+			RunSession(conn);
 		}
-		else if (pid > 0)
+	}
+}
+
+static void
+FreeClosedSessions()
+{
+	while (closedSessions)
+	{
+		WbConn conn = closedSessions;
+		closedSessions = conn->next;
+		CloseConn(conn);
+	}
+}
+
+static void
+WorkerMain(WbSocket server)
+{
+	struct epoll_event events[WB_MAX_EVENTS];
+	bool rateLimited = CurrentConfig->max_rate > 0;
+	wb_config_list_entry *item;
+
+	for (item = CurrentConfig->configurations; item; item = item->next)
+		rateLimited |= WbRlLimited(&(item->entry));
+
+	WbInitLatch();
+
+	WbEvInit();
+	WbEvAdd(server->fd, EPOLLIN, &listenTag);
+	/* Only one of the workers is woken up for a new connection */
+	if (unixSocket)
+		WbEvAdd(unixSocket->fd, EPOLLIN | EPOLLEXCLUSIVE, &unixListenTag);
+	WbEvAdd(WbLatchGetSocket(), EPOLLIN, &latchTag);
+
+	WbPlInit();
+
+	while (!stopRequested)
+	{
+		int nevents;
+		int i;
+
+		if (!DaemonIsAlive())
+			error("Master process died, exiting!");
+
+		nevents = WbEvWait(events, WB_MAX_EVENTS, sessionsPending ? 0 :
+				(rateLimited ? ThrottleTimeout() : WORKER_NAPTIME));
+		log_debug3("epoll returned %d", nevents);
+
+		if (sessionsPending)
+			RunPendingSessions();
+		if (rateLimited)
+			RunThrottledSessions();
+
+		for (i = 0; i < nevents; i++)
 		{
-			BouncerSlot* slot = FindBouncerSlot();
-			slot->pid = pid;
-			slot->state = SLOT_ACTIVE;
-			CloseConn(conn);
+			void *ptr = events[i].data.ptr;
+
+			if (ptr == &listenTag)
+				AcceptConnections(server);
+			else if (ptr == &unixListenTag)
+				AcceptConnections(unixSocket);
+			else if (ptr == &latchTag)
+				RunLatchedSessions();
+			else if (WbPlIsEventTag(ptr))
+				WbPlProcessEvents();
+			else
+			{
+				/* Might be the upstream socket, an extra read doesn't hurt */
+				if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+					((WbConn) ptr)->recvReady = true;
+				RunSession((WbConn) ptr);
+			}
 		}
+
+		FreeClosedSessions();
+		WbPlMaintain();
 	}
-	log_info("Stopping server.");
 	CloseSocket(server);
 }
 
+static void
+StartWorker(int id)
+{
+	pid_t pid;
+
+	pid = fork_process();
+	if (pid == 0) /* child */
+	{
+		int i;
+
+		signal(SIGCHLD, SIG_DFL);
+		for (i = 0; i < numWorkers; i++)
+			if (i != id)
+				CloseSocket(workerSockets[i]);
+		CloseDeathwatchPort();
+
+		WorkerMain(workerSockets[id]);
+		exit(0);
+	}
+
+	if (pid < 0)
+	{
+		log_error("Could not fork worker %d", id);
+	}
+	else
+	{
+		workerPids[id] = pid;
+		log_debug1("Started worker %d with PID %d", id, pid);
+	}
+}
+
+static void
+StopChildren()
+{
+	int i;
+
+	for (i = 0; i < numWorkers; i++)
+		if (workerPids[i])
+			kill(workerPids[i], SIGINT);
+}
+
+void WalBouncerMain()
+{
+	int i;
+
+	// set up signals for child reaper, etc.
+	WbInitializeSignals();
+	signal(SIGCHLD, reaper);
+	WbInitLatch();
+
+	numWorkers = CurrentConfig->workers;
+	if (numWorkers <= 0)
+		numWorkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (numWorkers <= 0)
+		numWorkers = 1;
+	log_info("Starting %d workers", numWorkers);
+
+	// open sockets for listening, one per worker
+	workerPids = wballoc0(sizeof(pid_t) * numWorkers);
+	workerSockets = wballoc(sizeof(WbSocket) * numWorkers);
+	for (i = 0; i < numWorkers; i++)
+		workerSockets[i] = OpenServerSocket(CurrentConfig->listen_port);
+	if (CurrentConfig->unix_socket_directory)
+		unixSocket = OpenUnixServerSocket(CurrentConfig->unix_socket_directory,
+				CurrentConfig->listen_port);
+
+	while (!stopRequested)
+	{
+		struct pollfd latch;
+
+		if (childExited)
+			ReapChildren();
+
+		for (i = 0; i < numWorkers; i++)
+			if (!workerPids[i])
+				StartWorker(i);
+
+		if (WbFoNeedsReceiver())
+			StartFanoutReceiver();
+
+		if (WbArNeedsWriter())
+			StartArchiveWriter();
+
+		latch.fd = WbLatchGetSocket();
+		latch.events = POLLIN;
+		latch.revents = 0;
+		if (poll(&latch, 1, POSTMASTER_NAPTIME) < 0 && errno != EINTR)
+			error("poll failed in main loop");
+		WbResetLatch();
+	}
+	log_info("Stopping server.");
+	StopChildren();
+	if (unixSocket)
+	{
+		unlink(unixSocket->path);
+		unlink(unixSocket->lockPath);
+	}
+	CloseListenSockets();
+}
+
 const char* progname;
 
 static void usage()
@@ -305,9 +599,16 @@ main(int argc, char **argv)
 	if (config_filename)
 		wb_read_config(CurrentConfig, config_filename);
 
-	InitializeBouncerArray();
 	InitDeathWatchHandle();
 
+	if (CurrentConfig->fanout.enabled)
+		WbFoInitShmem();
+	WbOcInitShmem();
+	WbWcInit();
+	WbSlInit();
+	WbTlInit();
+	WbRlInit();
+
 	WalBouncerMain();
 	return 0;
 }
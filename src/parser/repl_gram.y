@@ -201,7 +201,9 @@ create_replication_slot:
 					cmd->kind = REPLICATION_KIND_PHYSICAL;
 					cmd->slotname = $2;
 					$$ = (Node *) cmd;*/
-					$$ = MakeReplCommand(REPL_CREATE_SLOT);
+					ReplicationCommand *cmd = MakeReplCommand(REPL_CREATE_SLOT);
+					cmd->slotname = $2;
+					$$ = cmd;
 				}
 			/* CREATE_REPLICATION_SLOT slot LOGICAL plugin */
 			| K_CREATE_REPLICATION_SLOT IDENT K_LOGICAL IDENT
@@ -212,7 +214,10 @@ create_replication_slot:
 					cmd->slotname = $2;
 					cmd->plugin = $4;
 					$$ = (Node *) cmd;*/
-					$$ = MakeReplCommand(REPL_CREATE_SLOT);
+					ReplicationCommand *cmd = MakeReplCommand(REPL_CREATE_SLOT);
+					cmd->slotname = $2;
+					cmd->logical = true;
+					$$ = cmd;
 				}
 			;
 
@@ -224,7 +229,9 @@ drop_replication_slot:
 					cmd = makeNode(DropReplicationSlotCmd);
 					cmd->slotname = $2;
 					$$ = (Node *) cmd;*/
-					$$ = MakeReplCommand(REPL_DROP_SLOT);
+					ReplicationCommand *cmd = MakeReplCommand(REPL_DROP_SLOT);
+					cmd->slotname = $2;
+					$$ = cmd;
 				}
 			;
 
@@ -1,5 +1,20 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #include "wbutils.h"
+#include "wbcrc32c.h"
+#include "wboidcache.h"
+#include "wboidset.h"
+#include "wbspool.h"
+#include "wbconfig.h"
+#include "wbslots.h"
+#include "wbwalcache.h"
+#include "wbfilter.h"
+#include "wbcompress.h"
+#include "wbratelimit.h"
+#include "wbpgtypes.h"
 
 #define FAIL(...) { printf(__VA_ARGS__); printf(" on line %d\n", __LINE__); return false; }
 #define EXPECT_TRUE(x) if (!x) FAIL("Expected true, got false")
@@ -50,6 +65,668 @@ test_hostmask_match()
 	return true;
 }
 
+bool
+test_oid_cache()
+{
+	char *names[] = { "spc1", "missing" };
+	char *found[] = { "spc1", "pg_default", "pg_global" };
+	Oid oids[] = { 16400, 1663, 1664, InvalidOid };
+	Oid *result;
+
+	WbOcInitShmem();
+
+	EXPECT_FALSE(WbOcLookup(OID_RESOLVE_TABLESPACES, false, names, 2, &result));
+
+	WbOcStore(OID_RESOLVE_TABLESPACES, true, names, 2, oids, found);
+
+	/* Names that don't exist are left out */
+	EXPECT_TRUE(WbOcLookup(OID_RESOLVE_TABLESPACES, false, names, 2, &result));
+	ASSERT_INT_EQUALS(result[0], 16400);
+	ASSERT_INT_EQUALS(result[1], InvalidOid);
+
+	EXPECT_TRUE(WbOcLookup(OID_RESOLVE_TABLESPACES, true, names, 1, &result));
+	ASSERT_INT_EQUALS(result[0], 16400);
+	ASSERT_INT_EQUALS(result[1], 1663);
+	ASSERT_INT_EQUALS(result[2], 1664);
+
+	/* Kinds are separate */
+	EXPECT_FALSE(WbOcLookup(OID_RESOLVE_DATABASES, false, names, 1, &result));
+	return true;
+}
+
+bool
+test_oid_set()
+{
+	Oid oids[3001];
+	OidSet *set;
+	int i;
+
+	for (i = 0; i < 3000; i++)
+		oids[i] = 16384 + i * 3;
+	oids[3000] = InvalidOid;
+
+	set = WbOsCreate(oids);
+	for (i = 0; i < 3000; i++)
+		EXPECT_TRUE(WbOsContains(set, 16384 + i * 3));
+	EXPECT_FALSE(WbOsContains(set, 16385));
+	EXPECT_FALSE(WbOsContains(set, 1663));
+	WbOsFree(set);
+
+	/* Empty list */
+	set = WbOsCreate(oids + 3000);
+	EXPECT_FALSE(WbOsContains(set, 16384));
+	WbOsFree(set);
+	return true;
+}
+
+bool
+test_crc32c()
+{
+	unsigned char buf[4200];
+	pg_crc32c crc;
+	int len;
+	int i;
+
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = (i * 7919) ^ (i >> 5);
+
+	/* Check value for "123456789" */
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, "123456789", 9);
+	FIN_CRC32C(crc);
+	ASSERT_INT_EQUALS(crc, 0xE3069283);
+
+	/* Zero runs against the table implementation over real zeros */
+	memset(buf, 0, sizeof(buf));
+	for (len = 0; len < sizeof(buf); len += (len < 200 ? 1 : 97))
+		ASSERT_INT_EQUALS(pg_comp_crc32c_zero(0x12345678, len),
+						  pg_comp_crc32c_sb8(0x12345678, buf, len));
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = (i * 7919) ^ (i >> 5);
+
+#ifdef USE_SSE42_CRC32C_WITH_RUNTIME_CHECK
+	if (!__builtin_cpu_supports("sse4.2") || !__builtin_cpu_supports("pclmul"))
+		return true;
+
+	pg_comp_crc32c_pclmul_init();
+	for (len = 0; len < 4100; len += (len < 300 ? 1 : 37))
+	{
+		for (i = 0; i < 8; i++)
+		{
+			pg_crc32c expected = pg_comp_crc32c_sb8(0x12345678, buf + i, len);
+			ASSERT_INT_EQUALS(pg_comp_crc32c_sse42(0x12345678, buf + i, len), expected);
+			ASSERT_INT_EQUALS(pg_comp_crc32c_pclmul(0x12345678, buf + i, len), expected);
+		}
+	}
+#endif
+	return true;
+}
+
+bool
+test_spool()
+{
+	static char data[8192];
+	WbSpool *spool = WbSpCreate(64 * 1024, 1024 * 1024, "/tmp");
+	ReplMessage in, out;
+	int put = 0, got = 0;
+	int i;
+
+	in.type = MSG_WAL_DATA;
+	in.dataLen = sizeof(data);
+	in.data = data;
+
+	EXPECT_TRUE(WbSpIsEmpty(spool));
+
+	/* Fill past the memory budget and read back while still putting */
+	while (put < 300)
+	{
+		if (WbSpHasRoom(spool))
+		{
+			for (i = 0; i < sizeof(data); i++)
+				data[i] = (i % 100 == 0) ? put + i : 'x';
+			in.dataStart = (XLogRecPtr) put * sizeof(data);
+			WbSpPut(spool, &in);
+			put++;
+		}
+		if (put % 3 == 0 || !WbSpHasRoom(spool))
+		{
+			EXPECT_TRUE(WbSpGet(spool, &out));
+			if (out.dataStart != (XLogRecPtr) got * sizeof(data))
+				FAIL("Got message %d out of order", got);
+			ASSERT_INT_EQUALS(out.dataLen, (int) sizeof(data));
+			ASSERT_INT_EQUALS(out.data[100], (char) (got + 100));
+			got++;
+		}
+	}
+	while (WbSpGet(spool, &out))
+		got++;
+	ASSERT_INT_EQUALS(got, put);
+	EXPECT_TRUE(WbSpIsEmpty(spool));
+
+	/* Nothing is taken after the end of WAL */
+	in.type = MSG_END_OF_WAL;
+	WbSpPut(spool, &in);
+	EXPECT_FALSE(WbSpHasRoom(spool));
+	WbSpReset(spool);
+	EXPECT_TRUE(WbSpIsEmpty(spool));
+	EXPECT_TRUE(WbSpHasRoom(spool));
+
+	WbSpFree(spool);
+	return true;
+}
+
+bool
+test_slots()
+{
+	char dir[] = "/tmp/wbtestXXXXXX";
+	char path[sizeof(dir) + 8];
+	int slot = 0;
+
+	if (!mkdtemp(dir))
+		FAIL("Could not create a directory for slots");
+	snprintf(path, sizeof(path), "%s/slots", dir);
+
+	CurrentConfig = wb_new_config();
+	CurrentConfig->wal_cache.enabled = true;
+	CurrentConfig->wal_cache.directory = dir;
+	CurrentConfig->wal_cache.max_slots = 2;
+
+	WbSlInit();
+	EXPECT_TRUE(WbSlEnabled());
+	ASSERT_INT_EQUALS(WbSlCreate("Bad-Name"), SLOT_INVALID_NAME);
+	ASSERT_INT_EQUALS(WbSlCreate("standby1"), SLOT_OK);
+	ASSERT_INT_EQUALS(WbSlCreate("standby1"), SLOT_EXISTS);
+	ASSERT_INT_EQUALS(WbSlCreate("standby2"), SLOT_OK);
+	ASSERT_INT_EQUALS(WbSlCreate("standby3"), SLOT_NO_SPACE);
+
+	/* Nothing is retained until a slot is streamed from */
+	EXPECT_FALSE(WbSlRetainPtr());
+	ASSERT_INT_EQUALS(WbSlAcquire("standby1", 3 * XLogSegSize, &slot), SLOT_OK);
+	ASSERT_INT_EQUALS(WbSlAcquire("standby1", 3 * XLogSegSize, &slot), SLOT_ACTIVE);
+	EXPECT_TRUE((WbSlRetainPtr() == 3 * XLogSegSize));
+	ASSERT_INT_EQUALS(WbSlDrop("standby1"), SLOT_ACTIVE);
+
+	/* Flushed WAL is no longer needed, going backwards is ignored */
+	WbSlAdvance(slot, 5 * XLogSegSize + 100);
+	WbSlAdvance(slot, 4 * XLogSegSize);
+	EXPECT_TRUE((WbSlRetainPtr() == 5 * XLogSegSize + 100));
+
+	/* Slots of a process that died can be streamed from again */
+	WbSlProcessExited(getpid());
+	ASSERT_INT_EQUALS(WbSlAcquire("standby1", 3 * XLogSegSize, &slot), SLOT_OK);
+	EXPECT_TRUE((WbSlRetainPtr() == 5 * XLogSegSize + 100));
+	WbSlRelease(slot);
+
+	/* Slots survive a restart, as of the last segment passed */
+	WbSlInit();
+	ASSERT_INT_EQUALS(WbSlCreate("standby2"), SLOT_EXISTS);
+	EXPECT_TRUE((WbSlRetainPtr() == 5 * XLogSegSize + 100));
+	ASSERT_INT_EQUALS(WbSlDrop("standby1"), SLOT_OK);
+	ASSERT_INT_EQUALS(WbSlDrop("standby1"), SLOT_NOT_FOUND);
+	EXPECT_FALSE(WbSlRetainPtr());
+
+	unlink(path);
+	rmdir(dir);
+	return true;
+}
+
+#define TEST_CACHE_PAGES 2
+
+/* Write two pages of WAL at pos to the cache, each page tagged with pos */
+static void
+write_test_segment(char *wal, XLogRecPtr pos)
+{
+	int i;
+
+	for (i = 0; i < TEST_CACHE_PAGES; i++)
+	{
+		XLogPageHeader header = (XLogPageHeader) (wal + i * XLOG_BLCKSZ);
+
+		memset(wal + i * XLOG_BLCKSZ, (char) (pos / XLogSegSize), XLOG_BLCKSZ);
+		header->xlp_magic = XLOG_PAGE_MAGIC;
+		header->xlp_info = 0;
+		header->xlp_pageaddr = pos + i * XLOG_BLCKSZ;
+		header->xlp_rem_len = 0;
+	}
+	WbWcWrite(0, 1, pos, wal, TEST_CACHE_PAGES * XLOG_BLCKSZ);
+}
+
+static bool
+is_test_segment_cached(XLogRecPtr pos)
+{
+	WbWalCacheReader *reader = WbWcAttach(pos, 1, 0);
+
+	if (!reader)
+		return false;
+	WbWcDetach(reader);
+	return true;
+}
+
+bool
+test_wal_cache()
+{
+	char dir[] = "/tmp/wbtestXXXXXX";
+	char path[sizeof(dir) + 16];
+	char wal[TEST_CACHE_PAGES * XLOG_BLCKSZ];
+	WbWalCacheReader *reader;
+	ReplMessage msg;
+	int slot = 0;
+
+	if (!mkdtemp(dir))
+		FAIL("Could not create a directory for the WAL cache");
+
+	/* Room for two segments */
+	CurrentConfig = wb_new_config();
+	CurrentConfig->wal_cache.enabled = true;
+	CurrentConfig->wal_cache.directory = dir;
+	CurrentConfig->wal_cache.size = 2 * XLogSegSize / (1024 * 1024);
+	CurrentConfig->wal_cache.max_slots = 1;
+
+	WbWcInit();
+	WbSlInit();
+	EXPECT_TRUE(WbWcEnabled());
+
+	/* Nothing is cached before the master is known */
+	write_test_segment(wal, 3 * XLogSegSize);
+	EXPECT_FALSE(is_test_segment_cached(3 * XLogSegSize));
+	WbWcSetSystem("6000000000000000001");
+
+	/* Read back from the middle, up to the end of what was written */
+	write_test_segment(wal, 3 * XLogSegSize);
+	reader = WbWcAttach(3 * XLogSegSize + 100, 1, 0);
+	EXPECT_TRUE(reader);
+	EXPECT_TRUE(WbWcReceiveWalMessage(reader, &msg));
+	ASSERT_INT_EQUALS(msg.type, MSG_WAL_DATA);
+	EXPECT_TRUE((msg.dataStart == 3 * XLogSegSize + 100));
+	ASSERT_INT_EQUALS(msg.dataLen, (int) sizeof(wal) - 100);
+	EXPECT_FALSE(memcmp(msg.data, wal + 100, msg.dataLen));
+	EXPECT_FALSE(WbWcReceiveWalMessage(reader, &msg));
+	ASSERT_INT_EQUALS(msg.type, MSG_NOTHING);
+	WbWcDetach(reader);
+
+	/* Other timelines, gaps and what lies beyond aren't cached */
+	EXPECT_FALSE(WbWcAttach(3 * XLogSegSize, 2, 0));
+	EXPECT_FALSE(is_test_segment_cached(3 * XLogSegSize + sizeof(wal)));
+	WbWcWrite(0, 1, 3 * XLogSegSize + 2 * sizeof(wal), wal, sizeof(wal));
+	EXPECT_FALSE(is_test_segment_cached(3 * XLogSegSize + 2 * sizeof(wal)));
+
+	/* The least recently used segment is replaced, reading counts as use */
+	write_test_segment(wal, 4 * XLogSegSize);
+	reader = WbWcAttach(3 * XLogSegSize, 1, 0);
+	EXPECT_TRUE(WbWcReceiveWalMessage(reader, &msg));
+	WbWcDetach(reader);
+	write_test_segment(wal, 5 * XLogSegSize);
+	EXPECT_TRUE(is_test_segment_cached(3 * XLogSegSize));
+	EXPECT_FALSE(is_test_segment_cached(4 * XLogSegSize));
+	EXPECT_TRUE(is_test_segment_cached(5 * XLogSegSize));
+
+	/* WAL retained for a replication slot stays */
+	ASSERT_INT_EQUALS(WbSlCreate("standby1"), SLOT_OK);
+	ASSERT_INT_EQUALS(WbSlAcquire("standby1", 3 * XLogSegSize, &slot), SLOT_OK);
+	write_test_segment(wal, 6 * XLogSegSize);
+	EXPECT_FALSE(is_test_segment_cached(6 * XLogSegSize));
+	EXPECT_TRUE(is_test_segment_cached(3 * XLogSegSize));
+
+	/* Until the standby has flushed it */
+	WbSlAdvance(slot, 5 * XLogSegSize);
+	write_test_segment(wal, 6 * XLogSegSize);
+	EXPECT_FALSE(is_test_segment_cached(3 * XLogSegSize));
+	EXPECT_TRUE(is_test_segment_cached(5 * XLogSegSize));
+	EXPECT_TRUE(is_test_segment_cached(6 * XLogSegSize));
+	WbSlRelease(slot);
+	ASSERT_INT_EQUALS(WbSlDrop("standby1"), SLOT_OK);
+
+	/* The cache is kept over a restart */
+	WbWcInit();
+	EXPECT_TRUE(is_test_segment_cached(5 * XLogSegSize));
+	EXPECT_TRUE(is_test_segment_cached(6 * XLogSegSize));
+
+	snprintf(path, sizeof(path), "%s/slots", dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/walcache", dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/walcache.index", dir);
+	unlink(path);
+	rmdir(dir);
+	return true;
+}
+
+#define TEST_WAL_PAGES 8
+#define TEST_WAL_START (XLogRecPtr) (3 * XLOG_BLCKSZ)
+
+/* Append a record to a WAL stream, adding page headers as needed */
+static int
+append_test_record(char *wal, int pos, char *rec, int len)
+{
+	int copied = 0;
+
+	while (copied < len && pos < TEST_WAL_PAGES * XLOG_BLCKSZ)
+	{
+		if (pos % XLOG_BLCKSZ == 0)
+		{
+			XLogPageHeader header = (XLogPageHeader) (wal + pos);
+
+			header->xlp_magic = XLOG_PAGE_MAGIC;
+			header->xlp_info = copied ? XLP_FIRST_IS_CONTRECORD : 0;
+			header->xlp_pageaddr = TEST_WAL_START + pos;
+			header->xlp_rem_len = len - copied;
+			pos += SizeOfXLogShortPHD;
+		}
+		wal[pos++] = rec[copied++];
+	}
+	return pos;
+}
+
+/*
+ * Filter the stream in two messages, the second one large. If output is
+ * given, what the filter passes on is collected there.
+ */
+static void
+filter_test_wal(char *wal, int start, int split, int end, char *output)
+{
+	FilterData *fl = WbFCreateProcessingState(TEST_WAL_START + start);
+	ReplMessage msg;
+	FilterOutput out;
+	XLogRecPtr retryPos;
+	int bounds[] = { start, split, end };
+	int i;
+
+	fl->exclude_databases = wballoc(2 * sizeof(Oid));
+	fl->exclude_databases[0] = 1;
+	fl->exclude_databases[1] = InvalidOid;
+	WbFCompileFilter(fl);
+
+	for (i = 0; i < 2; i++)
+	{
+		msg.type = MSG_WAL_DATA;
+		msg.dataStart = TEST_WAL_START + bounds[i];
+		msg.walEnd = TEST_WAL_START + bounds[i + 1];
+		msg.data = wal + bounds[i];
+		msg.dataLen = bounds[i + 1] - bounds[i];
+		msg.dataPtr = 0;
+		msg.nextPageBoundary = (XLOG_BLCKSZ - msg.dataStart) & (XLOG_BLCKSZ-1);
+		WbFProcessWalDataBlock(&msg, fl, &retryPos);
+		if (WbFGetOutput(&msg, fl, &out) && output)
+		{
+			int pos = out.dataStart - TEST_WAL_START;
+			int j;
+
+			for (j = 0; j < out.nparts; j++)
+			{
+				memcpy(output + pos, out.parts[j], out.partLen[j]);
+				pos += out.partLen[j];
+			}
+		}
+	}
+	WbFFreeProcessingState(fl);
+}
+
+bool
+test_parallel_filter()
+{
+	static char sequential[TEST_WAL_PAGES * XLOG_BLCKSZ];
+	static char parallel[TEST_WAL_PAGES * XLOG_BLCKSZ];
+	char rec[3000];
+	int starts[200];
+	int nrecs = 0;
+	int pos = 0;
+	int noops = 0;
+	int i;
+
+	memset(sequential, 0, sizeof(sequential));
+
+	/* Records of all sizes, every other one in an excluded database */
+	while (pos < (TEST_WAL_PAGES - 1) * XLOG_BLCKSZ)
+	{
+		XLogRecord *hdr = (XLogRecord*) rec;
+		XLogRecordBlockHeader *block = (XLogRecordBlockHeader*) (rec + REC_HEADER_LEN);
+		RelFileNode *node = (RelFileNode*) (rec + REC_HEADER_LEN + SizeOfXLogRecordBlockHeader);
+		int dataLen = (nrecs * 379) % 2800 + 4;
+
+		memset(rec, 'x', sizeof(rec));
+		hdr->xl_tot_len = REC_HEADER_LEN + SizeOfXLogRecordBlockHeader +
+			sizeof(RelFileNode) + sizeof(BlockNumber) + dataLen;
+		hdr->xl_rmid = 10;
+		hdr->xl_info = 0;
+		block->id = 0;
+		block->fork_flags = 0;
+		block->data_length = dataLen;
+		node->spcNode = 1663;
+		node->dbNode = nrecs % 2 + 1;
+		node->relNode = 16384;
+
+		starts[nrecs++] = pos;
+		pos = append_test_record(sequential, pos, rec, hdr->xl_tot_len);
+		pos = MAXALIGN(pos);
+	}
+	memcpy(parallel, sequential, sizeof(sequential));
+
+	CurrentConfig = wb_new_config();
+	CurrentConfig->filter_threads = 1;
+	filter_test_wal(sequential, starts[1], XLOG_BLCKSZ + 3000, pos, NULL);
+	CurrentConfig->filter_threads = 4;
+	filter_test_wal(parallel, starts[1], XLOG_BLCKSZ + 3000, pos, NULL);
+
+	if (memcmp(sequential, parallel, sizeof(sequential)) != 0)
+		FAIL("Parallel filtering differs from sequential");
+
+	/* Check records with headers that are in one piece */
+	for (i = 1; i < nrecs; i++)
+	{
+		bool noop = sequential[starts[i] + offsetof(XLogRecord, xl_info)] == XLOG_NOOP;
+
+		if (starts[i] % XLOG_BLCKSZ > XLOG_BLCKSZ - REC_HEADER_LEN ||
+				(starts[i] < XLOG_BLCKSZ + 3000 && starts[i] + 64 > XLOG_BLCKSZ + 3000))
+			continue;
+		if (noop != (i % 2 == 0))
+			FAIL("Record %d was not filtered correctly", i);
+		noops += noop;
+	}
+	EXPECT_TRUE(noops);
+	return true;
+}
+
+bool
+test_compression()
+{
+	static char wal[64 * 1024];
+	WbCompressor *cm = WbCmCreate(false);
+	WbCompressor *dc = WbCmCreate(true);
+	int pos = 0;
+	int msgno;
+	int i;
+
+	/* Records filtered out to zeros, in runs of all lengths */
+	memset(wal, 0, sizeof(wal));
+	for (i = 0; i < sizeof(wal); i += 1000 + (i % 7) * 300)
+		memset(wal + i, 'a' + i % 26, 100 + i % 200);
+
+	for (msgno = 0; msgno < 2; msgno++)
+	{
+		WbCmReset(cm);
+		WbCmReset(dc);
+		for (pos = 0; pos < sizeof(wal); pos += 8192)
+		{
+			char *parts[2] = { wal + pos, wal + pos + 3001 };
+			int partLen[2] = { 3001, 8192 - 3001 };
+			char *compressed;
+			char *raw;
+			int len;
+
+			len = WbCmCompress(cm, parts, partLen, 2, &compressed);
+			if (len > 8192 / 4)
+				FAIL("8192 bytes compressed only to %d", len);
+			raw = WbCmDecompress(dc, compressed, len, 8192);
+			if (memcmp(raw, wal + pos, 8192) != 0)
+				FAIL("Decompressed data differs at %d", pos);
+		}
+	}
+
+	WbCmFree(cm);
+	WbCmFree(dc);
+	return true;
+}
+
+/*
+ * A record with three block references: block 0 in database 2, block 1 in
+ * database db and block 2 in the same relation as block 1.
+ */
+static int
+build_block_record(char *rec, Oid db)
+{
+	XLogRecord *hdr = (XLogRecord*) rec;
+	int dataLen[3] = { 100, 50, 30 };
+	int len = REC_HEADER_LEN;
+	int i;
+
+	memset(rec, 'x', 512);
+	hdr->xl_rmid = 10;
+	hdr->xl_info = 0;
+	for (i = 0; i < 3; i++)
+	{
+		XLogRecordBlockHeader *block = (XLogRecordBlockHeader*) (rec + len);
+
+		block->id = i;
+		block->fork_flags = BKPBLOCK_HAS_DATA | (i == 2 ? BKPBLOCK_SAME_REL : 0);
+		block->data_length = dataLen[i];
+		len += SizeOfXLogRecordBlockHeader;
+		if (i < 2)
+		{
+			RelFileNode *node = (RelFileNode*) (rec + len);
+
+			node->spcNode = 1663;
+			node->dbNode = i == 0 ? 2 : db;
+			node->relNode = 16384 + i;
+			len += sizeof(RelFileNode);
+		}
+		len += sizeof(BlockNumber);
+	}
+	hdr->xl_tot_len = len + dataLen[0] + dataLen[1] + dataLen[2];
+	return hdr->xl_tot_len;
+}
+
+bool
+test_block_references()
+{
+	static char wal[TEST_WAL_PAGES * XLOG_BLCKSZ];
+	static char inPlace[TEST_WAL_PAGES * XLOG_BLCKSZ];
+	static char buffered[TEST_WAL_PAGES * XLOG_BLCKSZ];
+	XLogRecord *filtered;
+	char rec[512];
+	int start = SizeOfXLogShortPHD;
+	int kept;
+	int end;
+	int split;
+
+	CurrentConfig = wb_new_config();
+	CurrentConfig->filter_threads = 1;
+
+	/* Only the second block is excluded, the third inherits its relation */
+	memset(wal, 0, sizeof(wal));
+	end = append_test_record(wal, 0, rec, build_block_record(rec, 1));
+	kept = MAXALIGN(end);
+	end = MAXALIGN(append_test_record(wal, kept, rec, build_block_record(rec, 2)));
+	filtered = (XLogRecord*) (inPlace + start);
+
+	/* All headers in one message are decoded in place */
+	memcpy(inPlace, wal, sizeof(wal));
+	filter_test_wal(inPlace, start, end - 8, end, inPlace);
+	if (filtered->xl_rmid != RM_XLOG_ID || filtered->xl_info != XLOG_NOOP)
+		FAIL("Record with an excluded second block was not filtered in place");
+	if (memcmp(inPlace + kept, wal + kept, end - kept) != 0)
+		FAIL("Record with allowed blocks was changed");
+
+	/* Headers split between messages go through the buffering states */
+	for (split = start + 1; split < start + 72; split++)
+	{
+		memcpy(buffered, wal, sizeof(wal));
+		filter_test_wal(buffered, start, split, end, buffered);
+		if (memcmp(buffered, inPlace, end) != 0)
+			FAIL("Filtering headers split at %d differs from filtering in place", split - start);
+	}
+
+	/* Headers crossing a page boundary, split before, in and after the page header */
+	start = XLOG_BLCKSZ - 48;
+	memset(wal, 0, sizeof(wal));
+	end = MAXALIGN(append_test_record(wal, start, rec, build_block_record(rec, 1)));
+	filtered = (XLogRecord*) (inPlace + start);
+
+	memcpy(inPlace, wal, sizeof(wal));
+	filter_test_wal(inPlace, start, end - 8, end, inPlace);
+	if (filtered->xl_rmid != RM_XLOG_ID || filtered->xl_info != XLOG_NOOP)
+		FAIL("Record with headers crossing a page was not filtered");
+	if (memcmp(inPlace + XLOG_BLCKSZ, wal + XLOG_BLCKSZ, SizeOfXLogShortPHD) != 0)
+		FAIL("Page header inside a filtered record was changed");
+
+	for (split = start + 1; split < start + 72 + SizeOfXLogShortPHD; split++)
+	{
+		/* The filter expects page headers in one piece */
+		if (split > XLOG_BLCKSZ && split < XLOG_BLCKSZ + SizeOfXLogShortPHD)
+			continue;
+		memcpy(buffered, wal, sizeof(wal));
+		filter_test_wal(buffered, start, split, end, buffered);
+		if (memcmp(buffered, inPlace, end) != 0)
+			FAIL("Filtering headers crossing a page split at %d differs", split - start);
+	}
+
+	/* A record that is kept comes out as it was, wherever it is split */
+	memset(wal, 0, sizeof(wal));
+	end = MAXALIGN(append_test_record(wal, start, rec, build_block_record(rec, 2)));
+	for (split = start + 1; split < start + 72 + SizeOfXLogShortPHD; split++)
+	{
+		if (split > XLOG_BLCKSZ && split < XLOG_BLCKSZ + SizeOfXLogShortPHD)
+			continue;
+		memcpy(buffered, wal, sizeof(wal));
+		filter_test_wal(buffered, start, split, end, buffered);
+		if (memcmp(buffered, wal, end) != 0)
+			FAIL("Kept record with headers crossing a page split at %d was changed", split - start);
+	}
+	return true;
+}
+
+bool
+test_rate_limit()
+{
+	wb_config_list_entry *item;
+	wb_config_entry *entry;
+	TimestampTz retryAt = 0;
+	int available;
+
+	CurrentConfig = wb_new_config();
+	CurrentConfig->max_rate = 4096;
+	item = wballoc0(sizeof(wb_config_list_entry));
+	item->entry.id = 1;
+	item->entry.max_rate = 1024;
+	CurrentConfig->configurations = item;
+	entry = &(item->entry);
+
+	WbRlInit();
+	EXPECT_TRUE(WbRlLimited(entry));
+
+	/* The entry's bucket is the smaller one, it holds a tenth of a second */
+	available = WbRlAvailable(entry, 1024 * 1024, &retryAt);
+	ASSERT_INT_EQUALS(available, 1024 * 1024 / 10);
+	ASSERT_INT_EQUALS(WbRlAvailable(entry, 100, &retryAt), 100);
+	EXPECT_FALSE(retryAt);
+
+	/* Sending more than allowed is paid off before sending again */
+	WbRlCharge(entry, available + 1000);
+	ASSERT_INT_EQUALS(WbRlAvailable(entry, 100, &retryAt), 0);
+	EXPECT_TRUE((retryAt > GetCurrentTimestamp()));
+
+	/* Sessions of an entry share its bucket, also across worker processes */
+	WbRlInit();
+	if (fork() == 0)
+	{
+		WbRlCharge(entry, 1024 * 1024);
+		exit(0);
+	}
+	wait(NULL);
+	retryAt = 0;
+	ASSERT_INT_EQUALS(WbRlAvailable(entry, 100, &retryAt), 0);
+	return true;
+}
+
 int
 main()
 {
@@ -57,6 +734,16 @@ main()
 
 	failures += !test_inet_parsing();
 	failures += !test_hostmask_match();
+	failures += !test_oid_cache();
+	failures += !test_oid_set();
+	failures += !test_crc32c();
+	failures += !test_spool();
+	failures += !test_slots();
+	failures += !test_wal_cache();
+	failures += !test_parallel_filter();
+	failures += !test_compression();
+	failures += !test_block_references();
+	failures += !test_rate_limit();
 
 	printf("Got %d failures\n", failures);
 	return failures > 0 ? 1 : 0;
@@ -0,0 +1,506 @@
+#include "wbarchive.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wbconfig.h"
+#include "wbfilter.h"
+#include "wbmasterconn.h"
+#include "wbpgtypes.h"
+#include "wbsignals.h"
+#include "wbsocket.h"
+#include "wbutils.h"
+
+#define ARCHIVE_NAPTIME 1000
+#define ARCHIVE_RESTART_INTERVAL 5
+#define PARTIAL_SUFFIX ".partial"
+
+/* Postmaster side */
+static pid_t writerPid = 0;
+static time_t lastWriterStart = 0;
+
+/*
+ * Writer side. Data up to writePtr has been written to the segment files,
+ * up to flushPtr it has also been synced. Syncing is batched, it happens
+ * when a segment is complete and before every status sent to the master.
+ */
+static int segFd = -1;
+static TimeLineID segTli = 0;
+static uint64 segNo = 0;
+static XLogRecPtr writePtr = InvalidXLogRecPtr;
+static XLogRecPtr flushPtr = InvalidXLogRecPtr;
+
+static bool ArFindStartPoint(XLogRecPtr *startPos, TimeLineID *tli);
+static FilterData* ArCreateFilter(XLogRecPtr startPos);
+static void ArWriteHistory(MasterConn *master, TimeLineID tli);
+static void ArSyncDirectory();
+static void ArOpenSegment(TimeLineID tli, uint64 segno);
+static void ArCloseSegment(bool complete);
+static void ArWrite(TimeLineID tli, XLogRecPtr pos, char *data, int len);
+static void ArSync();
+static void ArSendStatus(MasterConn *master, bool force);
+
+bool
+WbArNeedsWriter()
+{
+	if (!CurrentConfig->archive.enabled || writerPid)
+		return false;
+
+	return time(NULL) - lastWriterStart >= ARCHIVE_RESTART_INTERVAL;
+}
+
+void
+WbArSetWriterPid(pid_t pid)
+{
+	writerPid = pid;
+	lastWriterStart = time(NULL);
+}
+
+/*
+ * Clean up after an exited child process. Returns true if the process was
+ * the archive writer.
+ */
+bool
+WbArProcessExited(pid_t pid)
+{
+	if (!writerPid || writerPid != pid)
+		return false;
+
+	writerPid = 0;
+	return true;
+}
+
+void
+WbArWriterMain()
+{
+	MasterConn *master;
+	FilterData *fl;
+	ReplMessage msg;
+	FilterOutput out;
+	char conninfo[MAX_CONNINFO_LEN+1];
+	char *primary_sysid;
+	char *primary_tli;
+	char *primary_xpos;
+	TimeLineID tli;
+	XLogRecPtr xpos;
+	XLogRecPtr startPos;
+	XLogRecPtr pos;
+	int i;
+
+	WbInitLatch();
+
+	if (mkdir(CurrentConfig->archive.directory, 0700) != 0 && errno != EEXIST)
+		error("Could not create archive directory %s: %s",
+				CurrentConfig->archive.directory, strerror(errno));
+
+	WbMcBuildConninfo(conninfo, sizeof(conninfo), CurrentConfig->master.host,
+			CurrentConfig->master.port, CurrentConfig->archive.user, true);
+
+	log_info("Archive writer connecting to %s", conninfo);
+	master = WbMcOpenConnection(conninfo);
+
+	WbMcIdentifySystem(master, &primary_sysid, &primary_tli, &primary_xpos);
+	tli = ensure_atoi(primary_tli);
+	if (!parse_recptr(primary_xpos, &xpos))
+		error("Invalid xlog position %s from master", primary_xpos);
+	wbfree(primary_sysid);
+	wbfree(primary_tli);
+	wbfree(primary_xpos);
+
+	if (!ArFindStartPoint(&startPos, &tli))
+		startPos = xpos - (xpos % XLogSegSize);
+	log_info("Archiving to %s from %X/%X on timeline %u",
+			CurrentConfig->archive.directory, FormatRecPtr(startPos), tli);
+
+	fl = ArCreateFilter(startPos);
+	writePtr = flushPtr = startPos;
+
+	for (;;)
+	{
+		bool endofwal = false;
+		bool restart = false;
+		XLogRecPtr retryPos = InvalidXLogRecPtr;
+		TimeLineID nextTli;
+		char *nextTliStart;
+
+		ArWriteHistory(master, tli);
+
+		if (!WbMcStartStreaming(master, startPos, tli))
+			error("Master did not start streaming at %X/%X on timeline %u",
+					FormatRecPtr(startPos), tli);
+
+		while (!endofwal && !restart)
+		{
+			struct pollfd fds[2];
+			int wait;
+
+			if (!DaemonIsAlive())
+				error("Master died, exiting!");
+
+			/* Also pushes out status messages queued in the last round */
+			wait = WbMcWaitEvents(master);
+			fds[0].fd = WbMcGetSocket(master);
+			fds[0].events = POLLERR | ((wait & MC_WAIT_READ) ? POLLIN : 0) |
+					((wait & MC_WAIT_WRITE) ? POLLOUT : 0);
+			fds[0].revents = 0;
+			fds[1].fd = WbLatchGetSocket();
+			fds[1].events = POLLIN;
+			fds[1].revents = 0;
+
+			if (fds[0].fd == -1)
+				error("Master socket has been closed");
+
+			if (poll(fds, 2, ARCHIVE_NAPTIME) < 0 && errno != EINTR)
+				error("poll failed in archive writer");
+
+			WbResetLatch();
+
+			while (!endofwal && !restart && WbMcReceiveWalMessage(master, &msg))
+			{
+				switch (msg.type)
+				{
+					case MSG_WAL_DATA:
+						if (!WbFProcessWalDataBlock(&msg, fl, &retryPos))
+						{
+							restart = true;
+							break;
+						}
+						if (!WbFGetOutput(&msg, fl, &out))
+							break;
+						pos = out.dataStart;
+						for (i = 0; i < out.nparts; i++)
+						{
+							ArWrite(tli, pos, out.parts[i], out.partLen[i]);
+							pos += out.partLen[i];
+						}
+						break;
+					case MSG_KEEPALIVE:
+						if (msg.replyRequested)
+							ArSendStatus(master, true);
+						break;
+					case MSG_END_OF_WAL:
+						endofwal = true;
+						break;
+					case MSG_NOTHING:
+						break;
+				}
+			}
+
+			ArSendStatus(master, false);
+		}
+
+		if (restart)
+		{
+			/* The filter has to see WAL from an earlier position again */
+			WbMcEndStreaming(master, NULL, NULL);
+			startPos = retryPos;
+			continue;
+		}
+
+		WbMcEndStreaming(master, &nextTli, &nextTliStart);
+		if (!nextTli || !nextTliStart)
+			error("Master ended streaming without a next timeline");
+		if (!parse_recptr(nextTliStart, &startPos))
+			error("Invalid timeline switch position %s", nextTliStart);
+		wbfree(nextTliStart);
+
+		/* The last segment of the old timeline stays partial, like in PostgreSQL */
+		ArCloseSegment(false);
+		ArSendStatus(master, true);
+
+		log_info("Archive writer switching to timeline %u at %X/%X",
+				nextTli, FormatRecPtr(startPos));
+		tli = nextTli;
+		WbFResetProcessingState(fl, startPos);
+		writePtr = flushPtr = startPos;
+	}
+}
+
+/*
+ * Continue after the last complete segment in the archive, or from the start
+ * of the partial one.
+ */
+static bool
+ArFindStartPoint(XLogRecPtr *startPos, TimeLineID *tli)
+{
+	DIR *dir = opendir(CurrentConfig->archive.directory);
+	struct dirent *de;
+	uint64 highSegNo = 0;
+	TimeLineID highTli = 0;
+	bool highPartial = false;
+
+	if (!dir)
+		error("Could not open archive directory %s: %s",
+				CurrentConfig->archive.directory, strerror(errno));
+
+	while ((de = readdir(dir)) != NULL)
+	{
+		TimeLineID fileTli;
+		uint64 fileSegNo;
+		bool partial;
+
+		if (strspn(de->d_name, "0123456789ABCDEF") != 24)
+			continue;
+		if (de->d_name[24] == '\0')
+			partial = false;
+		else if (strcmp(de->d_name + 24, PARTIAL_SUFFIX) == 0)
+			partial = true;
+		else
+			continue;
+
+		XLogFromFileName(de->d_name, &fileTli, &fileSegNo);
+		if (fileSegNo > highSegNo ||
+				(fileSegNo == highSegNo && fileTli > highTli) ||
+				(fileSegNo == highSegNo && fileTli == highTli && highPartial && !partial))
+		{
+			highSegNo = fileSegNo;
+			highTli = fileTli;
+			highPartial = partial;
+		}
+	}
+	closedir(dir);
+
+	if (!highTli)
+		return false;
+
+	XLogSegNoOffsetToRecPtr(highPartial ? highSegNo : highSegNo + 1, 0, *startPos);
+	*tli = highTli;
+	return true;
+}
+
+/* Resolve the filter clauses of the configured entry on the master */
+static FilterData*
+ArCreateFilter(XLogRecPtr startPos)
+{
+	FilterData *fl = WbFCreateProcessingState(startPos);
+	wb_config_list_entry *item;
+	wb_config_entry *entry = NULL;
+	MasterConn *metadata;
+	char conninfo[MAX_CONNINFO_LEN+1];
+
+	if (!CurrentConfig->archive.configuration)
+		return fl;
+
+	for (item = CurrentConfig->configurations; item && !entry; item = item->next)
+		if (strcmp(item->entry.name, CurrentConfig->archive.configuration) == 0)
+			entry = &(item->entry);
+	if (!entry)
+		error("Archive configuration %s does not exist", CurrentConfig->archive.configuration);
+
+	if ((entry->filter.n_include_tablespaces +
+		 entry->filter.n_include_databases +
+		 entry->filter.n_exclude_tablespaces +
+		 entry->filter.n_exclude_databases) == 0)
+		return fl;
+
+	WbMcBuildConninfo(conninfo, sizeof(conninfo), CurrentConfig->master.host,
+			CurrentConfig->master.port, CurrentConfig->archive.user, false);
+	metadata = WbMcOpenConnection(conninfo);
+
+	if (entry->filter.n_include_tablespaces)
+		fl->include_tablespaces = WbMcResolveOids(metadata, OID_RESOLVE_TABLESPACES, true,
+				entry->filter.include_tablespaces, entry->filter.n_include_tablespaces);
+	if (entry->filter.n_include_databases)
+		fl->include_databases = WbMcResolveOids(metadata, OID_RESOLVE_DATABASES, true,
+				entry->filter.include_databases, entry->filter.n_include_databases);
+	if (entry->filter.n_exclude_tablespaces)
+		fl->exclude_tablespaces = WbMcResolveOids(metadata, OID_RESOLVE_TABLESPACES, false,
+				entry->filter.exclude_tablespaces, entry->filter.n_exclude_tablespaces);
+	if (entry->filter.n_exclude_databases)
+		fl->exclude_databases = WbMcResolveOids(metadata, OID_RESOLVE_DATABASES, false,
+				entry->filter.exclude_databases, entry->filter.n_exclude_databases);
+
+	WbMcCloseConnection(metadata);
+	WbFCompileFilter(fl);
+
+	log_info("Archive writer filtering like for configuration %s", entry->name);
+	return fl;
+}
+
+/* Recovery needs the history of a timeline to follow it from the archive */
+static void
+ArWriteHistory(MasterConn *master, TimeLineID tli)
+{
+	TimelineHistory history;
+	char path[1024];
+	char tempPath[sizeof(path) + sizeof(".tmp")];
+	struct stat st;
+	int fd;
+
+	if (tli == 1)
+		return;
+
+	if (snprintf(path, sizeof(path), "%s/%08X.history", CurrentConfig->archive.directory, tli) >= sizeof(path))
+		error("Archive directory path %s is too long", CurrentConfig->archive.directory);
+	if (stat(path, &st) == 0)
+		return;
+
+	if (!WbMcGetTimelineHistory(master, tli, &history))
+		error("Could not fetch history of timeline %u", tli);
+
+	snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+	fd = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		error("Could not create timeline history file %s: %s", tempPath, strerror(errno));
+	if (write(fd, history.content, history.contentLen) != history.contentLen || fsync(fd) != 0)
+		error("Could not write timeline history file %s: %s", tempPath, strerror(errno));
+	close(fd);
+	if (rename(tempPath, path) != 0)
+		error("Could not rename timeline history file to %s: %s", path, strerror(errno));
+	ArSyncDirectory();
+
+	log_info("Archived timeline history file %s", history.filename);
+	wbfree(history.filename);
+	wbfree(history.content);
+}
+
+static void
+ArSyncDirectory()
+{
+	int fd = open(CurrentConfig->archive.directory, O_RDONLY);
+
+	if (fd < 0 || fsync(fd) != 0)
+		error("Could not sync archive directory %s: %s",
+				CurrentConfig->archive.directory, strerror(errno));
+	close(fd);
+}
+
+/*
+ * Segment files are allocated in full up front, so that syncing written data
+ * doesn't have to update the file size every time.
+ */
+static void
+ArOpenSegment(TimeLineID tli, uint64 segno)
+{
+	char fname[MAXFNAMELEN];
+	char path[1024];
+	struct stat st;
+	int rc;
+
+	XLogFileName(fname, tli, segno);
+	if (snprintf(path, sizeof(path), "%s/%s%s", CurrentConfig->archive.directory, fname,
+				PARTIAL_SUFFIX) >= sizeof(path))
+		error("Archive directory path %s is too long", CurrentConfig->archive.directory);
+
+	segFd = open(path, O_WRONLY | O_CREAT, 0600);
+	if (segFd < 0)
+		error("Could not open archive segment %s: %s", path, strerror(errno));
+	if (fstat(segFd, &st) != 0)
+		error("Could not stat archive segment %s: %s", path, strerror(errno));
+
+	if (st.st_size != XLogSegSize)
+	{
+		if ((rc = posix_fallocate(segFd, 0, XLogSegSize)) != 0)
+			error("Could not allocate archive segment %s: %s", path, strerror(rc));
+		if (fsync(segFd) != 0)
+			error("Could not sync archive segment %s: %s", path, strerror(errno));
+		ArSyncDirectory();
+	}
+
+	segTli = tli;
+	segNo = segno;
+	log_debug1("Opened archive segment %s", path);
+}
+
+/* A complete segment loses its .partial suffix, atomically */
+static void
+ArCloseSegment(bool complete)
+{
+	char fname[MAXFNAMELEN];
+	char path[1024];
+	char partialPath[sizeof(path) + sizeof(PARTIAL_SUFFIX)];
+
+	if (segFd < 0)
+		return;
+
+	ArSync();
+	close(segFd);
+	segFd = -1;
+
+	if (!complete)
+		return;
+
+	XLogFileName(fname, segTli, segNo);
+	if (snprintf(path, sizeof(path), "%s/%s", CurrentConfig->archive.directory, fname) >= sizeof(path))
+		error("Archive directory path %s is too long", CurrentConfig->archive.directory);
+	snprintf(partialPath, sizeof(partialPath), "%s%s", path, PARTIAL_SUFFIX);
+	if (rename(partialPath, path) != 0)
+		error("Could not rename %s to %s: %s", partialPath, path, strerror(errno));
+	ArSyncDirectory();
+
+	log_info("Archived segment %s", fname);
+}
+
+static void
+ArWrite(TimeLineID tli, XLogRecPtr pos, char *data, int len)
+{
+	while (len > 0)
+	{
+		uint64 segno = pos / XLogSegSize;
+		uint32 offset = pos % XLogSegSize;
+		int amount = XLogSegSize - offset;
+
+		if (amount > len)
+			amount = len;
+
+		if (segFd >= 0 && (segNo != segno || segTli != tli))
+			ArCloseSegment(false);
+		if (segFd < 0)
+			ArOpenSegment(tli, segno);
+
+		if (pwrite(segFd, data, amount, offset) != amount)
+			error("Could not write to archive segment: %s", strerror(errno));
+
+		pos += amount;
+		data += amount;
+		len -= amount;
+		writePtr = pos;
+
+		if (offset + amount == XLogSegSize)
+			ArCloseSegment(true);
+	}
+}
+
+static void
+ArSync()
+{
+	if (segFd < 0 || flushPtr >= writePtr)
+		return;
+
+	if (fdatasync(segFd) != 0)
+		error("Could not sync archive segment: %s", strerror(errno));
+	flushPtr = writePtr;
+}
+
+/*
+ * Tell the master how far we got. Everything written is synced first, so the
+ * status interval and the master's reply requests decide how often that
+ * happens.
+ */
+static void
+ArSendStatus(MasterConn *master, bool force)
+{
+	static TimestampTz lastSend = 0;
+	StandbyReplyMessage reply;
+	TimestampTz now = GetCurrentTimestamp();
+
+	if (!force && now - lastSend < (TimestampTz) CurrentConfig->status_interval * 1000000)
+		return;
+
+	ArSync();
+
+	memset(&reply, 0, sizeof(reply));
+	reply.writePtr = writePtr;
+	reply.flushPtr = flushPtr;
+	reply.applyPtr = InvalidXLogRecPtr;
+	reply.sendTime = now;
+	WbMcSendReply(master, &reply, force, false);
+
+	lastSend = now;
+}
@@ -2,23 +2,44 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
-#include <poll.h>
 #include <string.h>
 
 #include "wbsocket.h"
 #include "wbutils.h"
+#include "wbcompress.h"
+#include "wbevent.h"
+#include "wbfanout.h"
 #include "wbfilter.h"
 #include "wbmasterconn.h"
+#include "wboidcache.h"
+#include "wbpool.h"
+#include "wbslots.h"
+#include "wbspool.h"
+#include "wbtls.h"
+#include "wbwalcache.h"
 
 #include "parser/parser.h"
 
-#define MAX_CONNINFO_LEN 4000
-#define NAPTIME 60000
 
-typedef struct {
-	int qtype;
-	WbMessage *msg;
-} XfCommand;
+/* WAL messages processed in one go before letting other sessions run */
+#define STREAM_BATCH 16
+
+/* Steps of START_REPLICATION, kept in conn->commandStep */
+typedef enum {
+	SP_LOOKUP_OIDS = 0,
+	SP_START,
+	SP_WAIT_START,
+	SP_STREAMING,
+	SP_RESTART,
+	SP_END,
+	SP_WAIT_END
+} StartPhysicalStep;
+
+typedef enum {
+	STREAM_WAIT,
+	STREAM_RESTART,
+	STREAM_END
+} StreamResult;
 
 typedef struct {
 	char *name;
@@ -28,47 +49,169 @@ typedef struct {
 } ResultCol;
 
 
-static int WbCCProcessStartupPacket(WbConn conn, bool SSLdone);
-static int WbCCReadCommand(WbConn conn, XfCommand *cmd);
+static bool WbCCProcessStartupPacket(WbConn conn);
+static void WbCCParseCmdlineOptions(WbConn conn);
+static void WbCCPerformAuthentication(WbConn conn);
+static bool WbCCFinishStartup(WbConn conn);
+static bool WbCCReadCommand(WbConn conn);
 static void WbCCSendReadyForQuery(WbConn conn);
 static MasterConn* WbCCOpenConnectionToMaster(WbConn conn);
+static bool WbCCMasterReady(WbConn conn);
+static bool WbCCMetadataReady(WbConn conn);
+static void WbCCCloseUpstream(WbConn conn, MasterConn **upstream, bool reuse);
+static void WbCCUpdateUpstreamEvents(WbConn conn);
 static void ForbiddenInWalBouncer();
-static void WbCCBeginReportingGUCOptions(WbConn conn, MasterConn* master);
-static void WbCCReportGuc(WbConn conn, MasterConn* master, char *name);
-static void WbCCExecCommand(WbConn conn, MasterConn *master, char *query_string);
-static void WbCCExecIdentifySystem(WbConn conn, MasterConn *master);
-static bool WbCCWaitForData(WbConn conn, MasterConn *master);
-static void WbCCExecStartPhysical(WbConn conn, MasterConn *master, ReplicationCommand *cmd);
-static void WbCCExecTimeline(WbConn conn, MasterConn *master, ReplicationCommand *cmd);
-static void WbCCLookupFilteringOids(WbConn conn, FilterData *fl);
+static void WbCCBeginReportingGUCOptions(WbConn conn);
+static void WbCCReportGuc(WbConn conn, const char *name);
+static void WbCCStartCommand(WbConn conn, char *query_string);
+static bool WbCCExecCommand(WbConn conn, bool *yielded);
+static bool WbCCExecIdentifySystem(WbConn conn);
+static bool WbCCExecStartPhysical(WbConn conn, bool *yielded);
+static bool WbCCExecCreateSlot(WbConn conn);
+static bool WbCCExecDropSlot(WbConn conn);
+static void WbCCSlotError(WbConn conn, WbSlotResult result);
+static int WbCCFilterProfile(WbConn conn);
+static void WbCCAttachWalSource(WbConn conn, TimeLineID tli);
+static void WbCCDetachWalSource(WbConn conn);
+static void WbCCReleaseProducer(WbConn conn);
+static StreamResult WbCCStreamWal(WbConn conn, bool *yielded);
+static bool WbCCReceiveFromMaster(WbConn conn, ReplMessage *msg);
+static void WbCCFillSpool(WbConn conn);
+static void WbCCFinishStreaming(WbConn conn, TimeLineID nextTli, char *nextTliStart);
+static bool WbCCExecTimeline(WbConn conn);
+static bool WbCCLookupFilteringOids(WbConn conn, FilterData *fl);
 //static void WbCCSendWALRecord(XfConn conn, char *data, int len, XLogRecPtr sentPtr, TimestampTz lastSend);
 //static void WbCCSendEndOfWal(XfConn conn);
 static void WbCCProcessRepliesIfAny(WbConn conn);
-static void WbCCProcessReplyMessage(WbConn conn);
-static void WbCCProcessStandbyReplyMessage(WbConn conn, WbMessage *msg);
+static void WbCCProcessReplyMessage(WbConn conn, char *data, int len);
+static void WbCCProcessStandbyReplyMessage(WbConn conn, char *data);
 static void WbCCSendKeepalive(WbConn conn, bool request_reply);
-static void WbCCProcessStandbyHSFeedbackMessage(WbConn conn, WbMessage *msg);
-static void WbCCForwardPendingReplies(WbConn conn, MasterConn* master);
+static void WbCCProcessStandbyHSFeedbackMessage(WbConn conn, char *data);
+static void WbCCForwardPendingReplies(WbConn conn);
 static void WbCCSendCopyBothResponse(WbConn conn);
 static void WbCCSendWalBlock(WbConn conn, ReplMessage *msg, FilterData *fl);
+static void WbCCSendFilteredBlock(WbConn conn, ReplMessage *msg);
+static void WbCCQueueWal(WbConn conn, XLogRecPtr dataStart, XLogRecPtr walEnd,
+		TimestampTz sendTime, char **parts, int *partLen, int nparts);
+static void WbCCFlushWalBatch(WbConn conn);
+static void WbCCSendWalMessage(WbConn conn, XLogRecPtr dataStart, XLogRecPtr walEnd,
+		TimestampTz sendTime, char **parts, int *partLen, int nparts);
+static void WbCCSendCompressedWalMessage(WbConn conn, XLogRecPtr dataStart, XLogRecPtr walEnd,
+		TimestampTz sendTime, char **parts, int *partLen, int nparts);
+static void WbCCCacheFilteredWal(WbConn conn, XLogRecPtr pos, char *data, int len);
 static void WbCCSendResultset(WbConn conn, int ncols, ResultCol *cols);
 static void WbCCSendErrorReport(WbConn conn, LogLevel level, char *message, char* detail);
 
 
+/* Parameter statuses passed on from the master to standbys */
+const char * const WbReportedGucs[] = {
+	"server_version",
+	"server_encoding",
+	"client_encoding",
+	"application_name",
+	"is_superuser",
+	"session_authorization",
+	"DateStyle",
+	"IntervalStyle",
+	"TimeZone",
+	"integer_datetimes",
+	"standard_conforming_strings",
+	NULL
+};
 
 void
 WbCCInitConnection(WbConn conn)
 {
-	log_info("Received conn from %08X:%d", conn->client.addr, conn->client.port);
+	if (conn->client.local)
+	{
+		log_info("Received conn on Unix socket");
+	}
+	else
+	{
+		log_info("Received conn from %08X:%d", conn->client.addr, conn->client.port);
+	}
 
 	//FIXME: need to timeout here
-	// setup error log destination
-	// copy socket info out here
-	if (WbCCProcessStartupPacket(conn, false) != STATUS_OK)
-		error("Error while processing startup packet");
+	conn->state = CONN_STARTUP;
+}
+
+/*
+ * Advance the session as far as possible without blocking. Returns true if
+ * the session gave up its turn while it still has work to do, in that case
+ * it should be run again without waiting for socket events.
+ *
+ * Errors are reported with error(), the event loop catches them and closes
+ * the session.
+ */
+bool
+WbCCRun(WbConn conn)
+{
+	bool yielded = false;
+	bool progress = true;
+
+	while (progress && !yielded)
+	{
+		switch (conn->state)
+		{
+			case CONN_STARTUP:
+				progress = WbCCProcessStartupPacket(conn);
+				break;
+			case CONN_CONNECTING:
+				progress = WbCCFinishStartup(conn);
+				break;
+			case CONN_IDLE:
+				progress = WbCCReadCommand(conn);
+				break;
+			case CONN_EXECUTING:
+				progress = WbCCExecCommand(conn, &yielded);
+				break;
+			case CONN_CLOSED:
+				return false;
+		}
+	}
+
+	if (conn->state != CONN_CLOSED)
+	{
+		if (ConnHasDataToFlush(conn))
+			ConnFlush(conn, FLUSH_ASYNC);
+		WbCCUpdateUpstreamEvents(conn);
+	}
+	return yielded;
 }
 
+/*
+ * Release everything the session holds on to except the client socket, the
+ * caller closes that once the event loop is done with the connection.
+ */
 void
+WbCCCloseConnection(WbConn conn)
+{
+	WbCCCloseUpstream(conn, &(conn->metadata), true);
+	WbCCCloseUpstream(conn, &(conn->master), true);
+
+	WbCCDetachWalSource(conn);
+	WbCCReleaseProducer(conn);
+	WbSlRelease(conn->replSlot);
+	conn->replSlot = 0;
+	if (conn->spool)
+		WbSpFree(conn->spool);
+	conn->spool = NULL;
+	if (conn->compressor)
+		WbCmFree(conn->compressor);
+	conn->compressor = NULL;
+
+	if (conn->filter)
+		WbFFreeProcessingState(conn->filter);
+	conn->filter = NULL;
+	wbfree(conn->msg);
+	conn->msg = NULL;
+	wbfree(conn->command);
+	conn->command = NULL;
+
+	conn->state = CONN_CLOSED;
+}
+
+static void
 WbCCPerformAuthentication(WbConn conn)
 {
 	int status = STATUS_ERROR;
@@ -81,7 +224,6 @@ WbCCPerformAuthentication(WbConn conn)
 		ConnBeginMessage(conn, 'R');
 		ConnSendInt(conn, (int32) AUTH_REQ_OK, sizeof(int32));
 		ConnEndMessage(conn);
-		ConnFlush(conn, FLUSH_IMMEDIATE);
 	}
 	else
 	{
@@ -111,7 +253,9 @@ WbCCMatchConfigEntry(WbConn conn)
 
 		if (entry->match.source_ip.mask > 0)
 		{
-			if (!match_hostmask(&entry->match.source_ip, conn->client.addr))
+			/* Local connections have no address to match */
+			if (conn->client.local ||
+					!match_hostmask(&entry->match.source_ip, conn->client.addr))
 				continue;
 			log_debug2("Source IP mask matches");
 		}
@@ -122,27 +266,36 @@ WbCCMatchConfigEntry(WbConn conn)
 	return false;
 }
 
-static int
-WbCCProcessStartupPacket(WbConn conn, bool SSLdone)
+/*
+ * Returns true once the startup packet has been processed, false if we are
+ * still waiting for it.
+ */
+static bool
+WbCCProcessStartupPacket(WbConn conn)
 {
 	int32 len;
 	void *buf;
 	ProtocolVersion proto;
+	WbMessage *msg;
+	int r;
 
-	if (ConnGetBytes(conn, (char*) &len, 4) == EOF)
-	{
-		log_error("Incomplete startup packet");
-		return STATUS_ERROR;
-	}
+	/* The startup packet follows once the SSL handshake is done */
+	if (!WbTlHandshake(conn))
+		return false;
 
-	len = ntohl(len);
-	len -= 4;
+	r = ConnGetMessage(conn, NULL, &msg);
+	if (r == 0)
+		return false;
+	if (r == EOF)
+		error("Incomplete startup packet");
+
+	len = msg->len;
 
 	if (len < (int32) sizeof(ProtocolVersion) ||
 		len > MAX_STARTUP_PACKET_LENGTH)
 	{
-		log_error("Invalid length of startup packet");
-		return STATUS_ERROR;
+		ConnFreeMessage(msg);
+		error("Invalid length of startup packet");
 	}
 
 	/*
@@ -156,56 +309,43 @@ WbCCProcessStartupPacket(WbConn conn, bool SSLdone)
 	else
 		buf = wballoc0(len + 1);
 
-	if (ConnGetBytes(conn, buf, len) == EOF)
-	{
-		log_error("incomplete startup packet");
-		return STATUS_ERROR;
-	}
+	memcpy(buf, msg->data, len);
+	ConnFreeMessage(msg);
 
 	/*
 	 * The first field is either a protocol version number or a special
 	 * request code.
 	 */
-	conn->proto = proto = ntohl(*((ProtocolVersion *) buf));
+	proto = ntohl(*((ProtocolVersion *) buf));
 
 	if (proto == CANCEL_REQUEST_CODE)
 	{
-		error("Cancel not supported");
+		wbfree(buf);
 		/* Not really an error, but we don't want to proceed further */
-		return STATUS_ERROR;
+		error("Cancel not supported");
 	}
 
-	if (proto == NEGOTIATE_SSL_CODE && !SSLdone)
+	/* Only one SSL negotiation is allowed */
+	if (proto == NEGOTIATE_SSL_CODE && conn->proto != NEGOTIATE_SSL_CODE)
 	{
-		char		SSLok;
-
-#ifdef USE_SSL
-		/* No SSL when disabled or on Unix sockets */
-		if (!EnableSSL || IS_AF_UNIX(port->laddr.addr.ss_family))
-			SSLok = 'N';
-		else
-			SSLok = 'S';		/* Support for SSL */
-#else
-		SSLok = 'N';			/* No support for SSL */
-#endif
+		/* No point in encrypting what never leaves the host */
+		char		SSLok = WbTlEnabled() && !conn->client.local ? 'S' : 'N';
 
-retry1:
-		if (send(conn->fd, &SSLok, 1, 0) != 1)
-		{
-			if (errno == EINTR)
-				goto retry1;	/* if interrupted, just retry */
-			error("failed to send SSL negotiation response");
-			return STATUS_ERROR;	/* close the connection */
-		}
+		/* The answer has to be out before the handshake starts */
+		ConnSendBytes(conn, &SSLok, 1);
+		ConnFlush(conn, FLUSH_ASYNC);
+		if (ConnHasDataToFlush(conn))
+			error("Could not answer SSL negotiation request");
 
-#ifdef USE_SSL
-		if (SSLok == 'S' && secure_open_server(port) == -1)
-			return STATUS_ERROR;
-#endif
+		if (SSLok == 'S')
+			WbTlStartServer(conn);
 		/* regular startup packet, cancel, etc packet should follow... */
 		/* but not another SSL negotiation request */
-		return WbCCProcessStartupPacket(conn, true);
+		conn->proto = proto;
+		wbfree(buf);
+		return true;
 	}
+	conn->proto = proto;
 
 	/* Could add additional special packet types here */
 
@@ -316,22 +456,32 @@ retry1:
 	if (conn->user_name == NULL || conn->user_name[0] == '\0')
 		error("no PostgreSQL user name specified in startup packet");
 
+	wbfree(buf);
+
+	if (conn->cmdline_options)
+		WbCCParseCmdlineOptions(conn);
+
 	/* Match the config entry */
 	if (!WbCCMatchConfigEntry(conn))
 		error("No configuration entry matches the connection");
 
-	return STATUS_OK;
-}
+	WbCCPerformAuthentication(conn);
 
+	conn->state = CONN_CONNECTING;
+	return true;
+}
 
-void
-WbCCCommandLoop(WbConn conn)
+/*
+ * Report parameters to the client and get ready for commands. With a
+ * shared upstream we only connect to master when necessary.
+ */
+static bool
+WbCCFinishStartup(WbConn conn)
 {
-	int firstchar;
-	bool send_ready_for_query = true;
-	MasterConn* master = WbCCOpenConnectionToMaster(conn);
+	if ((conn->master || !WbFoIsReady()) && !WbCCMasterReady(conn))
+		return false;
 
-	WbCCBeginReportingGUCOptions(conn, master);
+	WbCCBeginReportingGUCOptions(conn);
 
 	// Cancel message
 	ConnBeginMessage(conn, 'K');
@@ -339,66 +489,9 @@ WbCCCommandLoop(WbConn conn)
 	ConnSendInt(conn, 0, 4); // Cancel key
 	ConnEndMessage(conn);
 
-	// set up error handling
-
-	for (;;)
-	{
-		XfCommand cmd;
-		cmd.msg = NULL;
-		cmd.qtype = 0;
-		if (send_ready_for_query)
-		{
-			WbCCSendReadyForQuery(conn);
-			send_ready_for_query = false;
-		}
-
-		firstchar = WbCCReadCommand(conn, &cmd);
-
-		switch (firstchar)
-		{
-			case 'Q':
-				{
-					WbCCExecCommand(conn, master, cmd.msg->data);
-					send_ready_for_query = true;
-
-					/*char *query_string = pq_getmsgstgring(msg);
-					pq_getmsgend(msg);
-
-					ExecCommand(cmd->);
-
-					send_ready_for_query = true;*/
-				}
-				break;
-			case 'P':
-			case 'B':
-			case 'E':
-			case 'F':
-			case 'C':
-			case 'D':
-				ForbiddenInWalBouncer();
-				break;
-			case 'H':
-				ConnFlush(conn, FLUSH_IMMEDIATE);
-				break;
-			case 'S':
-				send_ready_for_query = true;
-				break;
-			case 'X':
-			case EOF:
-				// TODO: do something here?
-				if (cmd.msg)
-					ConnFreeMessage(cmd.msg);
-				return;
-			case 'd':
-			case 'c':
-			case 'f':
-				break;
-			default:
-				error("invalid frontend message type");
-		}
-		if (cmd.msg)
-			ConnFreeMessage(cmd.msg);
-	}
+	WbCCSendReadyForQuery(conn);
+	conn->state = CONN_IDLE;
+	return true;
 }
 
 static void
@@ -409,21 +502,62 @@ ForbiddenInWalBouncer()
 
 
 
-static int
-WbCCReadCommand(WbConn conn, XfCommand *cmd)
+/*
+ * Read and dispatch the next command from the client. Returns false when
+ * there is nothing to read.
+ */
+static bool
+WbCCReadCommand(WbConn conn)
 {
 	int qtype;
-	cmd->qtype = qtype = ConnGetByte(conn);
-
-	if (qtype == EOF)
-		return EOF;
+	WbMessage *msg;
+	int r;
 
-	if (ConnGetMessage(conn, &(cmd->msg)))
-		return EOF;
+	r = ConnGetMessage(conn, &qtype, &msg);
+	if (r == 0)
+		return false;
+	if (r == EOF)
+	{
+		// TODO: do something here?
+		conn->state = CONN_CLOSED;
+		return true;
+	}
 
-	log_debug1("Command %c payload %d", qtype, cmd->msg->len);
+	log_debug1("Command %c payload %d", qtype, msg->len);
 
-	return qtype;
+	switch (qtype)
+	{
+		case 'Q':
+			WbCCStartCommand(conn, msg->data);
+			break;
+		case 'P':
+		case 'B':
+		case 'E':
+		case 'F':
+		case 'C':
+		case 'D':
+			ConnFreeMessage(msg);
+			ForbiddenInWalBouncer();
+			break;
+		case 'H':
+			ConnFlush(conn, FLUSH_ASYNC);
+			break;
+		case 'S':
+			WbCCSendReadyForQuery(conn);
+			break;
+		case 'X':
+			conn->state = CONN_CLOSED;
+			break;
+		case 'd':
+		case 'c':
+		case 'f':
+			break;
+		default:
+			ConnFreeMessage(msg);
+			error("invalid frontend message type");
+	}
+	ConnFreeMessage(msg);
+	return true;
 }
 
 static void
@@ -432,7 +566,7 @@ WbCCSendReadyForQuery(WbConn conn)
 	ConnBeginMessage(conn, 'Z');
 	ConnSendInt(conn, 'I', 1);
 	ConnEndMessage(conn);
-	ConnFlush(conn, FLUSH_IMMEDIATE);
+	ConnFlush(conn, FLUSH_ASYNC);
 }
 
 static MasterConn*
@@ -440,50 +574,195 @@ WbCCOpenConnectionToMaster(WbConn conn)
 {
 	MasterConn* master;
 	char conninfo[MAX_CONNINFO_LEN+1];
-	char *buf = conninfo;
-	char *buf_end = &(conninfo[MAX_CONNINFO_LEN]);
 
-	memset(conninfo, 0, sizeof(conninfo));
+	WbMcBuildConninfo(conninfo, sizeof(conninfo), conn->master_host,
+			conn->master_port, conn->user_name, true);
+
+	master = WbPlCheckout(conninfo);
+	if (master)
+	{
+		log_info("Using pooled connection to %s", conninfo);
+		return master;
+	}
+
+	log_info("Start connecting to %s", conninfo);
+	master = WbMcStartConnection(conninfo);
+	return master;
+}
+
+/*
+ * Returns true once the session's own master connection is usable, opening
+ * it when needed.
+ */
+static bool
+WbCCMasterReady(WbConn conn)
+{
+	if (!conn->master)
+		conn->master = WbCCOpenConnectionToMaster(conn);
+	return WbMcConnectionReady(conn->master);
+}
+
+/*
+ * Same for the connection to the postgres database used to look up OIDs.
+ */
+static bool
+WbCCMetadataReady(WbConn conn)
+{
+	if (!conn->metadata)
+	{
+		// TODO: take in other options
+		char conninfo[MAX_CONNINFO_LEN+1];
+
+		WbMcBuildConninfo(conninfo, sizeof(conninfo), conn->master_host,
+				conn->master_port, conn->user_name, false);
+
+		conn->metadata = WbPlCheckout(conninfo);
+		if (!conn->metadata)
+			conn->metadata = WbMcStartConnection(conninfo);
+	}
+	return WbMcConnectionReady(conn->metadata);
+}
+
+/*
+ * Stop using an upstream connection. With reuse set the connection is handed
+ * back to the pool when possible.
+ */
+static void
+WbCCCloseUpstream(WbConn conn, MasterConn **upstream, bool reuse)
+{
+	if (!*upstream)
+		return;
 
-	if (conn->master_host) {
-		buf += snprintf(buf, buf_end - buf, "host=%s ", conn->master_host);
+	if (conn->upstreamFd >= 0 && conn->upstreamFd == WbMcGetSocket(*upstream))
+	{
+		WbEvDelete(conn->upstreamFd);
+		conn->upstreamFd = -1;
+		conn->upstreamEvents = 0;
 	}
+	if (reuse)
+		WbPlRelease(*upstream);
+	else
+		WbMcCloseConnection(*upstream);
+	*upstream = NULL;
+}
 
-	if (conn->master_port)
-		buf +=  snprintf(buf, buf_end - buf, "port=%d ", conn->master_port);
+/*
+ * Register the master connection we are currently waiting on with the event
+ * loop. Master sockets are level triggered, WAL is left in the socket while
+ * the standby catches up and has to be reported again once it can be read.
+ */
+static void
+WbCCUpdateUpstreamEvents(WbConn conn)
+{
+	MasterConn *upstream = NULL;
+	int fd = -1;
+	uint32 events = 0;
 
-	if (conn->user_name)
-		buf += snprintf(buf, buf_end - buf, "user=%s ", conn->user_name);
+	if (conn->metadata)
+		upstream = conn->metadata;
+	else if (conn->master && !conn->fanout && !conn->walCache && conn->state != CONN_IDLE)
+		upstream = conn->master;
 
-	buf += snprintf(buf, buf_end - buf, "dbname=replication replication=true application_name=walbouncer");
+	if (upstream)
+	{
+		int wait = WbMcWaitEvents(upstream);
 
-	log_info("Start connecting to %s", conninfo);
-	master = WbMcOpenConnection(conninfo);
-	log_info("Connected to master");
-	return master;
+		/*
+		 * Leave WAL in the socket buffer while the standby is catching up,
+		 * unless there is room to spool it.
+		 */
+		if (ConnHasDataToFlush(conn) &&
+				!(upstream == conn->master && conn->spool && WbSpHasRoom(conn->spool)))
+			wait &= ~MC_WAIT_READ;
+
+		fd = WbMcGetSocket(upstream);
+		if (wait & MC_WAIT_READ)
+			events |= EPOLLIN;
+		if (wait & MC_WAIT_WRITE)
+			events |= EPOLLOUT;
+	}
+
+	if (fd == conn->upstreamFd && events == conn->upstreamEvents)
+		return;
+
+	if (conn->upstreamFd >= 0 && (fd != conn->upstreamFd || !events))
+	{
+		WbEvDelete(conn->upstreamFd);
+		conn->upstreamFd = -1;
+	}
+
+	if (events && fd >= 0)
+	{
+		if (fd == conn->upstreamFd)
+			WbEvModify(fd, events, conn);
+		else
+			WbEvAdd(fd, events, conn);
+		conn->upstreamFd = fd;
+	}
+	conn->upstreamEvents = events;
+}
+
+/*
+ * Options are passed on the command line as -c name=value or --name=value.
+ * The only one we care about is a downstream walbouncer asking for
+ * compressed WAL.
+ */
+static void
+WbCCParseCmdlineOptions(WbConn conn)
+{
+	char *options = wbstrdup(conn->cmdline_options);
+	char *saveptr;
+	char *token;
+	bool nextIsOption = false;
+
+	for (token = strtok_r(options, " \t", &saveptr); token; token = strtok_r(NULL, " \t", &saveptr))
+	{
+		char *option = NULL;
+		char *value;
+
+		if (nextIsOption)
+			option = token;
+		else if (strncmp(token, "--", 2) == 0)
+			option = token + 2;
+		nextIsOption = strcmp(token, "-c") == 0;
+
+		if (!option || !(value = strchr(option, '=')))
+			continue;
+		*value++ = '\0';
+		if (strcmp(option, WB_COMPRESSION_OPTION) == 0)
+			conn->compressWal = strcmp(value, WB_COMPRESSION_ZLIB) == 0;
+	}
+	wbfree(options);
 }
 
 static void
-WbCCBeginReportingGUCOptions(WbConn conn, MasterConn* master)
+WbCCBeginReportingGUCOptions(WbConn conn)
 {
-	//conn->sendBufMsgLenPtr
-	 WbCCReportGuc(conn, master, "server_version");
-	 WbCCReportGuc(conn, master, "server_encoding");
-	 WbCCReportGuc(conn, master, "client_encoding");
-	 WbCCReportGuc(conn, master, "application_name");
-	 WbCCReportGuc(conn, master, "is_superuser");
-	 WbCCReportGuc(conn, master, "session_authorization");
-	 WbCCReportGuc(conn, master, "DateStyle");
-	 WbCCReportGuc(conn, master, "IntervalStyle");
-	 WbCCReportGuc(conn, master, "TimeZone");
-	 WbCCReportGuc(conn, master, "integer_datetimes");
-	 WbCCReportGuc(conn, master, "standard_conforming_strings");
+	const char * const *name;
+
+	for (name = WbReportedGucs; *name; name++)
+		WbCCReportGuc(conn, *name);
+
+	/* Tells the downstream walbouncer to expect compressed WAL */
+	if (conn->compressWal)
+	{
+		ConnBeginMessage(conn, 'S');
+		ConnSendString(conn, WB_COMPRESSION_OPTION);
+		ConnSendString(conn, WB_COMPRESSION_ZLIB);
+		ConnEndMessage(conn);
+	}
 }
 
 static void
-WbCCReportGuc(WbConn conn, MasterConn* master, char *name)
+WbCCReportGuc(WbConn conn, const char *name)
 {
-	const char *value = WbMcParameterStatus(master, name);
+	const char *value;
+
+	if (conn->master)
+		value = WbMcParameterStatus(conn->master, (char*) name);
+	else
+		value = WbFoParameterStatus(name);
+
 	if (!value)
 		return;
 	ConnBeginMessage(conn, 'S');
@@ -493,7 +772,7 @@ WbCCReportGuc(WbConn conn, MasterConn* master, char *name)
 }
 
 static void
-WbCCExecCommand(WbConn conn, MasterConn *master, char *query_string)
+WbCCStartCommand(WbConn conn, char *query_string)
 {
 	int parse_rc;
 	ReplicationCommand *cmd;
@@ -510,30 +789,69 @@ WbCCExecCommand(WbConn conn, MasterConn *master, char *query_string)
 
 	switch (cmd->command)
 	{
-		case REPL_IDENTIFY_SYSTEM:
-			WbCCExecIdentifySystem(conn, master);
-			break;
-		case REPL_BASE_BACKUP:
 		case REPL_CREATE_SLOT:
 		case REPL_DROP_SLOT:
+			/* Only physical slots, and only if we retain WAL for them */
+			if (WbSlEnabled() && !cmd->logical)
+				break;
+			/* fall through */
+		case REPL_BASE_BACKUP:
+		case REPL_START_LOGICAL:
+			wbfree(cmd);
 			error("Command not supported");
 			break;
-		case REPL_START_PHYSICAL:
-			WbCCExecStartPhysical(conn, master, cmd);
+		default:
 			break;
-		case REPL_START_LOGICAL:
-			error("Command not supported");
+	}
+
+	conn->command = cmd;
+	conn->commandStep = 0;
+	conn->querySent = false;
+	conn->state = CONN_EXECUTING;
+}
+
+/*
+ * Continue executing the current command. Returns true when the command
+ * has completed.
+ */
+static bool
+WbCCExecCommand(WbConn conn, bool *yielded)
+{
+	bool done = false;
+
+	switch (conn->command->command)
+	{
+		case REPL_IDENTIFY_SYSTEM:
+			done = WbCCExecIdentifySystem(conn);
+			break;
+		case REPL_START_PHYSICAL:
+			done = WbCCExecStartPhysical(conn, yielded);
 			break;
 		case REPL_TIMELINE:
-			WbCCExecTimeline(conn, master, cmd);
+			done = WbCCExecTimeline(conn);
+			break;
+		case REPL_CREATE_SLOT:
+			done = WbCCExecCreateSlot(conn);
+			break;
+		case REPL_DROP_SLOT:
+			done = WbCCExecDropSlot(conn);
 			break;
+		default:
+			error("Command not supported");
 	}
 
+	if (!done)
+		return false;
 
 	ConnBeginMessage(conn, 'C');
 	ConnSendString(conn, "SELECT");
 	ConnEndMessage(conn);
-	wbfree(cmd);
+	wbfree(conn->command);
+	conn->command = NULL;
+
+	WbCCSendReadyForQuery(conn);
+	conn->state = CONN_IDLE;
+	return true;
 }
 
 /* TODO: move these to PG version specific config file */
@@ -542,8 +860,8 @@ WbCCExecCommand(WbConn conn, MasterConn *master, char *query_string)
 #define INT4OID 23
 #define BYTEAOID 17
 
-static void
-WbCCExecIdentifySystem(WbConn conn, MasterConn *master)
+static bool
+WbCCExecIdentifySystem(WbConn conn)
 {
 	// query master server, pass through data
 	char *primary_sysid;
@@ -551,11 +869,23 @@ WbCCExecIdentifySystem(WbConn conn, MasterConn *master)
 	char *primary_xpos;
 	char *dbname = NULL;
 
-	if (!WbMcIdentifySystem(master,
-			&primary_sysid,
-			&primary_tli,
-			&primary_xpos))
-		error("Identify system failed.");
+	if (conn->querySent ||
+		!WbFoIdentifySystem(&primary_sysid, &primary_tli, &primary_xpos))
+	{
+		if (!conn->querySent)
+		{
+			if (!WbCCMasterReady(conn))
+				return false;
+			WbMcSendIdentifySystem(conn->master);
+			conn->querySent = true;
+		}
+		if (!WbMcFinishIdentifySystem(conn->master,
+				&primary_sysid,
+				&primary_tli,
+				&primary_xpos))
+			return false;
+		conn->querySent = false;
+	}
 
 	log_info("Received system information from master:\n"
 			"    System identifier: %s\n"
@@ -566,6 +896,8 @@ WbCCExecIdentifySystem(WbConn conn, MasterConn *master)
 
 	//TODO: parse out tli and xpos for our use
 
+	WbWcSetSystem(primary_sysid);
+
 	{
 		ResultCol cols[4] = {
 				{"systemid", TEXTOID, primary_sysid, 0},
@@ -579,54 +911,6 @@ WbCCExecIdentifySystem(WbConn conn, MasterConn *master)
 	wbfree(primary_sysid);
 	wbfree(primary_tli);
 	wbfree(primary_xpos);
-}
-
-/*
- * Wait for new data on master or slave connections depending on state.
- * Returns true if anything interesting happened.
- */
-static bool
-WbCCWaitForData(WbConn conn, MasterConn *master)
-{
-	struct pollfd fds[2];
-	int ret;
-	int numfds = 0;
-
-	fds[numfds].fd = ConnGetSocket(conn);
-	fds[numfds].events = POLLIN | POLLERR;
-	fds[numfds].revents = 0;
-	numfds++;
-
-	if (ConnHasDataToFlush(conn))
-	{
-		/*
-		 * If we are in process of flushing out a message to slave we only
-		 * care if we can resume sending or the slave has sent us a reply
-		 * message we need to relay back to the master.
-		 *
-		 * We don't care about failed master connections at this point as we
-		 * want to finish sending processed WAL out.
-		 **/
-		 fds[0].events |= POLLOUT;
-	} else {
-		/*
-		 * If we are finished forwarding data to the the slave we want to get
-		 * a new message from the master.
-		 */
-		fds[numfds].fd = WbMcGetSocket(master);
-		if (fds[numfds].fd == -1)
-			error("Master socket has been closed");
-		fds[numfds].events = POLLIN | POLLERR;
-		fds[numfds].revents = 0;
-		numfds++;
-	}
-
-	log_debug2("Waiting up to %dms on %d file descriptors", NAPTIME, numfds);
-	ret = poll(fds, numfds, NAPTIME);
-
-	if (ret == 0 || (ret < 0 && errno == EINTR))
-		return false;
-
 	return true;
 }
 
@@ -698,107 +982,492 @@ WbCCSendResultset(WbConn conn, int ncols, ResultCol *cols)
 }
 
 
-static void
-WbCCExecStartPhysical(WbConn conn, MasterConn *master, ReplicationCommand *cmd)
+/*
+ * START_REPLICATION, resumed at conn->commandStep whenever we had to wait.
+ */
+static bool
+WbCCExecStartPhysical(WbConn conn, bool *yielded)
 {
-	bool endofwal = false;
-	XLogRecPtr startReceivingFrom;
-	ReplMessage *msg = wballoc(sizeof(ReplMessage));
-	FilterData *fl = WbFCreateProcessingState(cmd->startpoint);
+	ReplicationCommand *cmd = conn->command;
 
-	WbCCLookupFilteringOids(conn, fl);
-
-	startReceivingFrom = cmd->startpoint;
-again:
-	WbMcStartStreaming(master, startReceivingFrom, cmd->timeline);
-
-	WbCCSendCopyBothResponse(conn);
-
-	while (!endofwal)
+	for (;;)
 	{
-		if (!DaemonIsAlive())
-			error("Master died, exiting!");
+		switch ((StartPhysicalStep) conn->commandStep)
+		{
+			case SP_LOOKUP_OIDS:
+				if (!conn->filter)
+				{
+					conn->filter = WbFCreateProcessingState(cmd->startpoint);
+					conn->msg = wballoc(sizeof(ReplMessage));
+					conn->startReceivingFrom = cmd->startpoint;
+					conn->copyDoneSent = false;
+					conn->copyDoneReceived = false;
+					conn->lookupStep = 0;
+
+					/* Without slots of our own the name is ignored, like before */
+					if (cmd->slotname && WbSlEnabled())
+					{
+						WbSlotResult result = WbSlAcquire(cmd->slotname,
+								cmd->startpoint, &(conn->replSlot));
+						if (result != SLOT_OK)
+							WbCCSlotError(conn, result);
+					}
+				}
 
-		if (!WbCCWaitForData(conn, master))
-			continue;
+				if (!WbCCLookupFilteringOids(conn, conn->filter))
+					return false;
+
+				WbCCSendCopyBothResponse(conn);
+				if (conn->compressWal)
+				{
+					if (!conn->compressor)
+						conn->compressor = WbCmCreate(false);
+					WbCmReset(conn->compressor);
+				}
+				conn->commandStep = SP_START;
+				break;
+			case SP_START:
+				if (!conn->fanout && !conn->walCache)
+					WbCCAttachWalSource(conn, cmd->timeline);
+				if (conn->fanout || conn->walCache)
+				{
+					conn->commandStep = SP_STREAMING;
+					break;
+				}
+				if (!WbCCMasterReady(conn))
+					return false;
+				if (conn->configEntry->spool.memory && !conn->spool)
+					conn->spool = WbSpCreate((size_t) conn->configEntry->spool.memory * 1024 * 1024,
+							(off_t) conn->configEntry->spool.disk * 1024 * 1024,
+							conn->configEntry->spool.directory);
+				else if (conn->spool)
+					WbSpReset(conn->spool);
+				WbMcSendStartStreaming(conn->master, conn->startReceivingFrom, cmd->timeline);
+				conn->commandStep = SP_WAIT_START;
+				break;
+			case SP_WAIT_START:
+				{
+					bool streaming;
+
+					if (!WbMcFinishStartStreaming(conn->master, &streaming))
+						return false;
+					if (!streaming)
+					{
+						log_info("Master has no WAL to stream");
+						ConnBeginMessage(conn, 'c');
+						ConnEndMessage(conn);
+						WbCCFinishStreaming(conn, 0, NULL);
+						return true;
+					}
+					conn->commandStep = SP_STREAMING;
+				}
+				break;
+			case SP_STREAMING:
+				{
+					StreamResult result = WbCCStreamWal(conn, yielded);
+
+					/* Merged WAL doesn't wait for the next turn */
+					WbCCFlushWalBatch(conn);
+					switch (result)
+					{
+						case STREAM_WAIT:
+							return false;
+						case STREAM_RESTART:
+							if (conn->fanout || conn->walCache)
+							{
+								WbCCDetachWalSource(conn);
+								conn->commandStep = SP_START;
+							}
+							else
+							{
+								WbMcSendEndStreaming(conn->master);
+								conn->commandStep = SP_RESTART;
+							}
+							break;
+						case STREAM_END:
+							conn->commandStep = SP_END;
+							break;
+					}
+				}
+				break;
+			case SP_RESTART:
+				if (!WbMcFinishEndStreaming(conn->master, NULL, NULL))
+					return false;
+				conn->commandStep = SP_START;
+				break;
+			case SP_END:
+				if (conn->fanout)
+				{
+					TimeLineID nextTli;
+					char *nextTliStart;
+
+					WbFoEndStreaming(conn->fanout, &nextTli, &nextTliStart);
+					WbCCDetachWalSource(conn);
+					WbCCFinishStreaming(conn, nextTli, nextTliStart);
+					return true;
+				}
+				if (conn->walCache)
+				{
+					/* The standby ended streaming while still reading from cache */
+					WbCCDetachWalSource(conn);
+					WbCCFinishStreaming(conn, 0, NULL);
+					return true;
+				}
+				WbMcSendEndStreaming(conn->master);
+				conn->commandStep = SP_WAIT_END;
+				break;
+			case SP_WAIT_END:
+				{
+					TimeLineID nextTli;
+					char *nextTliStart;
+
+					if (!WbMcFinishEndStreaming(conn->master, &nextTli, &nextTliStart))
+						return false;
+					WbCCFinishStreaming(conn, nextTli, nextTliStart);
+					return true;
+				}
+		}
+	}
+}
+
+/*
+ * Slots live in walbouncer, the master knows nothing about them. The reply
+ * has the same columns as PostgreSQL's for a physical slot.
+ */
+static bool
+WbCCExecCreateSlot(WbConn conn)
+{
+	char *slotname = conn->command->slotname;
+	WbSlotResult result = WbSlCreate(slotname);
+
+	if (result != SLOT_OK)
+		WbCCSlotError(conn, result);
+
+	{
+		ResultCol cols[4] = {
+				{"slot_name", TEXTOID, slotname, 0},
+				{"consistent_point", TEXTOID, "0/0", 0},
+				{"snapshot_name", TEXTOID, NULL, 0},
+				{"output_plugin", TEXTOID, NULL, 0}
+		};
+		WbCCSendResultset(conn, 4, cols);
+	}
+	return true;
+}
+
+static bool
+WbCCExecDropSlot(WbConn conn)
+{
+	WbSlotResult result = WbSlDrop(conn->command->slotname);
+
+	if (result != SLOT_OK)
+		WbCCSlotError(conn, result);
+	return true;
+}
+
+/* Tell the client why, then give up on the session like for other errors */
+static void
+WbCCSlotError(WbConn conn, WbSlotResult result)
+{
+	const char *message = WbSlResultMessage(result);
+
+	WbCCSendErrorReport(conn, LOG_ERROR, (char *) message, conn->command->slotname);
+	ConnFlush(conn, FLUSH_IMMEDIATE);
+	error("%s: %s", message, conn->command->slotname);
+}
+
+/*
+ * Standbys matched by the same configuration entry with filter clauses get
+ * the same output, the entry is the profile it is cached under.
+ */
+static int
+WbCCFilterProfile(WbConn conn)
+{
+	wb_config_entry *entry = conn->configEntry;
+
+	if (entry->filter.n_include_tablespaces || entry->filter.n_exclude_tablespaces ||
+			entry->filter.n_include_databases || entry->filter.n_exclude_databases)
+		return entry->id;
+	return 0;
+}
+
+/*
+ * Pick where streaming continues from. Output another session filtered for
+ * our profile comes first, then the WAL cache and the shared fan-out buffer,
+ * if none of them has the WAL the master is asked for it.
+ */
+static void
+WbCCAttachWalSource(WbConn conn, TimeLineID tli)
+{
+	int profile = WbCCFilterProfile(conn);
+
+	/* Filtered output can only be picked up before we filtered anything */
+	if (profile && !conn->producerClaim && !conn->filter->synchronized &&
+			conn->startReceivingFrom == conn->filter->requestedStartPos)
+	{
+		conn->walCache = WbWcAttach(conn->startReceivingFrom, tli, profile);
+		if (conn->walCache)
+		{
+			log_info("Streaming filtered WAL from WAL cache at %X/%X",
+					FormatRecPtr(conn->startReceivingFrom));
+			return;
+		}
+	}
+
+	if (profile && !conn->producerClaim)
+		conn->producerClaim = WbWcClaimProducer(profile, tli);
+
+	conn->walCache = WbWcAttach(conn->startReceivingFrom, tli, 0);
+	if (conn->walCache)
+	{
+		log_info("Streaming from WAL cache at %X/%X",
+				FormatRecPtr(conn->startReceivingFrom));
+		return;
+	}
+
+	if (WbFoEnabled())
+	{
+		conn->fanout = WbFoAttach(conn->startReceivingFrom, tli);
+		if (conn->fanout)
+		{
+			log_info("Streaming from shared fan-out buffer at %X/%X",
+					FormatRecPtr(conn->startReceivingFrom));
+		}
+		else
+		{
+			log_info("Fan-out buffer can't serve %X/%X, streaming from master",
+					FormatRecPtr(conn->startReceivingFrom));
+		}
+	}
+}
+
+static void
+WbCCDetachWalSource(WbConn conn)
+{
+	if (conn->fanout)
+		WbFoDetach(conn->fanout);
+	conn->fanout = NULL;
+	if (conn->walCache)
+		WbWcDetach(conn->walCache);
+	conn->walCache = NULL;
+}
+
+static void
+WbCCReleaseProducer(WbConn conn)
+{
+	if (conn->producerClaim)
+		WbWcReleaseProducer(WbCCFilterProfile(conn), conn->producerClaim);
+	conn->producerClaim = 0;
+}
+
+/*
+ * Pass WAL on to the standby until we run out of data, the standby can't
+ * keep up or streaming needs to be restarted or ended.
+ */
+static StreamResult
+WbCCStreamWal(WbConn conn, bool *yielded)
+{
+	ReplMessage *msg = conn->msg;
+	FilterData *fl = conn->filter;
+	int processed = 0;
+
+	for (;;)
+	{
+		bool received;
 
 		WbCCProcessRepliesIfAny(conn);
-		WbCCForwardPendingReplies(conn, master);
+		WbCCForwardPendingReplies(conn);
 
 		if (ConnHasDataToFlush(conn))
 		{
 			ConnFlush(conn, FLUSH_ASYNC);
-			continue;
+			if (ConnHasDataToFlush(conn))
+			{
+				WbCCFillSpool(conn);
+				return STREAM_WAIT;
+			}
 		}
 
 		if (conn->copyDoneSent && conn->copyDoneReceived)
-			break;
+			return STREAM_END;
+
+		if (processed++ == STREAM_BATCH)
+		{
+			*yielded = true;
+			return STREAM_WAIT;
+		}
 
-		if (WbMcReceiveWalMessage(master, msg))
+		if (conn->walCache)
 		{
-			switch (msg->type)
+			received = WbWcReceiveWalMessage(conn->walCache, msg);
+			if (!received)
 			{
-				case MSG_END_OF_WAL:
-					log_info("End of WAL");
-					log_debug1("Sending CopyDone to client");
-					ConnBeginMessage(conn, 'c');
-					ConnEndMessage(conn);
-					// TODO handle waiting for client CopyDone reply.
-					endofwal = true;
-					break;
-				case MSG_WAL_DATA:
+				/* Caught up with the cache, continue from upstream */
+				conn->startReceivingFrom = WbWcGetPosition(conn->walCache);
+				if (WbWcIsFiltered(conn->walCache))
 				{
-					XLogRecPtr restartPos;
-					if (!WbFProcessWalDataBlock(msg, fl, &restartPos))
-					{
-						WbMcEndStreaming(master, NULL, NULL);
-						startReceivingFrom = restartPos;
-						goto again;
-					}
-					WbCCSendWalBlock(conn, msg, fl);
-					break;
+					log_info("Reached end of filtered WAL in WAL cache at %X/%X, filtering on our own",
+							FormatRecPtr(conn->startReceivingFrom));
+					WbFResetProcessingState(fl, conn->startReceivingFrom);
 				}
-				case MSG_KEEPALIVE:
-					conn->lastSend = msg->sendTime;
-					WbCCSendKeepalive(conn, msg->replyRequested);
-					break;
-				case MSG_NOTHING:
-					// Nothing received, we loop back around and wait for data.
+				else
+				{
+					log_info("Reached end of WAL cache at %X/%X",
+							FormatRecPtr(conn->startReceivingFrom));
+				}
+				return STREAM_RESTART;
+			}
+		}
+		else if (conn->fanout)
+			received = WbFoReceiveWalMessage(conn->fanout, msg);
+		else if (conn->spool && !WbSpIsEmpty(conn->spool))
+			received = WbSpGet(conn->spool, msg);
+		else
+			received = WbCCReceiveFromMaster(conn, msg);
+
+		if (!received)
+			return STREAM_WAIT;
+
+		switch (msg->type)
+		{
+			case MSG_END_OF_WAL:
+				log_info("End of WAL");
+				log_debug1("Sending CopyDone to client");
+				WbCCFlushWalBatch(conn);
+				ConnBeginMessage(conn, 'c');
+				ConnEndMessage(conn);
+				// TODO handle waiting for client CopyDone reply.
+				return STREAM_END;
+			case MSG_WAL_DATA:
+			{
+				XLogRecPtr restartPos;
+
+				if (conn->walCache && WbWcIsFiltered(conn->walCache))
+				{
+					WbCCSendFilteredBlock(conn, msg);
 					break;
+				}
+
+				if (!WbFProcessWalDataBlock(msg, fl, &restartPos))
+				{
+					conn->startReceivingFrom = restartPos;
+					if (conn->fanout && WbFoRestartAt(conn->fanout, restartPos))
+						break;
+					if (conn->walCache && WbWcRestartAt(conn->walCache, restartPos))
+						break;
+					return STREAM_RESTART;
+				}
+				WbCCSendWalBlock(conn, msg, fl);
+				break;
 			}
+			case MSG_KEEPALIVE:
+				conn->lastSend = msg->sendTime;
+				if (conn->producerClaim)
+					WbWcProducerKeepalive(WbCCFilterProfile(conn), msg->walEnd,
+							msg->sendTime, msg->replyRequested);
+				/* The standby's answer is passed on without delay */
+				if (msg->replyRequested)
+					conn->masterReplyRequested = true;
+				WbCCSendKeepalive(conn, msg->replyRequested);
+				break;
+			case MSG_NOTHING:
+				/* Following the producer of our profile, wait for its output */
+				return STREAM_WAIT;
 		}
 	}
-	{
-		TimeLineID nextTli;
-		char *nextTliStart;
-		WbMcEndStreaming(master, &nextTli, &nextTliStart);
+}
 
-		if (nextTli && nextTliStart)
+/* WAL from our own master connection also goes to the WAL cache */
+static bool
+WbCCReceiveFromMaster(WbConn conn, ReplMessage *msg)
+{
+	if (!WbMcReceiveWalMessage(conn->master, msg))
+		return false;
+	if (msg->type == MSG_WAL_DATA)
+		WbWcWrite(0, conn->command->timeline, msg->dataStart, msg->data, msg->dataLen);
+	return true;
+}
+
+/*
+ * Keep draining the master while the standby is busy so that the walsender
+ * doesn't fall behind because of a slow link. Stops once the spool is full,
+ * the master then waits in the socket buffer as without a spool.
+ */
+static void
+WbCCFillSpool(WbConn conn)
+{
+	ReplMessage msg;
+	int spooled = 0;
+
+	if (!conn->spool || conn->fanout || conn->walCache || !conn->master)
+		return;
+
+	while (spooled < STREAM_BATCH && WbSpHasRoom(conn->spool) &&
+			WbCCReceiveFromMaster(conn, &msg))
+	{
+		if (msg.type == MSG_KEEPALIVE)
 		{
-			ResultCol cols[2] = {
-					{ "next_tli", INT8OID, &nextTli, 0},
-					{ "next_tli_startpos", TEXTOID, nextTliStart, 0}
-			};
-			WbCCSendResultset(conn, 2, cols);
-			wbfree(nextTliStart);
+			/* The standby won't see it in time, answer with what it told us last */
+			if (msg.replyRequested)
+			{
+				StandbyReplyMessage reply = conn->lastReply;
+
+				reply.sendTime = GetCurrentTimestamp();
+				WbMcSendReply(conn->master, &reply, true, false);
+			}
+			continue;
 		}
-		ConnBeginMessage(conn, 'C');
-		ConnSendString(conn, "START_STREAMING");
-		ConnEndMessage(conn);
+		WbSpPut(conn->spool, &msg);
+		spooled++;
 	}
-
-	WbFFreeProcessingState(fl);
-	wbfree(msg);
 }
 
 static void
-WbCCExecTimeline(WbConn conn, MasterConn *master, ReplicationCommand *cmd)
+WbCCFinishStreaming(WbConn conn, TimeLineID nextTli, char *nextTliStart)
+{
+	if (nextTli && nextTliStart)
+	{
+		ResultCol cols[2] = {
+				{ "next_tli", INT8OID, &nextTli, 0},
+				{ "next_tli_startpos", TEXTOID, nextTliStart, 0}
+		};
+		WbCCSendResultset(conn, 2, cols);
+	}
+	wbfree(nextTliStart);
+
+	ConnBeginMessage(conn, 'C');
+	ConnSendString(conn, "START_STREAMING");
+	ConnEndMessage(conn);
+
+	WbCCReleaseProducer(conn);
+	WbSlRelease(conn->replSlot);
+	conn->replSlot = 0;
+	WbFFreeProcessingState(conn->filter);
+	conn->filter = NULL;
+	wbfree(conn->msg);
+	conn->msg = NULL;
+}
+
+static bool
+WbCCExecTimeline(WbConn conn)
 {
 	TimelineHistory history;
+	ReplicationCommand *cmd = conn->command;
 
-	log_info("Received request for timeline %d", cmd->timeline);
+	if (!conn->querySent)
+	{
+		if (!WbCCMasterReady(conn))
+			return false;
+
+		log_info("Received request for timeline %d", cmd->timeline);
 
-	WbMcGetTimelineHistory(master, cmd->timeline, &history);
+		WbMcSendTimelineHistory(conn->master, cmd->timeline);
+		conn->querySent = true;
+	}
+
+	if (!WbMcFinishTimelineHistory(conn->master, &history))
+		return false;
+	conn->querySent = false;
 
 	{
 		ResultCol cols[2] = {
@@ -812,62 +1481,83 @@ WbCCExecTimeline(WbConn conn, MasterConn *master, ReplicationCommand *cmd)
 
 	wbfree(history.filename);
 	wbfree(history.content);
+	return true;
 }
 
-static void
+/*
+ * Resolve names in the filter configuration to OIDs. Names not in the OID
+ * cache are looked up over a separate connection to the postgres database.
+ * Returns true once done.
+ */
+static bool
 WbCCLookupFilteringOids(WbConn conn, FilterData *fl)
 {
-	// TODO: take in other options
-	char conninfo[MAX_CONNINFO_LEN+1];
-	char *buf = conninfo;
-	char *buf_end = &(conninfo[MAX_CONNINFO_LEN]);
-	MasterConn* master;
+	wb_config_entry *entry = conn->configEntry;
+	struct {
+		OidResolveKind kind;
+		bool include;
+		char **names;
+		int n_items;
+		Oid **result;
+	} lookups[] = {
+		{ OID_RESOLVE_TABLESPACES, true, NULL, 0, &(fl->include_tablespaces) },
+		{ OID_RESOLVE_DATABASES, true, NULL, 0, &(fl->include_databases) },
+		{ OID_RESOLVE_TABLESPACES, false, NULL, 0, &(fl->exclude_tablespaces) },
+		{ OID_RESOLVE_DATABASES, false, NULL, 0, &(fl->exclude_databases) }
+	};
+	int n_lookups = sizeof(lookups)/sizeof(lookups[0]);
+
+	if (!entry)
+		return true;
 
-	if (!conn->configEntry)
-		return;
+	if ((entry->filter.n_include_tablespaces +
+		 entry->filter.n_include_databases +
+		 entry->filter.n_exclude_tablespaces +
+		 entry->filter.n_exclude_databases) == 0)
+		return true;
 
-	if ((conn->configEntry->filter.n_include_tablespaces +
-		 conn->configEntry->filter.n_include_databases +
-		 conn->configEntry->filter.n_exclude_tablespaces +
-		 conn->configEntry->filter.n_exclude_databases) == 0)
-		return;
+	lookups[0].names = entry->filter.include_tablespaces;
+	lookups[0].n_items = entry->filter.n_include_tablespaces;
+	lookups[1].names = entry->filter.include_databases;
+	lookups[1].n_items = entry->filter.n_include_databases;
+	lookups[2].names = entry->filter.exclude_tablespaces;
+	lookups[2].n_items = entry->filter.n_exclude_tablespaces;
+	lookups[3].names = entry->filter.exclude_databases;
+	lookups[3].n_items = entry->filter.n_exclude_databases;
 
-	memset(conninfo, 0, sizeof(conninfo));
+	for (; conn->lookupStep < n_lookups; conn->lookupStep++)
+	{
+		int i = conn->lookupStep;
+		char **oidNames;
+		int j;
 
-	if (conn->master_host) {
-		buf += snprintf(buf, buf_end - buf, "host=%s ", conn->master_host);
-	}
+		if (!lookups[i].n_items)
+			continue;
 
-	if (conn->master_port)
-		buf +=  snprintf(buf, buf_end - buf, "port=%d ", conn->master_port);
-
-	if (conn->user_name)
-		buf += snprintf(buf, buf_end - buf, "user=%s ", conn->user_name);
-
-	buf += snprintf(buf, buf_end - buf, "dbname=postgres application_name=walbouncer");
-
-	master = WbMcOpenConnection(conninfo);
-
-	if (conn->configEntry->filter.n_include_tablespaces)
-		fl->include_tablespaces = WbMcResolveOids(master,
-				OID_RESOLVE_TABLESPACES, true,
-				conn->configEntry->filter.include_tablespaces,
-				conn->configEntry->filter.n_include_tablespaces);
-	if (conn->configEntry->filter.n_include_databases)
-		fl->include_databases = WbMcResolveOids(master,
-				OID_RESOLVE_DATABASES, true,
-				conn->configEntry->filter.include_databases,
-				conn->configEntry->filter.n_include_databases);
-	if (conn->configEntry->filter.n_exclude_tablespaces)
-		fl->exclude_tablespaces = WbMcResolveOids(master,
-				OID_RESOLVE_TABLESPACES, false,
-				conn->configEntry->filter.exclude_tablespaces,
-				conn->configEntry->filter.n_exclude_tablespaces);
-	if (conn->configEntry->filter.n_exclude_databases)
-		fl->exclude_databases = WbMcResolveOids(master,
-				OID_RESOLVE_DATABASES, false,
-				conn->configEntry->filter.exclude_databases,
-				conn->configEntry->filter.n_exclude_databases);
+		if (!conn->querySent)
+		{
+			if (WbOcLookup(lookups[i].kind, lookups[i].include,
+					lookups[i].names, lookups[i].n_items, lookups[i].result))
+				continue;
+
+			if (!WbCCMetadataReady(conn))
+				return false;
+
+			WbMcSendResolveOids(conn->metadata, lookups[i].kind,
+					lookups[i].include, lookups[i].names, lookups[i].n_items);
+			conn->querySent = true;
+		}
+		if (!WbMcFinishResolveOids(conn->metadata, lookups[i].kind, lookups[i].result, &oidNames))
+			return false;
+		conn->querySent = false;
+
+		WbOcStore(lookups[i].kind, lookups[i].include, lookups[i].names,
+				lookups[i].n_items, *(lookups[i].result), oidNames);
+		for (j = 0; oidNames[j]; j++)
+			wbfree(oidNames[j]);
+		wbfree(oidNames);
+	}
+	WbFCompileFilter(fl);
 
 	{
 		char buf[32000];
@@ -915,7 +1605,8 @@ WbCCLookupFilteringOids(WbConn conn, FilterData *fl)
 		WbCCSendErrorReport(conn, LOG_INFO, "WAL stream is being filtered", buf);
 	}
 
-	WbMcCloseConnection(master);
+	WbCCCloseUpstream(conn, &(conn->metadata), true);
+	return true;
 }
 /* TODO: Probably not necessary
 static void
@@ -933,6 +1624,7 @@ WbCCSendWALRecord(XfConn conn, char *data, int len, XLogRecPtr sentPtr, Timestam
 static void
 WbCCSendEndOfWal(WbConn conn)
 {
+	WbCCFlushWalBatch(conn);
 	ConnBeginMessage(conn, 'c');
 	ConnEndMessage(conn);
 	//ConnFlush(conn);
@@ -942,14 +1634,17 @@ WbCCSendEndOfWal(WbConn conn)
 static void
 WbCCProcessRepliesIfAny(WbConn conn)
 {
-	char firstchar;
+	int firstchar;
 	int r;
+	char *data;
+	int len;
 
 	// TODO: record last receive timestamp here
 
 	for (;;)
 	{
-		r = ConnGetByteIfAvailable(conn, &firstchar);
+		/* Replies are small and handled right away, no need to copy them */
+		r = ConnGetMessageData(conn, &firstchar, &data, &len);
 		if (r < 0)
 		{
 			error("Unexpected EOF from receiver");
@@ -964,18 +1659,11 @@ WbCCProcessRepliesIfAny(WbConn conn)
 		switch (firstchar)
 		{
 			case 'd':
-				WbCCProcessReplyMessage(conn);
+				WbCCProcessReplyMessage(conn, data, len);
 				break;
 			case 'c':
 				if (!conn->copyDoneSent)
 					WbCCSendEndOfWal(conn);
-				// consume the CopyData message
-				{
-					WbMessage *msg;
-					if (ConnGetMessage(conn, &msg))
-						error("Unexpected EOF on standby connection");
-					ConnFreeMessage(msg);
-				}
 				conn->copyDoneReceived = true;
 				break;
 			case 'X':
@@ -987,38 +1675,36 @@ WbCCProcessRepliesIfAny(WbConn conn)
 }
 
 static void
-WbCCProcessReplyMessage(WbConn conn)
+WbCCProcessReplyMessage(WbConn conn, char *data, int len)
 {
-	WbMessage *msg;
-	if (ConnGetMessage(conn, &msg))
-		error("unexpected EOF from receiver");
-
-	switch (msg->data[0])
+	switch (len > 0 ? data[0] : 0)
 	{
 		case 'r':
-			WbCCProcessStandbyReplyMessage(conn, msg);
+			if (len < 34)
+				error("Invalid standby reply message");
+			WbCCProcessStandbyReplyMessage(conn, data);
 			break;
 		case 'h':
-			WbCCProcessStandbyHSFeedbackMessage(conn, msg);
+			if (len < 17)
+				error("Invalid hot standby feedback message");
+			WbCCProcessStandbyHSFeedbackMessage(conn, data);
 			break;
 		default:
 			error("Unexpected message type");
 	}
-
-	ConnFreeMessage(msg);
 }
 
 static void
-WbCCProcessStandbyReplyMessage(WbConn conn, WbMessage *msg)
+WbCCProcessStandbyReplyMessage(WbConn conn, char *data)
 {
 	StandbyReplyMessage *reply = &(conn->lastReply);
 
 	/* the caller already consumed the msgtype byte */
-	reply->writePtr = fromnetwork64(msg->data + 1);
-	reply->flushPtr = fromnetwork64(msg->data + 9);
-	reply->applyPtr = fromnetwork64(msg->data + 17);
-	reply->sendTime = fromnetwork64(msg->data + 25);		/* sendTime; not used ATM */
-	reply->replyRequested = msg->data[33];
+	reply->writePtr = fromnetwork64(data + 1);
+	reply->flushPtr = fromnetwork64(data + 9);
+	reply->applyPtr = fromnetwork64(data + 17);
+	reply->sendTime = fromnetwork64(data + 25);		/* sendTime; not used ATM */
+	reply->replyRequested = data[33];
 
 	log_debug1("Standby reply msg: write %X/%X flush %X/%X apply %X/%X sendTime %s%s",
 		 FormatRecPtr(reply->writePtr),
@@ -1031,6 +1717,7 @@ WbCCProcessStandbyReplyMessage(WbConn conn, WbMessage *msg)
 	if (reply->replyRequested)
 		WbCCSendKeepalive(conn, false);
 
+	WbSlAdvance(conn->replSlot, reply->flushPtr);
 	conn->replyForwarded = false;
 }
 
@@ -1042,6 +1729,7 @@ WbCCSendKeepalive(WbConn conn, bool request_reply)
 			(uint32) conn->sentPtr,
 			request_reply ? " (reply requested)" : "");
 
+	WbCCFlushWalBatch(conn);
 	ConnBeginMessage(conn, 'd');
 	ConnSendInt(conn, 'k', 1);
 	ConnSendInt64(conn, conn->sentPtr);
@@ -1051,16 +1739,16 @@ WbCCSendKeepalive(WbConn conn, bool request_reply)
 }
 
 static void
-WbCCProcessStandbyHSFeedbackMessage(WbConn conn, WbMessage *msg)
+WbCCProcessStandbyHSFeedbackMessage(WbConn conn, char *data)
 {
 	HSFeedbackMessage *feedback = &(conn->lastFeedback);
 	/*
 	 * Decipher the reply message. The caller already consumed the msgtype
 	 * byte.
 	 */
-	feedback->sendTime = fromnetwork64(msg->data + 1);		/* sendTime; not used ATM */
-	feedback->xmin = fromnetwork32(msg->data + 9);
-	feedback->epoch = fromnetwork32(msg->data + 13);
+	feedback->sendTime = fromnetwork64(data + 1);		/* sendTime; not used ATM */
+	feedback->xmin = fromnetwork32(data + 9);
+	feedback->epoch = fromnetwork32(data + 13);
 
 	log_debug1("hot standby feedback xmin %u epoch %u sendTime %s",
 		 feedback->xmin,
@@ -1070,18 +1758,90 @@ WbCCProcessStandbyHSFeedbackMessage(WbConn conn, WbMessage *msg)
 	conn->feedbackForwarded = false;
 }
 
+/*
+ * Status sent upstream is rate limited: a reply goes to the master right
+ * away only when the standby has flushed or applied more WAL or the master
+ * asked for it, feedback only when xmin moved. Anything else is merged and
+ * goes out once status_interval has passed. The fan-out receiver does the
+ * same for all its standbys.
+ */
 static void
-WbCCForwardPendingReplies(WbConn conn, MasterConn* master)
+WbCCForwardPendingReplies(WbConn conn)
 {
-	if (!conn->replyForwarded)
+	StandbyReplyMessage reply;
+	HSFeedbackMessage feedback;
+	bool replyPending = !conn->replyForwarded;
+	bool feedbackPending = !conn->feedbackForwarded;
+	TimestampTz now;
+	bool due;
+
+	if (conn->walCache)
+	{
+		/* Following the producer of our profile, it answers the master for us */
+		if (WbWcIsFiltered(conn->walCache))
+		{
+			if (replyPending)
+				WbWcSendReply(conn->walCache, &(conn->lastReply));
+			if (feedbackPending)
+				WbWcSendFeedback(conn->walCache, &(conn->lastFeedback));
+			conn->replyForwarded = true;
+			conn->feedbackForwarded = true;
+			conn->masterReplyRequested = false;
+		}
+		/* Otherwise held back until streaming from upstream resumes */
+		return;
+	}
+
+	reply = conn->lastReply;
+	feedback = conn->lastFeedback;
+
+	/* Producing for a profile, we answer for its followers too */
+	if (conn->producerClaim)
+	{
+		WbWcMergeFollowerStatus(WbCCFilterProfile(conn), &reply, &feedback);
+		replyPending |= reply.flushPtr != conn->forwardedReply.flushPtr ||
+			reply.applyPtr != conn->forwardedReply.applyPtr;
+		feedbackPending |= feedback.xmin != conn->forwardedFeedback.xmin ||
+			feedback.epoch != conn->forwardedFeedback.epoch;
+	}
+	if (!replyPending && !feedbackPending)
+		return;
+
+	if (conn->fanout)
 	{
-		WbMcSendReply(master, &(conn->lastReply), false, false);
+		if (replyPending)
+			WbFoSendReply(conn->fanout, &reply);
+		if (feedbackPending)
+			WbFoSendFeedback(conn->fanout, &feedback);
+		conn->forwardedReply = reply;
+		conn->forwardedFeedback = feedback;
 		conn->replyForwarded = true;
+		conn->feedbackForwarded = true;
+		return;
+	}
+
+	now = GetCurrentTimestamp();
+	due = now - conn->lastStatusForward >= (TimestampTz) CurrentConfig->status_interval * 1000000;
+
+	if (replyPending &&
+			(due || conn->masterReplyRequested ||
+			 reply.flushPtr > conn->forwardedReply.flushPtr ||
+			 reply.applyPtr > conn->forwardedReply.applyPtr))
+	{
+		WbMcSendReply(conn->master, &reply, false, false);
+		conn->forwardedReply = reply;
+		conn->replyForwarded = true;
+		conn->masterReplyRequested = false;
+		conn->lastStatusForward = now;
 	}
-	if (!conn->feedbackForwarded)
+	if (feedbackPending &&
+			(due || feedback.xmin != conn->forwardedFeedback.xmin ||
+			 feedback.epoch != conn->forwardedFeedback.epoch))
 	{
-		WbMcSendFeedback(master, &(conn->lastFeedback));
+		WbMcSendFeedback(conn->master, &feedback);
+		conn->forwardedFeedback = feedback;
 		conn->feedbackForwarded = true;
+		conn->lastStatusForward = now;
 	}
 }
 
@@ -1093,87 +1853,172 @@ WbCCSendCopyBothResponse(WbConn conn)
 	ConnSendInt(conn, 0, 1);
 	ConnSendInt(conn, 0, 2);
 	ConnEndMessage(conn);
-	ConnFlush(conn, FLUSH_IMMEDIATE);
+	ConnFlush(conn, FLUSH_ASYNC);
 }
 
 static void
 WbCCSendWalBlock(WbConn conn, ReplMessage *msg, FilterData *fl)
 {
+	FilterOutput out;
 	XLogRecPtr dataStart;
-	int msgOffset = 0;
-	int buffered = 0;
-	int unsentLen = 0;
-	char unsentBuf[FL_BUFFER_LEN];
-
-	// Take a local copy of the unsent buffer in case we need to rewrite it
-	if (fl->unsentBufferLen) {
-		unsentLen = fl->unsentBufferLen;
-		memcpy(unsentBuf, fl->unsentBuffer, unsentLen);
-		log_debug2("Sending %d bytes of unbuffered data", unsentLen);
-	}
+	int i;
 
-	//'d' 'w' l(dataStart) l(walEnd) l(sendTime) s[WALdata]
-	if (fl->state & FS_BUFFERING_STATE)
+	if (!WbFGetOutput(msg, fl, &out))
+		return;
+
+	log_debug1("Sending out %d bytes of WAL at %X/%X",
+			(int) (out.dataEnd - out.dataStart), FormatRecPtr(out.dataStart));
+
+	dataStart = out.dataStart;
+	for (i = 0; i < out.nparts; i++)
 	{
-		// Chomp the buffered data off of what we send
-		buffered = fl->bufferLen;
-		// Stash it away into fl state, we will send it with the next block
-		fl->unsentBufferLen = fl->bufferLen;
-		memcpy(fl->unsentBuffer, fl->buffer, fl->bufferLen);
-		// Make note that record starts in the unsent buffer for rewriting
-		fl->recordStart = -1;
-		log_debug2("Buffering %d bytes of data", buffered);
-
-	} else {
-		// Clear out unsent buffer
-		fl->unsentBufferLen = 0;
+		WbCCCacheFilteredWal(conn, dataStart, out.parts[i], out.partLen[i]);
+		dataStart += out.partLen[i];
 	}
+	WbCCQueueWal(conn, out.dataStart, out.walEnd, msg->sendTime,
+			out.parts, out.partLen, out.nparts);
+
+	conn->sentPtr = out.dataEnd;
+	conn->lastSend = msg->sendTime;
+}
 
-	// Don't send anything if we are not synchronized, we will see this data again after replication restart
-	if (!fl->synchronized)
+/* Output another session filtered for our profile goes out as it is */
+static void
+WbCCSendFilteredBlock(WbConn conn, ReplMessage *msg)
+{
+	log_debug1("Sending out %d bytes of filtered WAL at %X/%X",
+			msg->dataLen, FormatRecPtr(msg->dataStart));
+	WbCCQueueWal(conn, msg->dataStart, msg->walEnd, msg->sendTime,
+			&(msg->data), &(msg->dataLen), 1);
+
+	conn->sentPtr = msg->dataStart + msg->dataLen;
+	conn->lastSend = msg->sendTime;
+}
+
+/*
+ * Consecutive WAL blocks are merged into one message to the standby, up to
+ * batch_size. Small blocks are copied into the batch, blocks of at least half
+ * of it aren't worth copying and go out from where they are. The batch is
+ * sent before anything else goes to the standby and at the end of the
+ * session's turn, so nothing is held back waiting for more WAL.
+ */
+static void
+WbCCQueueWal(WbConn conn, XLogRecPtr dataStart, XLogRecPtr walEnd,
+		TimestampTz sendTime, char **parts, int *partLen, int nparts)
+{
+	int batchSize = CurrentConfig->batch_size * 1024;
+	int len = 0;
+	int i;
+
+	for (i = 0; i < nparts; i++)
+		len += partLen[i];
+
+	if (conn->walBatchOpen &&
+			(dataStart != conn->walBatchStart + conn->walBatchLen ||
+			 conn->walBatchLen + len > batchSize))
+		WbCCFlushWalBatch(conn);
+
+	if (len * 2 >= batchSize)
 	{
-		log_debug2("Skipping sending data.");
+		WbCCFlushWalBatch(conn);
+		WbCCSendWalMessage(conn, dataStart, walEnd, sendTime, parts, partLen, nparts);
 		return;
 	}
 
-	// Include the previously unsent data
-	dataStart = msg->dataStart - unsentLen;
+	if (!conn->walBatch)
+		conn->walBatch = wballoc(batchSize);
+	if (!conn->walBatchOpen)
+	{
+		conn->walBatchOpen = true;
+		conn->walBatchStart = dataStart;
+	}
+	for (i = 0; i < nparts; i++)
+	{
+		memcpy(conn->walBatch + conn->walBatchLen, parts[i], partLen[i]);
+		conn->walBatchLen += partLen[i];
+	}
+	conn->walBatchWalEnd = walEnd;
+	conn->walBatchSendTime = sendTime;
+}
+
+static void
+WbCCFlushWalBatch(WbConn conn)
+{
+	if (!conn->walBatchOpen)
+		return;
+
+	WbCCSendWalMessage(conn, conn->walBatchStart, conn->walBatchWalEnd,
+			conn->walBatchSendTime, &(conn->walBatch), &(conn->walBatchLen), 1);
+	conn->walBatchOpen = false;
+	conn->walBatchLen = 0;
+}
 
-	if (fl->requestedStartPos > dataStart) {
-		if (fl->requestedStartPos > (msg->dataStart + msg->dataLen))
-		{
-			log_info("Skipping whole WAL message as not requested");
-			return;
-		}
-		msgOffset = fl->requestedStartPos - dataStart;
-		dataStart = fl->requestedStartPos;
-		Assert(msgOffset < (msg->dataLen + unsentLen));
-		log_debug2("Chomping WAL message down to size at %d", msgOffset);
+static void
+WbCCSendWalMessage(WbConn conn, XLogRecPtr dataStart, XLogRecPtr walEnd,
+		TimestampTz sendTime, char **parts, int *partLen, int nparts)
+{
+	struct iovec data[2];
+	int i;
+
+	if (conn->compressor)
+	{
+		WbCCSendCompressedWalMessage(conn, dataStart, walEnd, sendTime, parts, partLen, nparts);
+		return;
 	}
 
+	//'d' 'w' l(dataStart) l(walEnd) l(sendTime) s[WALdata]
 	log_debug2("Sending data start %X/%X", FormatRecPtr(dataStart));
 
 	ConnBeginMessage(conn, 'd');
 	ConnSendInt(conn, 'w', 1);
 	ConnSendInt64(conn, dataStart);
-	ConnSendInt64(conn, msg->walEnd - buffered);
-	ConnSendInt64(conn, msg->sendTime);
-	log_debug1("Sending out %d bytes of WAL at %X/%X",
-			msg->dataLen + unsentLen - msgOffset - buffered,
-			FormatRecPtr(dataStart));
+	ConnSendInt64(conn, walEnd);
+	ConnSendInt64(conn, sendTime);
 
-	if (unsentLen && msgOffset < unsentLen) {
-		log_debug2("Sending unsent data at offset %d, %d bytes", msgOffset, unsentLen-msgOffset);
-		ConnSendBytes(conn, unsentBuf + msgOffset, unsentLen-msgOffset);
-		msgOffset = msgOffset < unsentLen ? 0 : msgOffset - unsentLen;
+	for (i = 0; i < nparts; i++)
+	{
+		data[i].iov_base = parts[i];
+		data[i].iov_len = partLen[i];
 	}
+	/* Goes out straight from where it is, unless the socket is full */
+	ConnEndMessageWithData(conn, data, nparts);
+}
 
-	ConnSendBytes(conn, msg->data + msgOffset, msg->dataLen - msgOffset - buffered);
-	ConnEndMessage(conn);
+static void
+WbCCSendCompressedWalMessage(WbConn conn, XLogRecPtr dataStart, XLogRecPtr walEnd,
+		TimestampTz sendTime, char **parts, int *partLen, int nparts)
+{
+	struct iovec data;
+	char *compressed;
+	int rawLen = 0;
+	int i;
 
-	conn->sentPtr = msg->dataStart + msg->dataLen - buffered;
-	conn->lastSend = msg->sendTime;
-	ConnFlush(conn, FLUSH_ASYNC);
+	for (i = 0; i < nparts; i++)
+		rawLen += partLen[i];
+	data.iov_len = WbCmCompress(conn->compressor, parts, partLen, nparts, &compressed);
+	data.iov_base = compressed;
+
+	//'d' 'z' l(dataStart) l(walEnd) l(sendTime) i(rawLen) s[compressed]
+	log_debug2("Sending data start %X/%X, %d bytes compressed to %d",
+			FormatRecPtr(dataStart), rawLen, (int) data.iov_len);
+
+	ConnBeginMessage(conn, 'd');
+	ConnSendInt(conn, 'z', 1);
+	ConnSendInt64(conn, dataStart);
+	ConnSendInt64(conn, walEnd);
+	ConnSendInt64(conn, sendTime);
+	ConnSendInt(conn, rawLen, 4);
+	ConnEndMessageWithData(conn, &data, 1);
+}
+
+/* Share what we send with other standbys of our profile */
+static void
+WbCCCacheFilteredWal(WbConn conn, XLogRecPtr pos, char *data, int len)
+{
+	int profile = WbCCFilterProfile(conn);
+
+	if (profile && len > 0)
+		WbWcWrite(profile, conn->command->timeline, pos, data, len);
 }
 
 static char*
@@ -1227,5 +2072,5 @@ WbCCSendErrorReport(WbConn conn, LogLevel level, char *message, char* detail)
 
 	ConnSendInt(conn, '\0', 1);
 	ConnEndMessage(conn);
-	ConnFlush(conn, FLUSH_IMMEDIATE);
+	ConnFlush(conn, FLUSH_ASYNC);
 }
@@ -0,0 +1,250 @@
+#include "wbcompress.h"
+
+#include <string.h>
+#include <zlib.h>
+
+#include "wbutils.h"
+
+/* Shorter runs of zeros are cheaper to leave to zlib */
+#define CM_MIN_ZERO_RUN 64
+#define CM_BUFFER_INIT_SIZE (64 * 1024)
+/* Upper limit on the size of a message from upstream */
+#define CM_MAX_RAW_LEN (1024 * 1024 * 1024)
+
+/*
+ * Before compression WAL data is encoded as a sequence of runs, each a
+ * number of zero bytes followed by a number of literal bytes:
+ *
+ *   uint32 zeros, uint32 literalLen, char literal[literalLen]
+ *
+ * Only the runs go through zlib, the zeros themselves are never touched.
+ */
+struct WbCompressor {
+	bool decompress;
+	z_stream zs;
+	char *buffer;			/* compressed output, or decompressed WAL */
+	int bufSize;
+};
+
+static void CmDeflate(WbCompressor *cm, const char *data, int len, int flush);
+static void CmInflate(WbCompressor *cm, char *out, int len);
+static int CmZeroRun(const char *data, int len);
+static void CmReserve(WbCompressor *cm, int needed);
+
+WbCompressor*
+WbCmCreate(bool decompress)
+{
+	WbCompressor *cm = wballoc0(sizeof(WbCompressor));
+	int rc;
+
+	cm->decompress = decompress;
+	if (decompress)
+		rc = inflateInit(&(cm->zs));
+	else
+		rc = deflateInit(&(cm->zs), Z_BEST_SPEED);
+	if (rc != Z_OK)
+		error("Could not initialize WAL compression: %s", cm->zs.msg ? cm->zs.msg : "out of memory");
+	return cm;
+}
+
+void
+WbCmFree(WbCompressor *cm)
+{
+	if (cm->decompress)
+		inflateEnd(&(cm->zs));
+	else
+		deflateEnd(&(cm->zs));
+	wbfree(cm->buffer);
+	wbfree(cm);
+}
+
+/* Start a new stream, both sides do this when streaming is started */
+void
+WbCmReset(WbCompressor *cm)
+{
+	if (cm->decompress)
+		inflateReset(&(cm->zs));
+	else
+		deflateReset(&(cm->zs));
+}
+
+/*
+ * Compress the concatenation of parts into one message. The result is valid
+ * until the next call.
+ */
+int
+WbCmCompress(WbCompressor *cm, char **parts, int *partLen, int nparts, char **out)
+{
+	int i;
+
+	CmReserve(cm, CM_BUFFER_INIT_SIZE);
+	cm->zs.next_out = (Bytef *) cm->buffer;
+	cm->zs.avail_out = cm->bufSize;
+
+	for (i = 0; i < nparts; i++)
+	{
+		const char *data = parts[i];
+		int len = partLen[i];
+		int pos = 0;
+
+		while (pos < len)
+		{
+			int zeros = CmZeroRun(data + pos, len - pos);
+			int literal = pos + zeros;
+			int end = literal;
+			char header[8];
+
+			/* Literal bytes run until the next long enough run of zeros */
+			while (end < len)
+			{
+				const char *zero = memchr(data + end, 0, len - end);
+				int run;
+
+				if (!zero)
+				{
+					end = len;
+					break;
+				}
+				end = zero - data;
+				run = CmZeroRun(data + end, len - end);
+				if (run >= CM_MIN_ZERO_RUN)
+					break;
+				end += run;
+			}
+
+			write32(header, zeros);
+			write32(header + 4, end - literal);
+			CmDeflate(cm, header, sizeof(header), Z_NO_FLUSH);
+			CmDeflate(cm, data + literal, end - literal, Z_NO_FLUSH);
+			pos = end;
+		}
+	}
+	/* Everything so far has to be decodable on the other end */
+	CmDeflate(cm, NULL, 0, Z_SYNC_FLUSH);
+
+	*out = cm->buffer;
+	return (char *) cm->zs.next_out - cm->buffer;
+}
+
+/*
+ * Decompress a message of rawLen bytes of WAL. The result is valid until the
+ * next call. Errors out on anything that doesn't decode to exactly rawLen
+ * bytes.
+ */
+char*
+WbCmDecompress(WbCompressor *cm, char *data, int len, int rawLen)
+{
+	int pos = 0;
+	char extra;
+
+	if (rawLen < 0 || rawLen > CM_MAX_RAW_LEN)
+		error("Invalid length %d of compressed WAL message", rawLen);
+	CmReserve(cm, rawLen);
+
+	cm->zs.next_in = (Bytef *) data;
+	cm->zs.avail_in = len;
+
+	while (pos < rawLen)
+	{
+		char header[8];
+		uint32 zeros, literal;
+
+		CmInflate(cm, header, sizeof(header));
+		zeros = fromnetwork32(header);
+		literal = fromnetwork32(header + 4);
+		if (zeros > rawLen - pos || literal > rawLen - pos - zeros)
+			error("Corrupt compressed WAL message, data exceeds %d bytes", rawLen);
+
+		memset(cm->buffer + pos, 0, zeros);
+		pos += zeros;
+		CmInflate(cm, cm->buffer + pos, literal);
+		pos += literal;
+	}
+
+	/* Only the end of the flush may be left over */
+	while (cm->zs.avail_in > 0)
+	{
+		cm->zs.next_out = (Bytef *) &extra;
+		cm->zs.avail_out = 1;
+		if (inflate(&(cm->zs), Z_SYNC_FLUSH) != Z_OK || cm->zs.avail_out == 0)
+			error("Corrupt compressed WAL message, trailing data");
+	}
+
+	return cm->buffer;
+}
+
+/*
+ * Feed data to zlib, growing the output buffer as needed. Z_SYNC_FLUSH is
+ * done once zlib leaves room in the output buffer.
+ */
+static void
+CmDeflate(WbCompressor *cm, const char *data, int len, int flush)
+{
+	cm->zs.next_in = (Bytef *) data;
+	cm->zs.avail_in = len;
+
+	for (;;)
+	{
+		if (cm->zs.avail_out == 0)
+		{
+			int used = (char *) cm->zs.next_out - cm->buffer;
+
+			CmReserve(cm, cm->bufSize * 2);
+			cm->zs.next_out = (Bytef *) cm->buffer + used;
+			cm->zs.avail_out = cm->bufSize - used;
+		}
+		if (deflate(&(cm->zs), flush) == Z_STREAM_ERROR)
+			error("Compressing WAL failed");
+		if (cm->zs.avail_in == 0 && cm->zs.avail_out > 0)
+			break;
+	}
+}
+
+static void
+CmInflate(WbCompressor *cm, char *out, int len)
+{
+	cm->zs.next_out = (Bytef *) out;
+	cm->zs.avail_out = len;
+
+	while (cm->zs.avail_out > 0)
+	{
+		int rc = inflate(&(cm->zs), Z_SYNC_FLUSH);
+
+		if (rc != Z_OK)
+			error("Corrupt compressed WAL message: %s",
+					rc == Z_BUF_ERROR ? "data ends early" : (cm->zs.msg ? cm->zs.msg : "inflate failed"));
+	}
+}
+
+/* Number of zero bytes data starts with */
+static int
+CmZeroRun(const char *data, int len)
+{
+	int n = 0;
+
+	while (n + 8 <= len)
+	{
+		uint64 word;
+
+		memcpy(&word, data + n, sizeof(word));
+		if (word != 0)
+			break;
+		n += 8;
+	}
+	while (n < len && data[n] == 0)
+		n++;
+	return n;
+}
+
+static void
+CmReserve(WbCompressor *cm, int needed)
+{
+	int newSize = cm->bufSize ? cm->bufSize : CM_BUFFER_INIT_SIZE;
+
+	if (cm->bufSize >= needed && cm->buffer)
+		return;
+	while (newSize < needed)
+		newSize *= 2;
+	cm->buffer = rewballoc(cm->buffer, newSize);
+	cm->bufSize = newSize;
+}
@@ -1,7 +1,9 @@
 #include <stdio.h>
+#include <strings.h>
 
 #include <yaml.h>
 #include "wbconfig.h"
+#include "wbcompress.h"
 #include "wbutils.h"
 
 typedef struct {
@@ -14,6 +16,11 @@ wb_configuration *CurrentConfig = NULL;
 
 static int wb_read_main_config(wb_config_parser_state *state, wb_configuration* config);
 static int wb_read_master_config(wb_config_parser_state *state, wb_configuration* config);
+static int wb_read_ssl_config(wb_config_parser_state *state, wb_configuration* config);
+static int wb_read_fanout_config(wb_config_parser_state *state, wb_configuration* config);
+static int wb_read_pool_config(wb_config_parser_state *state, wb_configuration* config);
+static int wb_read_wal_cache_config(wb_config_parser_state *state, wb_configuration* config);
+static int wb_read_archive_config(wb_config_parser_state *state, wb_configuration* config);
 static int wb_read_configurations(wb_config_parser_state *state, wb_configuration* config);
 static int wb_read_configuration_entry(wb_config_parser_state *state, wb_config_entry *entry);
 
@@ -172,6 +179,24 @@ wb_read_string(wb_config_parser_state *state)
 	return result;
 }
 
+static bool
+wb_read_bool(wb_config_parser_state *state)
+{
+	char *value = wb_read_string(state);
+	bool result = false;
+
+	if (!value)
+		return false;
+	if (strcasecmp(value, "true") == 0 || strcasecmp(value, "on") == 0 ||
+			strcasecmp(value, "yes") == 0 || strcmp(value, "1") == 0)
+		result = true;
+	else if (strcasecmp(value, "false") != 0 && strcasecmp(value, "off") != 0 &&
+			strcasecmp(value, "no") != 0 && strcmp(value, "0") != 0)
+		error("Invalid format for boolean: '%s'", value);
+	free(value);
+	return result;
+}
+
 static void
 wb_read_list_of_string(wb_config_parser_state *state, char ***list, int *n)
 {
@@ -240,8 +265,34 @@ wb_new_config()
 	wb_configuration *config = wballoc(sizeof(wb_configuration));
 
 	config->listen_port = 5433;
+	config->unix_socket_directory = NULL;
+	config->workers = 0;
+	config->filter_threads = 1;
+	config->batch_size = 128;
+	config->status_interval = 10;
+	config->max_rate = 0;
 	config->master.host = "localhost";
 	config->master.port = 5432;
+	config->master.compression = NULL;
+	config->master.sslmode = NULL;
+	config->ssl.enabled = false;
+	config->ssl.cert_file = NULL;
+	config->ssl.key_file = NULL;
+	config->ssl.ktls = true;
+	config->fanout.enabled = false;
+	config->fanout.buffer_size = 64;
+	config->fanout.user = NULL;
+	config->pool.size = 0;
+	config->pool.users = NULL;
+	config->pool.n_users = 0;
+	config->wal_cache.enabled = false;
+	config->wal_cache.directory = NULL;
+	config->wal_cache.size = 1024;
+	config->wal_cache.max_slots = 10;
+	config->archive.enabled = false;
+	config->archive.directory = NULL;
+	config->archive.configuration = NULL;
+	config->archive.user = NULL;
 	config->configurations = NULL;
 
 	return config;
@@ -258,6 +309,7 @@ wb_delete_config_entry(wb_config_entry *entry)
 	FreeIfNotNull(entry->filter.exclude_tablespaces);
 
 	FreeIfNotNull(entry->match.application_name);
+	FreeIfNotNull(entry->spool.directory);
 
 	wbfree(entry);
 }
@@ -315,8 +367,34 @@ wb_read_main_config(wb_config_parser_state *state, wb_configuration *config)
 	{
 		if (strcmp(key, "listen_port") == 0)
 			config->listen_port = wb_read_int(state);
+		else if (strcmp(key, "unix_socket_directory") == 0)
+			config->unix_socket_directory = wb_read_string(state);
+		else if (strcmp(key, "workers") == 0)
+			config->workers = wb_read_int(state);
+		else if (strcmp(key, "filter_threads") == 0)
+			config->filter_threads = wb_read_int(state);
+		else if (strcmp(key, "batch_size") == 0)
+			config->batch_size = wb_read_int(state);
+		else if (strcmp(key, "status_interval") == 0)
+			config->status_interval = wb_read_int(state);
+		else if (strcmp(key, "max_rate") == 0)
+		{
+			config->max_rate = wb_read_int(state);
+			if (config->max_rate < 0)
+				error("max_rate must not be negative");
+		}
 		else if (strcmp(key, "master") == 0)
 			wb_read_master_config(state, config);
+		else if (strcmp(key, "ssl") == 0)
+			wb_read_ssl_config(state, config);
+		else if (strcmp(key, "fanout") == 0)
+			wb_read_fanout_config(state, config);
+		else if (strcmp(key, "pool") == 0)
+			wb_read_pool_config(state, config);
+		else if (strcmp(key, "wal_cache") == 0)
+			wb_read_wal_cache_config(state, config);
+		else if (strcmp(key, "archive") == 0)
+			wb_read_archive_config(state, config);
 		else if (strcmp(key, "configurations") == 0)
 			wb_read_configurations(state, config);
 		else
@@ -342,6 +420,76 @@ wb_read_master_config(wb_config_parser_state *state, wb_configuration *config)
 			config->master.host = wb_read_string(state);
 		else if (strcmp(key, "port") == 0)
 			config->master.port = wb_read_int(state);
+		else if (strcmp(key, "compression") == 0)
+		{
+			char *value = wb_read_string(state);
+
+			if (strcmp(value, WB_COMPRESSION_ZLIB) == 0)
+				config->master.compression = value;
+			else if (strcmp(value, "none") == 0)
+				config->master.compression = NULL;
+			else
+				error("Unsupported master compression %s, use zlib or none", value);
+		}
+		else if (strcmp(key, "sslmode") == 0)
+			config->master.sslmode = wb_read_string(state);
+		else
+			log_warning("Unknown configuration entry with key %s", key);
+		free(key);
+		CHECK_FOR_FAILURE(state);
+	}
+
+	return 0;
+}
+
+static int
+wb_read_ssl_config(wb_config_parser_state *state, wb_configuration *config)
+{
+	char *key;
+	if (!wb_expect_mapping(state))
+		error("SSL config must be a YAML mapping");
+
+	CHECK_FOR_FAILURE(state);
+	config->ssl.enabled = true;
+	while ((key = wb_read_key(state)))
+	{
+		if (strcmp(key, "cert_file") == 0)
+			config->ssl.cert_file = wb_read_string(state);
+		else if (strcmp(key, "key_file") == 0)
+			config->ssl.key_file = wb_read_string(state);
+		else if (strcmp(key, "ktls") == 0)
+			config->ssl.ktls = wb_read_bool(state);
+		else
+			log_warning("Unknown configuration entry with key %s", key);
+		free(key);
+		CHECK_FOR_FAILURE(state);
+	}
+
+	if (!config->ssl.cert_file || !config->ssl.key_file)
+		error("SSL needs a cert_file and a key_file");
+
+	return 0;
+}
+
+static int
+wb_read_fanout_config(wb_config_parser_state *state, wb_configuration *config)
+{
+	char *key;
+	if (!wb_expect_mapping(state))
+		error("Fanout config must be a YAML mapping");
+
+	CHECK_FOR_FAILURE(state);
+	config->fanout.enabled = true;
+	while ((key = wb_read_key(state)))
+	{
+		if (strcmp(key, "buffer_size") == 0)
+		{
+			config->fanout.buffer_size = wb_read_int(state);
+			if (config->fanout.buffer_size < 1)
+				error("Fanout buffer_size must be at least 1 megabyte");
+		}
+		else if (strcmp(key, "user") == 0)
+			config->fanout.user = wb_read_string(state);
 		else
 			log_warning("Unknown configuration entry with key %s", key);
 		free(key);
@@ -351,11 +499,106 @@ wb_read_master_config(wb_config_parser_state *state, wb_configuration *config)
 	return 0;
 }
 
+static int
+wb_read_pool_config(wb_config_parser_state *state, wb_configuration *config)
+{
+	char *key;
+	if (!wb_expect_mapping(state))
+		error("Pool config must be a YAML mapping");
+
+	CHECK_FOR_FAILURE(state);
+	config->pool.size = 1;
+	while ((key = wb_read_key(state)))
+	{
+		if (strcmp(key, "size") == 0)
+		{
+			config->pool.size = wb_read_int(state);
+			if (config->pool.size < 0)
+				error("Pool size must not be negative");
+		}
+		else if (strcmp(key, "users") == 0)
+			wb_read_list_of_string(state, &(config->pool.users), &(config->pool.n_users));
+		else
+			log_warning("Unknown configuration entry with key %s", key);
+		free(key);
+		CHECK_FOR_FAILURE(state);
+	}
+
+	return 0;
+}
+
+static int
+wb_read_wal_cache_config(wb_config_parser_state *state, wb_configuration *config)
+{
+	char *key;
+	if (!wb_expect_mapping(state))
+		error("WAL cache config must be a YAML mapping");
+
+	CHECK_FOR_FAILURE(state);
+	config->wal_cache.enabled = true;
+	while ((key = wb_read_key(state)))
+	{
+		if (strcmp(key, "directory") == 0)
+			config->wal_cache.directory = wb_read_string(state);
+		else if (strcmp(key, "size") == 0)
+		{
+			config->wal_cache.size = wb_read_int(state);
+			if (config->wal_cache.size < 1)
+				error("WAL cache size must be at least 1 megabyte");
+		}
+		else if (strcmp(key, "max_slots") == 0)
+		{
+			config->wal_cache.max_slots = wb_read_int(state);
+			if (config->wal_cache.max_slots < 0)
+				error("Number of replication slots can't be negative");
+		}
+		else
+			log_warning("Unknown configuration entry with key %s", key);
+		free(key);
+		CHECK_FOR_FAILURE(state);
+	}
+
+	if (!config->wal_cache.directory)
+		error("WAL cache needs a directory");
+
+	return 0;
+}
+
+static int
+wb_read_archive_config(wb_config_parser_state *state, wb_configuration *config)
+{
+	char *key;
+	if (!wb_expect_mapping(state))
+		error("Archive config must be a YAML mapping");
+
+	CHECK_FOR_FAILURE(state);
+	config->archive.enabled = true;
+	while ((key = wb_read_key(state)))
+	{
+		if (strcmp(key, "directory") == 0)
+			config->archive.directory = wb_read_string(state);
+		else if (strcmp(key, "configuration") == 0)
+			config->archive.configuration = wb_read_string(state);
+		else if (strcmp(key, "user") == 0)
+			config->archive.user = wb_read_string(state);
+		else
+			log_warning("Unknown configuration entry with key %s", key);
+		free(key);
+		CHECK_FOR_FAILURE(state);
+	}
+
+	if (!config->archive.directory)
+		error("Archive needs a directory");
+
+	return 0;
+}
+
 static int
 wb_read_configurations(wb_config_parser_state *state, wb_configuration *config)
 {
 	char *key;
 	wb_config_list_entry **next_ptr;
+	int id = 0;
 	if (!wb_expect_sequence(state))
 		error("Configuration file must be a YAML sequence");
 
@@ -372,6 +615,7 @@ wb_read_configurations(wb_config_parser_state *state, wb_configuration *config)
 
 		item = wb_new_config_entry();
 		item->entry.name = key;
+		item->entry.id = ++id;
 		wb_read_configuration_entry(state, &(item->entry));
 
 		//log_debug2("Read end of mapping key");
@@ -442,6 +686,40 @@ wb_read_configuration_entry(wb_config_parser_state *state, wb_config_entry *entr
 				free(key);
 			}
 		}
+		else if (strcmp(key, "spool") == 0)
+		{
+			if (!wb_expect_mapping(state))
+				error("Spool must be a mapping");
+			entry->spool.memory = 16;
+			while ((key = wb_read_key(state)))
+			{
+				if (strcmp(key, "memory") == 0)
+				{
+					entry->spool.memory = wb_read_int(state);
+					if (entry->spool.memory < 1)
+						error("Spool memory must be at least 1 megabyte");
+				}
+				else if (strcmp(key, "disk") == 0)
+				{
+					entry->spool.disk = wb_read_int(state);
+					if (entry->spool.disk < 0)
+						error("Spool disk size must not be negative");
+				}
+				else if (strcmp(key, "directory") == 0)
+					entry->spool.directory = wb_read_string(state);
+				else
+					error("Unexpected key %s for spool", key);
+				free(key);
+			}
+			if (!entry->spool.directory)
+				entry->spool.directory = wbstrdup("/tmp");
+		}
+		else if (strcmp(key, "max_rate") == 0)
+		{
+			entry->max_rate = wb_read_int(state);
+			if (entry->max_rate < 0)
+				error("max_rate must not be negative");
+		}
 		else
 		{
 			error("Unknown config entry %s", key);
@@ -21,6 +21,10 @@
 
 #include "wbcrc32c.h"
 
+#ifdef USE_SSE42_CRC32C_WITH_RUNTIME_CHECK
+#include <cpuid.h>
+#endif
+
 static const uint32 pg_crc32c_table[8][256];
 
 #define CRC8(x) pg_crc32c_table[0][(crc ^ (x)) & 0xFF] ^ (crc >> 8)
@@ -82,65 +86,108 @@ pg_comp_crc32c_sb8(pg_crc32c crc, const void *data, size_t len)
 }
 
 
+/* Below this many bytes stepping through the table is cheaper */
+#define CRC32C_ZERO_MIN_LEN 64
+
+#define CRC32C_POLY_REFLECTED 0x82F63B78
+
+/* x2n_table[k] is x^(2^k) mod P, filled on first use */
+static uint32 x2n_table[64];
+static bool x2n_table_ready = false;
+
 /*
- * all data considered as zeroes
-*/
+ * Multiply a and b modulo the CRC polynomial, both in the reflected bit
+ * order used by the CRC register. Same as multmodp() in zlib.
+ */
+static uint32
+crc32c_multmodp(uint32 a, uint32 b)
+{
+    uint32 m = (uint32) 1 << 31;
+    uint32 p = 0;
+
+    for (;;)
+    {
+        if (a & m)
+        {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY_REFLECTED : b >> 1;
+    }
+    return p;
+}
+
+/*
+ * Feed len zero bytes into the CRC. Each zero bit multiplies the register
+ * by x, so this is crc * x^(8 * len) mod P, which takes O(log len)
+ * multiplications with the powers of two table, see crc32_combine() in
+ * zlib.
+ */
 pg_crc32c
-pg_comp_crc32c_sb8_zero(pg_crc32c crc, const void *data, size_t len)
+pg_comp_crc32c_zero(pg_crc32c crc, size_t len)
 {
-    const unsigned char *p = data;
-    const uint32 *p4;
+    uint32 p = (uint32) 1 << 31;    /* x^0 */
+    int k;
 
-    /*
-     * Handle 0-3 initial bytes one at a time, so that the loop below starts
-     * with a pointer aligned to four bytes.
-     */
-    while (len > 0 && ((uintptr_t) p & 3))
+    if (len < CRC32C_ZERO_MIN_LEN)
     {
-        crc = CRC8(0);
-        len--;
+        while (len > 0)
+        {
+            crc = CRC8(0);
+            len--;
+        }
+        return crc;
     }
 
-    /*
-     * Process eight bytes of data at a time.
-     */
-    p4 = (const uint32 *) p;
-    while (len >= 8)
+    if (!x2n_table_ready)
     {
-        uint32		a = crc;    // 0 ^ crc
-        uint32		b = 0;
+        x2n_table[0] = (uint32) 1 << 30;    /* x^1 */
+        for (k = 1; k < 64; k++)
+            x2n_table[k] = crc32c_multmodp(x2n_table[k - 1], x2n_table[k - 1]);
+        x2n_table_ready = true;
+    }
 
-        const uint8 c0 = b >> 24;
-        const uint8 c1 = b >> 16;
-        const uint8 c2 = b >> 8;
-        const uint8 c3 = b;
-        const uint8 c4 = a >> 24;
-        const uint8 c5 = a >> 16;
-        const uint8 c6 = a >> 8;
-        const uint8 c7 = a;
+    /* Bytes to bits */
+    for (k = 3; len; len >>= 1, k++)
+        if (len & 1)
+            p = crc32c_multmodp(x2n_table[k], p);
 
-        crc =
-            pg_crc32c_table[0][c0] ^ pg_crc32c_table[1][c1] ^
-            pg_crc32c_table[2][c2] ^ pg_crc32c_table[3][c3] ^
-            pg_crc32c_table[4][c4] ^ pg_crc32c_table[5][c5] ^
-            pg_crc32c_table[6][c6] ^ pg_crc32c_table[7][c7];
+    return crc32c_multmodp(p, crc);
+}
 
-        len -= 8;
-    }
+#ifdef USE_SSE42_CRC32C_WITH_RUNTIME_CHECK
 
-    /*
-     * Handle any remaining bytes one at a time.
-     */
-    p = (const unsigned char *) p4;
-    while (len > 0)
-    {
-        crc = CRC8(0);
-        len--;
-    }
+/*
+ * Pick the fastest implementation the CPU supports, see
+ * src/port/pg_crc32c_choose.c in PostgreSQL.
+ */
+static pg_crc32c
+pg_comp_crc32c_choose(pg_crc32c crc, const void *data, size_t len)
+{
+	unsigned int eax, ebx, ecx, edx;
 
-    return crc;
+	pg_comp_crc32c = pg_comp_crc32c_sb8;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2))
+	{
+		if (ecx & bit_PCLMUL)
+		{
+			pg_comp_crc32c_pclmul_init();
+			pg_comp_crc32c = pg_comp_crc32c_pclmul;
+		}
+		else
+			pg_comp_crc32c = pg_comp_crc32c_sse42;
+	}
+
+	return pg_comp_crc32c(crc, data, len);
 }
 
+pg_crc32c (*pg_comp_crc32c) (pg_crc32c crc, const void *data, size_t len) = pg_comp_crc32c_choose;
+
+#endif
+
 
 /*
  * Lookup tables for the slicing-by-8 algorithm, for the so-called Castagnoli
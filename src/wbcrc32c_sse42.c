@@ -0,0 +1,173 @@
+/*-------------------------------------------------------------------------
+ *
+ * wbcrc32c_sse42.c
+ *	  Compute CRC-32C checksum using Intel SSE 4.2 and PCLMULQDQ
+ *	  instructions.
+ *
+ * The SSE 4.2 version follows PostgreSQL's pg_crc32c_sse42.c. The PCLMULQDQ
+ * version folds the input four 16 byte lanes at a time with carry-less
+ * multiplication, as described in "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ Instruction" by Gopal et al., and leaves the
+ * final reduction to the crc32 instruction.
+ *
+ * Both are compiled with function level target attributes and must only be
+ * called after checking cpuid, see pg_comp_crc32c_choose().
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "wbcrc32c.h"
+
+#ifdef USE_SSE42_CRC32C_WITH_RUNTIME_CHECK
+
+#include <string.h>
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+
+/* Below this length folding doesn't pay for its setup */
+#define PCLMUL_MIN_LEN 256
+
+#define CRC32C_POLY_REFLECTED 0x82F63B78
+
+/* Folding constants for distances of 4, 3, 2 and 1 lanes */
+static __m128i fold_512;
+static __m128i fold_384;
+static __m128i fold_256;
+static __m128i fold_128;
+
+__attribute__((target("sse4.2")))
+pg_crc32c
+pg_comp_crc32c_sse42(pg_crc32c crc, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	const unsigned char *pend = p + len;
+
+	/*
+	 * Process eight bytes of data at a time.
+	 *
+	 * NB: We do unaligned accesses here. The Intel architecture allows that,
+	 * and performance testing didn't show any performance gain from aligning
+	 * the begin address.
+	 */
+	while (p + 8 <= pend)
+	{
+		uint64 chunk;
+
+		memcpy(&chunk, p, 8);
+		crc = (uint32) _mm_crc32_u64(crc, chunk);
+		p += 8;
+	}
+
+	/* Process remaining full four bytes if any */
+	if (p + 4 <= pend)
+	{
+		uint32 chunk;
+
+		memcpy(&chunk, p, 4);
+		crc = _mm_crc32_u32(crc, chunk);
+		p += 4;
+	}
+
+	/* Process any remaining bytes one at a time. */
+	while (p < pend)
+	{
+		crc = _mm_crc32_u8(crc, *p);
+		p++;
+	}
+
+	return crc;
+}
+
+/*
+ * x^n mod P in the reflected bit order used by the CRC register, where bit
+ * 31 is the coefficient of x^0.
+ */
+static uint32
+xpow_mod(int n)
+{
+	uint32 v = 0x80000000;
+
+	while (n-- > 0)
+		v = (v >> 1) ^ ((v & 1) ? CRC32C_POLY_REFLECTED : 0);
+	return v;
+}
+
+/*
+ * Constants to move a 128 bit lane forward by dist bits. In a lane bit k is
+ * the coefficient of x^(127-k), so the low quadword holds the high degree
+ * half. Carry-less multiplication of reflected operands yields the product
+ * times x, which the exponents compensate for.
+ */
+static __m128i
+fold_constants(int dist)
+{
+	uint64 khigh = ((uint64) xpow_mod(dist + 63)) << 32;
+	uint64 klow = ((uint64) xpow_mod(dist - 1)) << 32;
+
+	return _mm_set_epi64x(klow, khigh);
+}
+
+void
+pg_comp_crc32c_pclmul_init()
+{
+	fold_512 = fold_constants(512);
+	fold_384 = fold_constants(384);
+	fold_256 = fold_constants(256);
+	fold_128 = fold_constants(128);
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static inline __m128i
+fold(__m128i x, __m128i k)
+{
+	return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),
+						 _mm_clmulepi64_si128(x, k, 0x11));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+pg_crc32c
+pg_comp_crc32c_pclmul(pg_crc32c crc, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	__m128i x0, x1, x2, x3;
+	uint64 lanes[2];
+
+	if (len < PCLMUL_MIN_LEN)
+		return pg_comp_crc32c_sse42(crc, data, len);
+
+	/* Starting from crc is the same as starting from zero with crc xored in */
+	x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *) p), _mm_cvtsi32_si128(crc));
+	x1 = _mm_loadu_si128((const __m128i *) (p + 16));
+	x2 = _mm_loadu_si128((const __m128i *) (p + 32));
+	x3 = _mm_loadu_si128((const __m128i *) (p + 48));
+	p += 64;
+	len -= 64;
+
+	while (len >= 64)
+	{
+		x0 = _mm_xor_si128(fold(x0, fold_512), _mm_loadu_si128((const __m128i *) p));
+		x1 = _mm_xor_si128(fold(x1, fold_512), _mm_loadu_si128((const __m128i *) (p + 16)));
+		x2 = _mm_xor_si128(fold(x2, fold_512), _mm_loadu_si128((const __m128i *) (p + 32)));
+		x3 = _mm_xor_si128(fold(x3, fold_512), _mm_loadu_si128((const __m128i *) (p + 48)));
+		p += 64;
+		len -= 64;
+	}
+
+	x0 = _mm_xor_si128(_mm_xor_si128(fold(x0, fold_384), fold(x1, fold_256)),
+					   _mm_xor_si128(fold(x2, fold_128), x3));
+
+	while (len >= 16)
+	{
+		x0 = _mm_xor_si128(fold(x0, fold_128), _mm_loadu_si128((const __m128i *) p));
+		p += 16;
+		len -= 16;
+	}
+
+	/* The folded lane has the same CRC as everything before it */
+	_mm_storeu_si128((__m128i *) lanes, x0);
+	crc = (uint32) _mm_crc32_u64(0, lanes[0]);
+	crc = (uint32) _mm_crc32_u64(crc, lanes[1]);
+
+	return pg_comp_crc32c_sse42(crc, p, len);
+}
+
+#endif   /* USE_SSE42_CRC32C_WITH_RUNTIME_CHECK */
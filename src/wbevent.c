@@ -0,0 +1,80 @@
+#include "wbevent.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "wbutils.h"
+
+static int epollFd = -1;
+
+void
+WbEvInit()
+{
+	if (epollFd >= 0)
+		close(epollFd);
+
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (epollFd < 0)
+		error("Could not create epoll set: %s", strerror(errno));
+}
+
+static void
+WbEvControl(int op, int fd, uint32 events, void *ptr)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = ptr;
+
+	if (epoll_ctl(epollFd, op, fd, &ev) == 0)
+		return;
+
+	/*
+	 * libpq may replace its socket behind our back, the kernel drops closed
+	 * sockets from the set and the number can be reused by the new one.
+	 */
+	if (op == EPOLL_CTL_ADD && errno == EEXIST)
+		op = EPOLL_CTL_MOD;
+	else if (op == EPOLL_CTL_MOD && errno == ENOENT)
+		op = EPOLL_CTL_ADD;
+	else
+		error("epoll_ctl failed for socket %d: %s", fd, strerror(errno));
+
+	if (epoll_ctl(epollFd, op, fd, &ev))
+		error("epoll_ctl failed for socket %d: %s", fd, strerror(errno));
+}
+
+void
+WbEvAdd(int fd, uint32 events, void *ptr)
+{
+	WbEvControl(EPOLL_CTL_ADD, fd, events, ptr);
+}
+
+void
+WbEvModify(int fd, uint32 events, void *ptr)
+{
+	WbEvControl(EPOLL_CTL_MOD, fd, events, ptr);
+}
+
+void
+WbEvDelete(int fd)
+{
+	/* The socket may already be closed, nothing to do then */
+	epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+int
+WbEvWait(struct epoll_event *events, int maxevents, int timeout)
+{
+	int n = epoll_wait(epollFd, events, maxevents, timeout);
+
+	if (n < 0)
+	{
+		if (errno != EINTR)
+			error("epoll_wait failed: %s", strerror(errno));
+		return 0;
+	}
+	return n;
+}
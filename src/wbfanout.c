@@ -0,0 +1,731 @@
+#include "wbfanout.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wbclientconn.h"
+#include "wbconfig.h"
+#include "wbpgtypes.h"
+#include "wbsignals.h"
+#include "wbutils.h"
+#include "wbwalcache.h"
+
+#define FANOUT_NAPTIME 1000
+#define FANOUT_RESTART_INTERVAL 5
+#define FANOUT_READ_CHUNK (XLOG_BLCKSZ * 16)
+#define FANOUT_MAX_GUCS 16
+#define FANOUT_GUC_NAME_LEN 64
+#define FANOUT_GUC_VALUE_LEN 256
+
+typedef struct {
+	char name[FANOUT_GUC_NAME_LEN];
+	char value[FANOUT_GUC_VALUE_LEN];
+} FanoutGuc;
+
+/*
+ * Per standby status, written by the session and aggregated by the receiver
+ * into the replies sent to the master.
+ */
+typedef struct {
+	pid_t pid;
+	bool waiting;
+	XLogRecPtr flushPtr;
+	XLogRecPtr applyPtr;
+	TransactionId xmin;
+	uint32 epoch;
+} FanoutSlot;
+
+/*
+ * The ring buffer is addressed by LSN, byte at position p lives at
+ * buffer[p % bufferSize]. There is one writer, the receiver. It advances
+ * startPtr before overwriting old data and writePtr after new data is in
+ * place, readers verify after copying that their data was not overwritten
+ * in the meantime.
+ */
+typedef struct {
+	pid_t receiverPid;
+	bool ready;
+	uint32 generation;
+
+	char sysid[32];
+	TimeLineID tli;
+
+	/* The previous timeline ended at switchPtr */
+	TimeLineID prevTli;
+	XLogRecPtr switchPtr;
+
+	XLogRecPtr startPtr;
+	XLogRecPtr writePtr;
+
+	XLogRecPtr walEnd;
+	TimestampTz sendTime;
+	uint32 keepaliveCount;
+	bool replyRequested;
+
+	int nGucs;
+	FanoutGuc gucs[FANOUT_MAX_GUCS];
+
+	FanoutSlot slots[FANOUT_MAX_READERS];
+
+	uint64 bufferSize;
+	char buffer[1];
+} FanoutShmem;
+
+struct WbFanoutReader {
+	FanoutSlot *slot;
+	TimeLineID tli;
+	uint32 generation;
+	XLogRecPtr cursor;
+	uint32 keepaliveCount;
+	char *buf;
+};
+
+static FanoutShmem *shm = NULL;
+static time_t lastReceiverStart = 0;
+
+#define atomic_read(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define atomic_write(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+#define memory_barrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+static void FanoutCaptureGucs(MasterConn *master);
+static void FanoutWrite(XLogRecPtr dataStart, char *data, int len);
+static void FanoutKeepalive(ReplMessage *msg);
+static void FanoutWakeReaders();
+static void FanoutSendStatus(MasterConn *master, bool force);
+static bool FanoutAvailable(WbFanoutReader *reader, XLogRecPtr *end, bool *timelineEnded);
+
+void
+WbFoInitShmem()
+{
+	uint64 bufferSize = (uint64) CurrentConfig->fanout.buffer_size * 1024 * 1024;
+	size_t size = offsetof(FanoutShmem, buffer) + bufferSize;
+
+	shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shm == MAP_FAILED)
+		error("Could not allocate %lu bytes of shared memory for fan-out buffer", size);
+
+	/* Anonymous mappings are zeroed */
+	shm->bufferSize = bufferSize;
+
+	log_info("Fan-out enabled with %dMB WAL buffer", CurrentConfig->fanout.buffer_size);
+}
+
+bool
+WbFoEnabled()
+{
+	return shm != NULL;
+}
+
+bool
+WbFoNeedsReceiver()
+{
+	if (!shm || shm->receiverPid)
+		return false;
+
+	return time(NULL) - lastReceiverStart >= FANOUT_RESTART_INTERVAL;
+}
+
+void
+WbFoSetReceiverPid(pid_t pid)
+{
+	shm->receiverPid = pid;
+	lastReceiverStart = time(NULL);
+}
+
+/*
+ * Clean up after an exited child process. Returns true if the process was
+ * the fan-out receiver.
+ */
+bool
+WbFoProcessExited(pid_t pid)
+{
+	int i;
+
+	if (!shm)
+		return false;
+
+	for (i = 0; i < FANOUT_MAX_READERS; i++)
+		if (shm->slots[i].pid == pid)
+			atomic_write(&(shm->slots[i].pid), 0);
+
+	if (shm->receiverPid == pid)
+	{
+		shm->receiverPid = 0;
+		return true;
+	}
+	return false;
+}
+
+void
+WbFoReceiverMain()
+{
+	MasterConn *master;
+	ReplMessage msg;
+	char conninfo[MAX_CONNINFO_LEN+1];
+	char *primary_sysid;
+	char *primary_tli;
+	char *primary_xpos;
+	TimeLineID tli;
+	XLogRecPtr xpos;
+	XLogRecPtr startPos;
+
+	WbInitLatch();
+	shm->receiverPid = getpid();
+
+	WbMcBuildConninfo(conninfo, sizeof(conninfo), CurrentConfig->master.host,
+			CurrentConfig->master.port, CurrentConfig->fanout.user, true);
+
+	log_info("Fan-out receiver connecting to %s", conninfo);
+	master = WbMcOpenConnection(conninfo);
+
+	FanoutCaptureGucs(master);
+
+	WbMcIdentifySystem(master, &primary_sysid, &primary_tli, &primary_xpos);
+	WbWcSetSystem(primary_sysid);
+	tli = ensure_atoi(primary_tli);
+	if (!parse_recptr(primary_xpos, &xpos))
+		error("Invalid xlog position %s from master", primary_xpos);
+
+	if (shm->ready && shm->tli == tli &&
+			shm->writePtr <= xpos && strcmp(shm->sysid, primary_sysid) == 0)
+	{
+		/* A previous receiver died, continue where it left off */
+		startPos = shm->writePtr;
+	}
+	else
+	{
+		/* Start at a segment boundary, that is where standbys ask for WAL */
+		startPos = xpos - (xpos % XLogSegSize);
+
+		atomic_write(&(shm->ready), false);
+		atomic_write(&(shm->generation), shm->generation + 2);
+		strncpy(shm->sysid, primary_sysid, sizeof(shm->sysid) - 1);
+		shm->tli = tli;
+		shm->prevTli = 0;
+		shm->switchPtr = 0;
+		atomic_write(&(shm->startPtr), startPos);
+		atomic_write(&(shm->writePtr), startPos);
+		FanoutWakeReaders();
+	}
+	atomic_write(&(shm->ready), true);
+
+	wbfree(primary_sysid);
+	wbfree(primary_tli);
+	wbfree(primary_xpos);
+
+	for (;;)
+	{
+		bool endofwal = false;
+		TimeLineID nextTli;
+		char *nextTliStart;
+		XLogRecPtr switchPtr;
+
+		if (!WbMcStartStreaming(master, startPos, tli))
+			error("Master did not start streaming at %X/%X on timeline %u",
+					FormatRecPtr(startPos), tli);
+
+		while (!endofwal)
+		{
+			struct pollfd fds[2];
+			int wait;
+
+			if (!DaemonIsAlive())
+				error("Master died, exiting!");
+
+			/* Also pushes out status messages queued in the last round */
+			wait = WbMcWaitEvents(master);
+			fds[0].fd = WbMcGetSocket(master);
+			fds[0].events = POLLERR | ((wait & MC_WAIT_READ) ? POLLIN : 0) |
+					((wait & MC_WAIT_WRITE) ? POLLOUT : 0);
+			fds[0].revents = 0;
+			fds[1].fd = WbLatchGetSocket();
+			fds[1].events = POLLIN;
+			fds[1].revents = 0;
+
+			if (fds[0].fd == -1)
+				error("Master socket has been closed");
+
+			if (poll(fds, 2, FANOUT_NAPTIME) < 0 && errno != EINTR)
+				error("poll failed in fan-out receiver");
+
+			WbResetLatch();
+
+			while (!endofwal && WbMcReceiveWalMessage(master, &msg))
+			{
+				switch (msg.type)
+				{
+					case MSG_WAL_DATA:
+						FanoutWrite(msg.dataStart, msg.data, msg.dataLen);
+						WbWcWrite(0, tli, msg.dataStart, msg.data, msg.dataLen);
+						break;
+					case MSG_KEEPALIVE:
+						FanoutKeepalive(&msg);
+						if (msg.replyRequested)
+							FanoutSendStatus(master, true);
+						break;
+					case MSG_END_OF_WAL:
+						endofwal = true;
+						break;
+					case MSG_NOTHING:
+						break;
+				}
+			}
+
+			FanoutSendStatus(master, false);
+		}
+
+		WbMcEndStreaming(master, &nextTli, &nextTliStart);
+		if (!nextTli || !nextTliStart)
+			error("Master ended streaming without a next timeline");
+		if (!parse_recptr(nextTliStart, &switchPtr))
+			error("Invalid timeline switch position %s", nextTliStart);
+		wbfree(nextTliStart);
+
+		log_info("Fan-out receiver switching to timeline %u at %X/%X",
+				nextTli, FormatRecPtr(switchPtr));
+
+		if (switchPtr != shm->writePtr)
+		{
+			/* Can't continue the buffer, start over */
+			atomic_write(&(shm->generation), shm->generation + 2);
+			atomic_write(&(shm->startPtr), switchPtr);
+			atomic_write(&(shm->writePtr), switchPtr);
+		}
+		else
+		{
+			shm->prevTli = shm->tli;
+			shm->switchPtr = switchPtr;
+			atomic_write(&(shm->generation), shm->generation + 1);
+		}
+		shm->tli = nextTli;
+		FanoutWakeReaders();
+
+		startPos = switchPtr;
+		tli = nextTli;
+	}
+}
+
+static void
+FanoutCaptureGucs(MasterConn *master)
+{
+	const char * const *name;
+
+	shm->nGucs = 0;
+	for (name = WbReportedGucs; *name && shm->nGucs < FANOUT_MAX_GUCS; name++)
+	{
+		const char *value = WbMcParameterStatus(master, (char*) *name);
+		FanoutGuc *guc;
+
+		if (!value)
+			continue;
+
+		guc = &(shm->gucs[shm->nGucs++]);
+		strncpy(guc->name, *name, FANOUT_GUC_NAME_LEN - 1);
+		strncpy(guc->value, value, FANOUT_GUC_VALUE_LEN - 1);
+	}
+}
+
+static void
+FanoutWrite(XLogRecPtr dataStart, char *data, int len)
+{
+	XLogRecPtr writePtr = shm->writePtr;
+	XLogRecPtr newEnd = dataStart + len;
+	uint64 offset;
+	uint64 firstPart;
+
+	if (dataStart != writePtr)
+	{
+		log_warning("Fan-out received discontiguous WAL at %X/%X, expected %X/%X",
+				FormatRecPtr(dataStart), FormatRecPtr(writePtr));
+		atomic_write(&(shm->generation), shm->generation + 2);
+		atomic_write(&(shm->startPtr), dataStart);
+		writePtr = dataStart;
+	}
+
+	if ((uint64) len > shm->bufferSize)
+	{
+		data += len - shm->bufferSize;
+		dataStart = newEnd - shm->bufferSize;
+		len = shm->bufferSize;
+	}
+
+	/* Invalidate the part we are about to overwrite before touching it */
+	if (newEnd - shm->startPtr > shm->bufferSize)
+	{
+		atomic_write(&(shm->startPtr), newEnd - shm->bufferSize);
+		memory_barrier();
+	}
+
+	offset = dataStart % shm->bufferSize;
+	firstPart = shm->bufferSize - offset;
+	if (firstPart >= (uint64) len)
+		memcpy(shm->buffer + offset, data, len);
+	else
+	{
+		memcpy(shm->buffer + offset, data, firstPart);
+		memcpy(shm->buffer, data + firstPart, len - firstPart);
+	}
+
+	atomic_write(&(shm->writePtr), newEnd);
+	FanoutWakeReaders();
+}
+
+static void
+FanoutKeepalive(ReplMessage *msg)
+{
+	atomic_write(&(shm->walEnd), msg->walEnd);
+	atomic_write(&(shm->sendTime), msg->sendTime);
+	atomic_write(&(shm->replyRequested), msg->replyRequested);
+	atomic_write(&(shm->keepaliveCount), shm->keepaliveCount + 1);
+	FanoutWakeReaders();
+}
+
+static void
+FanoutWakeReaders()
+{
+	int i;
+
+	memory_barrier();
+
+	for (i = 0; i < FANOUT_MAX_READERS; i++)
+	{
+		FanoutSlot *slot = &(shm->slots[i]);
+		pid_t pid = atomic_read(&(slot->pid));
+
+		if (pid && __atomic_exchange_n(&(slot->waiting), false, __ATOMIC_SEQ_CST))
+			WbSetLatch(pid);
+	}
+}
+
+/*
+ * Send the master the most conservative status of all attached standbys.
+ */
+static void
+FanoutSendStatus(MasterConn *master, bool force)
+{
+	static StandbyReplyMessage lastReply;
+	static HSFeedbackMessage lastFeedback;
+	static TimestampTz lastSend = 0;
+	StandbyReplyMessage reply;
+	HSFeedbackMessage feedback;
+	TimestampTz now = GetCurrentTimestamp();
+	TimestampTz interval = (TimestampTz) CurrentConfig->status_interval * 1000000;
+	int i;
+
+	memset(&reply, 0, sizeof(reply));
+	memset(&feedback, 0, sizeof(feedback));
+
+	for (i = 0; i < FANOUT_MAX_READERS; i++)
+	{
+		FanoutSlot *slot = &(shm->slots[i]);
+		XLogRecPtr flushPtr;
+		XLogRecPtr applyPtr;
+		TransactionId xmin;
+
+		if (!atomic_read(&(slot->pid)))
+			continue;
+
+		flushPtr = atomic_read(&(slot->flushPtr));
+		applyPtr = atomic_read(&(slot->applyPtr));
+		xmin = atomic_read(&(slot->xmin));
+
+		if (flushPtr && (!reply.flushPtr || flushPtr < reply.flushPtr))
+			reply.flushPtr = flushPtr;
+		if (applyPtr && (!reply.applyPtr || applyPtr < reply.applyPtr))
+			reply.applyPtr = applyPtr;
+		if (xmin && (!feedback.xmin || (int32) (xmin - feedback.xmin) < 0))
+		{
+			feedback.xmin = xmin;
+			feedback.epoch = atomic_read(&(slot->epoch));
+		}
+	}
+	reply.writePtr = shm->writePtr;
+
+	if (!force && now - lastSend < interval &&
+			reply.writePtr == lastReply.writePtr &&
+			reply.flushPtr == lastReply.flushPtr &&
+			reply.applyPtr == lastReply.applyPtr &&
+			feedback.xmin == lastFeedback.xmin)
+		return;
+
+	reply.sendTime = now;
+	WbMcSendReply(master, &reply, force, false);
+
+	if (feedback.xmin != lastFeedback.xmin || now - lastSend >= interval)
+	{
+		feedback.sendTime = now;
+		WbMcSendFeedback(master, &feedback);
+	}
+
+	lastReply = reply;
+	lastFeedback = feedback;
+	lastSend = now;
+}
+
+bool
+WbFoIsReady()
+{
+	return shm && atomic_read(&(shm->ready));
+}
+
+bool
+WbFoIdentifySystem(char** sysid, char** tli, char** xpos)
+{
+	char buf[32];
+
+	if (!WbFoIsReady())
+		return false;
+
+	*sysid = wbstrdup(shm->sysid);
+	snprintf(buf, sizeof(buf), "%u", shm->tli);
+	*tli = wbstrdup(buf);
+	snprintf(buf, sizeof(buf), "%X/%X", FormatRecPtr(atomic_read(&(shm->writePtr))));
+	*xpos = wbstrdup(buf);
+	return true;
+}
+
+const char *
+WbFoParameterStatus(const char *name)
+{
+	int i;
+
+	for (i = 0; i < shm->nGucs; i++)
+		if (strcmp(shm->gucs[i].name, name) == 0)
+			return shm->gucs[i].value;
+	return NULL;
+}
+
+/*
+ * Attach to the shared WAL buffer if it can serve the requested start
+ * position. Returns NULL if the caller needs to stream from the master
+ * itself.
+ */
+WbFanoutReader*
+WbFoAttach(XLogRecPtr startPos, TimeLineID tli)
+{
+	WbFanoutReader *reader;
+	FanoutSlot *slot = NULL;
+	uint32 generation;
+	XLogRecPtr startPtr, writePtr;
+	int i;
+
+	if (!WbFoIsReady())
+		return NULL;
+
+	generation = atomic_read(&(shm->generation));
+	startPtr = atomic_read(&(shm->startPtr));
+	writePtr = atomic_read(&(shm->writePtr));
+
+	if (startPos < startPtr || startPos > writePtr)
+	{
+		log_debug1("Fan-out buffer holds %X/%X - %X/%X, can't serve %X/%X",
+				FormatRecPtr(startPtr), FormatRecPtr(writePtr), FormatRecPtr(startPos));
+		return NULL;
+	}
+
+	if (tli == 0 || tli == shm->tli)
+		tli = shm->tli;
+	else if (tli == shm->prevTli && startPos <= shm->switchPtr)
+		generation--;
+	else
+		return NULL;
+
+	for (i = 0; i < FANOUT_MAX_READERS; i++)
+	{
+		pid_t expected = 0;
+		if (__atomic_compare_exchange_n(&(shm->slots[i].pid), &expected, getpid(),
+				false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		{
+			slot = &(shm->slots[i]);
+			break;
+		}
+	}
+	if (!slot)
+	{
+		log_warning("All %d fan-out reader slots are in use", FANOUT_MAX_READERS);
+		return NULL;
+	}
+
+	slot->waiting = false;
+	slot->flushPtr = 0;
+	slot->applyPtr = 0;
+	slot->xmin = 0;
+	slot->epoch = 0;
+
+	reader = wballoc0(sizeof(WbFanoutReader));
+	reader->slot = slot;
+	reader->tli = tli;
+	reader->generation = generation;
+	reader->cursor = startPos;
+	reader->keepaliveCount = atomic_read(&(shm->keepaliveCount));
+	reader->buf = wballoc(FANOUT_READ_CHUNK);
+
+	return reader;
+}
+
+void
+WbFoDetach(WbFanoutReader *reader)
+{
+	atomic_write(&(reader->slot->pid), 0);
+	wbfree(reader->buf);
+	wbfree(reader);
+}
+
+bool
+WbFoRestartAt(WbFanoutReader *reader, XLogRecPtr pos)
+{
+	if (pos < atomic_read(&(shm->startPtr)))
+		return false;
+
+	reader->cursor = pos;
+	return true;
+}
+
+static bool
+FanoutAvailable(WbFanoutReader *reader, XLogRecPtr *end, bool *timelineEnded)
+{
+	uint32 generation = atomic_read(&(shm->generation));
+
+	if (generation == reader->generation)
+	{
+		*end = atomic_read(&(shm->writePtr));
+		*timelineEnded = false;
+	}
+	else if (generation == reader->generation + 1 && reader->tli == shm->prevTli)
+	{
+		*end = shm->switchPtr;
+		*timelineEnded = true;
+	}
+	else
+		error("Fan-out WAL stream was restarted, disconnecting standby");
+
+	return reader->cursor < *end || *timelineEnded ||
+			atomic_read(&(shm->keepaliveCount)) != reader->keepaliveCount;
+}
+
+/*
+ * Fetch the next message for the reader. If nothing is available we ask the
+ * receiver to set our latch, the event loop resets the latch before running
+ * the readers it woke up.
+ */
+bool
+WbFoReceiveWalMessage(WbFanoutReader *reader, ReplMessage *msg)
+{
+	XLogRecPtr end;
+	bool timelineEnded;
+	int len;
+
+	if (!FanoutAvailable(reader, &end, &timelineEnded))
+	{
+		/* Ask the receiver to wake us up, then check again for a race */
+		atomic_write(&(reader->slot->waiting), true);
+		memory_barrier();
+		if (!FanoutAvailable(reader, &end, &timelineEnded))
+		{
+			msg->type = MSG_NOTHING;
+			return false;
+		}
+		atomic_write(&(reader->slot->waiting), false);
+	}
+
+	if (reader->cursor < end)
+	{
+		XLogRecPtr startPtr;
+		uint64 offset;
+		uint64 firstPart;
+
+		if (end - reader->cursor > FANOUT_READ_CHUNK)
+		{
+			/* Don't split page headers between messages */
+			XLogRecPtr chunkEnd = reader->cursor + FANOUT_READ_CHUNK;
+			len = chunkEnd - (chunkEnd % XLOG_BLCKSZ) - reader->cursor;
+		}
+		else
+			len = end - reader->cursor;
+
+		offset = reader->cursor % shm->bufferSize;
+		firstPart = shm->bufferSize - offset;
+		if (firstPart >= (uint64) len)
+			memcpy(reader->buf, shm->buffer + offset, len);
+		else
+		{
+			memcpy(reader->buf, shm->buffer + offset, firstPart);
+			memcpy(reader->buf + firstPart, shm->buffer, len - firstPart);
+		}
+
+		memory_barrier();
+		startPtr = atomic_read(&(shm->startPtr));
+		if (reader->cursor < startPtr)
+			error("Standby fell behind the fan-out buffer at %X/%X, buffer starts at %X/%X",
+					FormatRecPtr(reader->cursor), FormatRecPtr(startPtr));
+
+		msg->type = MSG_WAL_DATA;
+		msg->dataStart = reader->cursor;
+		msg->walEnd = timelineEnded ? end : atomic_read(&(shm->writePtr));
+		msg->sendTime = atomic_read(&(shm->sendTime));
+		msg->replyRequested = false;
+		msg->dataPtr = 0;
+		msg->dataLen = len;
+		msg->data = reader->buf;
+		msg->nextPageBoundary = (XLOG_BLCKSZ - msg->dataStart) & (XLOG_BLCKSZ-1);
+
+		reader->cursor += len;
+
+		log_debug1("Read %u byte WAL block from fan-out buffer. dataStart: %X/%X walEnd: %X/%X",
+				len, FormatRecPtr(msg->dataStart), FormatRecPtr(msg->walEnd));
+	}
+	else if (timelineEnded)
+	{
+		msg->type = MSG_END_OF_WAL;
+	}
+	else
+	{
+		reader->keepaliveCount = atomic_read(&(shm->keepaliveCount));
+		msg->type = MSG_KEEPALIVE;
+		msg->walEnd = atomic_read(&(shm->walEnd));
+		msg->sendTime = atomic_read(&(shm->sendTime));
+		msg->replyRequested = atomic_read(&(shm->replyRequested));
+	}
+
+	return true;
+}
+
+void
+WbFoEndStreaming(WbFanoutReader *reader, TimeLineID *nextTli, char** nextTliStart)
+{
+	char buf[32];
+
+	if (atomic_read(&(shm->generation)) == reader->generation + 1 &&
+			reader->tli == shm->prevTli)
+	{
+		*nextTli = shm->tli;
+		snprintf(buf, sizeof(buf), "%X/%X", FormatRecPtr(shm->switchPtr));
+		*nextTliStart = wbstrdup(buf);
+		log_info("Ended fan-out streaming, next TLI %u, start pos %s", *nextTli, *nextTliStart);
+	}
+	else
+	{
+		*nextTli = 0;
+		*nextTliStart = NULL;
+	}
+}
+
+void
+WbFoSendReply(WbFanoutReader *reader, StandbyReplyMessage *reply)
+{
+	atomic_write(&(reader->slot->flushPtr), reply->flushPtr);
+	atomic_write(&(reader->slot->applyPtr), reply->applyPtr);
+	WbSetLatch(shm->receiverPid);
+}
+
+void
+WbFoSendFeedback(WbFanoutReader *reader, HSFeedbackMessage *feedback)
+{
+	atomic_write(&(reader->slot->epoch), feedback->epoch);
+	atomic_write(&(reader->slot->xmin), feedback->xmin);
+	WbSetLatch(shm->receiverPid);
+}
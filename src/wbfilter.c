@@ -1,7 +1,11 @@
 #include "wbfilter.h"
 
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <string.h>
 
+#include "wbconfig.h"
 #include "wbpgtypes.h"
 #include "wbutils.h"
 #include "wbcrc32c.h"
@@ -16,11 +20,48 @@ static void ReplMessageZero(FilterData *fl, ReplMessage *msg, int amount);
 static void ReplMessageAlign(ReplMessage *msg);
 static int ReplDataRemainingInSegment(ReplMessage *msg);
 static void WriteNoopRecord(FilterData *fl, ReplMessage *msg);
+static void WriteToStream(FilterData *fl, ReplMessage *msg, int pos, char *data, int len);
 static void FilterClearBuffer(FilterData *fl);
-static bool NeedToFilter(FilterData *fl, RelFileNode *node);
+static bool NeedToFilter(FilterData *fl, FilterDecision *last, RelFileNode *node);
 static void FilterBufferRecordHeader(FilterData* fl, ReplMessage* msg);
+static bool FilterParseRecordInPlace(FilterData *fl, ReplMessage *msg, int amountAvailable);
+static int ParseRecordHeaders(FilterData *fl, FilterDecision *last, char *start, int amountAvailable, bool *filter);
+static void FilterBufferBlockLocation(FilterData *fl);
+static void FilterRecord(FilterData *fl, ReplMessage *msg, bool filter);
+static void WbFClearFilterSets(FilterData* fl);
+static bool NeedToFilterUncached(FilterData *fl, RelFileNode *node);
 static pg_crc32c CalculateCRC32(char *buffer, int len, int total_len);
 static void InjectDummyDataHeaderLongAfterRecordHeader(XLogRecord *rec);
+static bool FilterPoolReady();
+static void* FilterPoolThread(void *arg);
+static void FilterPagesParallel(FilterData *fl, ReplMessage *msg);
+static void FilterPrepassPart(int part);
+static void FilterPrepassPage(FilterData *fl, FilterDecision *last, char *data, int len, XLogRecPtr pageAddr);
+static int FilterPrepassRecordEnd(char *data, int len, int pos, uint32 totLen);
+static void FilterPrepassNoop(char *data, int pos, int end);
+
+/*
+ * Threads helping with the prepass of large messages, started in each
+ * process on first use. The calling thread does a share of the work too.
+ */
+static struct {
+	int nthreads;			/* including the calling thread, 0 until started */
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	uint32 generation;
+	int running;
+
+	/* The batch being worked on, whole pages starting at data */
+	FilterData *fl;
+	char *data;
+	int len;
+	int npages;
+	XLogRecPtr pageAddr;
+} FilterPool = { 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/* Smaller messages are not worth waking up the threads for */
+#define FL_PARALLEL_MIN_PAGES 4
 
 FilterData*
 WbFCreateProcessingState(XLogRecPtr startPoint)
@@ -28,6 +69,18 @@ WbFCreateProcessingState(XLogRecPtr startPoint)
 	FilterData *fl;
 	fl = wballoc0(sizeof(FilterData));
 
+	WbFResetProcessingState(fl, startPoint);
+
+	return fl;
+}
+
+/*
+ * Start over at startPoint as if nothing was seen before, keeping the
+ * filtering rules. startPoint needs to be at a page or record boundary.
+ */
+void
+WbFResetProcessingState(FilterData* fl, XLogRecPtr startPoint)
+{
 	fl->state = FS_SYNCHRONIZING;
 	fl->dataNeeded = 0;
 	fl->recordRemaining = 0;
@@ -38,14 +91,55 @@ WbFCreateProcessingState(XLogRecPtr startPoint)
 	fl->headerLen = 0;
 	fl->bufferLen = 0;
 	fl->unsentBufferLen = 0;
-
-	return fl;
+	fl->unsentBuffer = fl->unsentBuffers[0];
 }
 void WbFFreeProcessingState(FilterData* fl)
 {
+	wbfree(fl->include_tablespaces);
+	wbfree(fl->include_databases);
+	wbfree(fl->exclude_tablespaces);
+	wbfree(fl->exclude_databases);
+	WbFClearFilterSets(fl);
 	wbfree(fl);
 }
 
+static void
+WbFClearFilterSets(FilterData* fl)
+{
+	OidSet **sets[] = {
+		&(fl->include_tablespace_set), &(fl->include_database_set),
+		&(fl->exclude_tablespace_set), &(fl->exclude_database_set)
+	};
+	int i;
+
+	for (i = 0; i < sizeof(sets)/sizeof(sets[0]); i++)
+	{
+		if (*sets[i])
+			WbOsFree(*sets[i]);
+		*sets[i] = NULL;
+	}
+	fl->last.valid = false;
+}
+
+/*
+ * Build hash sets out of the resolved OID lists, to be called once the
+ * lists are filled in.
+ */
+void
+WbFCompileFilter(FilterData* fl)
+{
+	WbFClearFilterSets(fl);
+
+	if (fl->include_tablespaces)
+		fl->include_tablespace_set = WbOsCreate(fl->include_tablespaces);
+	if (fl->include_databases)
+		fl->include_database_set = WbOsCreate(fl->include_databases);
+	if (fl->exclude_tablespaces)
+		fl->exclude_tablespace_set = WbOsCreate(fl->exclude_tablespaces);
+	if (fl->exclude_databases)
+		fl->exclude_database_set = WbOsCreate(fl->exclude_databases);
+}
+
 /*#define parse_debug(...) do{\
 	fprintf (stderr, __VA_ARGS__);\
 	fprintf (stderr, "\n");\
@@ -56,6 +150,9 @@ void WbFFreeProcessingState(FilterData* fl)
 bool
 WbFProcessWalDataBlock(ReplMessage* msg, FilterData* fl, XLogRecPtr *retryPos)
 {
+	if (fl->synchronized && msg->dataPtr == 0 && FilterPoolReady())
+		FilterPagesParallel(fl, msg);
+
 	// consume the whole message
 	while (msg->dataPtr < msg->dataLen)
 	{
@@ -106,6 +203,7 @@ WbFProcessWalDataBlock(ReplMessage* msg, FilterData* fl, XLogRecPtr *retryPos)
 			case FS_BUFFER_IMAGE_HEADER:
 			case FS_BUFFER_COMPRESSION_HEADER:
 			case FS_BUFFER_FILENODE:
+			case FS_BUFFER_BLOCK_NUMBER:
 			case FS_COPY_NORMAL:
 			case FS_COPY_ZERO:
 				// We just take note of the header pos to skip over it when
@@ -135,6 +233,8 @@ WbFProcessWalDataBlock(ReplMessage* msg, FilterData* fl, XLogRecPtr *retryPos)
 				// Fall through to the correct handler
 				/* no break */
 			case FS_BUFFER_RECORD:
+				if (fl->bufferLen == 0 && FilterParseRecordInPlace(fl, msg, amountAvailable))
+					break;
 				if (fl->dataNeeded <= amountAvailable)
 					ReplMessageBuffer(fl, msg, fl->dataNeeded);
 				else
@@ -192,19 +292,20 @@ WbFProcessWalDataBlock(ReplMessage* msg, FilterData* fl, XLogRecPtr *retryPos)
 					ReplMessageBuffer(fl, msg, amountAvailable);
 				if (!fl->dataNeeded)
 				{
-					uint8 block_id = *((uint8*) (fl->buffer + REC_HEADER_LEN));
+					uint8 block_id = *((uint8*) (fl->buffer + fl->bufferLen - 1));
 
 					fl->recordRemaining -= 1;
 
 					if (block_id > XLR_MAX_BLOCK_ID)
 					{
-						fl->state = FS_COPY_NORMAL;
-						fl->dataNeeded = fl->recordRemaining;
-						FilterClearBuffer(fl);
-						parse_debug(" - No block references in record, copying %d bytes ", fl->dataNeeded);
+						FilterRecord(fl, msg, false);
+						parse_debug(" - No more block references in record, copying %d bytes ", fl->dataNeeded);
 					}
 					else
 					{
+						if (block_id <= fl->blockId)
+							error("Out of order block reference %d in WAL record", block_id);
+						fl->blockId = block_id;
 						fl->state = FS_BUFFER_BLOCK_HEADER;
 						fl->dataNeeded = SizeOfXLogRecordBlockHeader - 1;
 						parse_debug(" - Buffer block reference header");
@@ -218,15 +319,15 @@ WbFProcessWalDataBlock(ReplMessage* msg, FilterData* fl, XLogRecPtr *retryPos)
 					ReplMessageBuffer(fl, msg, amountAvailable);
 				if (!fl->dataNeeded)
 				{
-					XLogRecordBlockHeader *block = (XLogRecordBlockHeader*) (fl->buffer + REC_HEADER_LEN);
+					XLogRecordBlockHeader *block = (XLogRecordBlockHeader*) (fl->buffer + fl->bufferLen - SizeOfXLogRecordBlockHeader);
 
 					fl->recordRemaining -= SizeOfXLogRecordBlockHeader - 1;
+					fl->forkFlags = block->fork_flags;
+					fl->dataTotal += block->data_length;
 
-					if (block->fork_flags & BKPBLOCK_SAME_REL)
-					{
-						log_error("First block reference has SAME_REL set");
-						exit(1);
-					}
+					if ((block->fork_flags & BKPBLOCK_SAME_REL) &&
+							fl->bufferLen == REC_HEADER_LEN + SizeOfXLogRecordBlockHeader)
+						error("Invalid WAL record, first block reference has SAME_REL set");
 
 					if (block->fork_flags & BKPBLOCK_HAS_IMAGE)
 					{
@@ -235,12 +336,7 @@ WbFProcessWalDataBlock(ReplMessage* msg, FilterData* fl, XLogRecPtr *retryPos)
 						parse_debug(" - Block header has image header, buffering %d", fl->dataNeeded);
 					}
 					else
-					{
-						fl->state = FS_BUFFER_FILENODE;
-						fl->dataNeeded = sizeof(RelFileNode);
-						parse_debug(" - Block reference, buffering %d bytes for filenode", fl->dataNeeded);
-					}
-
+						FilterBufferBlockLocation(fl);
 				}
 				break;
 			case FS_BUFFER_IMAGE_HEADER:
@@ -254,19 +350,16 @@ WbFProcessWalDataBlock(ReplMessage* msg, FilterData* fl, XLogRecPtr *retryPos)
 					bool has_compr_header = (imghdr->bimg_info & BKPIMAGE_HAS_HOLE) && (imghdr->bimg_info & BKPIMAGE_IS_COMPRESSED);
 
 					fl->recordRemaining -= SizeOfXLogRecordBlockImageHeader;
+					fl->dataTotal += imghdr->length;
 
 					if (has_compr_header)
 					{
 						fl->state = FS_BUFFER_COMPRESSION_HEADER;
 						fl->dataNeeded = SizeOfXLogRecordBlockCompressHeader;
-						parse_debug(" - FPI, buffering %d bytes for filenode", fl->dataNeeded);
+						parse_debug(" - FPI, buffering %d bytes for compression header", fl->dataNeeded);
 					}
 					else
-					{
-						fl->state = FS_BUFFER_FILENODE;
-						fl->dataNeeded = sizeof(RelFileNode);
-						parse_debug(" - Block reference, buffering %d bytes for filenode", fl->dataNeeded);
-					}
+						FilterBufferBlockLocation(fl);
 				}
 				break;
 			case FS_BUFFER_COMPRESSION_HEADER:
@@ -277,9 +370,7 @@ WbFProcessWalDataBlock(ReplMessage* msg, FilterData* fl, XLogRecPtr *retryPos)
 				if (!fl->dataNeeded)
 				{
 					fl->recordRemaining -= SizeOfXLogRecordBlockCompressHeader;
-					fl->state = FS_BUFFER_FILENODE;
-					fl->dataNeeded = sizeof(RelFileNode);
-					parse_debug(" - Block reference, buffering %d bytes for filenode", fl->dataNeeded);
+					FilterBufferBlockLocation(fl);
 				}
 				break;
 			case FS_BUFFER_FILENODE:
@@ -291,22 +382,40 @@ WbFProcessWalDataBlock(ReplMessage* msg, FilterData* fl, XLogRecPtr *retryPos)
 				{
 					parse_debug(" - Filenode buffered at %d", msg->dataPtr);
 					fl->recordRemaining -= sizeof(RelFileNode);
-					if (NeedToFilter(fl,
+					if (NeedToFilter(fl, &(fl->last),
 							(RelFileNode*) (fl->buffer + fl->bufferLen - sizeof(RelFileNode))))
 					{
-						WriteNoopRecord(fl, msg);
-						fl->state = FS_COPY_ZERO;
-						FilterClearBuffer(fl);
-						parse_debug(" - Filter record");
+						/* One excluded block is enough, the rest is zeroed */
+						FilterRecord(fl, msg, true);
+						parse_debug(" - Filter record, zeroing %d bytes", fl->dataNeeded);
 					}
 					else
 					{
-						fl->state = FS_COPY_NORMAL;
-						FilterClearBuffer(fl);
-						parse_debug(" - Passthrough record");
+						fl->state = FS_BUFFER_BLOCK_NUMBER;
+						fl->dataNeeded = sizeof(BlockNumber);
+					}
+				}
+				break;
+			case FS_BUFFER_BLOCK_NUMBER:
+				if (fl->dataNeeded <= amountAvailable)
+					ReplMessageBuffer(fl, msg, fl->dataNeeded);
+				else
+					ReplMessageBuffer(fl, msg, amountAvailable);
+				if (!fl->dataNeeded)
+				{
+					fl->recordRemaining -= sizeof(BlockNumber);
+					if (fl->recordRemaining > fl->dataTotal)
+					{
+						fl->state = FS_BUFFER_BLOCK_ID;
+						fl->dataNeeded = 1;
+						parse_debug(" - Buffer next block ID");
+					}
+					else
+					{
+						/* Only block data follows */
+						FilterRecord(fl, msg, false);
+						parse_debug(" - No more block references in record, copying %d bytes ", fl->dataNeeded);
 					}
-					fl->dataNeeded = fl->recordRemaining;
-					parse_debug(" - Copying %d bytes until next record", fl->dataNeeded);
 				}
 				break;
 			case FS_COPY_NORMAL:
@@ -349,6 +458,100 @@ WbFProcessWalDataBlock(ReplMessage* msg, FilterData* fl, XLogRecPtr *retryPos)
 	return true;
 }
 
+/*
+ * Split off what of a processed block can go out. The end of the block is
+ * held back while a record header is being buffered, it may still need to be
+ * rewritten. Returns false if nothing is to be passed on, either because we
+ * are not synchronized yet or it is before the requested start position.
+ */
+bool
+WbFGetOutput(ReplMessage* msg, FilterData* fl, FilterOutput *out)
+{
+	int msgOffset = 0;
+	int msgEnd;
+	int held = 0;
+	int unsentLen = fl->unsentBufferLen;
+	char *unsent = fl->unsentBuffer;
+
+	if (unsentLen)
+		log_debug2("Sending %d bytes of unbuffered data", unsentLen);
+
+	if (fl->state & FS_BUFFERING_STATE)
+	{
+		// Hold back the stream from where the record starts, page header and
+		// all, it may be in the unsent data already
+		held = msg->dataLen - fl->recordStart;
+		Assert(held <= unsentLen + msg->dataLen && held <= FL_BUFFER_LEN);
+		// Stash it away into the other unsent buffer, we will send it with
+		// the next block
+		fl->unsentBuffer = (unsent == fl->unsentBuffers[0]) ?
+			fl->unsentBuffers[1] : fl->unsentBuffers[0];
+		fl->unsentBufferLen = held;
+		if (fl->recordStart < 0)
+		{
+			memcpy(fl->unsentBuffer, unsent + unsentLen + fl->recordStart, -fl->recordStart);
+			memcpy(fl->unsentBuffer - fl->recordStart, msg->data, msg->dataLen);
+		}
+		else
+			memcpy(fl->unsentBuffer, msg->data + fl->recordStart, held);
+		// Positions in the record are relative to the next block from now on
+		fl->recordStart -= msg->dataLen;
+		fl->headerPos -= msg->dataLen;
+		log_debug2("Buffering %d bytes of data", held);
+
+	} else {
+		// Clear out unsent buffer
+		fl->unsentBufferLen = 0;
+	}
+
+	// Don't send anything if we are not synchronized, we will see this data again after replication restart
+	if (!fl->synchronized)
+	{
+		log_debug2("Skipping sending data.");
+		return false;
+	}
+
+	// Include the previously unsent data
+	out->dataStart = msg->dataStart - unsentLen;
+
+	if (fl->requestedStartPos > out->dataStart) {
+		if (fl->requestedStartPos > (msg->dataStart + msg->dataLen))
+		{
+			log_info("Skipping whole WAL message as not requested");
+			return false;
+		}
+		msgOffset = fl->requestedStartPos - out->dataStart;
+		out->dataStart = fl->requestedStartPos;
+		Assert(msgOffset < (msg->dataLen + unsentLen));
+		log_debug2("Chomping WAL message down to size at %d", msgOffset);
+	}
+
+	out->nparts = 0;
+	if (msgOffset < unsentLen) {
+		// What is held back may start in the unsent data
+		int unsentEnd = held > msg->dataLen ? unsentLen + msg->dataLen - held : unsentLen;
+
+		log_debug2("Sending unsent data at offset %d, %d bytes", msgOffset, unsentEnd-msgOffset);
+		if (unsentEnd > msgOffset)
+		{
+			out->parts[out->nparts] = unsent + msgOffset;
+			out->partLen[out->nparts++] = unsentEnd - msgOffset;
+		}
+		msgOffset = 0;
+	} else
+		msgOffset -= unsentLen;
+
+	msgEnd = held < msg->dataLen ? msg->dataLen - held : 0;
+	out->parts[out->nparts] = msg->data + msgOffset;
+	out->partLen[out->nparts++] = msgEnd > msgOffset ? msgEnd - msgOffset : 0;
+
+	out->walEnd = msg->walEnd - held;
+	out->dataEnd = msg->dataStart + msg->dataLen - held;
+	if (out->dataEnd < out->dataStart)
+		out->dataEnd = out->dataStart;
+	return true;
+}
+
 static bool
 IsAtWalPageBoundary(ReplMessage *msg)
 {
@@ -416,7 +619,7 @@ CalculateCRC32(char *buffer, int len, int total_len)
     	pg_crc32c crc;
     	INIT_CRC32C(crc);
     	COMP_CRC32C(crc, buffer + SizeOfXLogRecord, len - SizeOfXLogRecord);
-    	COMP_CRC32C_ZERO(crc, buffer + len, total_len - len);
+    	COMP_CRC32C_ZERO(crc, total_len - len);
     	COMP_CRC32C(crc, buffer, offsetof(XLogRecord, xl_crc));
     	FIN_CRC32C(crc);
     	return crc;
@@ -446,41 +649,43 @@ WriteNoopRecord(FilterData *fl, ReplMessage *msg)
                 rec->xl_tot_len, (uint32) ((msg->dataStart + fl->recordStart) >> 32), (uint32) (msg->dataStart + fl->recordStart), rec->xl_crc);
 
 	{
-		// We scribble over data in the message buffer
-		// some of the data may be in the filter unsent buffer.
-
-
-		int targetpos = fl->recordStart;
+		// We scribble over the headers where they are in the stream, the
+		// record may have started in the unsent buffer. Skip over the page
+		// header if there is one among them.
+		int pos = fl->recordStart;
 		int copied = 0;
-		int amount;
-		int toCopy = fl->bufferLen;
 
-		if (targetpos == -1)
+		if (fl->headerLen)
 		{
-			// Rewrite first part in the unsentbuffer
-			amount = fl->unsentBufferLen;
-			memcpy(fl->unsentBuffer, fl->buffer + copied, amount);
-			copied += amount;
-			toCopy -= amount;
-			targetpos = 0;
+			copied = fl->headerPos - pos;
+			if (copied > fl->bufferLen)
+				copied = fl->bufferLen;
+			WriteToStream(fl, msg, pos, fl->buffer, copied);
+			pos = fl->headerPos + fl->headerLen;
 		}
-		// Copy up to next pageheader or to end of buffer
-		amount = fl->headerPos >= 0 ? fl->headerPos - targetpos: toCopy;
-		memcpy(msg->data + targetpos, fl->buffer + copied, amount);
-
-		// Skip over page header in the target buffer
-		toCopy -= amount;
-		copied += amount;
-
-		if (!toCopy)
-			return;
+		WriteToStream(fl, msg, pos, fl->buffer + copied, fl->bufferLen - copied);
+	}
+}
 
-		targetpos += amount + fl->headerLen;
+/*
+ * Write len bytes at pos in the stream, relative to the start of the message.
+ * Negative positions are in the data held back from the previous block.
+ */
+static void
+WriteToStream(FilterData *fl, ReplMessage *msg, int pos, char *data, int len)
+{
+	if (pos < 0)
+	{
+		int amount = len < -pos ? len : -pos;
 
-		// Copy the rest if any
-		amount = toCopy;
-		memcpy(msg->data + targetpos, fl->buffer + copied, amount);
+		Assert(-pos <= fl->unsentBufferLen);
+		memcpy(fl->unsentBuffer + fl->unsentBufferLen + pos, data, amount);
+		data += amount;
+		len -= amount;
+		pos = 0;
 	}
+	Assert(pos + len <= msg->dataLen);
+	memcpy(msg->data + pos, data, len);
 }
 
 static void
@@ -489,43 +694,50 @@ FilterClearBuffer(FilterData *fl)
 	fl->bufferLen = 0;
 }
 
+/*
+ * Consecutive records mostly touch the same relation, so the last decision
+ * is remembered.
+ */
 static bool
-OidInZeroTermOidList(Oid search, Oid *list)
+NeedToFilter(FilterData *fl, FilterDecision *last, RelFileNode *node)
 {
-	Oid *cur = list;
-	for (; *cur; cur++)
-		if (search == *cur)
-			return true;
-	return false;
+	if (!last->valid || node->spcNode != last->spcNode || node->dbNode != last->dbNode)
+	{
+		last->filtered = NeedToFilterUncached(fl, node);
+		last->spcNode = node->spcNode;
+		last->dbNode = node->dbNode;
+		last->valid = true;
+	}
+	return last->filtered;
 }
 
 static bool
-NeedToFilter(FilterData *fl, RelFileNode *node)
+NeedToFilterUncached(FilterData *fl, RelFileNode *node)
 {
     log_debug2("Checking relfilnode with dbNode %d, spcNode %d", node->dbNode, node->spcNode);
-	if (fl->include_tablespaces)
-		if (!OidInZeroTermOidList(node->spcNode, fl->include_tablespaces))
+	if (fl->include_tablespace_set)
+		if (!WbOsContains(fl->include_tablespace_set, node->spcNode))
 		{
 			log_debug2("Data in tablespace %d is not included", node->spcNode);
 			return true;
 		}
 
-	if (fl->exclude_tablespaces)
-		if (OidInZeroTermOidList(node->spcNode, fl->exclude_tablespaces))
+	if (fl->exclude_tablespace_set)
+		if (WbOsContains(fl->exclude_tablespace_set, node->spcNode))
 		{
 			log_debug2("Data in tablespace %d is excluded", node->spcNode);
 			return true;
 		}
 
-	if (fl->include_databases)
-		if (!OidInZeroTermOidList(node->dbNode, fl->include_databases))
+	if (fl->include_database_set)
+		if (!WbOsContains(fl->include_database_set, node->dbNode))
 		{
 			log_debug2("Data in database %d is not included", node->dbNode);
 			return true;
 		}
 
-	if (fl->exclude_databases)
-		if (OidInZeroTermOidList(node->dbNode, fl->exclude_databases))
+	if (fl->exclude_database_set)
+		if (WbOsContains(fl->exclude_database_set, node->dbNode))
 		{
 			log_debug2("Data in database %d is excluded", node->dbNode);
 			return true;
@@ -540,12 +752,170 @@ FilterBufferRecordHeader(FilterData* fl, ReplMessage* msg)
 {
 	fl->state = FS_BUFFER_RECORD;
 	fl->recordStart = msg->dataPtr;
+	fl->blockId = -1;
+	fl->dataTotal = 0;
 	fl->dataNeeded = REC_HEADER_LEN;
 	fl->headerPos = -1;
 	fl->headerLen = 0;
 	fl->bufferLen = 0;
 }
 
+/*
+ * Buffer the rest of a block reference header, the relfilenode unless it is
+ * the same as the previous block's and the block number.
+ */
+static void
+FilterBufferBlockLocation(FilterData *fl)
+{
+	if (fl->forkFlags & BKPBLOCK_SAME_REL)
+	{
+		/* Previous block was let through, so is this one */
+		fl->state = FS_BUFFER_BLOCK_NUMBER;
+		fl->dataNeeded = sizeof(BlockNumber);
+	}
+	else
+	{
+		fl->state = FS_BUFFER_FILENODE;
+		fl->dataNeeded = sizeof(RelFileNode);
+		parse_debug(" - Block reference, buffering %d bytes for filenode", fl->dataNeeded);
+	}
+}
+
+/*
+ * Done with the headers of a record, rewrite it as a NOOP record if needed
+ * and copy out the rest.
+ */
+static void
+FilterRecord(FilterData *fl, ReplMessage *msg, bool filter)
+{
+	if (filter)
+	{
+		WriteNoopRecord(fl, msg);
+		fl->state = FS_COPY_ZERO;
+	}
+	else
+		fl->state = FS_COPY_NORMAL;
+	FilterClearBuffer(fl);
+	fl->dataNeeded = fl->recordRemaining;
+}
+
+/*
+ * Fast path for the common case where the headers of a record and of all its
+ * block references are on the same page and in the same message. They are
+ * decoded where they are instead of being buffered piece by piece. Only a
+ * record that gets filtered has its headers copied into the filter buffer
+ * for rewriting. Returns false if the record has to go through the buffering
+ * states.
+ */
+static bool
+FilterParseRecordInPlace(FilterData *fl, ReplMessage *msg, int amountAvailable)
+{
+	char *start = msg->data + msg->dataPtr;
+	XLogRecord *rec = (XLogRecord*) start;
+	bool filter;
+	int len;
+
+	if (!fl->synchronized)
+		return false;
+
+	len = ParseRecordHeaders(fl, &(fl->last), start, amountAvailable, &filter);
+	if (len < 0)
+		return false;
+	parse_debug(" - Record headers parsed in place, %d bytes", len);
+
+	fl->recordStart = msg->dataPtr;
+	fl->headerPos = -1;
+	fl->headerLen = 0;
+	fl->recordRemaining = rec->xl_tot_len - len;
+	if (filter)
+	{
+		memcpy(fl->buffer, start, len);
+		fl->bufferLen = len;
+	}
+	msg->dataPtr += len;
+	FilterRecord(fl, msg, filter);
+	return true;
+}
+
+/*
+ * Decode the headers of the record at start, of which amountAvailable bytes
+ * are contiguous. Returns the length of the headers up to where the decision
+ * was made, or -1 if the record is unusual or its headers are not all there.
+ */
+static int
+ParseRecordHeaders(FilterData *fl, FilterDecision *last, char *start, int amountAvailable, bool *filter)
+{
+	XLogRecord *rec = (XLogRecord*) start;
+	int len = REC_HEADER_LEN;
+	int lastBlockId = -1;
+	int dataTotal = 0;
+	bool haveRel = false;
+
+	*filter = false;
+
+	if (amountAvailable < len)
+		return -1;
+
+	/* Leave anything unusual to the buffering code */
+	if (rec->xl_tot_len <= len ||
+			(rec->xl_rmid == RM_XLOG_ID && (rec->xl_info & 0xF0) == XLOG_SWITCH))
+		return -1;
+	if (amountAvailable > rec->xl_tot_len)
+		amountAvailable = rec->xl_tot_len;
+
+	while (rec->xl_tot_len - len > dataTotal)
+	{
+		XLogRecordBlockHeader *block = (XLogRecordBlockHeader*) (start + len);
+
+		if (len + 1 > amountAvailable)
+			return -1;
+		if (block->id > XLR_MAX_BLOCK_ID)
+		{
+			len += 1;
+			break;
+		}
+		if (block->id <= lastBlockId)
+			return -1;
+		lastBlockId = block->id;
+
+		len += SizeOfXLogRecordBlockHeader;
+		if (len > amountAvailable)
+			return -1;
+		dataTotal += block->data_length;
+
+		if (block->fork_flags & BKPBLOCK_HAS_IMAGE)
+		{
+			XLogRecordBlockImageHeader *imghdr = (XLogRecordBlockImageHeader*) (start + len);
+
+			len += SizeOfXLogRecordBlockImageHeader;
+			if (len > amountAvailable)
+				return -1;
+			dataTotal += imghdr->length;
+			if ((imghdr->bimg_info & BKPIMAGE_HAS_HOLE) && (imghdr->bimg_info & BKPIMAGE_IS_COMPRESSED))
+				len += SizeOfXLogRecordBlockCompressHeader;
+		}
+
+		if (!(block->fork_flags & BKPBLOCK_SAME_REL))
+		{
+			len += sizeof(RelFileNode);
+			if (len > amountAvailable)
+				return -1;
+			*filter = NeedToFilter(fl, last, (RelFileNode*) (start + len - sizeof(RelFileNode)));
+			haveRel = true;
+		}
+		else if (!haveRel)
+			return -1;
+
+		if (*filter)
+			break;
+
+		len += sizeof(BlockNumber);
+		if (len > amountAvailable)
+			return -1;
+	}
+	return len;
+}
+
 static void
 InjectDummyDataHeaderLongAfterRecordHeader(XLogRecord* rec)
 {
@@ -553,3 +923,207 @@ InjectDummyDataHeaderLongAfterRecordHeader(XLogRecord* rec)
     *((uint8*)(buffer + REC_HEADER_LEN)) = (uint8)XLR_BLOCK_ID_DATA_LONG;
     *((uint32*)(buffer + REC_HEADER_LEN + 1)) = (uint32)(rec->xl_tot_len - REC_HEADER_LEN - SizeOfXLogRecordDataHeaderLong);
 }
+
+static bool
+FilterPoolReady()
+{
+	sigset_t all, old;
+	int i;
+
+	if (CurrentConfig->filter_threads <= 1)
+		return false;
+	if (FilterPool.nthreads)
+		return FilterPool.nthreads > 1;
+
+	/* Signals are for the main thread only */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (i = 1; i < CurrentConfig->filter_threads; i++)
+	{
+		pthread_t thread;
+
+		if (pthread_create(&thread, NULL, FilterPoolThread, (void*) (intptr_t) i) != 0)
+		{
+			log_warning("Could not start filter thread, using %d threads", i);
+			break;
+		}
+		pthread_detach(thread);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	FilterPool.nthreads = i;
+	return FilterPool.nthreads > 1;
+}
+
+static void*
+FilterPoolThread(void *arg)
+{
+	int part = (int) (intptr_t) arg;
+	uint32 seen = 0;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&FilterPool.lock);
+		while (FilterPool.generation == seen)
+			pthread_cond_wait(&FilterPool.start, &FilterPool.lock);
+		seen = FilterPool.generation;
+		pthread_mutex_unlock(&FilterPool.lock);
+
+		FilterPrepassPart(part);
+
+		pthread_mutex_lock(&FilterPool.lock);
+		if (--FilterPool.running == 0)
+			pthread_cond_signal(&FilterPool.done);
+		pthread_mutex_unlock(&FilterPool.lock);
+	}
+	return NULL;
+}
+
+/*
+ * Page headers tell where the first record on a page starts, so records can
+ * be found on each page independently. Before the message goes through the
+ * state machine, the pages are split between threads that decode the records
+ * starting on their pages and rewrite the ones to be filtered as NOOP records
+ * right in the message. The state machine then takes these for what they are
+ * now and deals with everything the threads left alone: records continued
+ * from the previous message or running past the end of this one, and records
+ * whose headers span pages.
+ */
+static void
+FilterPagesParallel(FilterData *fl, ReplMessage *msg)
+{
+	int first = msg->nextPageBoundary;
+
+	if (!fl->include_tablespace_set && !fl->include_database_set &&
+			!fl->exclude_tablespace_set && !fl->exclude_database_set)
+		return;
+	if (msg->dataLen - first < FL_PARALLEL_MIN_PAGES * XLOG_BLCKSZ)
+		return;
+
+	FilterPool.fl = fl;
+	FilterPool.data = msg->data + first;
+	FilterPool.len = msg->dataLen - first;
+	FilterPool.npages = (FilterPool.len + XLOG_BLCKSZ - 1) / XLOG_BLCKSZ;
+	FilterPool.pageAddr = msg->dataStart + first;
+
+	pthread_mutex_lock(&FilterPool.lock);
+	FilterPool.generation++;
+	FilterPool.running = FilterPool.nthreads - 1;
+	pthread_cond_broadcast(&FilterPool.start);
+	pthread_mutex_unlock(&FilterPool.lock);
+
+	FilterPrepassPart(0);
+
+	pthread_mutex_lock(&FilterPool.lock);
+	while (FilterPool.running)
+		pthread_cond_wait(&FilterPool.done, &FilterPool.lock);
+	pthread_mutex_unlock(&FilterPool.lock);
+}
+
+static void
+FilterPrepassPart(int part)
+{
+	int from = FilterPool.npages * part / FilterPool.nthreads;
+	int to = FilterPool.npages * (part + 1) / FilterPool.nthreads;
+	FilterDecision last = { false };
+	int page;
+
+	for (page = from; page < to; page++)
+		FilterPrepassPage(FilterPool.fl, &last,
+				FilterPool.data, FilterPool.len, FilterPool.pageAddr + page * XLOG_BLCKSZ);
+}
+
+/*
+ * Rewrite the records starting on the page at pageAddr that end within the
+ * message. Stops at anything it is not sure about, the state machine will
+ * take care of it. Must not write to anything but bodies of records starting
+ * on this page, other threads are reading the pages after it.
+ */
+static void
+FilterPrepassPage(FilterData *fl, FilterDecision *last, char *data, int len, XLogRecPtr pageAddr)
+{
+	int pageStart = pageAddr - FilterPool.pageAddr;
+	int pageEnd = pageStart + XLOG_BLCKSZ;
+	XLogPageHeader header = (XLogPageHeader) (data + pageStart);
+	int pos;
+
+	if (pageStart + SizeOfXLogLongPHD > len)
+		return;
+	if (header->xlp_magic != XLOG_PAGE_MAGIC || header->xlp_pageaddr != pageAddr)
+		return;
+	if (pageEnd > len)
+		pageEnd = len;
+
+	pos = pageStart + XLogPageHeaderSize(header);
+	if (header->xlp_info & XLP_FIRST_IS_CONTRECORD)
+	{
+		if (header->xlp_rem_len >= pageEnd - pos)
+			return;
+		pos = MAXALIGN(pos + header->xlp_rem_len);
+	}
+
+	while (pos < pageEnd)
+	{
+		XLogRecord *rec = (XLogRecord*) (data + pos);
+		bool filter;
+		int end;
+
+		/* Zeroes past the end of WAL or after a segment switch end up here */
+		if (ParseRecordHeaders(fl, last, data + pos, pageEnd - pos, &filter) < 0)
+			return;
+		end = FilterPrepassRecordEnd(data, len, pos, rec->xl_tot_len);
+		if (end < 0)
+			return;
+		if (filter)
+			FilterPrepassNoop(data, pos, end);
+		pos = MAXALIGN(end);
+	}
+}
+
+/* Offset right after the record at pos, -1 if it doesn't end within len */
+static int
+FilterPrepassRecordEnd(char *data, int len, int pos, uint32 totLen)
+{
+	int pageEnd = pos - pos % XLOG_BLCKSZ + XLOG_BLCKSZ;
+	uint32 remaining = totLen;
+
+	while (remaining > pageEnd - pos)
+	{
+		remaining -= pageEnd - pos;
+		if (pageEnd + SizeOfXLogLongPHD > len)
+			return -1;
+		pos = pageEnd + XLogPageHeaderSize((XLogPageHeader) (data + pageEnd));
+		pageEnd += XLOG_BLCKSZ;
+	}
+	if (pos + remaining > len)
+		return -1;
+	return pos + remaining;
+}
+
+/*
+ * Same as WriteNoopRecord followed by zeroing the rest of the record. The
+ * rewritten headers always fit on the first page, a record with a block
+ * reference to a relation is longer than that.
+ */
+static void
+FilterPrepassNoop(char *data, int pos, int end)
+{
+	XLogRecord *rec = (XLogRecord*) (data + pos);
+	int zeroPos = pos + REC_HEADER_LEN + SizeOfXLogRecordDataHeaderLong;
+
+	rec->xl_info = XLOG_NOOP;
+	rec->xl_rmid = RM_XLOG_ID;
+	InjectDummyDataHeaderLongAfterRecordHeader(rec);
+	rec->xl_crc = CalculateCRC32((char*) rec, REC_HEADER_LEN + SizeOfXLogRecordDataHeaderLong, rec->xl_tot_len);
+
+	while (zeroPos < end)
+	{
+		int pageEnd = zeroPos - zeroPos % XLOG_BLCKSZ + XLOG_BLCKSZ;
+		int amount = (end < pageEnd ? end : pageEnd) - zeroPos;
+
+		memset(data + zeroPos, 0, amount);
+		zeroPos += amount;
+		if (zeroPos < end)
+			zeroPos += XLogPageHeaderSize((XLogPageHeader) (data + zeroPos));
+	}
+}
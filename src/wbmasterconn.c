@@ -1,29 +1,117 @@
 #include "wbmasterconn.h"
 
+#include<arpa/inet.h>
 #include<errno.h>
 #include<poll.h>
 #include<string.h>
+#include<sys/socket.h>
 
+#include "wbcompress.h"
+#include "wbconfig.h"
+#include "wbtls.h"
 #include "wbutils.h"
 #include "wb_pg_config.h"
 
 #include "libpq-fe.h"
 
+#define MC_RECV_BUFFER_INIT_SIZE (256*1024)
+#define MC_SEND_BUFFER_INIT_SIZE 1024
+
 static void WbMcProcessWalsenderMessage(MasterConn *master, ReplMessage *msg);
 static void WbMcSend(MasterConn *master, const char *buffer, int nbytes);
 static int WbMcReceiveWal(MasterConn *master, char **buffer);
+static void McBeginMessage(MasterConn *master, char type, int len);
+static void McAppend(MasterConn *master, const char *data, int len);
+static bool McFlush(MasterConn *master);
+static bool McRead(MasterConn *master, int needed);
+static bool McNextMessage(MasterConn *master, char *type, char **body, int *len);
+static void McErrorResponse(char *body, int len) __attribute__((noreturn));
+static void McParseNextTimeline(MasterConn *master, char *body, int len);
 
+/*
+ * Libpq sets up the connection and runs ordinary commands. From
+ * START_REPLICATION on until the master is ready for the next command we
+ * speak the protocol ourselves on the socket, so that WAL is parsed and
+ * filtered right in our receive buffer. The buffer is reused for the next
+ * messages once the last one handed out is done with. Libpq is idle all the
+ * while and doesn't notice.
+ */
 struct MasterConn {
 	PGconn* conn;
-	char* recvBuf;
+	char* conninfo;
 	XLogRecPtr latestWalEnd;
 	TimestampTz latestSendTime;
+
+	// Nonblocking operation state
+	bool connecting;
+	PostgresPollingStatusType pollStatus;
+	bool queryDone;
+	PGresult *result;
+	bool streaming;
+
+	// Ending streaming
+	bool draining;
+	bool commandComplete;
+	TimeLineID nextTli;
+	char *nextTliStart;
+
+	// Protocol spoken natively, libpq is bypassed
+	bool native;
+	bool copyDoneReceived;
+	char *recvBuffer;
+	int recvBufSize;
+	int recvPointer;
+	int recvLength;
+	char *sendBuffer;
+	int sendBufSize;
+	int sendBufLen;
+	int sendBufFlushPtr;
+
+	// Libpq's SSL connection, if it made one
+	struct ssl_st *ssl;
+
+	// WAL arrives compressed from an upstream walbouncer
+	bool compressed;
+	WbCompressor *decompressor;
 };
 
+/*
+ * Build the connection string for connecting to the master as user, either
+ * for replication or to the postgres database.
+ */
+void
+WbMcBuildConninfo(char *buf, int buflen, const char *host, int port,
+		const char *user, bool replication)
+{
+	char *buf_end = buf + buflen;
+
+	memset(buf, 0, buflen);
+
+	if (host)
+		buf += snprintf(buf, buf_end - buf, "host=%s ", host);
+	if (port)
+		buf += snprintf(buf, buf_end - buf, "port=%d ", port);
+	if (user)
+		buf += snprintf(buf, buf_end - buf, "user=%s ", user);
+	if (CurrentConfig->master.sslmode)
+		buf += snprintf(buf, buf_end - buf, "sslmode=%s ", CurrentConfig->master.sslmode);
+
+	/* Only another walbouncer understands this, PostgreSQL ignores it */
+	if (replication && CurrentConfig->master.compression)
+		buf += snprintf(buf, buf_end - buf, "options='-c %s=%s' ",
+				WB_COMPRESSION_OPTION, CurrentConfig->master.compression);
+
+	if (replication)
+		snprintf(buf, buf_end - buf, "dbname=replication replication=true application_name=walbouncer");
+	else
+		snprintf(buf, buf_end - buf, "dbname=postgres application_name=walbouncer");
+}
+
 MasterConn*
 WbMcOpenConnection(const char *conninfo)
 {
 	MasterConn* master = wballoc0(sizeof(MasterConn));
+	master->conninfo = wbstrdup(conninfo);
 	master->conn = PQconnectdb(conninfo);
 	if (PQstatus(master->conn) != CONNECTION_OK)
 		error(PQerrorMessage(master->conn));
@@ -31,119 +119,432 @@ WbMcOpenConnection(const char *conninfo)
 	return master;
 }
 
+/*
+ * Start establishing a connection without blocking. The caller should wait
+ * for the events returned by WbMcWaitEvents and call WbMcConnectionReady
+ * until it returns true.
+ */
+MasterConn*
+WbMcStartConnection(const char *conninfo)
+{
+	MasterConn* master;
+	PGconn *conn = PQconnectStart(conninfo);
+
+	if (!conn)
+		error("Out of memory while connecting to master");
+	if (PQstatus(conn) == CONNECTION_BAD)
+	{
+		char errmsg[1024];
+		snprintf(errmsg, sizeof(errmsg), "%s", PQerrorMessage(conn));
+		PQfinish(conn);
+		error("Could not connect to master: %s", errmsg);
+	}
+
+	master = wballoc0(sizeof(MasterConn));
+	master->conn = conn;
+	master->conninfo = wbstrdup(conninfo);
+	master->connecting = true;
+	master->pollStatus = PGRES_POLLING_WRITING;
+	return master;
+}
+
+bool
+WbMcConnectionReady(MasterConn *master)
+{
+	struct pollfd pfd;
+
+	if (!master->connecting)
+		return true;
+
+	/* PQconnectPoll must only be called once the socket is ready */
+	pfd.fd = PQsocket(master->conn);
+	pfd.events = master->pollStatus == PGRES_POLLING_READING ? POLLIN : POLLOUT;
+	pfd.revents = 0;
+	if (pfd.fd >= 0 && poll(&pfd, 1, 0) == 0)
+		return false;
+
+	master->pollStatus = PQconnectPoll(master->conn);
+	switch (master->pollStatus)
+	{
+		case PGRES_POLLING_OK:
+			if (PQsetnonblocking(master->conn, 1))
+				error("Could not set master connection to nonblocking mode");
+			master->connecting = false;
+			return true;
+		case PGRES_POLLING_FAILED:
+			error(PQerrorMessage(master->conn));
+		default:
+			return false;
+	}
+}
+
 void
 WbMcCloseConnection(MasterConn *master)
 {
-	if (master->recvBuf)
-		PQfreemem(master->recvBuf);
+	wbfree(master->recvBuffer);
+	wbfree(master->sendBuffer);
+	if (master->decompressor)
+		WbCmFree(master->decompressor);
+	if (master->result)
+		PQclear(master->result);
+	if (master->nextTliStart)
+		wbfree(master->nextTliStart);
+	wbfree(master->conninfo);
 	PQfinish(master->conn);
 	wbfree(master);
 }
 
+const char *
+WbMcGetConninfo(MasterConn *master)
+{
+	return master->conninfo;
+}
+
+/*
+ * True when the connection is established and neither streaming nor running
+ * a command, i.e. ready for the next replication command.
+ */
+bool
+WbMcIsIdle(MasterConn *master)
+{
+	return !master->connecting && !master->streaming && !master->native &&
+			PQstatus(master->conn) == CONNECTION_OK &&
+			PQtransactionStatus(master->conn) == PQTRANS_IDLE;
+}
+
+bool
+WbMcIsStreaming(MasterConn *master)
+{
+	return master->streaming && PQstatus(master->conn) == CONNECTION_OK;
+}
+
+/*
+ * Read whatever the master has sent on an otherwise unused connection.
+ * Returns false if the connection has been lost.
+ */
+bool
+WbMcIsAlive(MasterConn *master)
+{
+	if (master->connecting)
+		return true;
+	if (!PQconsumeInput(master->conn))
+		return false;
+	return PQstatus(master->conn) == CONNECTION_OK;
+}
+
 int
 WbMcGetSocket(MasterConn *master)
 {
 	return PQsocket(master->conn);
 }
 
-bool
-WbMcStartStreaming(MasterConn *master, XLogRecPtr pos, TimeLineID tli)
+/*
+ * Socket events the connection is waiting for, a combination of
+ * MC_WAIT_READ and MC_WAIT_WRITE. Also pushes out any buffered output.
+ */
+int
+WbMcWaitEvents(MasterConn *master)
+{
+	int r;
+
+	if (master->connecting)
+		return master->pollStatus == PGRES_POLLING_READING ? MC_WAIT_READ : MC_WAIT_WRITE;
+	if (master->native)
+		return MC_WAIT_READ | (McFlush(master) ? 0 : MC_WAIT_WRITE);
+
+	r = PQflush(master->conn);
+	if (r < 0)
+		showPQerror(master->conn, "could not send data to master");
+
+	return MC_WAIT_READ | (r ? MC_WAIT_WRITE : 0);
+}
+
+/* Block until the connection has something for us to process. */
+static void
+WbMcWait(MasterConn *master)
+{
+	struct pollfd pfd;
+	int events = WbMcWaitEvents(master);
+
+	pfd.fd = PQsocket(master->conn);
+	pfd.events = ((events & MC_WAIT_READ) ? POLLIN : 0) |
+			((events & MC_WAIT_WRITE) ? POLLOUT : 0);
+	pfd.revents = 0;
+
+	if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+		error("poll on master connection failed");
+}
+
+static void
+WbMcClearResult(MasterConn *master)
+{
+	if (master->result)
+		PQclear(master->result);
+	master->result = NULL;
+	master->queryDone = false;
+}
+
+static void
+WbMcSendQuery(MasterConn *master, const char *query)
+{
+	WbMcClearResult(master);
+	if (!PQsendQuery(master->conn, query))
+		error(PQerrorMessage(master->conn));
+}
+
+/*
+ * Collect results of the last query without blocking. Returns true once
+ * all results have arrived, the first one is left in master->result.
+ * Entering COPY mode also completes the query.
+ */
+static bool
+WbMcQueryDone(MasterConn *master)
 {
 	PGconn *mc = master->conn;
+
+	if (master->queryDone)
+		return true;
+
+	if (PQflush(mc) < 0 || !PQconsumeInput(mc))
+		error(PQerrorMessage(mc));
+
+	while (!PQisBusy(mc))
+	{
+		PGresult *res = PQgetResult(mc);
+		ExecStatusType status;
+
+		if (!res)
+		{
+			master->queryDone = true;
+			break;
+		}
+
+		status = PQresultStatus(res);
+		if (!master->result)
+			master->result = res;
+		else
+			PQclear(res);
+
+		if (status == PGRES_COPY_BOTH || status == PGRES_COPY_OUT ||
+				status == PGRES_COPY_IN)
+		{
+			master->queryDone = true;
+			break;
+		}
+	}
+	return master->queryDone;
+}
+
+static void
+WbMcWaitForResult(MasterConn *master)
+{
+	while (!WbMcQueryDone(master))
+		WbMcWait(master);
+}
+
+void
+WbMcSendStartStreaming(MasterConn *master, XLogRecPtr pos, TimeLineID tli)
+{
 	char cmd[256];
-	PGresult *res;
+	int len;
+	const char *compression;
 
 	log_info("Start streaming from master at %X/%X", FormatRecPtr(pos));
 
-	snprintf(cmd, sizeof(cmd),
+	/* An upstream walbouncer reports when it will compress, streams start afresh */
+	compression = PQparameterStatus(master->conn, WB_COMPRESSION_OPTION);
+	master->compressed = compression && strcmp(compression, WB_COMPRESSION_ZLIB) == 0;
+	if (master->compressed)
+	{
+		if (!master->decompressor)
+			master->decompressor = WbCmCreate(true);
+		WbCmReset(master->decompressor);
+	}
+
+	len = snprintf(cmd, sizeof(cmd),
 			"START_REPLICATION %X/%X TIMELINE %u",
 			(uint32) (pos>>32), (uint32) pos, tli);
-	res = PQexec(mc, cmd);
 
-	if (PQresultStatus(res) == PGRES_COMMAND_OK)
-	{
-		PQclear(res);
-		return false;
-	}
-	else if (PQresultStatus(res) != PGRES_COPY_BOTH)
+	/* Libpq is done with the connection until we are back to idle */
+	WbMcClearResult(master);
+	master->native = true;
+	master->ssl = PQsslInUse(master->conn) ? PQsslStruct(master->conn, "OpenSSL") : NULL;
+	if (master->ssl)
+		WbTlAdoptClient(master->ssl);
+	master->copyDoneReceived = false;
+	McBeginMessage(master, 'Q', len + 1);
+	McAppend(master, cmd, len + 1);
+	McFlush(master);
+}
+
+/*
+ * Returns true once the master has answered START_REPLICATION, streaming
+ * is set to false if the master has nothing to stream.
+ */
+bool
+WbMcFinishStartStreaming(MasterConn *master, bool *streaming)
+{
+	char type;
+	char *body;
+	int len;
+
+	McFlush(master);
+	while (McNextMessage(master, &type, &body, &len))
 	{
-		PQclear(res);
-		error(PQerrorMessage(mc));
+		switch (type)
+		{
+			case 'W':
+				*streaming = master->streaming = true;
+				return true;
+			case 'E':
+				McErrorResponse(body, len);
+			case 'Z':
+				*streaming = master->streaming = false;
+				master->native = false;
+				return true;
+			default:
+				/* Next timeline when there is nothing to stream, notices */
+				break;
+		}
 	}
-	PQclear(res);
-	return true;
+	return false;
+}
+
+bool
+WbMcStartStreaming(MasterConn *master, XLogRecPtr pos, TimeLineID tli)
+{
+	bool streaming;
+
+	WbMcSendStartStreaming(master, pos, tli);
+	while (!WbMcFinishStartStreaming(master, &streaming))
+		WbMcWait(master);
+	return streaming;
 }
 
 void
-WbMcEndStreaming(MasterConn *master, TimeLineID *nextTli, char** nextTliStart)
+WbMcSendEndStreaming(MasterConn *master)
 {
-	PGconn *mc = master->conn;
-	PGresult   *res;
+	master->streaming = false;
+	master->draining = !master->copyDoneReceived;
+	master->commandComplete = false;
+	master->nextTli = 0;
+	if (master->nextTliStart)
+		wbfree(master->nextTliStart);
+	master->nextTliStart = NULL;
+
+	McBeginMessage(master, 'c', 0);
+	McFlush(master);
+}
 
-	if (PQputCopyEnd(mc, NULL) <= 0 || PQflush(mc))
-		error(PQerrorMessage(mc));
+/*
+ * After COPY is finished, we should receive a result set indicating the
+ * next timeline's ID, or just CommandComplete if the server was shut
+ * down. Returns true once all of it has arrived.
+ *
+ * If we had not yet received CopyDone from the backend, remaining WAL data
+ * is received and thrown away.
+ */
+bool
+WbMcFinishEndStreaming(MasterConn *master, TimeLineID *nextTli, char** nextTliStart)
+{
+	char type;
+	char *body;
+	int len;
 
-	/*
-	 * After COPY is finished, we should receive a result set indicating the
-	 * next timeline's ID, or just CommandComplete if the server was shut
-	 * down.
-	 *
-	 * If we had not yet received CopyDone from the backend, PGRES_COPY_IN
-	 * would also be possible. However, at the moment this function is only
-	 * called after receiving CopyDone from the backend - the walreceiver
-	 * never terminates replication on its own initiative.
-	 */
-	res = PQgetResult(mc);
-	while (PQresultStatus(res) == PGRES_COPY_OUT)
+	McFlush(master);
+	for (;;)
 	{
-		int copyresult;
-		do {
-			char *buf;
-			copyresult = PQgetCopyData(mc, &buf, 0);
-			if (buf)
-				PQfreemem(buf);
-
-		} while (copyresult >= 0);
-		res = PQgetResult(mc);
-	}
+		if (!McNextMessage(master, &type, &body, &len))
+			return false;
 
-	if (PQresultStatus(res) == PGRES_TUPLES_OK && nextTli && nextTliStart)
-	{
-		/*
-		 * Read the next timeline's ID. The server also sends the timeline's
-		 * starting point, but it is ignored.
-		 */
-		if (PQnfields(res) < 2 || PQntuples(res) != 1)
-			error("unexpected result set after end-of-streaming");
-		*nextTli = ensure_atoi(PQgetvalue(res, 0, 0));
-		*nextTliStart = wbstrdup(PQgetvalue(res, 0, 1));
-		log_info("Ended streaming with master, received next TLI %u, start pos %s", *nextTli, *nextTliStart);
+		if (type == 'Z')
+			break;
+		switch (type)
+		{
+			case 'd':
+				if (!master->draining)
+					error("Unexpected WAL data after end of streaming");
+				break;
+			case 'c':
+				master->draining = false;
+				break;
+			case 'D':
+				McParseNextTimeline(master, body, len);
+				break;
+			case 'C':
+				master->commandComplete = true;
+				break;
+			case 'E':
+				McErrorResponse(body, len);
+			default:
+				/* Row description, notices */
+				break;
+		}
+	}
+	master->native = false;
 
-		PQclear(res);
+	if (!master->commandComplete)
+		error("Master did not complete streaming");
 
-		/* the result set should be followed by CommandComplete */
-		res = PQgetResult(mc);
+	if (master->nextTliStart)
+	{
+		log_info("Ended streaming with master, received next TLI %u, start pos %s",
+				master->nextTli, master->nextTliStart);
 	}
 	else
-	{
 		log_info("Ended streaming with master, no historic TLI information received");
-		*nextTli = 0;
-		*nextTliStart = NULL;
+
+	if (nextTli && nextTliStart)
+	{
+		*nextTli = master->nextTli;
+		*nextTliStart = master->nextTliStart;
+		master->nextTliStart = NULL;
 	}
+	return true;
+}
 
-	if (PQresultStatus(res) != PGRES_COMMAND_OK)
-		error(PQerrorMessage(mc));
+/*
+ * The result set after streaming has the next timeline and where it starts.
+ * Each column is a 32-bit length followed by the value as text.
+ */
+static void
+McParseNextTimeline(MasterConn *master, char *body, int len)
+{
+	char *end = body + len;
+	char *col = body + 2;
+	char value[64];
+	int i;
 
-	/* Verify that there are no more results */
-	res = PQgetResult(mc);
-	while (res!=NULL) {
-		log_debug1("Status while ending streaming: %d", PQresultStatus(res));
-		res = PQgetResult(mc);
-	}
+	if (len < 2 || ntohs(*((uint16*) body)) < 2)
+		error("unexpected result set after end-of-streaming");
+
+	for (i = 0; i < 2; i++)
+	{
+		int collen;
+
+		if (col + 4 > end)
+			error("unexpected result set after end-of-streaming");
+		collen = (int32) fromnetwork32(col);
+		col += 4;
+		if (collen < 0 || collen >= sizeof(value) || col + collen > end)
+			error("unexpected result set after end-of-streaming");
+		memcpy(value, col, collen);
+		value[collen] = '\0';
+		col += collen;
 
-	if (res != NULL)
-		error("unexpected result after CommandComplete: %s", PQerrorMessage(mc));
+		if (i == 0)
+			master->nextTli = ensure_atoi(value);
+		else
+			master->nextTliStart = wbstrdup(value);
+	}
+}
 
+void
+WbMcEndStreaming(MasterConn *master, TimeLineID *nextTli, char** nextTliStart)
+{
+	WbMcSendEndStreaming(master);
+	while (!WbMcFinishEndStreaming(master, nextTli, nextTliStart))
+		WbMcWait(master);
 }
 
 bool
@@ -175,6 +576,35 @@ WbMcReceiveWalMessage(MasterConn *master, ReplMessage *msg)
 							FormatRecPtr(msg->walEnd),
 							timestamptz_to_str(msg->sendTime));
 
+					WbMcProcessWalsenderMessage(master, msg);
+					break;
+				}
+			case 'z':
+				{
+					int rawLen;
+
+					if (!master->compressed || len < WB_COMPRESSED_HEADER_LEN)
+						error("Received invalid compressed WAL message");
+
+					msg->type = MSG_WAL_DATA;
+					msg->dataStart = fromnetwork64(buf+1);
+					msg->walEnd = fromnetwork64(buf+9);
+					msg->sendTime = fromnetwork64(buf+17);
+					msg->replyRequested = 0;
+					rawLen = (int32) fromnetwork32(buf+25);
+
+					msg->dataPtr = 0;
+					msg->dataLen = rawLen;
+					msg->data = WbCmDecompress(master->decompressor, buf + WB_COMPRESSED_HEADER_LEN,
+							len - WB_COMPRESSED_HEADER_LEN, rawLen);
+					msg->nextPageBoundary = (XLOG_BLCKSZ - msg->dataStart) & (XLOG_BLCKSZ-1);
+
+					log_debug1("Received %u byte WAL block compressed to %d bytes. dataStart: %X/%X walEnd: %X/%X sendTime: %s",
+							rawLen, len - WB_COMPRESSED_HEADER_LEN,
+							FormatRecPtr(msg->dataStart),
+							FormatRecPtr(msg->walEnd),
+							timestamptz_to_str(msg->sendTime));
+
 					WbMcProcessWalsenderMessage(master, msg);
 					break;
 				}
@@ -201,51 +631,46 @@ WbMcReceiveWalMessage(MasterConn *master, ReplMessage *msg)
 }
 
 
+/*
+ * Fetch the next CopyData message, its length is returned and buffer set to
+ * point to it in the receive buffer. Returns 0 if nothing more has arrived
+ * and -1 when the master ended streaming.
+ */
 static int
 WbMcReceiveWal(MasterConn *master, char **buffer)
 {
-	PGconn *mc = master->conn;
-	int			rawlen;
+	char type;
+	char *body;
+	int len;
 
-	if (master->recvBuf != NULL)
-		PQfreemem(master->recvBuf);
-	master->recvBuf = NULL;
+	if (master->copyDoneReceived)
+		return -1;
 
-	/* Try to receive a CopyData message */
-	rawlen = PQgetCopyData(mc, &(master->recvBuf), 1);
-	if (rawlen == 0)
-	{
-		if (PQconsumeInput(mc) == 0)
-			showPQerror(mc, "could not receive data from WAL stream");
+	/* Status messages queued since the last round go out first */
+	McFlush(master);
 
-		/* Now that we've consumed some input, try again */
-		rawlen = PQgetCopyData(mc, &(master->recvBuf), 1);
-		if (rawlen == 0)
-			return 0;
-	}
-	if (rawlen == -1)			/* end-of-streaming or error */
+	while (McNextMessage(master, &type, &body, &len))
 	{
-		PGresult   *res;
-
-		res = PQgetResult(mc);
-		if (PQresultStatus(res) == PGRES_COMMAND_OK ||
-			PQresultStatus(res) == PGRES_COPY_IN)
+		switch (type)
 		{
-			PQclear(res);
-			return -1;
-		}
-		else
-		{
-			PQclear(res);
-			showPQerror(mc, "could not receive data from WAL stream");
+			case 'd':
+				if (len < 1)
+					error("Received empty message on WAL stream");
+				*buffer = body;
+				return len;
+			case 'c':
+				master->copyDoneReceived = true;
+				return -1;
+			case 'E':
+				McErrorResponse(body, len);
+			case 'N':
+			case 'S':
+				break;
+			default:
+				error("Unexpected message type %c on WAL stream", type);
 		}
 	}
-	if (rawlen < -1)
-		showPQerror(mc, "could not receive data from WAL stream");
-
-	/* Return received messages to caller */
-	*buffer = master->recvBuf;
-	return rawlen;
+	return 0;
 }
 
 static void
@@ -257,17 +682,178 @@ WbMcProcessWalsenderMessage(MasterConn *master, ReplMessage *msg)
 }
 
 /*
- * Send a message to XLOG stream.
- *
- * ereports on error.
+ * Queue a message to the XLOG stream. It goes out with the next query or
+ * when the event loop calls WbMcWaitEvents, so that status messages sent in
+ * one round go out together.
  */
 static void
 WbMcSend(MasterConn *master, const char *buffer, int nbytes)
 {
-	PGconn *mc = master->conn;
-	if (PQputCopyData(mc, buffer, nbytes) <= 0 ||
-		PQflush(mc))
-		showPQerror(mc, "could not send data to WAL stream");
+	McBeginMessage(master, 'd', nbytes);
+	McAppend(master, buffer, nbytes);
+}
+
+/* Start a message of len bytes after the header in the send buffer */
+static void
+McBeginMessage(MasterConn *master, char type, int len)
+{
+	char header[5];
+
+	header[0] = type;
+	write32(header + 1, len + 4);
+	McAppend(master, header, sizeof(header));
+}
+
+static void
+McAppend(MasterConn *master, const char *data, int len)
+{
+	if (master->sendBufSize - master->sendBufLen < len)
+	{
+		int newSize = master->sendBufSize ? master->sendBufSize : MC_SEND_BUFFER_INIT_SIZE;
+
+		while (newSize - master->sendBufLen < len)
+			newSize *= 2;
+		master->sendBuffer = rewballoc(master->sendBuffer, newSize);
+		master->sendBufSize = newSize;
+	}
+	memcpy(master->sendBuffer + master->sendBufLen, data, len);
+	master->sendBufLen += len;
+}
+
+/*
+ * Send out what the socket takes without blocking. Returns true if nothing
+ * is left over.
+ */
+static bool
+McFlush(MasterConn *master)
+{
+	while (master->sendBufFlushPtr < master->sendBufLen)
+	{
+		char *data = master->sendBuffer + master->sendBufFlushPtr;
+		int len = master->sendBufLen - master->sendBufFlushPtr;
+		int r;
+
+		if (master->ssl)
+			r = WbTlWrite(master->ssl, data, len);
+		else
+			r = send(PQsocket(master->conn), data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+		if (r < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return false;
+			error("Could not send data to master: %s", strerror(errno));
+		}
+		master->sendBufFlushPtr += r;
+	}
+	master->sendBufFlushPtr = master->sendBufLen = 0;
+	return true;
+}
+
+/*
+ * Read what the master has sent without blocking, making room for at least
+ * needed bytes from the current position. Messages before the current
+ * position are dropped. Returns false once the socket has nothing more.
+ */
+static bool
+McRead(MasterConn *master, int needed)
+{
+	int kept = master->recvLength - master->recvPointer;
+
+	if (master->recvPointer > 0)
+	{
+		memmove(master->recvBuffer, master->recvBuffer + master->recvPointer, kept);
+		master->recvLength = kept;
+		master->recvPointer = 0;
+	}
+	if (master->recvBufSize < needed || master->recvBufSize == 0)
+	{
+		int newSize = master->recvBufSize ? master->recvBufSize : MC_RECV_BUFFER_INIT_SIZE;
+
+		while (newSize < needed)
+			newSize *= 2;
+		master->recvBuffer = rewballoc(master->recvBuffer, newSize);
+		master->recvBufSize = newSize;
+	}
+
+	for (;;)
+	{
+		char *buf = master->recvBuffer + master->recvLength;
+		int len = master->recvBufSize - master->recvLength;
+		int r;
+
+		if (master->ssl)
+			r = WbTlRead(master->ssl, buf, len);
+		else
+			r = recv(PQsocket(master->conn), buf, len, MSG_DONTWAIT);
+
+		if (r < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return false;
+			error("Could not receive data from master: %s", strerror(errno));
+		}
+		if (r == 0)
+			error("Master closed the connection");
+		master->recvLength += r;
+		return true;
+	}
+}
+
+/*
+ * Next complete message from the master. Its body stays valid until the
+ * next call. Returns false only after the socket has reported EAGAIN, so
+ * that nothing already received waits in our buffer while the caller waits
+ * on the socket.
+ */
+static bool
+McNextMessage(MasterConn *master, char *type, char **body, int *len)
+{
+	for (;;)
+	{
+		char *msg = master->recvBuffer + master->recvPointer;
+		int avail = master->recvLength - master->recvPointer;
+		int needed = 5;
+
+		if (avail >= 5)
+		{
+			int msglen = (int32) fromnetwork32(msg + 1);
+
+			if (msglen < 4)
+				error("Invalid message length %d from master", msglen);
+			if (avail >= msglen + 1)
+			{
+				*type = msg[0];
+				*body = msg + 5;
+				*len = msglen - 4;
+				master->recvPointer += msglen + 1;
+				return true;
+			}
+			needed = msglen + 1;
+		}
+		if (!McRead(master, needed))
+			return false;
+	}
+}
+
+static void
+McErrorResponse(char *body, int len)
+{
+	char *end = body + len;
+
+	while (body < end && *body)
+	{
+		char field = *body++;
+
+		if (field == 'M')
+			error("Master reported an error: %.*s", (int) strnlen(body, end - body), body);
+		body += strnlen(body, end - body) + 1;
+	}
+	error("Master reported an error");
 }
 
 void
@@ -316,18 +902,24 @@ WbMcSendFeedback(MasterConn *master, HSFeedbackMessage *feedback)
 	WbMcSend(master, feedback_message, sizeof(feedback_message));
 }
 
+void
+WbMcSendIdentifySystem(MasterConn* master)
+{
+	WbMcSendQuery(master, "IDENTIFY_SYSTEM");
+}
+
 bool
-WbMcIdentifySystem(MasterConn* master,
+WbMcFinishIdentifySystem(MasterConn* master,
 		char** primary_sysid, char** primary_tli, char** primary_xpos)
 {
-	PGconn *mc = master->conn;
+	PGresult *result;
+
+	if (!WbMcQueryDone(master))
+		return false;
 
-	PGresult *result = PQexec(mc, "IDENTIFY_SYSTEM");
+	result = master->result;
 	if (PQresultStatus(result) != PGRES_TUPLES_OK)
-	{
-		PQclear(result);
-		error(PQerrorMessage(mc));
-	}
+		error(PQerrorMessage(master->conn));
 	if (PQnfields(result) < 3 || PQntuples(result) != 1)
 	{
 		error("Invalid response");
@@ -340,28 +932,42 @@ WbMcIdentifySystem(MasterConn* master,
 	if (primary_xpos)
 		*primary_xpos = wbstrdup(PQgetvalue(result, 0, 2));
 
-	PQclear(result);
+	WbMcClearResult(master);
 	return true;
 }
 
 bool
-WbMcGetTimelineHistory(MasterConn* master, TimeLineID timeline,
-		TimelineHistory *history)
+WbMcIdentifySystem(MasterConn* master,
+		char** primary_sysid, char** primary_tli, char** primary_xpos)
+{
+	WbMcSendIdentifySystem(master);
+	WbMcWaitForResult(master);
+	return WbMcFinishIdentifySystem(master, primary_sysid, primary_tli, primary_xpos);
+}
+
+void
+WbMcSendTimelineHistory(MasterConn* master, TimeLineID timeline)
 {
-	PGconn *mc = master->conn;
 	char query[16+1+10+1];
-	PGresult *result;
 
 	sprintf(query, "TIMELINE_HISTORY %d", timeline);
+	WbMcSendQuery(master, query);
+}
 
-	result = PQexec(mc, query);
+bool
+WbMcFinishTimelineHistory(MasterConn* master, TimelineHistory *history)
+{
+	PGresult *result;
 
+	if (!WbMcQueryDone(master))
+		return false;
+
+	result = master->result;
 	if (PQresultStatus(result) != PGRES_TUPLES_OK)
 	{
 		// TODO: handle missing timeline case
 		log_debug1("Timeline query returned %s", PQresStatus(PQresultStatus(result)));
-		PQclear(result);
-		error("Getting timeline history from master failed with: %s", PQerrorMessage(mc));
+		error("Getting timeline history from master failed with: %s", PQerrorMessage(master->conn));
 	}
 	if (PQnfields(result) < 2 || PQntuples(result) != 1)
 	{
@@ -371,30 +977,41 @@ WbMcGetTimelineHistory(MasterConn* master, TimeLineID timeline,
 	history->filename = wbstrdup(PQgetvalue(result, 0, 0));
 	history->contentLen = PQgetlength(result, 0, 1);
 	history->content = wballoc(history->contentLen);
-    memcpy(history->content, PQgetvalue(result, 0, 1), history->contentLen);
+	memcpy(history->content, PQgetvalue(result, 0, 1), history->contentLen);
 
-    PQclear(result);
+	WbMcClearResult(master);
 	return true;
 }
 
-Oid *
-WbMcResolveOids(MasterConn *master, OidResolveKind kind, bool include, char** names, int n_items)
+bool
+WbMcGetTimelineHistory(MasterConn* master, TimeLineID timeline,
+		TimelineHistory *history)
+{
+	WbMcSendTimelineHistory(master, timeline);
+	WbMcWaitForResult(master);
+	return WbMcFinishTimelineHistory(master, history);
+}
+
+static const char *
+OidResolveKindName(OidResolveKind kind)
+{
+	return kind == OID_RESOLVE_TABLESPACES ? "tablespaces" : "databases";
+}
+
+void
+WbMcSendResolveOids(MasterConn *master, OidResolveKind kind, bool include, char** names, int n_items)
 {
-	Oid *oids;
-	PGresult *res;
-	int oidcount;
 	int i;
 	char sql[1000];
 	int sqlpos = 0;
 	const char * const* paramValues = (const char * const*) names;
-	char *itemkind = "";
+	const char *itemkind = OidResolveKindName(kind);
 
 	switch (kind)
 	{
 		case OID_RESOLVE_TABLESPACES:
 			sqlpos = snprintf(sql, sizeof(sql),
 					"SELECT oid, spcname FROM pg_tablespace WHERE spcname IN (");
-			itemkind = "tablespaces";
 			if (include)
 				sqlpos += snprintf(sql+sqlpos, (sizeof(sql) - sqlpos),
 									"'pg_default', 'pg_global', ");
@@ -402,7 +1019,6 @@ WbMcResolveOids(MasterConn *master, OidResolveKind kind, bool include, char** na
 		case OID_RESOLVE_DATABASES:
 			sqlpos = snprintf(sql, sizeof(sql),
 					"SELECT oid, datname FROM pg_database WHERE datname IN (");
-			itemkind = "databases";
 			if (include)
 				sqlpos += snprintf(sql+sqlpos, (sizeof(sql) - sqlpos),
 									"'template0', 'template1', ");
@@ -417,23 +1033,63 @@ WbMcResolveOids(MasterConn *master, OidResolveKind kind, bool include, char** na
 	if (sqlpos >= sizeof(sql))
 		error("Too many %s specified", itemkind);
 
-	res = PQexecParams(master->conn, sql,
-		n_items, NULL, paramValues,
-		NULL, NULL, 0);
+	WbMcClearResult(master);
+	if (!PQsendQueryParams(master->conn, sql,
+			n_items, NULL, paramValues,
+			NULL, NULL, 0))
+		error("Could not retrieve %s: %s", itemkind, PQerrorMessage(master->conn));
+}
+
+/*
+ * The result is a zero terminated array of the OIDs found. If oidNames is
+ * given it is set to the names matching the OIDs.
+ */
+bool
+WbMcFinishResolveOids(MasterConn *master, OidResolveKind kind, Oid **result, char ***oidNames)
+{
+	Oid *oids;
+	char **names = NULL;
+	PGresult *res;
+	int oidcount;
+	int i;
+	const char *itemkind = OidResolveKindName(kind);
+
+	if (!WbMcQueryDone(master))
+		return false;
+
+	res = master->result;
 	if (PQresultStatus(res) != PGRES_TUPLES_OK)
 		error("Could not retrieve %s: %s", itemkind, PQerrorMessage(master->conn));
 
 	oidcount = PQntuples(res);
 	oids = wballoc0(sizeof(Oid)*(oidcount+1));
+	if (oidNames)
+		names = wballoc0(sizeof(char*)*(oidcount+1));
 
 	for (i = 0; i < oidcount; i++)
 	{
 		char *oid = PQgetvalue(res, i, 0);
 		oids[i] = atoi(oid);
+		if (names)
+			names[i] = wbstrdup(PQgetvalue(res, i, 1));
 		log_debug1("Found %s oid for %s: %d", itemkind, PQgetvalue(res, i, 1), oids[i]);
 	}
-	PQclear(res);
+	WbMcClearResult(master);
+
+	*result = oids;
+	if (oidNames)
+		*oidNames = names;
+	return true;
+}
+
+Oid *
+WbMcResolveOids(MasterConn *master, OidResolveKind kind, bool include, char** names, int n_items)
+{
+	Oid *oids;
 
+	WbMcSendResolveOids(master, kind, include, names, n_items);
+	WbMcWaitForResult(master);
+	WbMcFinishResolveOids(master, kind, &oids, NULL);
 	return oids;
 }
 
@@ -0,0 +1,206 @@
+#include "wboidcache.h"
+
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "wbutils.h"
+
+#define OID_CACHE_SIZE 256
+#define OID_CACHE_NAMELEN 64
+/* Seconds after which a mapping is looked up again */
+#define OID_CACHE_TTL 60
+
+/*
+ * A mapping of a name to its OID, or to InvalidOid if the name does not
+ * exist on the master.
+ */
+typedef struct {
+	bool valid;
+	OidResolveKind kind;
+	char name[OID_CACHE_NAMELEN];
+	Oid oid;
+	time_t fetched;
+} OidCacheEntry;
+
+typedef struct {
+	int lock;
+	OidCacheEntry entries[OID_CACHE_SIZE];
+} OidCacheShmem;
+
+static OidCacheShmem *shm = NULL;
+
+/* Names that are always included, see WbMcSendResolveOids */
+static char *includedTablespaces[] = { "pg_default", "pg_global" };
+static char *includedDatabases[] = { "template0", "template1" };
+
+static void OcLock();
+static void OcUnlock();
+static OidCacheEntry* OcFind(OidResolveKind kind, const char *name, time_t now);
+static void OcPut(OidResolveKind kind, const char *name, Oid oid, time_t now);
+static int OcNames(OidResolveKind kind, bool include, char **names, int n_names, char ***all);
+
+void
+WbOcInitShmem()
+{
+	shm = mmap(NULL, sizeof(OidCacheShmem), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shm == MAP_FAILED)
+		error("Could not allocate shared memory for OID cache");
+}
+
+/*
+ * The critical sections are a few string compares, a spinlock is plenty.
+ */
+static void
+OcLock()
+{
+	while (__atomic_test_and_set(&(shm->lock), __ATOMIC_ACQUIRE))
+		;
+}
+
+static void
+OcUnlock()
+{
+	__atomic_clear(&(shm->lock), __ATOMIC_RELEASE);
+}
+
+static OidCacheEntry*
+OcFind(OidResolveKind kind, const char *name, time_t now)
+{
+	int i;
+
+	for (i = 0; i < OID_CACHE_SIZE; i++)
+	{
+		OidCacheEntry *e = &(shm->entries[i]);
+		if (e->valid && e->kind == kind && now - e->fetched < OID_CACHE_TTL &&
+				strcmp(e->name, name) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+/* Insert or refresh a mapping, replacing the oldest entry when full */
+static void
+OcPut(OidResolveKind kind, const char *name, Oid oid, time_t now)
+{
+	OidCacheEntry *victim = NULL;
+	int i;
+
+	if (strlen(name) >= OID_CACHE_NAMELEN)
+		return;
+
+	for (i = 0; i < OID_CACHE_SIZE; i++)
+	{
+		OidCacheEntry *e = &(shm->entries[i]);
+		if (e->valid && e->kind == kind && strcmp(e->name, name) == 0)
+		{
+			victim = e;
+			break;
+		}
+		if (!victim || !e->valid || (victim->valid && e->fetched < victim->fetched))
+			victim = e;
+	}
+
+	victim->valid = true;
+	victim->kind = kind;
+	strcpy(victim->name, name);
+	victim->oid = oid;
+	victim->fetched = now;
+}
+
+/* Names to resolve, including the implicitly included ones */
+static int
+OcNames(OidResolveKind kind, bool include, char **names, int n_names, char ***all)
+{
+	char **extra = kind == OID_RESOLVE_TABLESPACES ? includedTablespaces : includedDatabases;
+	int n_extra = include ? 2 : 0;
+
+	*all = wballoc(sizeof(char*) * (n_names + n_extra));
+	memcpy(*all, names, sizeof(char*) * n_names);
+	memcpy(*all + n_names, extra, sizeof(char*) * n_extra);
+	return n_names + n_extra;
+}
+
+/*
+ * Returns true and the OIDs of the names if all of them are cached. Names
+ * that don't exist are left out of the result, same as when querying.
+ */
+bool
+WbOcLookup(OidResolveKind kind, bool include, char **names, int n_names, Oid **result)
+{
+	char **all;
+	int n_all;
+	Oid *oids;
+	int n_oids = 0;
+	time_t now = time(NULL);
+	int i;
+
+	if (!shm)
+		return false;
+
+	n_all = OcNames(kind, include, names, n_names, &all);
+	oids = wballoc0(sizeof(Oid) * (n_all + 1));
+
+	OcLock();
+	for (i = 0; i < n_all; i++)
+	{
+		OidCacheEntry *e = OcFind(kind, all[i], now);
+		if (!e)
+			break;
+		if (e->oid != InvalidOid)
+			oids[n_oids++] = e->oid;
+	}
+	OcUnlock();
+
+	wbfree(all);
+	if (i < n_all)
+	{
+		wbfree(oids);
+		return false;
+	}
+
+	log_debug1("Resolved %d names from OID cache", n_all);
+	*result = oids;
+	return true;
+}
+
+/*
+ * Remember the result of resolving names on the master. oids and oidNames
+ * are what the master returned, names not among them are remembered as
+ * not existing.
+ */
+void
+WbOcStore(OidResolveKind kind, bool include, char **names, int n_names,
+		Oid *oids, char **oidNames)
+{
+	char **all;
+	int n_all;
+	time_t now = time(NULL);
+	int i;
+	int j;
+
+	if (!shm)
+		return;
+
+	n_all = OcNames(kind, include, names, n_names, &all);
+
+	OcLock();
+	for (i = 0; i < n_all; i++)
+	{
+		Oid oid = InvalidOid;
+
+		for (j = 0; oids[j] != InvalidOid; j++)
+		{
+			if (strcmp(oidNames[j], all[i]) == 0)
+			{
+				oid = oids[j];
+				break;
+			}
+		}
+		OcPut(kind, all[i], oid, now);
+	}
+	OcUnlock();
+
+	wbfree(all);
+}
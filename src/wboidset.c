@@ -0,0 +1,71 @@
+#include "wboidset.h"
+
+#include <stddef.h>
+
+#include "wbutils.h"
+
+#define OID_SET_MIN_SIZE 8
+
+/*
+ * Open addressing with linear probing. InvalidOid marks an empty slot, the
+ * table is kept at most half full.
+ */
+struct OidSet {
+	uint32 mask;
+	Oid entries[1];
+};
+
+static inline uint32
+OidSetHash(Oid oid)
+{
+	/* Fibonacci hashing spreads runs of consecutive OIDs */
+	return (uint32) oid * 2654435761U;
+}
+
+OidSet*
+WbOsCreate(Oid *list)
+{
+	OidSet *set;
+	uint32 size = OID_SET_MIN_SIZE;
+	int n = 0;
+	Oid *cur;
+
+	for (cur = list; *cur; cur++)
+		n++;
+	while (size < 2 * n)
+		size *= 2;
+
+	set = wballoc0(offsetof(OidSet, entries) + size * sizeof(Oid));
+	set->mask = size - 1;
+
+	for (cur = list; *cur; cur++)
+	{
+		uint32 pos = OidSetHash(*cur) & set->mask;
+
+		while (set->entries[pos] && set->entries[pos] != *cur)
+			pos = (pos + 1) & set->mask;
+		set->entries[pos] = *cur;
+	}
+
+	return set;
+}
+
+bool
+WbOsContains(OidSet *set, Oid oid)
+{
+	uint32 pos = OidSetHash(oid) & set->mask;
+
+	while (set->entries[pos])
+	{
+		if (set->entries[pos] == oid)
+			return true;
+		pos = (pos + 1) & set->mask;
+	}
+	return false;
+}
+
+void
+WbOsFree(OidSet *set)
+{
+	wbfree(set);
+}
@@ -0,0 +1,371 @@
+#include "wbpool.h"
+
+#include <setjmp.h>
+#include <string.h>
+#include <time.h>
+
+#include "wbconfig.h"
+#include "wbevent.h"
+#include "wbutils.h"
+
+/* Distinct connection strings we keep connections for */
+#define POOL_MAX_KEYS 32
+/* Seconds to wait before connecting again after a failed attempt */
+#define POOL_RETRY_INTERVAL 10
+
+typedef enum {
+	PL_CONNECTING,		/* Connection is being established */
+	PL_ENDING_STREAM,	/* Returned by a standby, waiting for COPY to end */
+	PL_READY			/* Idle and ready to be handed out */
+} PooledConnState;
+
+typedef struct PooledConn {
+	struct PooledConn *next;
+	MasterConn *master;
+	PooledConnState state;
+	int fd;
+	uint32 events;
+} PooledConn;
+
+typedef struct {
+	char *conninfo;
+	PooledConn *conns;
+	int nconns;
+	time_t lastFailure;
+} PoolKey;
+
+static PoolKey poolKeys[POOL_MAX_KEYS];
+static int numPoolKeys = 0;
+
+/* All pool sockets are registered with the event loop using this tag */
+static char poolTag;
+
+static PoolKey* WbPlGetKey(const char *conninfo, bool create);
+static void WbPlAdd(PoolKey *key, MasterConn *master, PooledConnState state);
+static void WbPlRemove(PoolKey *key, PooledConn *pc, bool close);
+static void WbPlDrive(PoolKey *key, PooledConn *pc);
+static bool WbPlAdvance(PooledConn *pc);
+static void WbPlUpdateEvents(PooledConn *pc);
+static bool WbPlStartConnection(PoolKey *key);
+
+void
+WbPlInit()
+{
+	char conninfo[MAX_CONNINFO_LEN+1];
+	int i;
+
+	if (!WbPlEnabled())
+		return;
+
+	for (i = 0; i < CurrentConfig->pool.n_users; i++)
+	{
+		WbMcBuildConninfo(conninfo, sizeof(conninfo), CurrentConfig->master.host,
+				CurrentConfig->master.port, CurrentConfig->pool.users[i], true);
+		WbPlGetKey(conninfo, true);
+	}
+	WbPlMaintain();
+}
+
+bool
+WbPlEnabled()
+{
+	return CurrentConfig->pool.size > 0;
+}
+
+bool
+WbPlIsEventTag(void *ptr)
+{
+	return ptr == &poolTag;
+}
+
+static PoolKey*
+WbPlGetKey(const char *conninfo, bool create)
+{
+	int i;
+
+	for (i = 0; i < numPoolKeys; i++)
+		if (strcmp(poolKeys[i].conninfo, conninfo) == 0)
+			return &(poolKeys[i]);
+
+	if (!create || numPoolKeys >= POOL_MAX_KEYS)
+		return NULL;
+
+	poolKeys[numPoolKeys].conninfo = wbstrdup(conninfo);
+	poolKeys[numPoolKeys].conns = NULL;
+	poolKeys[numPoolKeys].nconns = 0;
+	poolKeys[numPoolKeys].lastFailure = 0;
+	return &(poolKeys[numPoolKeys++]);
+}
+
+static void
+WbPlAdd(PoolKey *key, MasterConn *master, PooledConnState state)
+{
+	PooledConn *pc = wballoc(sizeof(PooledConn));
+
+	pc->master = master;
+	pc->state = state;
+	pc->fd = -1;
+	pc->events = 0;
+	pc->next = key->conns;
+	key->conns = pc;
+	key->nconns++;
+
+	WbPlDrive(key, pc);
+}
+
+static void
+WbPlRemove(PoolKey *key, PooledConn *pc, bool close)
+{
+	PooledConn **prev;
+
+	for (prev = &(key->conns); *prev; prev = &((*prev)->next))
+	{
+		if (*prev == pc)
+		{
+			*prev = pc->next;
+			break;
+		}
+	}
+	key->nconns--;
+
+	if (pc->fd >= 0)
+		WbEvDelete(pc->fd);
+	if (close)
+		WbMcCloseConnection(pc->master);
+	wbfree(pc);
+}
+
+/*
+ * Wait for whatever the connection needs next. Idle connections are watched
+ * for the master closing them.
+ */
+static void
+WbPlUpdateEvents(PooledConn *pc)
+{
+	int fd = WbMcGetSocket(pc->master);
+	uint32 events = EPOLLIN;
+
+	if (pc->state != PL_READY && (WbMcWaitEvents(pc->master) & MC_WAIT_WRITE))
+		events |= EPOLLOUT;
+
+	if (fd == pc->fd && events == pc->events)
+		return;
+
+	if (pc->fd >= 0 && fd != pc->fd)
+		WbEvDelete(pc->fd);
+	if (fd >= 0)
+		WbEvAdd(fd, events, &poolTag);
+	pc->fd = fd;
+	pc->events = events;
+}
+
+/*
+ * Move a pooled connection towards ready. Returns false if the connection
+ * failed and has to be thrown away.
+ */
+static bool
+WbPlAdvance(PooledConn *pc)
+{
+	jmp_buf jump;
+	jmp_buf *saveJump = WbErrorJump;
+	volatile bool ok = true;
+
+	if (setjmp(jump) == 0)
+	{
+		WbErrorJump = &jump;
+		switch (pc->state)
+		{
+			case PL_CONNECTING:
+				if (WbMcConnectionReady(pc->master))
+					pc->state = PL_READY;
+				break;
+			case PL_ENDING_STREAM:
+				if (WbMcFinishEndStreaming(pc->master, NULL, NULL))
+					pc->state = PL_READY;
+				break;
+			case PL_READY:
+				ok = WbMcIsAlive(pc->master) && WbMcIsIdle(pc->master);
+				break;
+		}
+		if (ok)
+			WbPlUpdateEvents(pc);
+	}
+	else
+		ok = false;
+	WbErrorJump = saveJump;
+
+	return ok;
+}
+
+static void
+WbPlDrive(PoolKey *key, PooledConn *pc)
+{
+	if (WbPlAdvance(pc))
+		return;
+
+	log_info("Dropping pooled connection to %s", key->conninfo);
+	if (pc->state == PL_CONNECTING)
+		key->lastFailure = time(NULL);
+	WbPlRemove(key, pc, true);
+}
+
+void
+WbPlProcessEvents()
+{
+	int i;
+
+	for (i = 0; i < numPoolKeys; i++)
+	{
+		PoolKey *key = &(poolKeys[i]);
+		PooledConn *pc;
+		PooledConn *next;
+
+		for (pc = key->conns; pc; pc = next)
+		{
+			next = pc->next;
+			WbPlDrive(key, pc);
+		}
+	}
+}
+
+static bool
+WbPlStartConnection(PoolKey *key)
+{
+	jmp_buf jump;
+	jmp_buf *saveJump = WbErrorJump;
+	MasterConn * volatile master = NULL;
+
+	if (setjmp(jump) == 0)
+	{
+		WbErrorJump = &jump;
+		master = WbMcStartConnection(key->conninfo);
+	}
+	WbErrorJump = saveJump;
+
+	if (!master)
+	{
+		key->lastFailure = time(NULL);
+		return false;
+	}
+
+	log_debug1("Opening pooled connection to %s", key->conninfo);
+	WbPlAdd(key, master, PL_CONNECTING);
+	return true;
+}
+
+/*
+ * Top up the pool, holding off on connection strings that recently failed.
+ */
+void
+WbPlMaintain()
+{
+	time_t now;
+	int i;
+
+	if (!WbPlEnabled())
+		return;
+
+	now = time(NULL);
+	for (i = 0; i < numPoolKeys; i++)
+	{
+		PoolKey *key = &(poolKeys[i]);
+
+		if (now - key->lastFailure < POOL_RETRY_INTERVAL)
+			continue;
+
+		while (key->nconns < CurrentConfig->pool.size)
+			if (!WbPlStartConnection(key))
+				break;
+	}
+}
+
+/*
+ * Take a connection to the master out of the pool, preferring one that is
+ * ready over one still connecting. Returns NULL if there is none, the
+ * connection string is remembered so that the pool is filled for the next
+ * standby.
+ */
+MasterConn*
+WbPlCheckout(const char *conninfo)
+{
+	PoolKey *key;
+	PooledConn *pc;
+	PooledConn *found = NULL;
+	MasterConn *master;
+
+	if (!WbPlEnabled())
+		return NULL;
+
+	key = WbPlGetKey(conninfo, true);
+	if (!key)
+		return NULL;
+
+	for (pc = key->conns; pc; pc = pc->next)
+	{
+		if (pc->state == PL_READY && WbMcIsAlive(pc->master))
+		{
+			found = pc;
+			break;
+		}
+		if (pc->state == PL_CONNECTING && !found)
+			found = pc;
+	}
+
+	if (!found)
+		return NULL;
+
+	master = found->master;
+	WbPlRemove(key, found, false);
+	return master;
+}
+
+/*
+ * Take back a standby's connection to the master. A connection that is still
+ * streaming has COPY ended first, anything else that is not idle is closed.
+ */
+void
+WbPlRelease(MasterConn *master)
+{
+	jmp_buf jump;
+	jmp_buf *saveJump = WbErrorJump;
+	PoolKey *key = NULL;
+	volatile PooledConnState state = PL_READY;
+	volatile bool keep = false;
+
+	if (WbPlEnabled())
+		key = WbPlGetKey(WbMcGetConninfo(master), false);
+
+	if (key && key->nconns < CurrentConfig->pool.size)
+	{
+		if (setjmp(jump) == 0)
+		{
+			WbErrorJump = &jump;
+			if (WbMcIsStreaming(master))
+			{
+				HSFeedbackMessage feedback;
+
+				/* Don't let an idle connection hold back vacuum on master */
+				feedback.sendTime = GetCurrentTimestamp();
+				feedback.xmin = InvalidTransactionId;
+				feedback.epoch = 0;
+				WbMcSendFeedback(master, &feedback);
+
+				WbMcSendEndStreaming(master);
+				state = PL_ENDING_STREAM;
+				keep = true;
+			}
+			else
+				keep = WbMcIsIdle(master);
+		}
+		WbErrorJump = saveJump;
+	}
+
+	if (!keep)
+	{
+		WbMcCloseConnection(master);
+		return;
+	}
+
+	log_debug1("Returning connection to %s to the pool", key->conninfo);
+	WbPlAdd(key, master, state);
+}
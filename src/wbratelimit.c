@@ -0,0 +1,168 @@
+#include "wbratelimit.h"
+
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "wbutils.h"
+
+#define RL_BURST_DIVISOR 10		/* buckets hold 1/10 s worth of their rate */
+#define RL_MIN_BURST (16 * 1024)
+
+/*
+ * Tokens are bytes. Sending is charged after the fact, so when sessions
+ * send at the same time tokens can go negative. The debt is paid off by
+ * refilling before anybody can send again.
+ */
+typedef struct {
+	int lock;
+	int64 rate;				/* bytes per second, 0 for no limit */
+	int64 burst;
+	int64 tokens;
+	TimestampTz lastRefill;
+} RateBucket;
+
+/* Bucket 0 is for all standbys, the others by configuration entry id */
+static RateBucket *buckets = NULL;
+static int nbuckets = 0;
+
+static void RlLock(RateBucket *bucket);
+static void RlUnlock(RateBucket *bucket);
+static void RlSetRate(RateBucket *bucket, int rate);
+static int64 RlRefill(RateBucket *bucket, TimestampTz now, TimestampTz *retryAt);
+
+void
+WbRlInit()
+{
+	wb_config_list_entry *item;
+	bool limited = CurrentConfig->max_rate > 0;
+
+	nbuckets = 1;
+	for (item = CurrentConfig->configurations; item; item = item->next)
+	{
+		nbuckets++;
+		limited |= item->entry.max_rate > 0;
+	}
+	if (!limited)
+		return;
+
+	buckets = mmap(NULL, nbuckets * sizeof(RateBucket),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (buckets == MAP_FAILED)
+		error("Could not allocate shared memory for rate limits");
+
+	RlSetRate(&buckets[0], CurrentConfig->max_rate);
+	for (item = CurrentConfig->configurations; item; item = item->next)
+		RlSetRate(&buckets[item->entry.id], item->entry.max_rate);
+}
+
+bool
+WbRlLimited(wb_config_entry *entry)
+{
+	return buckets && entry && (buckets[0].rate || buckets[entry->id].rate);
+}
+
+/*
+ * Number of bytes up to wanted that may be sent now. When nothing may be
+ * sent retryAt is set to when there will be enough again.
+ */
+int
+WbRlAvailable(wb_config_entry *entry, int wanted, TimestampTz *retryAt)
+{
+	TimestampTz now = GetCurrentTimestamp();
+	int64 available;
+	int64 other;
+
+	available = RlRefill(&buckets[entry->id], now, retryAt);
+	other = RlRefill(&buckets[0], now, retryAt);
+	if (other < available)
+		available = other;
+
+	if (available <= 0)
+		return 0;
+	return available < wanted ? available : wanted;
+}
+
+void
+WbRlCharge(wb_config_entry *entry, int bytes)
+{
+	RateBucket *bucket = &buckets[entry->id];
+
+	if (bucket->rate)
+	{
+		RlLock(bucket);
+		bucket->tokens -= bytes;
+		RlUnlock(bucket);
+	}
+	bucket = &buckets[0];
+	if (bucket->rate)
+	{
+		RlLock(bucket);
+		bucket->tokens -= bytes;
+		RlUnlock(bucket);
+	}
+}
+
+static void
+RlLock(RateBucket *bucket)
+{
+	while (__atomic_test_and_set(&(bucket->lock), __ATOMIC_ACQUIRE))
+		;
+}
+
+static void
+RlUnlock(RateBucket *bucket)
+{
+	__atomic_clear(&(bucket->lock), __ATOMIC_RELEASE);
+}
+
+/* Rate in kilobytes per second */
+static void
+RlSetRate(RateBucket *bucket, int rate)
+{
+	bucket->rate = (int64) rate * 1024;
+	bucket->burst = bucket->rate / RL_BURST_DIVISOR;
+	if (bucket->burst < RL_MIN_BURST)
+		bucket->burst = RL_MIN_BURST;
+	bucket->tokens = bucket->burst;
+	bucket->lastRefill = GetCurrentTimestamp();
+}
+
+/*
+ * Add the tokens accrued since the last refill and return how many there
+ * are. If there are none, retryAt is moved to when a quarter of the bucket
+ * will be full, unless it is already later.
+ */
+static int64
+RlRefill(RateBucket *bucket, TimestampTz now, TimestampTz *retryAt)
+{
+	TimestampTz elapsed;
+	int64 tokens;
+
+	if (!bucket->rate)
+		return INT64_MAX;
+
+	RlLock(bucket);
+	elapsed = now - bucket->lastRefill;
+	if (elapsed >= (bucket->burst - bucket->tokens) * 1000000 / bucket->rate)
+	{
+		bucket->tokens = bucket->burst;
+		bucket->lastRefill = now;
+	}
+	else if (elapsed * bucket->rate >= 1000000)
+	{
+		/* Time is only used up once it is worth a byte */
+		bucket->tokens += elapsed * bucket->rate / 1000000;
+		bucket->lastRefill = now;
+	}
+	tokens = bucket->tokens;
+	RlUnlock(bucket);
+
+	if (tokens <= 0)
+	{
+		TimestampTz refilled = now + (bucket->burst / 4 - tokens) * 1000000 / bucket->rate;
+
+		if (refilled > *retryAt)
+			*retryAt = refilled;
+	}
+	return tokens;
+}
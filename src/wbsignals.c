@@ -1,10 +1,17 @@
+#include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <unistd.h>
 
 #include "wbsignals.h"
+#include "wbutils.h"
 
 sig_atomic_t stopRequested = false;
 
+static int latchPipe[2] = {-1, -1};
+
 static void RequestStopHandler(int signum);
+static void LatchSignalHandler(int signum);
 
 static void
 RequestStopHandler(int signum)
@@ -15,4 +22,69 @@ RequestStopHandler(int signum)
 void WbInitializeSignals()
 {
 	signal(SIGINT, RequestStopHandler);
+	/* A standby going away must not take down the other sessions */
+	signal(SIGPIPE, SIG_IGN);
+}
+
+/*
+ * Latches are modelled after PostgreSQL: another process sets our latch by
+ * sending SIGUSR1, the handler writes a byte into a self-pipe and the read
+ * end of the pipe can be waited on together with sockets.
+ *
+ * Must be called in every process that waits on its latch, after fork, so
+ * that siblings don't share the pipe.
+ */
+void
+WbInitLatch()
+{
+	if (latchPipe[0] >= 0)
+	{
+		close(latchPipe[0]);
+		close(latchPipe[1]);
+	}
+
+	if (pipe(latchPipe))
+		error("Could not create latch pipe");
+
+	if (fcntl(latchPipe[0], F_SETFL, O_NONBLOCK) ||
+			fcntl(latchPipe[1], F_SETFL, O_NONBLOCK))
+		error("Could not set latch pipe to nonblocking");
+
+	signal(SIGUSR1, LatchSignalHandler);
+}
+
+static void
+LatchSignalHandler(int signum)
+{
+	int save_errno = errno;
+	char c = 0;
+	ssize_t rc;
+
+	/* A full pipe is fine, the latch is set already. */
+	rc = write(latchPipe[1], &c, 1);
+	(void) rc;
+
+	errno = save_errno;
+}
+
+void
+WbSetLatch(pid_t pid)
+{
+	if (pid > 0)
+		kill(pid, SIGUSR1);
+}
+
+int
+WbLatchGetSocket()
+{
+	return latchPipe[0];
+}
+
+void
+WbResetLatch()
+{
+	char buf[64];
+
+	while (read(latchPipe[0], buf, sizeof(buf)) > 0)
+		;
 }
@@ -0,0 +1,419 @@
+#include "wbslots.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "wbconfig.h"
+#include "wbpgtypes.h"
+#include "wbutils.h"
+
+#define SLOTS_FILE "slots"
+#define SLOTS_TEMP_FILE "slots.tmp"
+
+typedef struct {
+	bool inUse;
+	char name[WB_SLOT_NAMELEN];
+	XLogRecPtr restartPtr;	/* 0 until a standby streamed from the slot */
+	XLogRecPtr savedPtr;	/* restartPtr as last written to the slots file */
+	pid_t active;			/* process streaming from the slot, if any */
+} ReplSlot;
+
+/*
+ * Only one process writes the slots file at a time. Others set dirty, the
+ * saver writes the file again until nobody changed anything in the meantime.
+ */
+typedef struct {
+	int lock;
+	pid_t saver;
+	bool dirty;
+	XLogRecPtr retainPtr;
+	int nslots;
+	ReplSlot slots[1];
+} SlotShmem;
+
+static SlotShmem *shm = NULL;
+static char slotsPath[1024];
+static char tempPath[1024];
+
+static void SlLock();
+static void SlUnlock();
+static bool SlValidName(const char *name);
+static ReplSlot* SlFind(const char *name);
+static void SlUpdateRetainPtr();
+static void SlLoad();
+static void SlSave();
+static void SlWrite(ReplSlot *snapshot);
+
+void
+WbSlInit()
+{
+	int nslots = CurrentConfig->wal_cache.max_slots;
+
+	if (!CurrentConfig->wal_cache.enabled || nslots < 1)
+		return;
+
+	shm = mmap(NULL, offsetof(SlotShmem, slots) + nslots * sizeof(ReplSlot),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shm == MAP_FAILED)
+		error("Could not allocate shared memory for replication slots");
+	shm->nslots = nslots;
+
+	snprintf(slotsPath, sizeof(slotsPath), "%s/%s", CurrentConfig->wal_cache.directory, SLOTS_FILE);
+	snprintf(tempPath, sizeof(tempPath), "%s/%s", CurrentConfig->wal_cache.directory, SLOTS_TEMP_FILE);
+	SlLoad();
+}
+
+bool
+WbSlEnabled()
+{
+	return shm != NULL;
+}
+
+/*
+ * Slots of a process that died are free to be streamed from again. If it died
+ * saving the slots file, the file is saved again. This allocates and writes
+ * files, so the postmaster calls it from its main loop, not the signal
+ * handler.
+ */
+void
+WbSlProcessExited(pid_t pid)
+{
+	bool resave = false;
+	int i;
+
+	if (!shm)
+		return;
+
+	SlLock();
+	for (i = 0; i < shm->nslots; i++)
+		if (shm->slots[i].active == pid)
+			shm->slots[i].active = 0;
+	if (shm->saver == pid)
+	{
+		shm->saver = 0;
+		resave = true;
+	}
+	SlUnlock();
+
+	if (resave)
+		SlSave();
+}
+
+static void
+SlLock()
+{
+	while (__atomic_test_and_set(&(shm->lock), __ATOMIC_ACQUIRE))
+		;
+}
+
+static void
+SlUnlock()
+{
+	__atomic_clear(&(shm->lock), __ATOMIC_RELEASE);
+}
+
+/* Same rules as PostgreSQL, so that standbys can move between servers */
+static bool
+SlValidName(const char *name)
+{
+	const char *c;
+
+	if (!name[0] || strlen(name) >= WB_SLOT_NAMELEN)
+		return false;
+	for (c = name; *c; c++)
+		if (!((*c >= 'a' && *c <= 'z') || (*c >= '0' && *c <= '9') || *c == '_'))
+			return false;
+	return true;
+}
+
+static ReplSlot*
+SlFind(const char *name)
+{
+	int i;
+
+	for (i = 0; i < shm->nslots; i++)
+		if (shm->slots[i].inUse && strcmp(shm->slots[i].name, name) == 0)
+			return &(shm->slots[i]);
+	return NULL;
+}
+
+static void
+SlUpdateRetainPtr()
+{
+	XLogRecPtr retain = InvalidXLogRecPtr;
+	int i;
+
+	for (i = 0; i < shm->nslots; i++)
+	{
+		ReplSlot *slot = &(shm->slots[i]);
+
+		if (slot->inUse && slot->restartPtr && (!retain || slot->restartPtr < retain))
+			retain = slot->restartPtr;
+	}
+	shm->retainPtr = retain;
+}
+
+/* One line per slot, its name and restart position */
+static void
+SlLoad()
+{
+	FILE *f = fopen(slotsPath, "r");
+	char name[WB_SLOT_NAMELEN];
+	uint32 hi, lo;
+	int n = 0;
+
+	if (!f)
+	{
+		if (errno != ENOENT)
+			error("Could not open replication slots file %s: %s", slotsPath, strerror(errno));
+		return;
+	}
+
+	while (fscanf(f, "%63s %X/%X\n", name, &hi, &lo) == 3)
+	{
+		ReplSlot *slot;
+
+		if (n >= shm->nslots)
+			error("Replication slots file %s has more slots than max_slots allows", slotsPath);
+		slot = &(shm->slots[n++]);
+		slot->inUse = true;
+		strcpy(slot->name, name);
+		slot->restartPtr = ((XLogRecPtr) hi << 32) | lo;
+		slot->savedPtr = slot->restartPtr;
+		log_info("Loaded replication slot %s at %X/%X", name, hi, lo);
+	}
+	if (!feof(f))
+		error("Could not parse replication slots file %s", slotsPath);
+	fclose(f);
+
+	SlUpdateRetainPtr();
+}
+
+/*
+ * Make the current state of the slots durable. Returns without waiting if
+ * another process is saving, it will pick up our changes.
+ */
+static void
+SlSave()
+{
+	ReplSlot *snapshot = wballoc(shm->nslots * sizeof(ReplSlot));
+	int i;
+
+	SlLock();
+	shm->dirty = true;
+	if (shm->saver)
+	{
+		SlUnlock();
+		wbfree(snapshot);
+		return;
+	}
+	shm->saver = getpid();
+
+	while (shm->dirty)
+	{
+		shm->dirty = false;
+		for (i = 0; i < shm->nslots; i++)
+			shm->slots[i].savedPtr = shm->slots[i].restartPtr;
+		memcpy(snapshot, shm->slots, shm->nslots * sizeof(ReplSlot));
+		SlUnlock();
+
+		SlWrite(snapshot);
+
+		SlLock();
+	}
+	shm->saver = 0;
+	SlUnlock();
+
+	wbfree(snapshot);
+}
+
+static void
+SlWrite(ReplSlot *snapshot)
+{
+	FILE *f = fopen(tempPath, "w");
+	int i;
+
+	if (!f)
+	{
+		log_error("Could not write replication slots file %s: %s", tempPath, strerror(errno));
+		return;
+	}
+
+	for (i = 0; i < shm->nslots; i++)
+		if (snapshot[i].inUse)
+			fprintf(f, "%s %X/%X\n", snapshot[i].name, FormatRecPtr(snapshot[i].restartPtr));
+
+	if (fflush(f) != 0 || fsync(fileno(f)) != 0)
+		log_error("Could not sync replication slots file %s: %s", tempPath, strerror(errno));
+	fclose(f);
+
+	if (rename(tempPath, slotsPath) != 0)
+		log_error("Could not rename replication slots file to %s: %s", slotsPath, strerror(errno));
+}
+
+WbSlotResult
+WbSlCreate(const char *name)
+{
+	ReplSlot *unused = NULL;
+	int i;
+
+	if (!SlValidName(name))
+		return SLOT_INVALID_NAME;
+
+	SlLock();
+	if (SlFind(name))
+	{
+		SlUnlock();
+		return SLOT_EXISTS;
+	}
+	for (i = 0; i < shm->nslots && !unused; i++)
+		if (!shm->slots[i].inUse)
+			unused = &(shm->slots[i]);
+	if (!unused)
+	{
+		SlUnlock();
+		return SLOT_NO_SPACE;
+	}
+	unused->inUse = true;
+	strcpy(unused->name, name);
+	unused->restartPtr = InvalidXLogRecPtr;
+	unused->savedPtr = InvalidXLogRecPtr;
+	unused->active = 0;
+	SlUnlock();
+
+	log_info("Created replication slot %s", name);
+	SlSave();
+	return SLOT_OK;
+}
+
+WbSlotResult
+WbSlDrop(const char *name)
+{
+	ReplSlot *slot;
+
+	SlLock();
+	slot = SlFind(name);
+	if (!slot || slot->active)
+	{
+		SlUnlock();
+		return slot ? SLOT_ACTIVE : SLOT_NOT_FOUND;
+	}
+	slot->inUse = false;
+	SlUpdateRetainPtr();
+	SlUnlock();
+
+	log_info("Dropped replication slot %s", name);
+	SlSave();
+	return SLOT_OK;
+}
+
+/*
+ * Mark the slot as streamed from by the calling session. A slot starts to
+ * retain WAL at the position it is first streamed from.
+ */
+WbSlotResult
+WbSlAcquire(const char *name, XLogRecPtr startPos, int *slotno)
+{
+	ReplSlot *slot;
+	bool save = false;
+
+	SlLock();
+	slot = SlFind(name);
+	if (!slot || slot->active)
+	{
+		SlUnlock();
+		return slot ? SLOT_ACTIVE : SLOT_NOT_FOUND;
+	}
+	slot->active = getpid();
+	if (!slot->restartPtr)
+	{
+		slot->restartPtr = startPos;
+		SlUpdateRetainPtr();
+		save = true;
+	}
+	*slotno = slot - shm->slots + 1;
+	SlUnlock();
+
+	if (save)
+		SlSave();
+	return SLOT_OK;
+}
+
+void
+WbSlRelease(int slotno)
+{
+	if (!shm || !slotno)
+		return;
+
+	SlLock();
+	shm->slots[slotno - 1].active = 0;
+	SlUnlock();
+}
+
+/*
+ * The standby has flushed WAL up to flushPtr, it doesn't need anything before
+ * that anymore. The slots file is only rewritten once a segment is passed,
+ * after a crash the slot retains a bit more than it needs to.
+ */
+void
+WbSlAdvance(int slotno, XLogRecPtr flushPtr)
+{
+	ReplSlot *slot;
+	bool save = false;
+
+	if (!shm || !slotno)
+		return;
+
+	slot = &(shm->slots[slotno - 1]);
+	SlLock();
+	if (flushPtr > slot->restartPtr)
+	{
+		slot->restartPtr = flushPtr;
+		SlUpdateRetainPtr();
+		save = flushPtr / XLogSegSize != slot->savedPtr / XLogSegSize;
+	}
+	SlUnlock();
+
+	if (save)
+		SlSave();
+}
+
+const char*
+WbSlResultMessage(WbSlotResult result)
+{
+	switch (result)
+	{
+		case SLOT_OK:
+			return "Success";
+		case SLOT_INVALID_NAME:
+			return "Replication slot names may only contain lower case letters, numbers and the underscore character";
+		case SLOT_EXISTS:
+			return "Replication slot already exists";
+		case SLOT_NOT_FOUND:
+			return "Replication slot does not exist";
+		case SLOT_ACTIVE:
+			return "Replication slot is active";
+		case SLOT_NO_SPACE:
+			return "All replication slots are in use";
+	}
+	return "Unknown replication slot error";
+}
+
+XLogRecPtr
+WbSlRetainPtr()
+{
+	XLogRecPtr retain;
+
+	if (!shm)
+		return InvalidXLogRecPtr;
+
+	SlLock();
+	retain = shm->retainPtr;
+	SlUnlock();
+
+	return retain;
+}
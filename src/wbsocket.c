@@ -4,19 +4,33 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#include "wbratelimit.h"
 #include "wbsocket.h"
+#include "wbtls.h"
 #include "wbutils.h"
 
-#define BACKLOG 10
+#define BACKLOG 128
 #define SEND_BUFFER_INIT_SIZE (256*1024)
-#define RECV_BUFFER_SIZE 8192
+#define RECV_BUFFER_INIT_SIZE 8192
+#define MAX_MESSAGE_LENGTH (1024*1024)
+#define MAX_MESSAGE_DATA_PARTS 4
+
+static void LockUnixSocket(const char *lockPath);
+static bool ConnSetNonBlocking(WbConn conn, bool nonblocking);
+static int ConnSend(WbConn conn, const char *buf, int len, int flags);
+static int ConnNextMessage(WbConn conn, int *type, char **data, int *msglen);
 
 WbSocket
 OpenServerSocket(int port)
@@ -27,7 +41,7 @@ OpenServerSocket(int port)
 	int yes=1;
 	char port_str[6];
 
-	WbSocket sock = wballoc(sizeof(WbSocketStruct));
+	WbSocket sock = wballoc0(sizeof(WbSocketStruct));
 
 	snprintf(port_str, 6, "%d", port);
 	log_info("Starting socket on port %s", port_str);
@@ -48,27 +62,151 @@ OpenServerSocket(int port)
 
 	if (setsockopt(sock->fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1)
 	    error("setsockopt");
+	/* Every worker has its own listen socket, the kernel spreads connections */
+	if (setsockopt(sock->fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1)
+	    error("setsockopt");
 
 	if (bind(sock->fd, res->ai_addr, res->ai_addrlen))
 		error("Bind failed");
 	if (listen(sock->fd, BACKLOG))
 		error("Listen failed");
+	if (fcntl(sock->fd, F_SETFL, O_NONBLOCK) == -1)
+		error("Could not set listen socket to nonblocking");
 
 	freeaddrinfo(res);
 
 	return sock;
 }
 
+/*
+ * Listen on directory/.s.PGSQL.port like PostgreSQL does, so that standbys
+ * on the same host can connect with host set to the directory. The socket
+ * is shared by all workers, it can't be bound more than once. A lock file
+ * with our PID guards it, like PostgreSQL's does.
+ */
+WbSocket
+OpenUnixServerSocket(const char *directory, int port)
+{
+	struct sockaddr_un addr;
+	WbSocket sock = wballoc0(sizeof(WbSocketStruct));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/.s.PGSQL.%d", directory, port) >=
+			sizeof(addr.sun_path))
+		error("Unix socket path %s/.s.PGSQL.%d is too long", directory, port);
+	log_info("Starting Unix socket %s", addr.sun_path);
+
+	sock->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock->fd < 0)
+		error("Could not create Unix socket: %s", strerror(errno));
+
+	if (asprintf(&(sock->lockPath), "%s.lock", addr.sun_path) < 0)
+		error("Out of memory");
+	LockUnixSocket(sock->lockPath);
+
+	/* Left over from a process that didn't shut down cleanly */
+	if (unlink(addr.sun_path) != 0 && errno != ENOENT)
+		error("Could not remove old Unix socket %s: %s", addr.sun_path, strerror(errno));
+	if (bind(sock->fd, (struct sockaddr *) &addr, sizeof(addr)))
+		error("Bind to %s failed: %s", addr.sun_path, strerror(errno));
+	sock->path = wbstrdup(addr.sun_path);
+	/* Access is checked when the standby authenticates, like for TCP */
+	if (chmod(sock->path, 0777) != 0)
+		error("Could not set permissions of %s: %s", sock->path, strerror(errno));
+	if (listen(sock->fd, BACKLOG))
+		error("Listen failed");
+	if (fcntl(sock->fd, F_SETFL, O_NONBLOCK) == -1)
+		error("Could not set listen socket to nonblocking");
+
+	return sock;
+}
+
+/*
+ * Create the lock file of a Unix socket. A lock file whose process is gone
+ * was left over by a crash and is replaced, otherwise the socket belongs to
+ * a running walbouncer or PostgreSQL server and we must not touch it.
+ */
+static void
+LockUnixSocket(const char *lockPath)
+{
+	char buf[32];
+	int attempt;
+	int fd;
+	int len;
+
+	for (attempt = 0; ; attempt++)
+	{
+		pid_t owner;
+
+		fd = open(lockPath, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd >= 0)
+			break;
+		if (errno != EEXIST || attempt >= 100)
+			error("Could not create lock file %s: %s", lockPath, strerror(errno));
+
+		fd = open(lockPath, O_RDONLY);
+		if (fd < 0)
+		{
+			/* Removed in the meantime, try again */
+			if (errno == ENOENT)
+				continue;
+			error("Could not open lock file %s: %s", lockPath, strerror(errno));
+		}
+		len = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		if (len < 0)
+			error("Could not read lock file %s: %s", lockPath, strerror(errno));
+		buf[len] = '\0';
+
+		/* Being written by its owner right now, give it a moment */
+		owner = atoi(buf);
+		if (owner <= 0)
+		{
+			if (attempt >= 10)
+				error("Lock file %s is empty, remove it if no server is running", lockPath);
+			usleep(100000);
+			continue;
+		}
+		if (owner != getpid() && (kill(owner, 0) == 0 || errno != ESRCH))
+			error("Lock file %s is held by process %d, is another server running?",
+					lockPath, owner);
+
+		if (unlink(lockPath) != 0 && errno != ENOENT)
+			error("Could not remove old lock file %s: %s", lockPath, strerror(errno));
+	}
+
+	len = snprintf(buf, sizeof(buf), "%d\n", (int) getpid());
+	if (write(fd, buf, len) != len)
+		error("Could not write lock file %s: %s", lockPath, strerror(errno));
+	close(fd);
+}
+
+/*
+ * Accept a new connection. The listen socket is nonblocking, returns NULL
+ * when there are no more connections waiting.
+ */
 WbConn
 ConnCreate(WbSocket server)
 {
 	struct sockaddr_storage their_addr;
 	socklen_t addr_size = sizeof(struct sockaddr_storage);
-	WbConn conn = wballoc0(sizeof(WbPortStruct));
+	WbConn conn;
+	int fd;
+
+	fd = accept(server->fd, (struct sockaddr *) &their_addr, &addr_size);
+	if (fd < 0)
+	{
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+				errno != ECONNABORTED)
+			log_error("Could not accept connection: %s", strerror(errno));
+		return NULL;
+	}
 
-	log_debug2("Waiting for connections...");
-	conn->fd = accept(server->fd, (struct sockaddr *) &their_addr, &addr_size);
-	//FIXME: handle errors here
+	conn = wballoc0(sizeof(WbPortStruct));
+	conn->fd = fd;
+	if (!ConnSetNonBlocking(conn, true))
+		error("Could not set client socket to nonblocking");
 
 	if (their_addr.ss_family == AF_INET)
 	{
@@ -76,10 +214,14 @@ ConnCreate(WbSocket server)
 		conn->client.addr = ip_addr->sin_addr.s_addr;
 		conn->client.port = ip_addr->sin_port;
 	}
+	else if (their_addr.ss_family == AF_UNIX)
+		conn->client.local = true;
 
-	conn->recvBuffer = wballoc(RECV_BUFFER_SIZE);
+	conn->recvBuffer = wballoc(RECV_BUFFER_INIT_SIZE);
+	conn->recvBufSize = RECV_BUFFER_INIT_SIZE;
 	conn->recvPointer = 0;
 	conn->recvLength = 0;
+	conn->recvReady = true;
 
 	conn->sendBuffer = wballoc(SEND_BUFFER_INIT_SIZE);
 	conn->sendBufSize = SEND_BUFFER_INIT_SIZE;
@@ -95,6 +237,9 @@ ConnCreate(WbSocket server)
 	conn->replyForwarded = true;
 	conn->feedbackForwarded = true;
 
+	conn->state = CONN_STARTUP;
+	conn->upstreamFd = -1;
+
 	return conn;
 }
 
@@ -121,9 +266,23 @@ ConnFlush(WbConn conn, ConnFlushMode mode)
 	while (remaining > 0)
 	{
 		int r;
+		int len = remaining;
 		log_debug1("Conn: Sending to client %d bytes of data", remaining);
 
-		r = send(conn->fd, conn->sendBuffer + sent, remaining, flags);
+		/* What has to go out right away is charged, but never held back */
+		if (mode == FLUSH_ASYNC && WbRlLimited(conn->configEntry))
+		{
+			conn->throttledUntil = 0;
+			len = WbRlAvailable(conn->configEntry, remaining, &(conn->throttledUntil));
+			if (len == 0)
+			{
+				log_debug1("Sending out data to client is throttled.");
+				conn->sendBufFlushPtr = sent;
+				return 0;
+			}
+		}
+
+		r = ConnSend(conn, conn->sendBuffer + sent, len, flags);
 		if (r <= 0)
 		{
 			if (errno == EINTR)
@@ -141,6 +300,8 @@ ConnFlush(WbConn conn, ConnFlushMode mode)
 			error("Could not send data to client");
 			return EOF;
 		}
+		if (WbRlLimited(conn->configEntry))
+			WbRlCharge(conn->configEntry, r);
 		sent += r;
 		if (r < remaining)
 			log_debug1("Sent out %d/%d bytes", sent, remaining);
@@ -157,7 +318,16 @@ ConnFlush(WbConn conn, ConnFlushMode mode)
 	return 0;
 }
 
-bool
+/* With kernel TLS the kernel encrypts what is sent on the socket */
+static int
+ConnSend(WbConn conn, const char *buf, int len, int flags)
+{
+	if (conn->ssl && !conn->ktlsSend)
+		return WbTlWrite(conn->ssl, buf, len);
+	return send(conn->fd, buf, len, flags);
+}
+
+static bool
 ConnSetNonBlocking(WbConn conn, bool nonblocking)
 {
 	if (nonblocking)
@@ -173,6 +343,15 @@ ConnSetNonBlocking(WbConn conn, bool nonblocking)
 	}
 }
 
+/*
+ * Read whatever the client has sent without blocking. Returns the number of
+ * bytes read, 0 if nothing is available and EOF on end of file.
+ *
+ * The socket is edge triggered, so once a read comes back short we know it
+ * is drained and don't ask again until epoll reports new data. Over SSL a
+ * short read only means the record ended, the socket is drained once
+ * OpenSSL would block.
+ */
 static int
 ConnRecvBuf(WbConn conn)
 {
@@ -189,17 +368,27 @@ ConnRecvBuf(WbConn conn)
 			conn->recvLength = conn->recvPointer = 0;
 	}
 
-	ConnSetNonBlocking(conn, false);
+	if (!conn->recvReady && !WbTlPending(conn->ssl))
+		return 0;
 
 	for (;;)
 	{
+		int space = conn->recvBufSize - conn->recvLength;
 		int r;
-		r = recv(conn->fd, conn->recvBuffer + conn->recvLength,
-				RECV_BUFFER_SIZE - conn->recvLength, 0);
+
+		if (conn->ssl)
+			r = WbTlRead(conn->ssl, conn->recvBuffer + conn->recvLength, space);
+		else
+			r = recv(conn->fd, conn->recvBuffer + conn->recvLength, space, 0);
 		if (r < 0)
 		{
 			if (errno == EINTR)
 				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				conn->recvReady = false;
+				return 0;
+			}
 
 			log_error("Could not read from socket");
 			return EOF;
@@ -208,88 +397,39 @@ ConnRecvBuf(WbConn conn)
 		{
 			return EOF;
 		}
+		if (r < space && !conn->ssl)
+			conn->recvReady = false;
 		conn->recvLength += r;
-		return 0;
-	}
-	// silence the compiler
-	Assert(false);
-	return EOF;
-}
-
-int
-ConnGetBytes(WbConn conn, char *s, size_t len)
-{
-	size_t amount;
-
-	while (len > 0)
-	{
-		while (conn->recvPointer >= conn->recvLength)
-		{
-			if (ConnRecvBuf(conn))
-				return EOF;
-		}
-		amount = conn->recvLength - conn->recvPointer;
-		if (amount > len)
-			amount = len;
-		memcpy(s, conn->recvBuffer + conn->recvPointer, amount);
-		conn->recvPointer += amount;
-		s += amount;
-		len -= amount;
+		return r;
 	}
-	return 0;
 }
 
-int
-ConnGetByteIfAvailable(WbConn conn, char *c)
+static void
+ConnEnsureRecvSpace(WbConn conn, int amount)
 {
-	int			r;
-
-	if (conn->recvPointer < conn->recvLength)
-	{
-		*c = conn->recvBuffer[conn->recvPointer++];
-		return 1;
-	}
-
-	/* Put the socket into non-blocking mode */
-	ConnSetNonBlocking(conn, true);
-
-	r = recv(conn->fd, c, 1, 0);
-
-	ConnSetNonBlocking(conn, false);
-
-	if (r < 0)
-	{
-		/*
-		 * Ok if no data available without blocking or interrupted (though
-		 * EINTR really shouldn't happen with a non-blocking socket). Report
-		 * other errors.
-		 */
-		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
-			r = 0;
-		else
-		{
-			/*
-			 * Careful: an ereport() that tries to write to the client would
-			 * cause recursion to here, leading to stack overflow and core
-			 * dump!  This message must go *only* to the postmaster log.
-			 */
-			error("could not receive nb data from client");
-			r = EOF;
-		}
-	}
-	else if (r == 0)
+	if (conn->recvBufSize < amount)
 	{
-		/* EOF detected */
-		r = EOF;
+		int new_size = conn->recvBufSize;
+		while (new_size < amount)
+			new_size *= 2;
+		conn->recvBuffer = rewballoc(conn->recvBuffer, new_size);
+		conn->recvBufSize = new_size;
 	}
-
-	return r;
 }
 
 void
 CloseConn(WbConn conn)
 {
+	WbTlClose(conn);
 	close(conn->fd);
+	wbfree(conn->recvBuffer);
+	wbfree(conn->sendBuffer);
+	wbfree(conn->walBatch);
+	wbfree(conn->database_name);
+	wbfree(conn->user_name);
+	wbfree(conn->application_name);
+	wbfree(conn->cmdline_options);
+	wbfree(conn->guc_options);
 	free(conn);
 }
 
@@ -299,6 +439,8 @@ void
 CloseSocket(WbSocket sock)
 {
 	close(sock->fd);
+	wbfree(sock->path);
+	wbfree(sock->lockPath);
 	free(sock);
 }
 
@@ -309,6 +451,8 @@ ConnEnsureFreeSpace(WbConn conn, int amount)
 	if (conn->sendBufSize - conn->sendBufLen < amount)
 	{
 		int new_size = conn->sendBufSize*2;
+		while (new_size - conn->sendBufLen < amount)
+			new_size *= 2;
 		conn->sendBuffer = rewballoc(conn->sendBuffer, new_size);
 		conn->sendBufSize = new_size;
 	}
@@ -335,8 +479,9 @@ ConnBeginMessage(WbConn conn, char type)
 void
 ConnSendInt(WbConn conn, int i, int b)
 {
-	char *target = conn->sendBuffer + conn->sendBufLen;
+	char *target;
 	ConnEnsureFreeSpace(conn, b);
+	target = conn->sendBuffer + conn->sendBufLen;
 
 	switch (b)
 	{
@@ -406,49 +551,165 @@ ConnEndMessage(WbConn conn)
 	conn->sendBufMsgLenPtr = -1;
 }
 
-int
-ConnGetByte(WbConn conn)
+/*
+ * End the message being built with data that is sent from where it is
+ * instead of being copied into the send buffer. The send buffer goes out
+ * along with it in a single writev. Only what the socket doesn't take right
+ * away is copied into the send buffer, to be flushed later.
+ */
+void
+ConnEndMessageWithData(WbConn conn, const struct iovec *data, int ndata)
 {
-	unsigned char value;
-	if (ConnGetBytes(conn, (char*) &value, 1) == EOF)
-		return EOF;
+	struct iovec iov[MAX_MESSAGE_DATA_PARTS + 1];
+	int buffered;
+	int dataLen = 0;
+	int sent;
+	int i;
 
-	return value;
-}
+	Assert(conn->sendBufMsgLenPtr > 0);
+	Assert(ndata <= MAX_MESSAGE_DATA_PARTS);
 
-int
-ConnGetMessage(WbConn conn, WbMessage **msg)
-{
-	int32 len;
-	WbMessage *buf;
+	for (i = 0; i < ndata; i++)
+		dataLen += data[i].iov_len;
+
+	*((uint32*)(conn->sendBuffer + conn->sendBufMsgLenPtr)) =
+		htonl((uint32) (conn->sendBufLen - conn->sendBufMsgLenPtr + dataLen));
+	conn->sendBufMsgLenPtr = -1;
+
+	/*
+	 * Without kernel TLS OpenSSL has to encrypt it, a copy is made anyway.
+	 * Rate limited data may have to wait, it is sent as it is allowed to.
+	 */
+	if ((conn->ssl && !conn->ktlsSend) || WbRlLimited(conn->configEntry))
+	{
+		for (i = 0; i < ndata; i++)
+			ConnSendBytes(conn, data[i].iov_base, data[i].iov_len);
+		ConnFlush(conn, FLUSH_ASYNC);
+		return;
+	}
+
+	buffered = conn->sendBufLen - conn->sendBufFlushPtr;
+	iov[0].iov_base = conn->sendBuffer + conn->sendBufFlushPtr;
+	iov[0].iov_len = buffered;
+	memcpy(iov + 1, data, ndata * sizeof(struct iovec));
 
-	if (ConnGetBytes(conn, (char*) &len, 4) == EOF)
+	do
+		sent = writev(conn->fd, iov, ndata + 1);
+	while (sent < 0 && errno == EINTR);
+	if (sent < 0)
 	{
-		log_error("Unexpeted EOF within message length word");
-		return EOF;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			error("Could not send data to client");
+		sent = 0;
 	}
+	log_debug1("Conn: Sent %d/%d bytes to client without copying", sent, buffered + dataLen);
 
-	len = ntohl(len);
+	if (sent >= buffered)
+	{
+		conn->sendBufFlushPtr = 0;
+		conn->sendBufLen = 0;
+		sent -= buffered;
+	}
+	else
+	{
+		conn->sendBufFlushPtr += sent;
+		sent = 0;
+	}
 
-	if (len < 4)
+	for (i = 0; i < ndata; i++)
 	{
-		log_error("Invalid message length");
-		return EOF;
+		if (sent >= data[i].iov_len)
+		{
+			sent -= data[i].iov_len;
+			continue;
+		}
+		ConnSendBytes(conn, (char*) data[i].iov_base + sent, data[i].iov_len - sent);
+		sent = 0;
 	}
+}
+
+/*
+ * Fetch the next complete message from the client, reading from the socket
+ * as needed. Returns 1 if a message was fetched, 0 if the socket has no
+ * more data for now and EOF on end of file or error. Startup packets have
+ * no type byte, for them pass NULL as type.
+ *
+ * Only returns 0 after the socket has been drained, so the caller can
+ * safely wait for the next edge triggered event.
+ */
+int
+ConnGetMessage(WbConn conn, int *type, WbMessage **msg)
+{
+	WbMessage *buf;
+	char *data;
+	int len;
+	int r;
+
+	r = ConnNextMessage(conn, type, &data, &len);
+	if (r != 1)
+		return r;
 
-	len -= 4;
 	*msg = buf = wballoc(offsetof(WbMessage, data) + len + 1);
 	buf->len = len;
-	if (len > 0)
+	memcpy(buf->data, data, len);
+	buf->data[len] = '\0';
+	return 1;
+}
+
+/*
+ * Same as ConnGetMessage, but the message is left in the receive buffer.
+ * It stays valid until the next message is fetched.
+ */
+int
+ConnGetMessageData(WbConn conn, int *type, char **data, int *len)
+{
+	return ConnNextMessage(conn, type, data, len);
+}
+
+static int
+ConnNextMessage(WbConn conn, int *type, char **data, int *msglen)
+{
+	int hdrlen = type ? 5 : 4;
+
+	for (;;)
 	{
-		if (ConnGetBytes(conn, buf->data, len) == EOF)
+		int avail = conn->recvLength - conn->recvPointer;
+		int r;
+
+		if (avail >= hdrlen)
 		{
-			log_error("Incomplete message from client");
-			return EOF;
+			char *hdr = conn->recvBuffer + conn->recvPointer;
+			int32 len;
+
+			memcpy(&len, hdr + hdrlen - 4, 4);
+			len = ntohl(len);
+
+			if (len < 4 || len > MAX_MESSAGE_LENGTH)
+			{
+				log_error("Invalid message length");
+				return EOF;
+			}
+
+			if (avail >= hdrlen - 4 + len)
+			{
+				len -= 4;
+				*data = hdr + hdrlen;
+				*msglen = len;
+				if (type)
+					*type = (unsigned char) hdr[0];
+				conn->recvPointer += hdrlen + len;
+				return 1;
+			}
+
+			ConnEnsureRecvSpace(conn, hdrlen - 4 + len);
 		}
-		buf->data[len] = '\0';
+
+		r = ConnRecvBuf(conn);
+		if (r == EOF)
+			return EOF;
+		if (r == 0)
+			return 0;
 	}
-	return 0;
 }
 
 void
@@ -0,0 +1,311 @@
+#include "wbspool.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "wbpgtypes.h"
+#include "wbutils.h"
+
+#define SPOOL_FILE_TEMPLATE "walbouncer-spool-XXXXXX"
+
+typedef struct SpoolEntry {
+	struct SpoolEntry *next;
+	WalMsgType type;
+	XLogRecPtr dataStart;
+	XLogRecPtr walEnd;
+	TimestampTz sendTime;
+	int dataLen;
+	char data[1];
+} SpoolEntry;
+
+/* Precedes every message in the spool file */
+typedef struct {
+	WalMsgType type;
+	XLogRecPtr dataStart;
+	XLogRecPtr walEnd;
+	TimestampTz sendTime;
+	int dataLen;
+	int storedLen;			/* equal to dataLen if stored uncompressed */
+} SpoolFileHeader;
+
+struct WbSpool {
+	size_t memoryLimit;
+	off_t diskLimit;
+	char *directory;
+
+	/* Oldest messages are in memory, once anything is on disk newer ones follow there */
+	SpoolEntry *head;
+	SpoolEntry *tail;
+	size_t memoryUsed;
+
+	int fd;
+	off_t readPos;
+	off_t writePos;
+	char *compressBuf;
+	size_t compressBufSize;
+	char *readBuf;
+	size_t readBufSize;
+
+	SpoolEntry *current;	/* handed out by WbSpGet, freed on the next call */
+	bool ended;				/* end of WAL was put in, nothing can follow */
+};
+
+static bool SpOnDisk(WbSpool *spool);
+static void SpWriteFile(WbSpool *spool, ReplMessage *msg);
+static void SpReadFile(WbSpool *spool, ReplMessage *msg);
+static void SpReserve(char **buf, size_t *size, size_t needed);
+
+/*
+ * A diskLimit of 0 keeps the spool in memory only. The file is only created
+ * when it is needed.
+ */
+WbSpool*
+WbSpCreate(size_t memoryLimit, off_t diskLimit, const char *directory)
+{
+	WbSpool *spool = wballoc0(sizeof(WbSpool));
+
+	spool->memoryLimit = memoryLimit;
+	spool->diskLimit = diskLimit;
+	spool->directory = wbstrdup(directory);
+	spool->fd = -1;
+	return spool;
+}
+
+void
+WbSpFree(WbSpool *spool)
+{
+	WbSpReset(spool);
+	if (spool->fd >= 0)
+		close(spool->fd);
+	wbfree(spool->compressBuf);
+	wbfree(spool->readBuf);
+	wbfree(spool->directory);
+	wbfree(spool);
+}
+
+/* Throw away everything spooled, used when streaming is restarted */
+void
+WbSpReset(WbSpool *spool)
+{
+	while (spool->head)
+	{
+		SpoolEntry *next = spool->head->next;
+		wbfree(spool->head);
+		spool->head = next;
+	}
+	spool->tail = NULL;
+	if (spool->current)
+		wbfree(spool->current);
+	spool->current = NULL;
+	spool->memoryUsed = 0;
+
+	if (spool->fd >= 0 && spool->writePos > 0 && ftruncate(spool->fd, 0) != 0)
+		error("Could not truncate spool file: %s", strerror(errno));
+	spool->readPos = 0;
+	spool->writePos = 0;
+	spool->ended = false;
+}
+
+static bool
+SpOnDisk(WbSpool *spool)
+{
+	return spool->readPos < spool->writePos;
+}
+
+bool
+WbSpIsEmpty(WbSpool *spool)
+{
+	return !spool->head && !SpOnDisk(spool);
+}
+
+/*
+ * Whether another message can be put in. The file only shrinks once it has
+ * been read back completely, until then what was read still counts.
+ */
+bool
+WbSpHasRoom(WbSpool *spool)
+{
+	if (spool->ended)
+		return false;
+	if (!SpOnDisk(spool) && spool->memoryUsed < spool->memoryLimit)
+		return true;
+	return spool->writePos < spool->diskLimit;
+}
+
+void
+WbSpPut(WbSpool *spool, ReplMessage *msg)
+{
+	int len = msg->type == MSG_WAL_DATA ? msg->dataLen : 0;
+	SpoolEntry *entry;
+
+	if (msg->type == MSG_END_OF_WAL)
+		spool->ended = true;
+
+	if (SpOnDisk(spool) || spool->memoryUsed >= spool->memoryLimit)
+	{
+		SpWriteFile(spool, msg);
+		return;
+	}
+
+	entry = wballoc(offsetof(SpoolEntry, data) + len);
+	entry->next = NULL;
+	entry->type = msg->type;
+	entry->dataStart = msg->dataStart;
+	entry->walEnd = msg->walEnd;
+	entry->sendTime = msg->sendTime;
+	entry->dataLen = len;
+	memcpy(entry->data, msg->data, len);
+
+	if (spool->tail)
+		spool->tail->next = entry;
+	else
+		spool->head = entry;
+	spool->tail = entry;
+	spool->memoryUsed += offsetof(SpoolEntry, data) + len;
+}
+
+/*
+ * Take the oldest message out of the spool. Its data stays valid until the
+ * next call.
+ */
+bool
+WbSpGet(WbSpool *spool, ReplMessage *msg)
+{
+	if (spool->current)
+	{
+		spool->memoryUsed -= offsetof(SpoolEntry, data) + spool->current->dataLen;
+		wbfree(spool->current);
+		spool->current = NULL;
+	}
+
+	if (spool->head)
+	{
+		SpoolEntry *entry = spool->head;
+
+		spool->head = entry->next;
+		if (!spool->head)
+			spool->tail = NULL;
+		spool->current = entry;
+
+		msg->type = entry->type;
+		msg->dataStart = entry->dataStart;
+		msg->walEnd = entry->walEnd;
+		msg->sendTime = entry->sendTime;
+		msg->dataLen = entry->dataLen;
+		msg->data = entry->data;
+	}
+	else if (SpOnDisk(spool))
+		SpReadFile(spool, msg);
+	else
+	{
+		msg->type = MSG_NOTHING;
+		return false;
+	}
+
+	msg->replyRequested = false;
+	msg->dataPtr = 0;
+	msg->nextPageBoundary = (XLOG_BLCKSZ - msg->dataStart) & (XLOG_BLCKSZ-1);
+	return true;
+}
+
+static void
+SpReserve(char **buf, size_t *size, size_t needed)
+{
+	if (*size >= needed)
+		return;
+	*buf = rewballoc(*buf, needed);
+	*size = needed;
+}
+
+static void
+SpWriteFile(WbSpool *spool, ReplMessage *msg)
+{
+	SpoolFileHeader hdr;
+	uLongf storedLen;
+	char *stored;
+
+	if (spool->fd < 0)
+	{
+		char path[1024];
+
+		snprintf(path, sizeof(path), "%s/%s", spool->directory, SPOOL_FILE_TEMPLATE);
+		spool->fd = mkstemp(path);
+		if (spool->fd < 0)
+			error("Could not create spool file %s: %s", path, strerror(errno));
+		/* Nobody else needs to see it, and it goes away with us */
+		unlink(path);
+		log_info("Spooling WAL for slow standby to %s", spool->directory);
+	}
+
+	hdr.type = msg->type;
+	hdr.dataStart = msg->dataStart;
+	hdr.walEnd = msg->walEnd;
+	hdr.sendTime = msg->sendTime;
+	hdr.dataLen = msg->type == MSG_WAL_DATA ? msg->dataLen : 0;
+
+	/* Store data as is if it doesn't compress */
+	storedLen = compressBound(hdr.dataLen);
+	SpReserve(&(spool->compressBuf), &(spool->compressBufSize), storedLen);
+	if (compress2((Bytef *) spool->compressBuf, &storedLen,
+				(Bytef *) msg->data, hdr.dataLen, Z_BEST_SPEED) == Z_OK &&
+			storedLen < hdr.dataLen)
+	{
+		hdr.storedLen = storedLen;
+		stored = spool->compressBuf;
+	}
+	else
+	{
+		hdr.storedLen = hdr.dataLen;
+		stored = msg->data;
+	}
+
+	if (pwrite(spool->fd, &hdr, sizeof(hdr), spool->writePos) != sizeof(hdr) ||
+			pwrite(spool->fd, stored, hdr.storedLen, spool->writePos + sizeof(hdr)) != hdr.storedLen)
+		error("Could not write to spool file: %s", strerror(errno));
+	spool->writePos += sizeof(hdr) + hdr.storedLen;
+}
+
+static void
+SpReadFile(WbSpool *spool, ReplMessage *msg)
+{
+	SpoolFileHeader hdr;
+
+	if (pread(spool->fd, &hdr, sizeof(hdr), spool->readPos) != sizeof(hdr))
+		error("Could not read from spool file: %s", strerror(errno));
+
+	SpReserve(&(spool->readBuf), &(spool->readBufSize), hdr.dataLen);
+	if (hdr.storedLen < hdr.dataLen)
+	{
+		uLongf dataLen = hdr.dataLen;
+
+		SpReserve(&(spool->compressBuf), &(spool->compressBufSize), hdr.storedLen);
+		if (pread(spool->fd, spool->compressBuf, hdr.storedLen, spool->readPos + sizeof(hdr)) != hdr.storedLen)
+			error("Could not read from spool file: %s", strerror(errno));
+		if (uncompress((Bytef *) spool->readBuf, &dataLen,
+					(Bytef *) spool->compressBuf, hdr.storedLen) != Z_OK ||
+				dataLen != hdr.dataLen)
+			error("Corrupt data in spool file");
+	}
+	else if (pread(spool->fd, spool->readBuf, hdr.dataLen, spool->readPos + sizeof(hdr)) != hdr.dataLen)
+		error("Could not read from spool file: %s", strerror(errno));
+	spool->readPos += sizeof(hdr) + hdr.storedLen;
+
+	/* Start over once everything was read back */
+	if (spool->readPos == spool->writePos)
+	{
+		if (ftruncate(spool->fd, 0) != 0)
+			error("Could not truncate spool file: %s", strerror(errno));
+		spool->readPos = 0;
+		spool->writePos = 0;
+	}
+
+	msg->type = hdr.type;
+	msg->dataStart = hdr.dataStart;
+	msg->walEnd = hdr.walEnd;
+	msg->sendTime = hdr.sendTime;
+	msg->dataLen = hdr.dataLen;
+	msg->data = spool->readBuf;
+}
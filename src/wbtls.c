@@ -0,0 +1,201 @@
+#include "wbtls.h"
+
+#include <errno.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "wbconfig.h"
+#include "wbutils.h"
+
+#define TLS_SESSION_ID_CONTEXT "walbouncer"
+
+static SSL_CTX *serverContext = NULL;
+
+static const char *TlErrorMessage();
+
+void
+WbTlInit()
+{
+	if (!CurrentConfig->ssl.enabled)
+		return;
+
+	serverContext = SSL_CTX_new(TLS_server_method());
+	if (!serverContext)
+		error("Could not create SSL context: %s", TlErrorMessage());
+
+	SSL_CTX_set_min_proto_version(serverContext, TLS1_2_VERSION);
+	if (SSL_CTX_use_certificate_chain_file(serverContext, CurrentConfig->ssl.cert_file) != 1)
+		error("Could not load SSL certificate %s: %s", CurrentConfig->ssl.cert_file, TlErrorMessage());
+	if (SSL_CTX_use_PrivateKey_file(serverContext, CurrentConfig->ssl.key_file, SSL_FILETYPE_PEM) != 1)
+		error("Could not load SSL key %s: %s", CurrentConfig->ssl.key_file, TlErrorMessage());
+	if (SSL_CTX_check_private_key(serverContext) != 1)
+		error("SSL key %s does not match the certificate", CurrentConfig->ssl.key_file);
+
+	/* Writes behave like send on a nonblocking socket */
+	SSL_CTX_set_mode(serverContext, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+	/*
+	 * Tickets are encrypted with keys of the context, workers inherit them.
+	 * The session cache only helps standbys that come back to the same
+	 * worker.
+	 */
+	SSL_CTX_set_session_cache_mode(serverContext, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_set_session_id_context(serverContext, (const unsigned char *) TLS_SESSION_ID_CONTEXT,
+			sizeof(TLS_SESSION_ID_CONTEXT) - 1);
+
+#ifdef SSL_OP_ENABLE_KTLS
+	if (CurrentConfig->ssl.ktls)
+		SSL_CTX_set_options(serverContext, SSL_OP_ENABLE_KTLS);
+#else
+	if (CurrentConfig->ssl.ktls)
+		log_warning("OpenSSL was built without kernel TLS support, encrypting in userspace");
+#endif
+}
+
+bool
+WbTlEnabled()
+{
+	return serverContext != NULL;
+}
+
+/* The client was told to go ahead, it starts the handshake next */
+void
+WbTlStartServer(WbConn conn)
+{
+	conn->ssl = SSL_new(serverContext);
+	if (!conn->ssl)
+		error("Could not create SSL connection: %s", TlErrorMessage());
+	if (SSL_set_fd(conn->ssl, conn->fd) != 1)
+		error("Could not set up SSL connection: %s", TlErrorMessage());
+	SSL_set_accept_state(conn->ssl);
+	conn->sslHandshake = true;
+}
+
+/*
+ * Continue the handshake as far as the socket allows. Returns true once it
+ * is done.
+ */
+bool
+WbTlHandshake(WbConn conn)
+{
+	int r;
+
+	if (!conn->sslHandshake)
+		return true;
+
+	ERR_clear_error();
+	r = SSL_do_handshake(conn->ssl);
+	if (r != 1)
+	{
+		int err = SSL_get_error(conn->ssl, r);
+
+		if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+			return false;
+		error("SSL handshake failed: %s", TlErrorMessage());
+	}
+	conn->sslHandshake = false;
+
+#ifdef SSL_OP_ENABLE_KTLS
+	conn->ktlsSend = BIO_get_ktls_send(SSL_get_wbio(conn->ssl));
+#endif
+	log_info("SSL connection with %s using %s%s%s", SSL_get_version(conn->ssl),
+			SSL_get_cipher(conn->ssl),
+			SSL_session_reused(conn->ssl) ? ", resumed" : "",
+			conn->ktlsSend ? ", kernel TLS send" : "");
+	return true;
+}
+
+/* Say goodbye if the socket takes it, we don't wait for an answer */
+void
+WbTlClose(WbConn conn)
+{
+	if (!conn->ssl)
+		return;
+	if (!conn->sslHandshake)
+	{
+		ERR_clear_error();
+		SSL_shutdown(conn->ssl);
+	}
+	SSL_free(conn->ssl);
+	conn->ssl = NULL;
+}
+
+/* Libpq copes with partial writes, our send buffer may move between them */
+void
+WbTlAdoptClient(SSL *ssl)
+{
+	SSL_set_mode(ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+}
+
+int
+WbTlRead(SSL *ssl, char *buf, int len)
+{
+	int r;
+
+	ERR_clear_error();
+	r = SSL_read(ssl, buf, len);
+	if (r > 0)
+		return r;
+
+	switch (SSL_get_error(ssl, r))
+	{
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			errno = EAGAIN;
+			return -1;
+		case SSL_ERROR_ZERO_RETURN:
+			return 0;
+		case SSL_ERROR_SYSCALL:
+			if (errno == 0)
+				errno = ECONNRESET;
+			return -1;
+		default:
+			log_error("SSL error: %s", TlErrorMessage());
+			errno = ECONNRESET;
+			return -1;
+	}
+}
+
+int
+WbTlWrite(SSL *ssl, const char *buf, int len)
+{
+	int r;
+
+	ERR_clear_error();
+	r = SSL_write(ssl, buf, len);
+	if (r > 0)
+		return r;
+
+	switch (SSL_get_error(ssl, r))
+	{
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			errno = EAGAIN;
+			return -1;
+		case SSL_ERROR_SYSCALL:
+			if (errno == 0)
+				errno = ECONNRESET;
+			return -1;
+		default:
+			log_error("SSL error: %s", TlErrorMessage());
+			errno = ECONNRESET;
+			return -1;
+	}
+}
+
+/* OpenSSL holds on to decrypted data that the socket won't report again */
+bool
+WbTlPending(SSL *ssl)
+{
+	return ssl && SSL_pending(ssl) > 0;
+}
+
+static const char *
+TlErrorMessage()
+{
+	unsigned long err = ERR_get_error();
+
+	if (!err)
+		return "no SSL error reported";
+	return ERR_reason_error_string(err) ? ERR_reason_error_string(err) : "unknown SSL error";
+}
@@ -1,11 +1,19 @@
 #include <arpa/inet.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <string.h>
+#include <sys/time.h>
 #include <time.h>
 #include "wbutils.h"
 
 LogLevel loggingLevel = LOG_INFO;
 
+/*
+ * When set error() jumps here instead of exiting. The event loop uses this
+ * to tear down only the session that hit the error.
+ */
+jmp_buf *WbErrorJump = NULL;
+
 /* Error reporting functions */
 
 void error(const char *message, ...)
@@ -15,6 +23,9 @@ void error(const char *message, ...)
 	vfprintf(stderr, message, args);
 	fprintf(stderr, "\n");
 	va_end(args);
+
+	if (WbErrorJump)
+		longjmp(*WbErrorJump, 1);
 	exit(1);
 }
 
@@ -37,8 +48,7 @@ void do_wb_log(LogLevel logLevel, const char* logLevelStr, const char *file, con
 
 void showPQerror(PGconn *mc, char *message)
 {
-	log_error("%s: %s", message, PQerrorMessage(mc));
-	exit(1);
+	error("%s: %s", message, PQerrorMessage(mc));
 }
 
 /* Memory allocation functions */
@@ -57,7 +67,7 @@ void *wballoc0(size_t amount)
 	memset(result, 0, amount);
 	return result;
 }
-char *wbstrdup(char *s)
+char *wbstrdup(const char *s)
 {
 	char *result = strdup(s);
 	if (!result)
@@ -127,6 +137,32 @@ write32(char *buf, uint32 v)
 #define INT64CONST(x)  ((int64) x)
 #define MAXDATELEN 30
 #define USECS_PER_SEC	INT64CONST(1000000)
+#define POSTGRES_EPOCH_UNIX 946684800
+
+/*
+ * Current time as a PostgreSQL timestamp, microseconds since 2000-01-01.
+ */
+TimestampTz
+GetCurrentTimestamp()
+{
+	struct timeval tp;
+
+	gettimeofday(&tp, NULL);
+
+	return ((TimestampTz) tp.tv_sec - POSTGRES_EPOCH_UNIX) * USECS_PER_SEC
+			+ tp.tv_usec;
+}
+
+bool
+parse_recptr(const char *s, XLogRecPtr *result)
+{
+	uint32 hi, lo;
+
+	if (sscanf(s, "%X/%X", &hi, &lo) != 2)
+		return false;
+	*result = ((uint64) hi << 32) | lo;
+	return true;
+}
 /*
  * Produce a C-string representation of a TimestampTz.
  *
@@ -142,7 +178,7 @@ timestamptz_to_str(TimestampTz t)
 	time_t time;
 	int offset;
 
-	time = (int32) (t / USECS_PER_SEC) + 946684800;
+	time = (int32) (t / USECS_PER_SEC) + POSTGRES_EPOCH_UNIX;
 	gmtime_r(&time, &tm);
 	offset = strftime(buf, MAXDATELEN, "%Y-%m-%d %H:%M:%S", &tm);
 	Assert(offset > 0);
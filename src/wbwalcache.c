@@ -0,0 +1,845 @@
+#include "wbwalcache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "wbconfig.h"
+#include "wbpgtypes.h"
+#include "wbsignals.h"
+#include "wbslots.h"
+#include "wbutils.h"
+
+#define WAL_CACHE_FILE "walcache"
+#define WAL_CACHE_INDEX_FILE "walcache.index"
+#define WAL_CACHE_MAGIC 0x57424331
+#define WAL_CACHE_READ_CHUNK (XLOG_BLCKSZ * 16)
+#define WAL_CACHE_MAX_WAITERS 128
+
+/*
+ * One slot of the cache file. Each slot holds the part of a segment from
+ * validStart to validEnd, it is only ever appended to until it is replaced.
+ * generation changes whenever the slot is given to another segment, readers
+ * check it after copying data out.
+ */
+typedef struct {
+	int profile;			/* 0 for WAL as received, see wbwalcache.h */
+	TimeLineID tli;			/* 0 if the slot is unused */
+	uint64 segno;
+	uint32 validStart;
+	uint32 validEnd;
+	uint32 generation;
+	pid_t writer;			/* process appending to the slot, if any */
+	uint64 lastUsed;
+} WalCacheSlot;
+
+/*
+ * The session currently filtering WAL for a profile, followers wait for it
+ * at the end of the cached output instead of filtering on their own.
+ */
+typedef struct {
+	pid_t producer;
+	uint32 claim;
+	TimeLineID tli;
+	uint32 keepaliveCount;
+	XLogRecPtr walEnd;
+	TimestampTz sendTime;
+	bool replyRequested;
+} WalCacheProfile;
+
+/* A session following the filtered output of a profile */
+typedef struct {
+	pid_t pid;
+	int profile;
+	bool waiting;
+} WalCacheWaiter;
+
+/*
+ * Status of a follower's standby, by waiter. The producer of the profile
+ * passes it on to the master along with its own.
+ */
+typedef struct {
+	XLogRecPtr flushPtr;
+	XLogRecPtr applyPtr;
+	TransactionId xmin;
+	uint32 epoch;
+} WalCacheFollowerStatus;
+
+/*
+ * Mapped from the index file, so that the cache, and WAL retained in it for
+ * replication slots, survives a restart.
+ */
+typedef struct {
+	uint32 magic;
+	int lock;
+	char sysid[32];
+	uint64 clock;
+	uint32 claims;
+	WalCacheWaiter waiters[WAL_CACHE_MAX_WAITERS];
+	int nslots;
+	WalCacheSlot slots[1];
+} WalCacheShmem;
+
+struct WbWalCacheReader {
+	int profile;
+	TimeLineID tli;
+	XLogRecPtr cursor;
+	WalCacheWaiter *waiter;
+	uint32 keepaliveCount;
+	char *buf;
+};
+
+static WalCacheShmem *shm = NULL;
+static char *segments = NULL;
+static int nprofiles = 0;
+static WalCacheProfile *profiles = NULL;
+static WalCacheFollowerStatus *followers = NULL;
+
+static void WcLock();
+static void WcUnlock();
+static WalCacheSlot* WcFind(int profile, TimeLineID tli, uint64 segno);
+static WalCacheSlot* WcReplace(int profile, TimeLineID tli, uint64 segno, uint32 offset);
+static uint32 WcReadableEnd(WalCacheSlot *slot);
+static bool WcIsCachedLocked(int profile, TimeLineID tli, XLogRecPtr pos);
+static bool WcIsCached(int profile, TimeLineID tli, XLogRecPtr pos);
+static void WcWriteSegment(int profile, TimeLineID tli, uint64 segno, uint32 offset, const char *data, int len);
+static void WcWakeWaiters(int profile);
+static void WcWakeProducer(int profile);
+static int WcOpen(const char *name, size_t size, bool *reused);
+static void WcRecover();
+static void WcVerifySlot(WalCacheSlot *slot);
+
+void
+WbWcInit()
+{
+	wb_config_list_entry *item;
+	size_t size;
+	int nslots;
+	int fd;
+	bool reused = true;
+
+	if (!CurrentConfig->wal_cache.enabled)
+		return;
+
+	nprofiles = 1;
+	for (item = CurrentConfig->configurations; item; item = item->next)
+		nprofiles++;
+
+	nslots = (uint64) CurrentConfig->wal_cache.size * 1024 * 1024 / XLogSegSize;
+	if (nslots < 1)
+		nslots = 1;
+
+	if (mkdir(CurrentConfig->wal_cache.directory, 0700) != 0 && errno != EEXIST)
+		error("Could not create WAL cache directory %s: %s",
+				CurrentConfig->wal_cache.directory, strerror(errno));
+
+	size = (size_t) nslots * XLogSegSize;
+	fd = WcOpen(WAL_CACHE_FILE, size, &reused);
+	segments = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (segments == MAP_FAILED)
+		error("Could not map WAL cache file: %s", strerror(errno));
+	close(fd);
+
+	size = offsetof(WalCacheShmem, slots) + nslots * sizeof(WalCacheSlot);
+	fd = WcOpen(WAL_CACHE_INDEX_FILE, size, &reused);
+	shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED)
+		error("Could not map WAL cache index file: %s", strerror(errno));
+	close(fd);
+
+	profiles = mmap(NULL, nprofiles * sizeof(WalCacheProfile),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (profiles == MAP_FAILED)
+		error("Could not allocate shared memory for WAL cache");
+
+	followers = mmap(NULL, WAL_CACHE_MAX_WAITERS * sizeof(WalCacheFollowerStatus),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (followers == MAP_FAILED)
+		error("Could not allocate shared memory for WAL cache");
+
+	if (reused && shm->magic == WAL_CACHE_MAGIC && shm->nslots == nslots)
+		WcRecover();
+	else
+	{
+		memset(shm, 0, size);
+		shm->magic = WAL_CACHE_MAGIC;
+		shm->nslots = nslots;
+	}
+
+	log_info("WAL cache of %d segments in %s", nslots, CurrentConfig->wal_cache.directory);
+}
+
+/*
+ * Open a file of the cache directory with the given size. A file of another
+ * size is left over from a different configuration and emptied.
+ */
+static int
+WcOpen(const char *name, size_t size, bool *reused)
+{
+	char path[1024];
+	struct stat st;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", CurrentConfig->wal_cache.directory, name);
+	fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (fd < 0)
+		error("Could not open WAL cache file %s: %s", path, strerror(errno));
+	if (fstat(fd, &st) != 0)
+		error("Could not stat WAL cache file %s: %s", path, strerror(errno));
+
+	if (st.st_size != size)
+	{
+		if (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0)
+			error("Could not size WAL cache file %s: %s", path, strerror(errno));
+		*reused = false;
+	}
+	return fd;
+}
+
+/*
+ * Pick up what a previous run left in the cache. Nothing was running then,
+ * filtered output is dropped as profiles may have changed, and WAL is only
+ * kept as far as its pages are intact.
+ */
+static void
+WcRecover()
+{
+	int kept = 0;
+	int i;
+
+	shm->lock = 0;
+	shm->claims = 0;
+	memset(shm->waiters, 0, sizeof(shm->waiters));
+
+	for (i = 0; i < shm->nslots; i++)
+	{
+		WalCacheSlot *slot = &(shm->slots[i]);
+
+		slot->writer = 0;
+		if (slot->profile)
+			slot->tli = 0;
+		if (slot->tli)
+			WcVerifySlot(slot);
+		if (slot->tli)
+			kept++;
+		else
+			slot->generation++;
+	}
+
+	log_info("Kept %d segments in WAL cache from previous run", kept);
+}
+
+/*
+ * The index could have been written out before the data it describes if the
+ * machine crashed. Cut the slot off at the first page that isn't what it is
+ * supposed to be.
+ */
+static void
+WcVerifySlot(WalCacheSlot *slot)
+{
+	char *base = segments + (size_t) (slot - shm->slots) * XLogSegSize;
+	uint32 page = TYPEALIGN(XLOG_BLCKSZ, slot->validStart);
+
+	for (; page < slot->validEnd; page += XLOG_BLCKSZ)
+	{
+		XLogPageHeader hdr = (XLogPageHeader) (base + page);
+
+		if (page + SizeOfXLogShortPHD > slot->validEnd ||
+				hdr->xlp_magic != XLOG_PAGE_MAGIC ||
+				hdr->xlp_pageaddr != slot->segno * XLogSegSize + page)
+		{
+			slot->validEnd = page;
+			break;
+		}
+	}
+
+	if (slot->validEnd <= slot->validStart)
+		slot->tli = 0;
+}
+
+bool
+WbWcEnabled()
+{
+	return shm != NULL;
+}
+
+/*
+ * Slots being written by a process that died are left as they are, the data
+ * up to validEnd is complete. Followers of profiles it was producing for
+ * have to take over. Called from the postmaster's main loop, never from the
+ * signal handler, as this takes the lock.
+ */
+void
+WbWcProcessExited(pid_t pid)
+{
+	int i;
+
+	if (!shm)
+		return;
+
+	WcLock();
+	for (i = 0; i < shm->nslots; i++)
+		if (shm->slots[i].writer == pid)
+			shm->slots[i].writer = 0;
+	for (i = 0; i < WAL_CACHE_MAX_WAITERS; i++)
+		if (shm->waiters[i].pid == pid)
+			shm->waiters[i].pid = 0;
+	WcUnlock();
+
+	for (i = 1; i < nprofiles; i++)
+		if (profiles[i].producer == pid)
+			WbWcReleaseProducer(i, profiles[i].claim);
+}
+
+static void
+WcLock()
+{
+	while (__atomic_test_and_set(&(shm->lock), __ATOMIC_ACQUIRE))
+		;
+}
+
+static void
+WcUnlock()
+{
+	__atomic_clear(&(shm->lock), __ATOMIC_RELEASE);
+}
+
+static WalCacheSlot*
+WcFind(int profile, TimeLineID tli, uint64 segno)
+{
+	int i;
+
+	for (i = 0; i < shm->nslots; i++)
+		if (shm->slots[i].tli == tli && shm->slots[i].segno == segno &&
+				shm->slots[i].profile == profile)
+			return &(shm->slots[i]);
+	return NULL;
+}
+
+/*
+ * Filtered output is only handed out in whole pages, so that a follower can
+ * take over filtering at a page boundary.
+ */
+static uint32
+WcReadableEnd(WalCacheSlot *slot)
+{
+	if (slot->profile)
+		return slot->validEnd - slot->validEnd % XLOG_BLCKSZ;
+	return slot->validEnd;
+}
+
+static bool
+WcIsCachedLocked(int profile, TimeLineID tli, XLogRecPtr pos)
+{
+	WalCacheSlot *slot = WcFind(profile, tli, pos / XLogSegSize);
+	uint32 offset = pos % XLogSegSize;
+
+	return slot && offset >= slot->validStart && offset < WcReadableEnd(slot);
+}
+
+static bool
+WcIsCached(int profile, TimeLineID tli, XLogRecPtr pos)
+{
+	bool cached;
+
+	WcLock();
+	cached = WcIsCachedLocked(profile, tli, pos);
+	WcUnlock();
+
+	return cached;
+}
+
+/*
+ * Give the least recently used slot that nobody is writing to a new segment.
+ * WAL that replication slots still need is never replaced.
+ */
+static WalCacheSlot*
+WcReplace(int profile, TimeLineID tli, uint64 segno, uint32 offset)
+{
+	static bool warned = false;
+	WalCacheSlot *victim = NULL;
+	XLogRecPtr retainPtr = WbSlRetainPtr();
+	int i;
+
+	for (i = 0; i < shm->nslots; i++)
+	{
+		WalCacheSlot *slot = &(shm->slots[i]);
+
+		if (slot->writer)
+			continue;
+		if (retainPtr && slot->tli && !slot->profile && slot->segno >= retainPtr / XLogSegSize)
+			continue;
+		if (!victim || !slot->tli || (victim->tli && slot->lastUsed < victim->lastUsed))
+			victim = slot;
+	}
+
+	if (!victim && retainPtr && !warned)
+	{
+		log_warning("WAL cache is full of WAL retained for replication slots, not caching segment %X/%X",
+				(uint32) (segno * XLogSegSize >> 32), (uint32) (segno * XLogSegSize));
+		warned = true;
+	}
+
+	if (victim)
+	{
+		victim->profile = profile;
+		victim->tli = tli;
+		victim->segno = segno;
+		victim->validStart = offset;
+		victim->validEnd = offset;
+		victim->generation++;
+	}
+	return victim;
+}
+
+/*
+ * The cache is only valid for one master. Called with the system identifier
+ * whenever it is fetched, a different one empties the cache.
+ */
+void
+WbWcSetSystem(const char *sysid)
+{
+	int i;
+
+	if (!shm)
+		return;
+
+	WcLock();
+	if (strcmp(shm->sysid, sysid) != 0)
+	{
+		if (shm->sysid[0])
+			log_warning("Master system identifier changed, emptying WAL cache");
+		for (i = 0; i < shm->nslots; i++)
+		{
+			shm->slots[i].tli = 0;
+			shm->slots[i].generation++;
+		}
+		strncpy(shm->sysid, sysid, sizeof(shm->sysid) - 1);
+	}
+	WcUnlock();
+}
+
+/*
+ * Append data to a segment's slot if it continues what is cached. Data that
+ * is already cached, or would leave a gap, is skipped, as is anything another
+ * process is writing at the same time.
+ */
+static void
+WcWriteSegment(int profile, TimeLineID tli, uint64 segno, uint32 offset, const char *data, int len)
+{
+	WalCacheSlot *slot;
+	uint32 skip;
+	char *target;
+
+	WcLock();
+	slot = WcFind(profile, tli, segno);
+	if (!slot)
+		slot = WcReplace(profile, tli, segno, offset);
+	if (!slot || slot->writer || offset > slot->validEnd || offset + len <= slot->validEnd)
+	{
+		WcUnlock();
+		return;
+	}
+	skip = slot->validEnd - offset;
+	slot->writer = getpid();
+	slot->lastUsed = ++shm->clock;
+	target = segments + (size_t) (slot - shm->slots) * XLogSegSize + slot->validEnd;
+	WcUnlock();
+
+	memcpy(target, data + skip, len - skip);
+
+	WcLock();
+	slot->validEnd = offset + len;
+	slot->writer = 0;
+	WcUnlock();
+}
+
+void
+WbWcWrite(int profile, TimeLineID tli, XLogRecPtr dataStart, const char *data, int len)
+{
+	if (!shm || !tli || !shm->sysid[0])
+		return;
+
+	while (len > 0)
+	{
+		uint32 offset = dataStart % XLogSegSize;
+		int amount = XLogSegSize - offset;
+
+		if (amount > len)
+			amount = len;
+		WcWriteSegment(profile, tli, dataStart / XLogSegSize, offset, data, amount);
+
+		dataStart += amount;
+		data += amount;
+		len -= amount;
+	}
+
+	if (profile)
+		WcWakeWaiters(profile);
+}
+
+/* Set the latches of followers of the profile waiting for more output */
+static void
+WcWakeWaiters(int profile)
+{
+	pid_t wake[WAL_CACHE_MAX_WAITERS];
+	int nwake = 0;
+	int i;
+
+	WcLock();
+	for (i = 0; i < WAL_CACHE_MAX_WAITERS; i++)
+	{
+		WalCacheWaiter *waiter = &(shm->waiters[i]);
+
+		if (waiter->pid && waiter->profile == profile && waiter->waiting)
+		{
+			waiter->waiting = false;
+			wake[nwake++] = waiter->pid;
+		}
+	}
+	WcUnlock();
+
+	for (i = 0; i < nwake; i++)
+		WbSetLatch(wake[i]);
+}
+
+/*
+ * Register the calling session as the one filtering WAL for the profile.
+ * Returns a claim to release it with, 0 if another session already does.
+ */
+uint32
+WbWcClaimProducer(int profile, TimeLineID tli)
+{
+	WalCacheProfile *prof;
+	uint32 claim = 0;
+
+	if (!shm || !profile || profile >= nprofiles)
+		return 0;
+
+	prof = &(profiles[profile]);
+	WcLock();
+	if (!prof->producer)
+	{
+		claim = ++shm->claims;
+		prof->producer = getpid();
+		prof->claim = claim;
+		prof->tli = tli;
+	}
+	WcUnlock();
+
+	return claim;
+}
+
+void
+WbWcReleaseProducer(int profile, uint32 claim)
+{
+	bool released = false;
+
+	if (!shm || !claim)
+		return;
+
+	WcLock();
+	if (profiles[profile].claim == claim)
+	{
+		profiles[profile].producer = 0;
+		profiles[profile].claim = 0;
+		released = true;
+	}
+	WcUnlock();
+
+	/* Followers have to carry on by themselves */
+	if (released)
+		WcWakeWaiters(profile);
+}
+
+/*
+ * Fold the status of the profile's followers into what its producer sends
+ * the master, so that the master sees the standby furthest behind.
+ */
+void
+WbWcMergeFollowerStatus(int profile, StandbyReplyMessage *reply, HSFeedbackMessage *feedback)
+{
+	int i;
+
+	if (!shm || !profile)
+		return;
+
+	WcLock();
+	for (i = 0; i < WAL_CACHE_MAX_WAITERS; i++)
+	{
+		WalCacheFollowerStatus *status = &(followers[i]);
+
+		if (!shm->waiters[i].pid || shm->waiters[i].profile != profile)
+			continue;
+
+		if (status->flushPtr && (!reply->flushPtr || status->flushPtr < reply->flushPtr))
+			reply->flushPtr = status->flushPtr;
+		if (status->applyPtr && (!reply->applyPtr || status->applyPtr < reply->applyPtr))
+			reply->applyPtr = status->applyPtr;
+		if (status->xmin && (!feedback->xmin || (int32) (status->xmin - feedback->xmin) < 0))
+		{
+			feedback->xmin = status->xmin;
+			feedback->epoch = status->epoch;
+		}
+	}
+	WcUnlock();
+}
+
+/* Pass a keepalive received by the producer on to its followers */
+void
+WbWcProducerKeepalive(int profile, XLogRecPtr walEnd, TimestampTz sendTime, bool replyRequested)
+{
+	WalCacheProfile *prof;
+
+	if (!shm || !profile)
+		return;
+
+	prof = &(profiles[profile]);
+	WcLock();
+	prof->walEnd = walEnd;
+	prof->sendTime = sendTime;
+	prof->replyRequested = replyRequested;
+	prof->keepaliveCount++;
+	WcUnlock();
+
+	WcWakeWaiters(profile);
+}
+
+/*
+ * Copy cached WAL at pos into buf. Returns the number of bytes copied, 0 if
+ * there is nothing cached at pos.
+ */
+static int
+WcRead(int profile, TimeLineID tli, XLogRecPtr pos, char *buf)
+{
+	WalCacheSlot *slot;
+	uint32 offset = pos % XLogSegSize;
+	uint32 generation;
+	char *source;
+	int len = 0;
+
+	WcLock();
+	slot = WcFind(profile, tli, pos / XLogSegSize);
+	if (slot && offset >= slot->validStart && offset < WcReadableEnd(slot))
+	{
+		len = WcReadableEnd(slot) - offset;
+		generation = slot->generation;
+		slot->lastUsed = ++shm->clock;
+		source = segments + (size_t) (slot - shm->slots) * XLogSegSize + offset;
+	}
+	WcUnlock();
+
+	if (!len)
+		return 0;
+
+	if (len > WAL_CACHE_READ_CHUNK)
+	{
+		/* Don't split page headers between messages */
+		XLogRecPtr chunkEnd = pos + WAL_CACHE_READ_CHUNK;
+		len = chunkEnd - (chunkEnd % XLOG_BLCKSZ) - pos;
+	}
+	memcpy(buf, source, len);
+
+	/* The slot may have been replaced while we were copying */
+	WcLock();
+	if (slot->generation != generation)
+		len = 0;
+	WcUnlock();
+
+	return len;
+}
+
+/*
+ * Start reading from the cache if it has WAL, or output filtered for the
+ * profile, at the requested position. Returns NULL if streaming has to start
+ * from upstream.
+ */
+WbWalCacheReader*
+WbWcAttach(XLogRecPtr startPos, TimeLineID tli, int profile)
+{
+	WbWalCacheReader *reader;
+	WalCacheWaiter *waiter = NULL;
+	int i;
+
+	if (!shm || !tli || profile >= nprofiles || !WcIsCached(profile, tli, startPos))
+		return NULL;
+
+	if (profile)
+	{
+		WcLock();
+		for (i = 0; i < WAL_CACHE_MAX_WAITERS && !waiter; i++)
+		{
+			if (!shm->waiters[i].pid)
+			{
+				waiter = &(shm->waiters[i]);
+				waiter->pid = getpid();
+				waiter->profile = profile;
+				waiter->waiting = false;
+				memset(&(followers[i]), 0, sizeof(WalCacheFollowerStatus));
+			}
+		}
+		WcUnlock();
+
+		if (!waiter)
+			return NULL;
+	}
+
+	reader = wballoc0(sizeof(WbWalCacheReader));
+	reader->profile = profile;
+	reader->tli = tli;
+	reader->cursor = startPos;
+	reader->waiter = waiter;
+	if (profile)
+		reader->keepaliveCount = profiles[profile].keepaliveCount;
+	reader->buf = wballoc(WAL_CACHE_READ_CHUNK);
+	return reader;
+}
+
+void
+WbWcDetach(WbWalCacheReader *reader)
+{
+	if (reader->waiter)
+	{
+		WcLock();
+		reader->waiter->pid = 0;
+		WcUnlock();
+	}
+	wbfree(reader->buf);
+	wbfree(reader);
+}
+
+/* A follower's standby replied, the producer passes it on */
+void
+WbWcSendReply(WbWalCacheReader *reader, StandbyReplyMessage *reply)
+{
+	WalCacheFollowerStatus *status = &(followers[reader->waiter - shm->waiters]);
+
+	WcLock();
+	status->flushPtr = reply->flushPtr;
+	status->applyPtr = reply->applyPtr;
+	WcUnlock();
+
+	WcWakeProducer(reader->profile);
+}
+
+void
+WbWcSendFeedback(WbWalCacheReader *reader, HSFeedbackMessage *feedback)
+{
+	WalCacheFollowerStatus *status = &(followers[reader->waiter - shm->waiters]);
+
+	WcLock();
+	status->xmin = feedback->xmin;
+	status->epoch = feedback->epoch;
+	WcUnlock();
+
+	WcWakeProducer(reader->profile);
+}
+
+static void
+WcWakeProducer(int profile)
+{
+	pid_t producer = __atomic_load_n(&(profiles[profile].producer), __ATOMIC_ACQUIRE);
+
+	if (producer)
+		WbSetLatch(producer);
+}
+
+bool
+WbWcIsFiltered(WbWalCacheReader *reader)
+{
+	return reader->profile != 0;
+}
+
+bool
+WbWcRestartAt(WbWalCacheReader *reader, XLogRecPtr pos)
+{
+	bool cached = WcIsCached(reader->profile, reader->tli, pos);
+
+	if (cached)
+		reader->cursor = pos;
+	return cached;
+}
+
+XLogRecPtr
+WbWcGetPosition(WbWalCacheReader *reader)
+{
+	return reader->cursor;
+}
+
+/*
+ * Whether a follower has to wait for the producer of its profile. Sets the
+ * waiting flag under the same lock the producer takes to wake us up, so that
+ * output written in the meantime isn't missed.
+ */
+static bool
+WcFollowerWaits(WbWalCacheReader *reader, ReplMessage *msg)
+{
+	WalCacheProfile *prof = &(profiles[reader->profile]);
+	bool wait = false;
+
+	WcLock();
+	if (prof->keepaliveCount != reader->keepaliveCount)
+	{
+		reader->keepaliveCount = prof->keepaliveCount;
+		msg->type = MSG_KEEPALIVE;
+		msg->walEnd = prof->walEnd;
+		msg->sendTime = prof->sendTime;
+		msg->replyRequested = prof->replyRequested;
+	}
+	else if (prof->producer && prof->tli == reader->tli &&
+			!WcIsCachedLocked(reader->profile, reader->tli, reader->cursor))
+	{
+		reader->waiter->waiting = true;
+		msg->type = MSG_NOTHING;
+		wait = true;
+	}
+	else
+		msg->type = MSG_WAL_DATA;
+	WcUnlock();
+
+	return wait;
+}
+
+/*
+ * Fetch the next block of WAL from the cache. Returns false once the reader
+ * reached the end of what is cached. Followers of a profile instead get
+ * MSG_NOTHING while its producer is still filtering, or the producer's
+ * keepalives.
+ */
+bool
+WbWcReceiveWalMessage(WbWalCacheReader *reader, ReplMessage *msg)
+{
+	int len = WcRead(reader->profile, reader->tli, reader->cursor, reader->buf);
+
+	if (!len && reader->profile)
+	{
+		if (WcFollowerWaits(reader, msg) || msg->type == MSG_KEEPALIVE)
+			return true;
+		len = WcRead(reader->profile, reader->tli, reader->cursor, reader->buf);
+	}
+
+	if (!len)
+	{
+		msg->type = MSG_NOTHING;
+		return false;
+	}
+
+	msg->type = MSG_WAL_DATA;
+	msg->dataStart = reader->cursor;
+	msg->walEnd = reader->cursor + len;
+	msg->sendTime = GetCurrentTimestamp();
+	msg->replyRequested = false;
+	msg->dataPtr = 0;
+	msg->dataLen = len;
+	msg->data = reader->buf;
+	msg->nextPageBoundary = (XLOG_BLCKSZ - msg->dataStart) & (XLOG_BLCKSZ-1);
+
+	reader->cursor += len;
+
+	log_debug1("Read %u byte WAL block from WAL cache. dataStart: %X/%X",
+			len, FormatRecPtr(msg->dataStart));
+	return true;
+}